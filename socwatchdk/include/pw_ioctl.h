@@ -130,6 +130,17 @@
 #define PW_IOCTL_MSR_ADDRS _IOW(APWR_IOCTL_MAGIC_NUM, 17, struct PWCollector_ioctl_arg *)
 #define PW_IOCTL_FREQ_RATIOS _IOR(APWR_IOCTL_MAGIC_NUM, 18, unsigned long *)
 #define PW_IOCTL_PLATFORM_RES_CONFIG _IOW(APWR_IOCTL_MAGIC_NUM, 19, struct PWCollector_ioctl_arg *)
+/*
+ * 'mmap' mode: once the output buffers have been mapped
+ * (PW_IOCTL_MMAP_SIZE bytes), 'read' no longer copies samples. Instead
+ * it returns a bitmap (an array of u64 words, one bit per segment) of
+ * EVERY segment that is ready to be consumed. Bit 'n' is the segment at
+ * offset 'n * PW_IOCTL_BUFFER_SIZE' in the mapping; each segment starts
+ * with a 'u32 bytes_written, u32 is_full' header. Segments stay owned by
+ * the reader until they are handed back with PW_IOCTL_RELEASE_SEGS, whose
+ * input is a bitmap in the same format.
+ */
+#define PW_IOCTL_RELEASE_SEGS _IOW(APWR_IOCTL_MAGIC_NUM, 20, struct PWCollector_ioctl_arg *)
 
 /*
  * 32b-compatible version of the above
@@ -161,6 +172,7 @@
     #define PW_IOCTL_MSR_ADDRS32 _IOW(APWR_IOCTL_MAGIC_NUM, 17, compat_uptr_t)
     #define PW_IOCTL_FREQ_RATIOS32 _IOR(APWR_IOCTL_MAGIC_NUM, 18, compat_uptr_t)
     #define PW_IOCTL_PLATFORM_RES_CONFIG32 _IOW(APWR_IOCTL_MAGIC_NUM, 19, compat_uptr_t)
+    #define PW_IOCTL_RELEASE_SEGS32 _IOW(APWR_IOCTL_MAGIC_NUM, 20, compat_uptr_t)
 #endif // defined(HAVE_COMPAT_IOCTL) && defined(CONFIG_X86_64)
 
 #endif // _PW_IOCTL_H_
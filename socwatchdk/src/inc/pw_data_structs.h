@@ -75,6 +75,7 @@
 
 #include "pw_ioctl.h" // For IOCTL mechanism
 #include <linux/fs.h>
+#include <linux/cache.h> // for "____cacheline_aligned_in_smp"
 #include <linux/bitops.h> // for "test_and_set_bit(...)" atomic functionality
 
 
@@ -327,7 +328,18 @@ struct pw_msr_info_set {
      * Required for an initial MSR set snapshot.
      */
     u8 init_msr_set_sent;
-};
+    /*
+     * Hot-path copy of the MSR list, built once in "pw_set_msr_addrs()".
+     * Structure-of-arrays in a single per-cpu allocation (rooted at
+     * 'msr_prev'); MSRs without a valid address are left out.
+     * 'msr_slots[i]' is the index of MSR 'i' in 'prev_msr_vals'.
+     */
+    u64 *msr_prev;
+    u32 *msr_addrs;
+    u16 *msr_slots;
+    pw_msr_identifier_t *msr_ids;
+    u32 num_valid_msrs;
+} ____cacheline_aligned_in_smp; // one per cpu, written on every C-state exit
 
 /*
  * Struct to hold old IA32_FIXED_CTR_CTRL MSR 
@@ -118,6 +118,8 @@ int pw_produce_generic_msg_on_cpu(int cpu, struct PWCollector_msg *, bool);
 
 bool pw_any_seg_full(u32 *val, const bool *is_flush_mode);
 unsigned long pw_consume_data(u32 mask, char __user *buffer, size_t bytes_to_read, size_t *bytes_read);
+unsigned long pw_consume_seg_map(char __user *buffer, size_t bytes_to_read, size_t *bytes_read, const bool *is_flush_mode);
+int pw_release_segs(const u64 __user *map, size_t map_len);
 
 unsigned long pw_get_buffer_size(void);
 
@@ -565,6 +565,17 @@ struct tnode{
     u16 trace_sent : 1;
     u16 trace_len : 14;
     unsigned long *trace;
+    /*
+     * Backing store for 'trace' -- carved out of the
+     * owning block's trace pool, so (re)initializing
+     * a node never needs to allocate.
+     */
+    unsigned long *trace_mem;
+    /*
+     * Nodes are unlinked with 'hlist_del_rcu()' and
+     * returned to a free list only after a grace period.
+     */
+    struct rcu_head rcu;
 };
 
 typedef struct hnode hnode_t;
@@ -575,6 +586,7 @@ struct hnode{
 typedef struct tblock tblock_t;
 struct tblock{
     struct tnode *data;
+    unsigned long *traces; // NUM_TIMER_NODES_PER_BLOCK * MAX_BACKTRACE_LENGTH entries
     tblock_t *next;
 };
 
@@ -667,7 +679,16 @@ typedef struct sys_node sys_node_t;
 struct sys_node{
     struct hlist_node list;
     pid_t tid, pid;
-    int ref_count, weight;
+    /*
+     * Updated without the map lock, by lookups
+     * under 'rcu_read_lock()'.
+     */
+    atomic_t ref_count, weight;
+    /*
+     * Nodes are unlinked with 'hlist_del_rcu()' and
+     * freed only after a grace period.
+     */
+    struct rcu_head rcu;
 };
 
 #define SYS_MAP_BUCKETS_BITS 9
@@ -676,7 +697,11 @@ struct sys_node{
 #define NUM_SYS_MAP_LOCKS (1UL << SYS_MAP_LOCK_BITS) // MUST be pow-of-2
 
 #define SYS_MAP_NODES_HASH(t) hash_32(t, SYS_MAP_BUCKETS_BITS)
-#define SYS_MAP_LOCK_HASH(t) ( (t) & (SYS_MAP_LOCK_BITS - 1) ) // pow-of-2 modulo
+/*
+ * Locks are picked by bucket, never by tid: every writer of
+ * a given bucket must serialize on the same lock.
+ */
+#define SYS_MAP_LOCK_HASH(hindex) ( (hindex) & (NUM_SYS_MAP_LOCKS - 1) ) // pow-of-2 modulo
 
 #define SYS_MAP_LOCK(index) LOCK(apwr_sys_map_locks[index])
 #define SYS_MAP_UNLOCK(index) UNLOCK(apwr_sys_map_locks[index])
@@ -768,6 +793,12 @@ static DEFINE_PER_CPU(u32, pcpu_prev_req_freq) = 0;
 static DEFINE_PER_CPU(struct msr_set, pw_pcpu_msr_sets);
 
 static struct pw_msr_info_set *pw_pcpu_msr_info_sets ____cacheline_aligned_in_smp = NULL;
+/*
+ * Backing block of 'pw_pcpu_msr_info_sets'. Over-allocated so that
+ * the (cacheline-aligned) info sets can start on a cacheline
+ * boundary: 'pw_kmalloc()' gives no such guarantee.
+ */
+static void *pw_pcpu_msr_info_sets_mem = NULL;
 
 
 /*
@@ -848,7 +879,8 @@ static atomic_t num_timer_entries = ATOMIC_INIT(0);
  */
 static struct hlist_head apwr_sys_map[NUM_SYS_MAP_BUCKETS];
 /*
- * Spinlock to guard updates to sys map.
+ * Spinlocks to guard inserts and deletes in the sys map.
+ * Lookups (and ref count updates) only need 'rcu_read_lock()'.
  */
 static spinlock_t apwr_sys_map_locks[NUM_SYS_MAP_LOCKS];
 /*
@@ -1187,19 +1219,11 @@ static void free_timer_block(tblock_t *block)
 	return;
     }
     if(block->data){
-	int i=0;
-	for(i=0; i<NUM_TIMER_NODES_PER_BLOCK; ++i){
-            /*
-             * Check trace, just to be sure
-             * (We shouldn't need this -- 'timer_destroy()'
-             * explicitly checks and frees call trace
-             * arrays).
-             */
-	    if(block->data[i].trace)
-		pw_kfree(block->data[i].trace);
-        }
 	pw_kfree(block->data);
     }
+    if(block->traces){
+	pw_kfree(block->traces);
+    }
     free_timer_block(block->next);
     pw_kfree(block);
     return;
@@ -1217,6 +1241,23 @@ static tblock_t *allocate_new_timer_block(struct hnode *free_head)
 	return NULL;
     }
     memset(block->data, 0, sizeof(tnode_t) * NUM_TIMER_NODES_PER_BLOCK);
+    /*
+     * One trace pool per block (instead of one 'kmalloc'
+     * per root timer) keeps backtraces on the CPU that
+     * owns the nodes.
+     */
+    block->traces = pw_kmalloc(sizeof(unsigned long) * NUM_TIMER_NODES_PER_BLOCK * MAX_BACKTRACE_LENGTH, GFP_ATOMIC);
+    if(!block->traces){
+	pw_kfree(block->data);
+	pw_kfree(block);
+	return NULL;
+    }
+    {
+	int i=0;
+	for(i=0; i<NUM_TIMER_NODES_PER_BLOCK; ++i){
+	    block->data[i].trace_mem = &block->traces[i * MAX_BACKTRACE_LENGTH];
+	}
+    }
     if(free_head){
 	LINK_FREE_TNODE_ENTRIES(block->data, NUM_TIMER_NODES_PER_BLOCK, free_head);
     }
@@ -1228,6 +1269,12 @@ static void destroy_per_cpu_timer_blocks(void)
 {
     int cpu = -1;
 
+    /*
+     * Wait for any pending 'timer_destroy_callback()'
+     * invocations -- they touch the per-cpu free lists.
+     */
+    rcu_barrier();
+
     for_each_online_cpu(cpu){
 	per_cpu_mem_t *pcpu_mem = GET_MEM_VARS(cpu);
 	tblock_t *blocks = pcpu_mem->block_list;
@@ -1261,6 +1308,14 @@ void free_sys_node_i(sys_node_t *node)
     pw_kfree(node);
 };
 
+/*
+ * RCU callback: no reader can still see 'node'.
+ */
+static void sys_node_destroy_callback(struct rcu_head *head)
+{
+    free_sys_node_i(container_of(head, struct sys_node, rcu));
+};
+
 sys_node_t *alloc_new_sys_node_i(pid_t tid, pid_t pid)
 {
     sys_node_t *node = pw_kmalloc(sizeof(sys_node_t), GFP_ATOMIC);
@@ -1269,7 +1324,8 @@ sys_node_t *alloc_new_sys_node_i(pid_t tid, pid_t pid)
 	return NULL;
     }
     node->tid = tid; node->pid = pid;
-    node->ref_count = node->weight = 1;
+    atomic_set(&node->ref_count, 1);
+    atomic_set(&node->weight, 1);
     INIT_HLIST_NODE(&node->list);
     return node;
 };
@@ -1278,6 +1334,12 @@ int destroy_sys_list(void)
 {
     int size = 0, i=0;
 
+    /*
+     * Wait for any pending 'sys_node_destroy_callback()'
+     * invocations.
+     */
+    rcu_barrier();
+
     for (i=0; i<NUM_SYS_MAP_BUCKETS; ++i) {
 	struct hlist_head *apwr_sys_list = GET_SYS_HLIST(i);
 	int tmp_size = 0;
@@ -1333,6 +1395,9 @@ static void pw_reset_msr_info_sets(void)
             if (likely(info_set->c_multi_msg_mem)) {
                 pw_kfree(info_set->c_multi_msg_mem);
             }
+            if (likely(info_set->msr_prev)) {
+                pw_kfree(info_set->msr_prev);
+            }
             memset(info_set, 0, sizeof(*info_set));
         }
     }
@@ -1342,7 +1407,8 @@ static void pw_destroy_msr_info_sets(void)
 {
     if (likely(pw_pcpu_msr_info_sets)) {
         pw_reset_msr_info_sets();
-        pw_kfree(pw_pcpu_msr_info_sets);
+        pw_kfree(pw_pcpu_msr_info_sets_mem);
+        pw_pcpu_msr_info_sets_mem = NULL;
         pw_pcpu_msr_info_sets = NULL;
     }
 };
@@ -1350,11 +1416,12 @@ static void pw_destroy_msr_info_sets(void)
 static int pw_init_msr_info_sets(void)
 {
     BUG_ON(pw_max_num_cpus <= 0);
-    pw_pcpu_msr_info_sets = pw_kmalloc(sizeof(struct pw_msr_info_set) * pw_max_num_cpus, GFP_KERNEL);
-    if (!pw_pcpu_msr_info_sets) {
+    pw_pcpu_msr_info_sets_mem = pw_kmalloc(sizeof(struct pw_msr_info_set) * pw_max_num_cpus + SMP_CACHE_BYTES - 1, GFP_KERNEL);
+    if (!pw_pcpu_msr_info_sets_mem) {
         pw_pr_error("ERROR allocating space for info sets!\n");
         return -ERROR;
     }
+    pw_pcpu_msr_info_sets = (struct pw_msr_info_set *)ALIGN((unsigned long)pw_pcpu_msr_info_sets_mem, SMP_CACHE_BYTES);
     memset(pw_pcpu_msr_info_sets, 0, sizeof(struct pw_msr_info_set) * pw_max_num_cpus);
     return SUCCESS;
 };
@@ -1463,24 +1530,21 @@ static int init_tnode_i(tnode_t *node, unsigned long timer_addr, pid_t tid, pid_
         return -ERROR;
     }
 
-    if(node->trace){
-        pw_kfree(node->trace);
-        node->trace = NULL;
+    if (trace_len > MAX_BACKTRACE_LENGTH) {
+        trace_len = MAX_BACKTRACE_LENGTH;
     }
 
     node->timer_addr = timer_addr; node->tsc = tsc; node->tid = tid; node->pid = pid; node->init_cpu = init_cpu; node->trace_sent = 0; node->trace_len = trace_len;
+    node->is_root_timer = 0;
+    node->trace = NULL;
 
     if(trace_len >  0){
         /*
-         * Root timer!
+         * Root timer! Backtrace goes into the node's
+         * slot in the (per-block) trace pool.
          */
         node->is_root_timer = 1;
-        node->trace = pw_kmalloc(sizeof(unsigned long) * trace_len, GFP_ATOMIC);
-        if(!node->trace){
-            pw_pr_error("ERROR: could NOT allocate memory for backtrace!\n");
-            // pw_kfree(node);
-            return -ERROR;
-        }
+        node->trace = node->trace_mem;
         memcpy(node->trace, trace, sizeof(unsigned long) * trace_len); // dst, src
     }
 
@@ -1494,9 +1558,21 @@ static int init_tnode_i(tnode_t *node, unsigned long timer_addr, pid_t tid, pid_
 
 static tnode_t *get_next_free_tnode_i(unsigned long timer_addr, pid_t tid, pid_t pid, u64 tsc, s32 init_cpu, int trace_len, unsigned long *trace)
 {
-    per_cpu_mem_t *pcpu_mem = GET_MY_MEM_VARS();
-    struct hnode *free_head = &pcpu_mem->free_list_head;
-    struct hlist_head *head = &free_head->head;
+    per_cpu_mem_t *pcpu_mem = NULL;
+    struct hnode *free_head = NULL;
+    struct hlist_head *head = NULL;
+    struct tnode *node = NULL;
+    unsigned long flags = 0;
+
+    /*
+     * The free list is also pushed to from RCU callbacks
+     * (softirq context) -- keep those off this CPU while
+     * we manipulate it.
+     */
+    local_irq_save(flags);
+    pcpu_mem = GET_MY_MEM_VARS();
+    free_head = &pcpu_mem->free_list_head;
+    head = &free_head->head;
 
     if(hlist_empty(head)){
 	tblock_t *block = allocate_new_timer_block(free_head);
@@ -1508,55 +1584,59 @@ static tnode_t *get_next_free_tnode_i(unsigned long timer_addr, pid_t tid, pid_t
     }
 
     if(!hlist_empty(head)){
-	struct tnode *node = hlist_entry(head->first, struct tnode, list);
+	node = hlist_entry(head->first, struct tnode, list);
 	hlist_del(&node->list);
-	/*
-	 * 'kmalloc' doesn't zero out memory -- set
-	 * 'trace' to NULL to avoid an invalid
-	 * 'free' in 'init_tnode_i(...)' just to
-	 * be sure (Shouldn't need to have to 
-	 * do this -- 'destroy_timer()' *should*
-	 * have handled it for us).
-	 */
-	node->trace = NULL;
+    }
+    local_irq_restore(flags);
 
-	if(init_tnode_i(node, timer_addr, tid, pid, tsc, init_cpu, trace_len, trace)){
-	    /*
-	     * Backtrace couldn't be inited -- re-enqueue
-	     * onto the free-list.
-	     */
-	    node->trace = NULL;
-	    hlist_add_head(&node->list, head);
-	    return NULL;
-	}
-	return node;
+    if(node){
+	init_tnode_i(node, timer_addr, tid, pid, tsc, init_cpu, trace_len, trace);
     }
-    return NULL;
+    return node;
 };
 
-static void timer_destroy(struct tnode *node)
+/*
+ * RCU callback: no reader can still see 'node' -- return
+ * it to the free list of whichever CPU runs the callback.
+ */
+static void timer_destroy_callback(struct rcu_head *head)
 {
-    per_cpu_mem_t *pcpu_mem = GET_MY_MEM_VARS();
-    struct hnode *free_head = &pcpu_mem->free_list_head;
-    
-    if (!node) {
-        return;
-    }
+    struct tnode *node = container_of(head, struct tnode, rcu);
+    per_cpu_mem_t *pcpu_mem = NULL;
+    unsigned long flags = 0;
 
     OUTPUT(3, KERN_INFO "DESTROYING %p\n", node);
 
-    if(node->trace){
-	pw_kfree(node->trace);
-	node->trace = NULL;
+    node->trace = NULL;
+
+    local_irq_save(flags);
+    pcpu_mem = GET_MY_MEM_VARS();
+    hlist_add_head(&node->list, &pcpu_mem->free_list_head.head);
+    local_irq_restore(flags);
+};
+
+/*
+ * Called after 'node' has been unlinked (with 'hlist_del_rcu()')
+ * from the timer map.
+ */
+static void timer_destroy(struct tnode *node)
+{
+    if (!node) {
+        return;
     }
 
-    hlist_add_head(&node->list, &((free_head)->head));
+    call_rcu(&node->rcu, &timer_destroy_callback);
 };
 
 /*
  * Hash map routines.
  */
 
+/*
+ * Lock-free lookup. Callers that dereference the returned
+ * node must hold 'rcu_read_lock()' for as long as they use it;
+ * callers that only test for existence need not.
+ */
 static tnode_t *timer_find(unsigned long timer_addr, pid_t tid)
 {
     int idx = TIMER_HASH_FUNC(timer_addr);
@@ -1564,18 +1644,18 @@ static tnode_t *timer_find(unsigned long timer_addr, pid_t tid)
     struct hlist_node *curr = NULL;
     struct hlist_head *head = NULL;
 
-    HASH_LOCK(idx);
+    rcu_read_lock();
     {
 	head = &timer_map[idx].head;
 
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, head, list) {
+        PW_HLIST_FOR_EACH_ENTRY_RCU(node, curr, head, list) {
 	    if(node->timer_addr == timer_addr && (node->tid == tid || tid < 0)){
 		retVal = node;
 		break;
 	    }
 	}
     }
-    HASH_UNLOCK(idx);
+    rcu_read_unlock();
 
     return retVal;
 };
@@ -1611,7 +1691,7 @@ static void timer_insert(unsigned long timer_addr, pid_t tid, pid_t pid, u64 tsc
              */
 	    new_node = get_next_free_tnode_i(timer_addr, tid, pid, tsc, init_cpu, trace_len, trace);
             if(likely(new_node)){
-                hlist_add_head(&new_node->list, &timer_map[idx].head);
+                hlist_add_head_rcu(&new_node->list, &timer_map[idx].head);
 #if DO_OVERHEAD_MEASUREMENTS
                 {
                     smp_mb();
@@ -1646,7 +1726,7 @@ static int timer_delete(unsigned long timer_addr, pid_t tid)
                 if (node->tid != tid){
                     OUTPUT(0, KERN_INFO "WARNING: stale timer tid value? node tid = %d, task tid = %d\n", node->tid, tid);
 		}
-		hlist_del(&node->list);
+		hlist_del_rcu(&node->list);
 		found_node = node;
 		retVal = SUCCESS;
 		OUTPUT(3, KERN_INFO "[%d]: TIMER_DELETE FOUND HRT = %p\n", tid, (void *)timer_addr);
@@ -1677,7 +1757,7 @@ static void delete_all_non_kernel_timers(void)
                     if (node->is_root_timer == 0) {
 			++num_timers;
 			OUTPUT(3, KERN_INFO "[%d]: Timer %p (Node %p) has TRACE = %p\n", node->tid, (void *)node->timer_addr, node, node->trace);
-			hlist_del(&node->list);
+			hlist_del_rcu(&node->list);
 			timer_destroy(node);
 		    }
 		}
@@ -1701,7 +1781,7 @@ static void delete_timers_for_tid(pid_t tid)
 		    if(node->is_root_timer == 0 && node->tid == tid){
 			++num_timers;
 			OUTPUT(3, KERN_INFO "[%d]: Timer %p (Node %p) has TRACE = %p\n", tid, (void *)node->timer_addr, node, node->trace);
-			hlist_del(&node->list);
+			hlist_del_rcu(&node->list);
 			timer_destroy(node);
 		    }
 		}
@@ -2119,26 +2199,33 @@ static int get_num_irq_mappings(void)
  * SYS map manipulation routines.
  */
 
-inline bool is_tid_in_sys_list(pid_t tid)
+/*
+ * Lock-free lookup. Callers that dereference the returned
+ * node must hold 'rcu_read_lock()' for as long as they use it.
+ */
+static sys_node_t *sys_node_find_i(pid_t tid)
 {
     sys_node_t *node = NULL;
     struct hlist_node *curr = NULL;
-    bool found = false;
+    struct hlist_head *apwr_sys_list = GET_SYS_HLIST(SYS_MAP_NODES_HASH(tid));
 
-    int hindex = SYS_MAP_NODES_HASH(tid);
-    int lindex = SYS_MAP_LOCK_HASH(tid);
+    PW_HLIST_FOR_EACH_ENTRY_RCU(node, curr, apwr_sys_list, list) {
+	if (node->tid == tid) {
+	    return node;
+	}
+    }
+    return NULL;
+};
 
-    SYS_MAP_LOCK(lindex);
+inline bool is_tid_in_sys_list(pid_t tid)
+{
+    bool found = false;
+
+    rcu_read_lock();
     {
-	struct hlist_head *apwr_sys_list = GET_SYS_HLIST(hindex);
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, apwr_sys_list, list) {
-	    if (node->tid == tid) {
-		found = true;
-		break;
-	    }
-	}
+	found = sys_node_find_i(tid) != NULL;
     }
-    SYS_MAP_UNLOCK(lindex);
+    rcu_read_unlock();
 
     return found;
 };
@@ -2146,23 +2233,14 @@ inline bool is_tid_in_sys_list(pid_t tid)
 inline int check_and_remove_proc_from_sys_list(pid_t tid, pid_t pid)
 {
     sys_node_t *node = NULL;
-    struct hlist_node *curr = NULL;
     bool found = false;
-    int hindex = SYS_MAP_NODES_HASH(tid);
-    int lindex = SYS_MAP_LOCK_HASH(tid);
 
-    SYS_MAP_LOCK(lindex);
+    rcu_read_lock();
     {
-	struct hlist_head *apwr_sys_list = GET_SYS_HLIST(hindex);
-        PW_HLIST_FOR_EACH_ENTRY(node, curr, apwr_sys_list, list) {
-	    if (node->tid == tid && node->ref_count > 0) {
-		found = true;
-		--node->ref_count;
-		break;
-	    }
-	}
+	node = sys_node_find_i(tid);
+	found = node && atomic_add_unless(&node->ref_count, -1, 0);
     }
-    SYS_MAP_UNLOCK(lindex);
+    rcu_read_unlock();
 
     if (!found) {
 	return -ERROR;
@@ -2176,7 +2254,7 @@ inline int check_and_delete_proc_from_sys_list(pid_t tid, pid_t pid)
     bool found = false;
     struct hlist_node *curr = NULL;
     int hindex = SYS_MAP_NODES_HASH(tid);
-    int lindex = SYS_MAP_LOCK_HASH(tid);
+    int lindex = SYS_MAP_LOCK_HASH(hindex);
 
     SYS_MAP_LOCK(lindex);
     {
@@ -2184,9 +2262,7 @@ inline int check_and_delete_proc_from_sys_list(pid_t tid, pid_t pid)
         PW_HLIST_FOR_EACH_ENTRY(node, curr, apwr_sys_list, list) {
 	    if (node->tid == tid) {
 		found = true;
-		hlist_del(&node->list);
-                OUTPUT(3, KERN_INFO "CHECK_AND_DELETE: successfully deleted node: tid = %d, ref_count = %d, weight = %d\n", tid, node->ref_count, node->weight);
-		free_sys_node_i(node);
+		hlist_del_rcu(&node->list);
 		break;
 	    }
 	}
@@ -2196,6 +2272,8 @@ inline int check_and_delete_proc_from_sys_list(pid_t tid, pid_t pid)
     if (!found) {
 	return -ERROR;
     }
+    OUTPUT(3, KERN_INFO "CHECK_AND_DELETE: successfully deleted node: tid = %d, ref_count = %d, weight = %d\n", tid, atomic_read(&node->ref_count), atomic_read(&node->weight));
+    call_rcu(&node->rcu, &sys_node_destroy_callback);
     return SUCCESS;
 };
 
@@ -2206,16 +2284,36 @@ inline int check_and_add_proc_to_sys_list(pid_t tid, pid_t pid)
     int retVal = SUCCESS;
     struct hlist_node *curr = NULL;
     int hindex = SYS_MAP_NODES_HASH(tid);
-    int lindex = SYS_MAP_LOCK_HASH(tid);
+    int lindex = SYS_MAP_LOCK_HASH(hindex);
+
+    /*
+     * Common case: the thread has been seen before.
+     */
+    rcu_read_lock();
+    {
+	node = sys_node_find_i(tid);
+	if (node) {
+	    atomic_inc(&node->ref_count);
+	    atomic_inc(&node->weight);
+	}
+    }
+    rcu_read_unlock();
+    if (node) {
+	return SUCCESS;
+    }
 
     SYS_MAP_LOCK(lindex);
     {
 	struct hlist_head *apwr_sys_list = GET_SYS_HLIST(hindex);
+	/*
+	 * Re-check: another CPU may have inserted 'tid'
+	 * after our lock-free lookup.
+	 */
         PW_HLIST_FOR_EACH_ENTRY(node, curr, apwr_sys_list, list) {
 	    if (node->tid == tid) {
 		found = true;
-		++node->ref_count;
-		++node->weight;
+		atomic_inc(&node->ref_count);
+		atomic_inc(&node->weight);
 		break;
 	    }
 	}
@@ -2225,7 +2323,7 @@ inline int check_and_add_proc_to_sys_list(pid_t tid, pid_t pid)
 		pw_pr_error("ERROR: could NOT allocate new node!\n");
 		retVal = -ERROR;
 	    } else {
-		hlist_add_head(&node->list, apwr_sys_list);
+		hlist_add_head_rcu(&node->list, apwr_sys_list);
 	    }
         }
     }
@@ -2236,7 +2334,7 @@ inline int check_and_add_proc_to_sys_list(pid_t tid, pid_t pid)
 
 void print_sys_node_i(sys_node_t *node)
 {
-    printk(KERN_INFO "SYS_NODE: %d -> %d, %d\n", node->tid, node->ref_count, node->weight);
+    printk(KERN_INFO "SYS_NODE: %d -> %d, %d\n", node->tid, atomic_read(&node->ref_count), atomic_read(&node->weight));
 };
 
 
@@ -3156,6 +3254,12 @@ static void timer_expire(void *timer_addr, pid_t tid)
 
     cpu = CPU();
 
+    /*
+     * 'entry' is used until the end of this function -- keep
+     * it from being recycled under us.
+     */
+    rcu_read_lock();
+
     if ( (entry = (tnode_t *)timer_find((unsigned long)timer_addr, tid))) {
 	pid = entry->pid;
 	tsc = entry->tsc;
@@ -3191,6 +3295,7 @@ static void timer_expire(void *timer_addr, pid_t tid)
 		 */
 		const char *irq_name = pw_softirq_to_name[irq_num];
 		OUTPUT(3, KERN_INFO "WARNING: could NOT find TID in timer_expire for Timer = %p: FALLING BACK TO TIMER_SOFTIRQ OPTION! was_hit = %s\n", timer_addr, GET_BOOL_STRING(was_hit));
+		rcu_read_unlock();
 		handle_irq_wakeup_i(cpu, irq_num, irq_name, was_hit);
 		/*
 		 * No further action is required.
@@ -3240,6 +3345,7 @@ static void timer_expire(void *timer_addr, pid_t tid)
 	produce_k_sample(cpu, entry);
 	entry->trace_sent = 1;
     }
+    rcu_read_unlock();
 };
 
 /*
@@ -3572,38 +3678,42 @@ static int pw_read_msr_info_set_i(struct pw_msr_info_set *info_set)
     int num_res = 0;
 #ifndef __arm__
     int i=0, curr_index = 0;
-    u64 val = 0;
-    s32 msr_addr = -1;
-    // bool init_msr_set_sent = info_set->init_msr_set_sent == 1;
-    int num_msrs = INTERNAL_STATE.num_msrs;
-    struct pw_msr_addr *msr_addrs = INTERNAL_STATE.msr_addrs;
+    u64 val = 0, prev = 0;
+    int num_msrs = info_set->num_valid_msrs;
+    u64 *msr_prev = info_set->msr_prev;
+    const u32 *msr_addrs = info_set->msr_addrs;
+    const pw_msr_identifier_t *msr_ids = info_set->msr_ids;
+    pw_msr_val_t *curr_msr_count = info_set->curr_msr_count;
 
     /*
      * Read values for EVERY C-state MSR (Thread/Core/Mod/Pkg)
-     * TODO:
-     * We will need to move away from a linked list to an array.
+     * All arrays are this cpu's own, built in "pw_set_msr_addrs()".
      */
     for (i=0; i<num_msrs; ++i) {
-        msr_addr = msr_addrs[i].addr;
-        if (unlikely(msr_addr <= 0)) {
-            continue;
-        }
-        rdmsrl(msr_addr, val);
-        if (unlikely(info_set->prev_msr_vals[i].val == 0x0)) {
-            if (msr_addrs[i].id.depth == MPERF) {
-                info_set->curr_msr_count[curr_index].id = info_set->prev_msr_vals[i].id;
-                info_set->curr_msr_count[curr_index++].val = val;
+        rdmsrl(msr_addrs[i], val);
+        prev = msr_prev[i];
+        msr_prev[i] = val;
+        if (unlikely(prev == 0x0)) {
+            if (msr_ids[i].depth == MPERF) {
+                curr_msr_count[curr_index].id = msr_ids[i];
+                curr_msr_count[curr_index++].val = val;
             }
-        } else { // val != 0x0
-            if (info_set->prev_msr_vals[i].val != val) {
-                if (msr_addrs[i].id.depth > MPERF) {
-                    ++num_res;
-                }
-                info_set->curr_msr_count[curr_index].id = info_set->prev_msr_vals[i].id;
-                info_set->curr_msr_count[curr_index++].val = val;
+        } else if (prev != val) {
+            if (msr_ids[i].depth > MPERF) {
+                ++num_res;
             }
+            curr_msr_count[curr_index].id = msr_ids[i];
+            curr_msr_count[curr_index++].val = val;
+        }
+    }
+    /*
+     * The initial MSR set is sent from 'prev_msr_vals'; that's the only
+     * time it is read, so only refresh it until then.
+     */
+    if (unlikely(info_set->init_msr_set_sent == 0)) {
+        for (i=0; i<num_msrs; ++i) {
+            info_set->prev_msr_vals[info_set->msr_slots[i]].val = msr_prev[i];
         }
-        info_set->prev_msr_vals[i].val = val;
     }
 #else
     // probe_power_end fills in these statistics when it is called
@@ -5413,14 +5523,15 @@ static ssize_t pw_device_read(struct file *file, char __user *buffer, size_t len
         return 0; // "0" ==> EOF
     }
     /*
-     * 'mmap' unsupported, for now
+     * 'mmap' mode: return a bitmap of every readable segment; the data
+     * itself is read (and later released) through the mapping.
      */
-    if (false && pw_did_mmap) {
-        if (put_user(val, (u32 *)buffer)) {
-            pw_pr_error("ERROR in put_user\n");
+    if (pw_did_mmap) {
+        size_t bytes_read = 0;
+        if (pw_consume_seg_map(buffer, length, &bytes_read, &INTERNAL_STATE.drain_buffers)) {
             return -ERROR;
         }
-        return sizeof(val); // 'read' returns # of bytes actually read
+        return bytes_read; // 'read' returns # of bytes actually read
     } else {
         /*
          * Copy the buffer contents into userspace.
@@ -5450,7 +5561,9 @@ static unsigned int pw_device_poll(struct file *filp, poll_table *wait)
 };
 
 /*
- * 'mmap' unsupported, for now
+ * Map every per-cpu output buffer into the reader's address space.
+ * After this, 'read' returns segment bitmaps instead of segment contents
+ * (see PW_IOCTL_RELEASE_SEGS).
  */
 static int pw_device_mmap(struct file *filp, struct vm_area_struct *vma)
 {
@@ -5459,10 +5572,6 @@ static int pw_device_mmap(struct file *filp, struct vm_area_struct *vma)
 
     pw_pr_debug("MMAP received!\n");
 
-    if (true) {
-        return -ERROR;
-    }
-
     /*
      * Check size restrictions.
      */
@@ -5630,6 +5739,44 @@ static void pw_deallocate_msr_info_i(struct pw_msr_addr **addrs)
     }
 };
 
+/*
+ * Build the per-cpu structure-of-arrays copy of the MSR list
+ * read on every C-state exit. One allocation: values first
+ * (8-byte aligned), then addresses, slots and identifiers.
+ */
+static int pw_build_msr_soa_i(pw_msr_info_set_t *info_set, const struct pw_msr_addr *msr_addrs, int num_msrs)
+{
+    int i = 0, num_valid = 0;
+    char *__mem = NULL;
+
+    for (i=0; i<num_msrs; ++i) {
+        if ((s32)msr_addrs[i].addr > 0) {
+            ++num_valid;
+        }
+    }
+    __mem = pw_kmalloc((sizeof(u64) + sizeof(u32) + sizeof(u16) + sizeof(pw_msr_identifier_t)) * (num_valid ? num_valid : 1), GFP_KERNEL);
+    if (unlikely(!__mem)) {
+        return -ERROR;
+    }
+    info_set->msr_prev = (u64 *)__mem; __mem += sizeof(u64) * num_valid;
+    info_set->msr_addrs = (u32 *)__mem; __mem += sizeof(u32) * num_valid;
+    info_set->msr_slots = (u16 *)__mem; __mem += sizeof(u16) * num_valid;
+    info_set->msr_ids = (pw_msr_identifier_t *)__mem;
+    info_set->num_valid_msrs = num_valid;
+
+    for (i=0, num_valid=0; i<num_msrs; ++i) {
+        if ((s32)msr_addrs[i].addr <= 0) {
+            continue;
+        }
+        info_set->msr_prev[num_valid] = 0x0;
+        info_set->msr_addrs[num_valid] = msr_addrs[i].addr;
+        info_set->msr_slots[num_valid] = (u16)i;
+        info_set->msr_ids[num_valid] = msr_addrs[i].id;
+        ++num_valid;
+    }
+    return SUCCESS;
+};
+
 /*
  * Set MSR addrs
  */
@@ -5716,6 +5863,18 @@ int pw_set_msr_addrs(struct pw_msr_info *remote_info, int size)
                 for (i=0; i<num_msrs; ++i) {
                     info_set->prev_msr_vals[i].id = msr_addrs[i].id;
                 }
+                if (pw_build_msr_soa_i(info_set, msr_addrs, num_msrs)) {
+                    pw_pr_error("ERROR allocating space for info_set->msr_prev!\n");
+                    pw_kfree(INTERNAL_STATE.msr_addrs);
+                    pw_kfree(info_set->prev_msr_vals);
+                    pw_kfree(info_set->curr_msr_count);
+                    pw_kfree(info_set->c_multi_msg_mem);
+                    info_set->prev_msr_vals = NULL;
+                    info_set->curr_msr_count = NULL;
+                    info_set->c_multi_msg_mem = NULL;
+                    retVal = -ERROR;
+                    goto done;
+                }
                 pw_pr_debug(KERN_INFO "[%d]: info_set = %p, prev_msr_vals = %p, curr_msr_count = %p\n", cpu, info_set, info_set->prev_msr_vals, info_set->curr_msr_count);
             }
         }
@@ -6186,6 +6345,9 @@ void reset_per_cpu_msr_residencies(void)
             if (likely(info_set->curr_msr_count)) {
                 memset(info_set->curr_msr_count, 0, sizeof(pw_msr_val_t) * info_set->num_msrs);
             }
+            if (likely(info_set->msr_prev)) {
+                memset(info_set->msr_prev, 0, sizeof(u64) * info_set->num_valid_msrs);
+            }
             info_set->init_msr_set_sent = 0;
         }
         /*
@@ -7222,6 +7384,14 @@ long pw_unlocked_handle_ioctl_i(unsigned int ioctl_num, struct PWCollector_ioctl
         return pw_set_platform_res_config_i((struct PWCollector_platform_res_info *)remote_args->in_arg, local_in_len);
         // return -ERROR;
     }
+    else if (MATCH_IOCTL(ioctl_num, PW_IOCTL_RELEASE_SEGS)) {
+        pw_pr_debug(KERN_INFO "PW_IOCTL_RELEASE_SEGS\n");
+        if (!pw_did_mmap) {
+            pw_pr_error("ERROR: PW_IOCTL_RELEASE_SEGS without a mapping!\n");
+            return -ERROR;
+        }
+        return pw_release_segs((u64 *)remote_args->in_arg, local_in_len) < 0 ? -ERROR : SUCCESS;
+    }
     else{
 	// ERROR!
 	pw_pr_error("Invalid IOCTL command = %u\n", ioctl_num);
@@ -7303,6 +7473,10 @@ static int pw_device_release(struct inode *inode, struct file *file)
 	INTERNAL_STATE.cmd = PW_CANCEL;
 	stop_collection(PW_CANCEL);
     }
+    /*
+     * Any mapping is gone by now (it holds a reference on the file).
+     */
+    pw_did_mmap = false;
     module_put(THIS_MODULE);
     /* 
      * We're now ready for our next caller 
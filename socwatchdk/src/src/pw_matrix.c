@@ -69,6 +69,7 @@
 #include <linux/io.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/smp.h>
 #include <linux/version.h>
 #ifdef CONFIG_X86_WANT_INTEL_MID
     #include <asm/intel-mid.h>
@@ -162,6 +163,24 @@ static int mt_free_memory(void);
 // static pw_mt_msg_t mt_msg_init_buff = {0, 0, 0x0}, mt_msg_poll_buff = {0, 0, 0x0}, mt_msg_term_buff = {0, 0, 0x0};
 static pw_mt_msg_t *mt_msg_init_buff = NULL, *mt_msg_poll_buff = NULL, *mt_msg_term_buff = NULL;
 
+/*
+ * The POLL MSR list, split into runs of consecutive entries
+ * for the same target CPU. Built once in 'mt_initialize_memory()'
+ * so that a POLL scan costs one IPI per run instead of one IPI
+ * per register.
+ */
+struct mt_poll_msr_op {
+    const struct mtx_msr *msr;
+    struct mt_msr_buffer *dst; // NULL ==> WRITE_OP
+};
+struct mt_poll_msr_group {
+    unsigned int cpu;
+    unsigned long start, count; // range in 'mt_poll_msr_ops'
+};
+static struct mt_poll_msr_op *mt_poll_msr_ops = NULL;
+static struct mt_poll_msr_group *mt_poll_msr_groups = NULL;
+static unsigned long mt_poll_msr_num_groups = 0;
+
 static u32 mt_platform_pci_read32(u32 address);
 static void mt_platform_pci_write32(unsigned long address, unsigned long data);
 
@@ -401,6 +420,93 @@ static int mt_init_msg_memory(void)
     return MT_SUCCESS;
 };
 
+static void mt_free_poll_msr_groups(void)
+{
+    if (mt_poll_msr_ops) {
+        vfree(mt_poll_msr_ops);
+    }
+    if (mt_poll_msr_groups) {
+        vfree(mt_poll_msr_groups);
+    }
+    mt_poll_msr_ops = NULL;
+    mt_poll_msr_groups = NULL;
+    mt_poll_msr_num_groups = 0;
+};
+
+/*
+ * Split the POLL MSRs into runs of consecutive entries with the
+ * same 'n_cpu'. The LUT may write a select register on one CPU
+ * and read the result on another, so the runs are done in LUT
+ * order and never merged across a change of CPU. Reads keep the
+ * exchange buffer slot they had when the LUT was walked in order,
+ * so the MT_MSG layout is unchanged. Must be called after
+ * 'mt_init_msg_memory()' and after the LUT has been copied in.
+ */
+static int mt_build_poll_msr_groups(void)
+{
+    unsigned long lut_loop, msr_loop = 0;
+    unsigned long max_msr_loop = ptr_lut->msr_poll_length;
+    struct mt_xchange_buffer *xbuff = (struct mt_xchange_buffer *)&mt_msg_poll_buff->p_data;
+    struct mt_msr_buffer *msr_buff = (struct mt_msr_buffer *)xbuff->ptr_msr_buff;
+    struct mt_poll_msr_group *group = NULL;
+
+    if (!ptr_lut->msrs_poll || !max_msr_loop) {
+        return MT_SUCCESS;
+    }
+    mt_poll_msr_ops = (struct mt_poll_msr_op *)vmalloc(max_msr_loop * sizeof(*mt_poll_msr_ops));
+    mt_poll_msr_groups = (struct mt_poll_msr_group *)vmalloc(max_msr_loop * sizeof(*mt_poll_msr_groups));
+    if (!mt_poll_msr_ops || !mt_poll_msr_groups) {
+        goto MT_POLL_GROUP_ERROR;
+    }
+    for (lut_loop = 0; lut_loop < max_msr_loop; ++lut_loop) {
+        const struct mtx_msr *msr = &ptr_lut->msrs_poll[lut_loop];
+        struct mt_poll_msr_op *op = &mt_poll_msr_ops[lut_loop];
+        if (msr->operation != READ_OP && msr->operation != WRITE_OP) {
+            dev_dbg(matrix_device, "Error in MSR_OP value..\n");
+            goto MT_POLL_GROUP_ERROR;
+        }
+        if (!group || group->cpu != (unsigned int)msr->n_cpu) {
+            group = &mt_poll_msr_groups[mt_poll_msr_num_groups++];
+            group->cpu = (unsigned int)msr->n_cpu;
+            group->start = lut_loop;
+            group->count = 0;
+        }
+        ++group->count;
+        op->msr = msr;
+        op->dst = NULL;
+        if (msr->operation == READ_OP) {
+            if (msr_loop >= xbuff->msr_length) {
+                dev_dbg(matrix_device, "A(%04d) [0x%40lu]of [0x%40lu]\n", __LINE__, msr_loop, xbuff->msr_length);
+                goto MT_POLL_GROUP_ERROR;
+            }
+            op->dst = &msr_buff[msr_loop++];
+        }
+    }
+    return MT_SUCCESS;
+
+MT_POLL_GROUP_ERROR:
+    mt_free_poll_msr_groups();
+    return -MT_ERROR;
+};
+
+/*
+ * Runs on the target CPU: do the POLL MSR ops of one run.
+ */
+static void mt_poll_msr_group_i(void *info)
+{
+    const struct mt_poll_msr_group *group = (const struct mt_poll_msr_group *)info;
+    unsigned long i;
+
+    for (i = group->start; i < group->start + group->count; ++i) {
+        const struct mt_poll_msr_op *op = &mt_poll_msr_ops[i];
+        if (op->dst) {
+            rdmsr(op->msr->ecx_address, op->dst->eax_LSB, op->dst->edx_MSB);
+        } else {
+            wrmsr(op->msr->ecx_address, op->msr->eax_LSB, op->msr->edx_MSB);
+        }
+    }
+};
+
 static int mt_msg_scan_msr(struct mt_xchange_buffer *xbuff, const struct mtx_msr *msrs, unsigned long max_msr_loop)
 {
     unsigned long lut_loop = 0, msr_loop = 0;
@@ -596,14 +702,10 @@ static int mt_msg_term_scan(void)
  */
 static int mt_msg_poll_scan(unsigned long poll_loop)
 {
-    unsigned long msr_loop = 0;
     unsigned long mem_loop = 0;
     unsigned long lut_loop;
-    unsigned long max_msr_loop;
     unsigned long max_mem_loop;
-    unsigned long msr_base_addr;
     unsigned long mem_base_addr;
-    unsigned long max_msr_read;
     unsigned long max_cfg_db_loop;
     unsigned long cfg_db_base_addr;
     unsigned long delta_time;
@@ -620,25 +722,18 @@ static int mt_msg_poll_scan(unsigned long poll_loop)
     MATRIX_GET_TIME_STAMP(mt_msg_poll_buff->timestamp);
     rdtscll(tsc);
 
-    max_msr_loop = ptr_lut->msr_poll_length;
-    max_msr_read = ptr_lut->msr_poll_wb;
     max_mem_loop = xbuff->mem_length;
     max_cfg_db_loop = ptr_lut->cfg_db_poll_length;
-    msr_base_addr = 0; // (poll_loop * max_msr_read);
     mem_base_addr = 0; // (poll_loop * max_mem_loop);
     cfg_db_base_addr = 0; // (poll_loop * max_cfg_db_loop);
 
-    if (ptr_lut->msrs_poll) {
-        for (lut_loop = 0; lut_loop < max_msr_loop; lut_loop++) {
-            if (ptr_lut->msrs_poll[lut_loop].operation == READ_OP) {
-                rdmsr_on_cpu(ptr_lut->msrs_poll[lut_loop].n_cpu, ptr_lut->msrs_poll[lut_loop].ecx_address, (u32 *) &(((struct mt_msr_buffer *)xbuff->ptr_msr_buff)[msr_base_addr + msr_loop].eax_LSB), (u32 *) &(((struct mt_msr_buffer *)xbuff->ptr_msr_buff)[msr_base_addr + msr_loop].edx_MSB));
-                msr_loop++;
-            } else if (ptr_lut->msrs_poll[lut_loop].operation == WRITE_OP) {
-                wrmsr_on_cpu(ptr_lut->msrs_poll[lut_loop].n_cpu, ptr_lut->msrs_poll[lut_loop].ecx_address, ptr_lut->msrs_poll[lut_loop].eax_LSB, ptr_lut->msrs_poll[lut_loop].edx_MSB);
-            } else {
-                dev_dbg(matrix_device, "Error in MSR_OP value..\n");
-                goto MT_MSG_POLL_ERROR;
-            }
+    for (lut_loop = 0; lut_loop < mt_poll_msr_num_groups; lut_loop++) {
+        /*
+         * One IPI per run. As with 'rdmsr_on_cpu()', an
+         * offline CPU is skipped rather than failing the scan.
+         */
+        if (smp_call_function_single(mt_poll_msr_groups[lut_loop].cpu, &mt_poll_msr_group_i, &mt_poll_msr_groups[lut_loop], 1)) {
+            dev_dbg(matrix_device, "Unable to poll MSRs on cpu %u\n", mt_poll_msr_groups[lut_loop].cpu);
         }
     }
 #if DO_ANDROID
@@ -846,6 +941,7 @@ static int mt_free_memory(void)
 
 	mem_alloc_status = false;
 
+        mt_free_poll_msr_groups();
         mt_free_msg_memory();
 
 	return 0;
@@ -940,6 +1036,11 @@ static int mt_initialize_memory(unsigned long ptr_data)
 		goto ERROR;
 	}
 
+	if (mt_build_poll_msr_groups()) {
+		printk(KERN_INFO "ERROR grouping the POLL MSRs by cpu!\n");
+		goto ERROR;
+	}
+
 	io_pm_status_reg =
 	    (mt_platform_pci_read32(ptr_lut->pci_ops_poll->port) &
 	     PWR_MGMT_BASE_ADDR_MASK);
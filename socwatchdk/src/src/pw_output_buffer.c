@@ -63,6 +63,7 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 
+#include <linux/smp.h> // for "smp_call_function_single"
 #include <linux/mm.h> // for "remap_pfn_range"
 #include <asm/io.h> // for "virt_to_phys"
 #include <asm/uaccess.h> // for "copy_to_user"
@@ -100,6 +101,12 @@ int pw_max_num_cpus = -1;
  */
 // #define GET_NUM_OUTPUT_BUFFERS() (pw_max_num_cpus)
 #define GET_NUM_OUTPUT_BUFFERS() (pw_max_num_cpus + 1)
+/*
+ * Segment bitmaps ('mmap' mode): bit (buffer * NUM_SEGS_PER_BUFFER + segment),
+ * stored in u64 words.
+ */
+#define GET_NUM_SEGS() (GET_NUM_OUTPUT_BUFFERS() * NUM_SEGS_PER_BUFFER)
+#define GET_SEG_MAP_SIZE() ( ((GET_NUM_SEGS() + 63) / 64) * sizeof(u64) )
 /*
  * Convenience macro: iterate over each per-cpu output buffer.
  */
@@ -146,6 +153,10 @@ wait_queue_head_t pw_reader_queue;
  * Per-cpu output buffers.
  */
 pw_output_buffer_t *per_cpu_output_buffers = NULL;
+/*
+ * Scratch bitmaps for 'pw_consume_seg_map()' and 'pw_release_segs()'.
+ */
+static u64 *pw_full_seg_map = NULL, *pw_release_seg_map = NULL;
 /*
  * Variables for book keeping.
  */
@@ -389,6 +400,14 @@ int pw_init_per_cpu_buffers(void)
         }
     }
 
+    pw_full_seg_map = (u64 *)pw_kmalloc(GET_SEG_MAP_SIZE(), GFP_KERNEL | __GFP_ZERO);
+    pw_release_seg_map = (u64 *)pw_kmalloc(GET_SEG_MAP_SIZE(), GFP_KERNEL | __GFP_ZERO);
+    if (pw_full_seg_map == NULL || pw_release_seg_map == NULL) {
+        pw_pr_error("ERROR allocating segment bitmaps!\n");
+        pw_destroy_per_cpu_buffers();
+        return -PW_ERROR;
+    }
+
     {
         init_waitqueue_head(&pw_reader_queue);
     }
@@ -429,6 +448,14 @@ void pw_destroy_per_cpu_buffers(void)
         pw_kfree(per_cpu_output_buffers);
         per_cpu_output_buffers = NULL;
     }
+    if (pw_full_seg_map != NULL) {
+        pw_kfree(pw_full_seg_map);
+        pw_full_seg_map = NULL;
+    }
+    if (pw_release_seg_map != NULL) {
+        pw_kfree(pw_release_seg_map);
+        pw_release_seg_map = NULL;
+    }
 };
 
 void pw_reset_per_cpu_buffers(void)
@@ -570,6 +597,122 @@ unsigned long pw_consume_data(u32 mask, char __user *buffer, size_t bytes_to_rea
     return bytes_not_copied;
 };
 
+/*
+ * Flush mode: mark every non-empty segment of one output buffer full,
+ * which closes it to producers. Runs on the CPU owning the buffer
+ * (with interrupts disabled) so it can't race a producer's reservation.
+ */
+static void pw_close_segs_i(void *info)
+{
+    pw_output_buffer_t *buff = (pw_output_buffer_t *)info;
+    int i = 0;
+
+    for_each_segment(i) {
+        pw_data_buffer_t *seg = buff->buffers[i];
+        if (!seg->is_full && seg->bytes_written > 0) {
+            seg->is_full = 1;
+        }
+    }
+};
+
+/*
+ * 'mmap' counterpart of 'pw_consume_data()': copies a bitmap of EVERY
+ * segment that is ready to be read (full; in flush mode, non-empty
+ * segments are closed and marked full first) to 'buffer'. Nothing is
+ * copied or reset -- the segments belong to the reader until it calls
+ * 'pw_release_segs()', which only accepts segments reported here.
+ * Has semantics of 'copy_to_user()'.
+ */
+unsigned long pw_consume_seg_map(char __user *buffer, size_t bytes_to_read, size_t *bytes_read, const bool *is_flush_mode)
+{
+    int cpu = -1, i = 0;
+    unsigned long bytes_not_copied = 0;
+    size_t map_size = GET_SEG_MAP_SIZE();
+
+    if (!buffer || !bytes_read || !is_flush_mode) {
+        pw_pr_error("ERROR: NULL ptrs in pw_consume_seg_map!\n");
+        return -PW_ERROR;
+    }
+
+    if (bytes_to_read < map_size) {
+        pw_pr_error("Error: bytes_to_read = %u, required to be at least %u\n", (unsigned)bytes_to_read, (unsigned)map_size);
+        return bytes_to_read;
+    }
+
+    if (*is_flush_mode) {
+        for_each_output_buffer(cpu) {
+            /*
+             * The last buffer has no owning CPU; an offline CPU has no producers.
+             */
+            if (cpu >= pw_max_num_cpus || smp_call_function_single(cpu, &pw_close_segs_i, GET_OUTPUT_BUFFER(cpu), 1)) {
+                pw_close_segs_i(GET_OUTPUT_BUFFER(cpu));
+            }
+        }
+    }
+    memset(pw_full_seg_map, 0, map_size);
+    smp_mb();
+    for_each_output_buffer(cpu) {
+        pw_output_buffer_t *buff = GET_OUTPUT_BUFFER(cpu);
+        for_each_segment(i) {
+            pw_data_buffer_t *seg = buff->buffers[i];
+            if (seg->is_full) {
+                int bit = cpu * NUM_SEGS_PER_BUFFER + i;
+                pw_full_seg_map[bit >> 6] |= 1ULL << (bit & 63);
+            }
+        }
+    }
+
+    bytes_not_copied = copy_to_user(buffer, pw_full_seg_map, map_size); // dst,src
+    if (likely(bytes_not_copied == 0)) {
+        *bytes_read = map_size;
+    } else {
+        pw_pr_warn("Warning: couldn't copy %lu bytes\n", bytes_not_copied);
+    }
+    return bytes_not_copied;
+};
+
+/*
+ * Hand segments (previously returned by 'pw_consume_seg_map()') back
+ * to their producers. Returns the # of segments released, or -PW_ERROR.
+ * Bits for segments that weren't reported, or that are no longer full,
+ * are ignored: a producer may be filling them.
+ */
+int pw_release_segs(const u64 __user *map, size_t map_len)
+{
+    int bit = 0, num_released = 0;
+    size_t map_size = GET_SEG_MAP_SIZE();
+
+    if (!map || map_len < map_size) {
+        pw_pr_error("ERROR: invalid segment map (len = %u, required %u)!\n", (unsigned)map_len, (unsigned)map_size);
+        return -PW_ERROR;
+    }
+    if (copy_from_user(pw_release_seg_map, map, map_size)) { // dst,src
+        pw_pr_error("ERROR copying segment map from user!\n");
+        return -PW_ERROR;
+    }
+
+    for (bit = 0; bit < GET_NUM_SEGS(); ++bit) {
+        pw_data_buffer_t *seg = NULL;
+        if (!(pw_release_seg_map[bit >> 6] & pw_full_seg_map[bit >> 6] & (1ULL << (bit & 63)))) {
+            continue;
+        }
+        pw_full_seg_map[bit >> 6] &= ~(1ULL << (bit & 63));
+        seg = GET_OUTPUT_BUFFER(bit / NUM_SEGS_PER_BUFFER)->buffers[bit % NUM_SEGS_PER_BUFFER];
+        if (!seg->is_full) {
+            continue;
+        }
+        /*
+         * Producers only look at 'bytes_written' once 'is_full' is clear.
+         */
+        seg->bytes_written = 0;
+        smp_wmb();
+        seg->is_full = 0;
+        ++num_released;
+    }
+    pw_pr_debug(KERN_INFO "Released %d segments\n", num_released);
+    return num_released;
+};
+
 unsigned long pw_get_buffer_size(void)
 {
     return PW_DATA_BUFFER_SIZE;
@@ -32,6 +32,7 @@
 #include <linux/mempool.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/hash.h>
 
 #include "lwpmudrv_types.h"
 #include "rise_errors.h"
@@ -39,11 +40,20 @@
 #include "lwpmudrv.h"
 #include "control.h"
 #include <linux/sched.h>
+#include <linux/topology.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
 #define SMP_CALL_FUNCTION(func,ctx,retry,wait)    smp_call_function((func),(ctx),(wait))
+#define SMP_CALL_FUNCTION_SINGLE(cpu,func,ctx,retry,wait)    smp_call_function_single((cpu),(func),(ctx),(wait))
 #else
 #define SMP_CALL_FUNCTION(func,ctx,retry,wait)    smp_call_function((func),(ctx),(retry),(wait))
+#define SMP_CALL_FUNCTION_SINGLE(cpu,func,ctx,retry,wait)    smp_call_function_single((cpu),(func),(ctx),(retry),(wait))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 28)
+#define cpumask_clear(mask)           cpus_clear(*(mask))
+#define cpumask_set_cpu(cpu,mask)     cpu_set((cpu), *(mask))
+#define cpumask_test_cpu(cpu,mask)    cpu_isset((cpu), *(mask))
 #endif
 
 /*
@@ -54,7 +64,11 @@ MSR_DATA           msr_data      = NULL;
 MEM_TRACKER        mem_tr_head   = NULL;   // start of the mem tracker list
 MEM_TRACKER        mem_tr_tail   = NULL;   // end of mem tracker list
 spinlock_t         mem_tr_lock;            // spinlock for mem tracker list
+static MEM_EL      mem_tr_hash[MEM_TR_HASH_SIZE]; // in-use elements, hashed by address
+static MEM_EL      mem_tr_free   = NULL;   // empty elements, first hole first
 U64                *restore_bl_bypass        = NULL;
+static cpumask_t   control_pkg_mask;       // scratch mask for CONTROL_Invoke_Package
+static DEFINE_SPINLOCK(control_pkg_lock);  // protects control_pkg_mask
 U32                **restore_ha_direct2core  = NULL;
 U32                **restore_qpi_direct2core = NULL;
 
@@ -62,7 +76,7 @@ U32                **restore_qpi_direct2core = NULL;
 /*!
  * @fn       VOID CONTROL_Invoke_Cpu (func, ctx, arg)
  *
- * @brief    Set up a DPC call and insert it into the queue
+ * @brief    Run the function on the specified core and wait for it to complete
  *
  * @param    IN cpu_idx  - the core id to dispatch this function to
  *           IN func     - function to be invoked by the specified core(s)
@@ -72,7 +86,8 @@ U32                **restore_qpi_direct2core = NULL;
  * @return   None
  *
  * <I>Special Notes:</I>
- *
+ *           Only the target core is interrupted.  If it is the current core
+ *           the function is called directly.
  */
 extern VOID
 CONTROL_Invoke_Cpu (
@@ -81,7 +96,112 @@ CONTROL_Invoke_Cpu (
     PVOID   ctx
 )
 {
-    CONTROL_Invoke_Parallel(func, ctx);
+    preempt_disable();
+    if (cpu_idx == CONTROL_THIS_CPU()) {
+        func(ctx);
+    }
+    else {
+        SMP_CALL_FUNCTION_SINGLE(cpu_idx, func, ctx, 0, TRUE);
+    }
+    preempt_enable();
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn       VOID CONTROL_Invoke_Mask (mask, func, ctx)
+ *
+ * @brief    Run the function on every core in the mask and wait for all of them
+ *
+ * @param    IN mask     - the cores to dispatch this function to
+ *           IN func     - function to be invoked by the specified cores
+ *           IN ctx      - pointer to the parameter block for each function
+ *                         invocation
+ *
+ * @return   None
+ *
+ * <I>Special Notes:</I>
+ *           The current core runs the function directly if it is in the mask.
+ */
+extern VOID
+CONTROL_Invoke_Mask (
+    cpumask_t *mask,
+    VOID      (*func)(PVOID),
+    PVOID      ctx
+)
+{
+    S32 me;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 28)
+    S32 cpu;
+#endif
+
+    preempt_disable();
+    me = CONTROL_THIS_CPU();
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 28)
+    smp_call_function_many(mask, func, ctx, TRUE);
+#else
+    for_each_cpu_mask(cpu, *mask) {
+        if (cpu != me && cpu_online(cpu)) {
+            SMP_CALL_FUNCTION_SINGLE(cpu, func, ctx, 0, TRUE);
+        }
+    }
+#endif
+    if (cpumask_test_cpu(me, mask)) {
+        func(ctx);
+    }
+    preempt_enable();
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn       VOID CONTROL_Invoke_Package (func, ctx)
+ *
+ * @brief    Run the function on one core of every package and wait for all of them
+ *
+ * @param    IN func     - function to be invoked once per package
+ *           IN ctx      - pointer to the parameter block for each function
+ *                         invocation
+ *
+ * @return   None
+ *
+ * <I>Special Notes:</I>
+ *           The current core covers its own package, the socket master is used
+ *           for the others.  Until the topology has been set there are no socket
+ *           masters, and the function is run on all cores instead.
+ */
+extern VOID
+CONTROL_Invoke_Package (
+    VOID    (*func)(PVOID),
+    PVOID   ctx
+)
+{
+    S32 me;
+    S32 cpu;
+    S32 my_pkg;
+
+    if (pcb == NULL || num_packages == 0) {
+        CONTROL_Invoke_Parallel(func, ctx);
+        return;
+    }
+
+    // the lock also keeps us on this cpu while the mask is built and used
+    spin_lock(&control_pkg_lock);
+    me     = CONTROL_THIS_CPU();
+    my_pkg = topology_physical_package_id(me);
+    cpumask_clear(&control_pkg_mask);
+    cpumask_set_cpu(me, &control_pkg_mask);
+    for (cpu = 0; cpu < GLOBAL_STATE_num_cpus(driver_state); cpu++) {
+        if (CPU_STATE_socket_master(&pcb[cpu]) &&
+            cpu_online(cpu)                    &&
+            topology_physical_package_id(cpu) != my_pkg) {
+            cpumask_set_cpu(cpu, &control_pkg_mask);
+        }
+    }
+    CONTROL_Invoke_Mask(&control_pkg_mask, func, ctx);
+    spin_unlock(&control_pkg_lock);
 
     return;
 }
@@ -129,6 +249,82 @@ CONTROL_Invoke_Parallel_Service (
     return;
 }
 
+/* ------------------------------------------------------------------------- */
+/*
+ * @fn VOID control_Memory_Tracker_Push_Free(mem_tr)
+ *
+ * @param    IN mem_tr    - memory tracker node whose empty elements to release
+ *
+ * @returns  None
+ *
+ * @brief    Put the empty elements of a node on the free list
+ *
+ * <I>Special Notes:</I>
+ *           Assumes mem_tr_lock is already held while calling this function!
+ *           Elements are pushed last to first so that the lowest index is
+ *           handed out first, as the linear scan used to do.
+ */
+static VOID
+control_Memory_Tracker_Push_Free (
+    MEM_TRACKER mem_tr
+)
+{
+    S32    i;
+    MEM_EL el;
+
+    for (i = MEM_TRACKER_max_size(mem_tr) - 1; i >= 0; i--) {
+        el = MEM_TRACKER_mem_el(mem_tr, i);
+        if (!MEM_EL_address(el)) {
+            MEM_EL_next(el) = mem_tr_free;
+            mem_tr_free     = el;
+        }
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*
+ * @fn VOID control_Memory_Tracker_Rebuild(void)
+ *
+ * @param    None
+ *
+ * @returns  None
+ *
+ * @brief    Rebuild the address hash and the free list from the node list
+ *
+ * <I>Special Notes:</I>
+ *           Assumes mem_tr_lock is already held while calling this function!
+ *           Needed whenever elements move between nodes or nodes are deleted.
+ */
+static VOID
+control_Memory_Tracker_Rebuild (
+    void
+)
+{
+    S32         i;
+    U32         bucket;
+    MEM_EL      el;
+    MEM_TRACKER mem_tr;
+
+    memset(mem_tr_hash, 0, sizeof(mem_tr_hash));
+    mem_tr_free = NULL;
+
+    for (mem_tr = mem_tr_tail; mem_tr; mem_tr = MEM_TRACKER_prev(mem_tr)) {
+        control_Memory_Tracker_Push_Free(mem_tr);
+        for (i = 0; i < MEM_TRACKER_max_size(mem_tr); i++) {
+            el = MEM_TRACKER_mem_el(mem_tr, i);
+            if (MEM_EL_address(el)) {
+                bucket              = hash_ptr(MEM_EL_address(el), MEM_TR_HASH_BITS);
+                MEM_EL_next(el)     = mem_tr_hash[bucket];
+                mem_tr_hash[bucket] = el;
+            }
+        }
+    }
+
+    return;
+}
+
 /* ------------------------------------------------------------------------- */
 /*
  * @fn VOID control_Memory_Tracker_Delete_Node(mem_tr)
@@ -249,6 +445,7 @@ control_Memory_Tracker_Create_Node (
         MEM_TRACKER_next(mem_tr_tail) = mem_tr;
     }
     mem_tr_tail = mem_tr;
+    control_Memory_Tracker_Push_Free(mem_tr);
     SEP_PRINT_DEBUG("control_Memory_Tracker_Create_node: allocating new node=0x%p, max_elements=%d, size=%d\n",
                     MEM_TRACKER_mem(mem_tr_tail), MEM_EL_MAX_ARRAY_SIZE, size);
 
@@ -268,9 +465,10 @@ control_Memory_Tracker_Create_Node (
  * @brief    Keep track of allocated memory with memory tracker
  *
  * <I>Special Notes:</I>
- *           Starting from first mem_tracker node, the algorithm
- *           finds the first "hole" in the mem_tracker list and
- *           tracks the memory allocation there.
+ *           Empty elements ("holes") of all mem_tracker nodes are kept on
+ *           a free list, so the memory item is tracked in the first one
+ *           without scanning.  The item is then hashed by address so that
+ *           CONTROL_Free_Memory can find it in constant time.
  */
 static U32
 control_Memory_Tracker_Add (
@@ -279,51 +477,34 @@ control_Memory_Tracker_Add (
     DRV_BOOL  vmalloc_flag
 )
 {
-    S32         i, n;
-    U32         status;
-    DRV_BOOL    found;
-    MEM_TRACKER mem_tr;
+    U32         status = OS_SUCCESS;
+    U32         bucket;
+    MEM_EL      el;
 
     spin_lock(&mem_tr_lock);
 
-    // check if there is space in ANY of mem_tracker's nodes for the memory item
-    mem_tr = mem_tr_head;
-    found = FALSE;
-    status = OS_SUCCESS;
-    i = n = 0;
-    while (mem_tr && (!found)) {
-        for (i = 0; i < MEM_TRACKER_max_size(mem_tr); i++) {
-            if (!MEM_TRACKER_mem_address(mem_tr,i)) {
-                SEP_PRINT_DEBUG("CONTROL_Memory_Tracker_Add: found index %d of %d available\n",
-                                        i,
-                                        MEM_TRACKER_max_size(mem_tr)-1);
-                n = i;
-                found = TRUE;
-            }
-        }
-        if (!found) {
-            mem_tr = MEM_TRACKER_next(mem_tr);
-        }
-    }
-
-    if (!found) {
+    if (!mem_tr_free) {
         // extend into (i.e., create new) mem_tracker node ...
         status = control_Memory_Tracker_Create_Node();
         if (status != OS_SUCCESS) {
             SEP_PRINT_ERROR("Unable to create mem tracker node\n");
             goto finish_add;
         }
-        // use mem tracker tail node and first available entry in mem_el array
-        mem_tr = mem_tr_tail;
-        n = 0;
     }
 
     // we now have a location in mem tracker to keep track of the memory item
-    MEM_TRACKER_mem_address(mem_tr,n) = location;
-    MEM_TRACKER_mem_size(mem_tr,n)    = size;
-    MEM_TRACKER_mem_vmalloc(mem_tr,n) = vmalloc_flag;
-    SEP_PRINT_DEBUG("control_Memory_Tracker_Add: tracking (0x%p, %d) in node %d of %d\n",
-                     location, (S32)size, n, MEM_TRACKER_max_size(mem_tr)-1);
+    el          = mem_tr_free;
+    mem_tr_free = MEM_EL_next(el);
+
+    MEM_EL_address(el) = location;
+    MEM_EL_size(el)    = size;
+    MEM_EL_vmalloc(el) = vmalloc_flag;
+
+    bucket              = hash_ptr(location, MEM_TR_HASH_BITS);
+    MEM_EL_next(el)     = mem_tr_hash[bucket];
+    mem_tr_hash[bucket] = el;
+    SEP_PRINT_DEBUG("control_Memory_Tracker_Add: tracking (0x%p, %d) in bucket %d\n",
+                     location, (S32)size, bucket);
 
 finish_add:
     spin_unlock(&mem_tr_lock);
@@ -353,6 +534,8 @@ CONTROL_Memory_Tracker_Init (
 
     mem_tr_head = NULL;
     mem_tr_tail = NULL;
+    mem_tr_free = NULL;
+    memset(mem_tr_hash, 0, sizeof(mem_tr_hash));
 
     spin_lock_init(&mem_tr_lock);
 
@@ -393,7 +576,12 @@ CONTROL_Memory_Tracker_Free (
                                              MEM_TRACKER_max_size(mem_tr_head)-1,
                                              MEM_TRACKER_mem_address(mem_tr_head,i),
                                              MEM_TRACKER_mem_size(mem_tr_head,i));
-                free_pages((unsigned long)MEM_TRACKER_mem_address(mem_tr_head,i), get_order(MEM_TRACKER_mem_size(mem_tr_head,i)));
+                if (MEM_TRACKER_mem_vmalloc(mem_tr_head,i)) {
+                    vfree(MEM_TRACKER_mem_address(mem_tr_head,i));
+                }
+                else {
+                    free_pages((unsigned long)MEM_TRACKER_mem_address(mem_tr_head,i), get_order(MEM_TRACKER_mem_size(mem_tr_head,i)));
+                }
                 MEM_TRACKER_mem_address(mem_tr_head,i) = NULL;
                 MEM_TRACKER_mem_size(mem_tr_head,i)    = 0;
                 MEM_TRACKER_mem_vmalloc(mem_tr_head,i) = FALSE;
@@ -403,6 +591,9 @@ CONTROL_Memory_Tracker_Free (
         control_Memory_Tracker_Delete_Node(mem_tr_head);
         mem_tr_head = temp;
     }
+    mem_tr_tail = NULL;
+    mem_tr_free = NULL;
+    memset(mem_tr_hash, 0, sizeof(mem_tr_hash));
 
     spin_unlock(&mem_tr_lock);
 
@@ -428,6 +619,7 @@ CONTROL_Memory_Tracker_Free (
  *           which nodes up to mem_tr_tail will be empty.
  *           At end of collection (or at other safe sync point),
  *           we reclaim/compact space used by mem tracker.
+ *           The address hash and free list are rebuilt afterwards.
  */
 extern VOID
 CONTROL_Memory_Tracker_Compaction (
@@ -530,6 +722,8 @@ CONTROL_Memory_Tracker_Compaction (
     }
 
 finish_compact:
+    // elements moved and nodes went away, so re-derive the lookup structures
+    control_Memory_Tracker_Rebuild();
     spin_unlock(&mem_tr_lock);
 
     SEP_PRINT_DEBUG("CONTROL_Memory_Tracker_Compaction: number of elements compacted = %d, nodes deleted = %d\n", c, d);
@@ -671,15 +865,19 @@ CONTROL_Allocate_KMemory (
  *               ptr = CONTROL_Free_Memory(ptr);
  *           Does not do compaction ... can have "holes" in
  *           mem_tracker list after this operation.
+ *           The tracked memory is released after dropping mem_tr_lock.
  */
 extern PVOID
 CONTROL_Free_Memory (
     PVOID  location
 )
 {
-    S32         i;
-    DRV_BOOL    found;
-    MEM_TRACKER mem_tr;
+    U32         bucket;
+    DRV_BOOL    found   = FALSE;
+    DRV_BOOL    vmalloc = FALSE;
+    S32         size    = 0;
+    MEM_EL     *link;
+    MEM_EL      el;
 
     if (!location) {
         return NULL;
@@ -687,34 +885,38 @@ CONTROL_Free_Memory (
 
     spin_lock(&mem_tr_lock);
 
-    // scan through mem_tracker nodes for matching entry (if any)
-    mem_tr = mem_tr_head;
-    found = FALSE;
-    while (mem_tr) {
-        for (i = 0; i < MEM_TRACKER_max_size(mem_tr); i++) {
-            if (location == MEM_TRACKER_mem_address(mem_tr,i)) {
-                SEP_PRINT_DEBUG("CONTROL_Free_Memory: freeing large memory location 0x%p\n", location);
-                found = TRUE;
-                if (MEM_TRACKER_mem_vmalloc(mem_tr, i)) {
-                    vfree(location);
-                }
-                else {
-                    free_pages((unsigned long)location, get_order(MEM_TRACKER_mem_size(mem_tr,i)));
-                }
-                MEM_TRACKER_mem_address(mem_tr,i) = NULL;
-                MEM_TRACKER_mem_size(mem_tr,i)    = 0;
-                MEM_TRACKER_mem_vmalloc(mem_tr,i) = FALSE;
-                goto finish_free;
-            }
+    // look up the matching entry (if any) in its hash chain
+    bucket = hash_ptr(location, MEM_TR_HASH_BITS);
+    for (link = &mem_tr_hash[bucket]; *link; link = &MEM_EL_next(*link)) {
+        el = *link;
+        if (location == MEM_EL_address(el)) {
+            found   = TRUE;
+            size    = MEM_EL_size(el);
+            vmalloc = MEM_EL_vmalloc(el);
+            *link   = MEM_EL_next(el);
+
+            MEM_EL_address(el) = NULL;
+            MEM_EL_size(el)    = 0;
+            MEM_EL_vmalloc(el) = FALSE;
+            MEM_EL_next(el)    = mem_tr_free;
+            mem_tr_free        = el;
+            break;
         }
-        mem_tr = MEM_TRACKER_next(mem_tr);
     }
 
-finish_free:
     spin_unlock(&mem_tr_lock);
 
+    if (found) {
+        SEP_PRINT_DEBUG("CONTROL_Free_Memory: freeing large memory location 0x%p\n", location);
+        if (vmalloc) {
+            vfree(location);
+        }
+        else {
+            free_pages((unsigned long)location, get_order(size));
+        }
+    }
     // must have been of smaller than the size limit for mem tracker nodes
-    if (!found) {
+    else {
         SEP_PRINT_DEBUG("CONTROL_Free_Memory: freeing small memory location 0x%p\n", location);
         kfree(location);
     }
@@ -320,6 +320,10 @@ core2_Write_PMU (
 #endif
     } END_FOR_EACH_REG_ENTRY;
 
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
+    }
+
     return;
 }
 
@@ -646,6 +650,7 @@ core2_Check_Overflow (
             if (DRV_MASKS_masks_num(masks) < MAX_OVERFLOW_EVENTS) {
                 DRV_EVENT_MASK_bitFields1(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = DRV_EVENT_MASK_bitFields1(&event_flag);
                 DRV_EVENT_MASK_event_idx(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = ECB_entries_event_id_index(pecb, i);
+                DRV_EVENT_MASK_ovf_index(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = (U8)index;
                 DRV_MASKS_masks_num(masks)++;
             } 
             else {
@@ -1221,6 +1226,7 @@ core2_Check_Overflow_Htoff_Mode (
             if (DRV_MASKS_masks_num(masks) < MAX_OVERFLOW_EVENTS) {
                 DRV_EVENT_MASK_bitFields1(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = DRV_EVENT_MASK_bitFields1(&event_flag);
                 DRV_EVENT_MASK_event_idx(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = ECB_entries_event_id_index(pecb, i);
+                DRV_EVENT_MASK_ovf_index(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = (U8)index;
                 DRV_MASKS_masks_num(masks)++;
             } 
             else {
@@ -32,15 +32,56 @@
 #include <linux/jiffies.h>
 #include <linux/time.h>
 #include <linux/percpu.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include "lwpmudrv_types.h"
 #include "rise_errors.h"
 #include "lwpmudrv_ecb.h"
 #include "lwpmudrv_struct.h"
 #include "lwpmudrv.h"
 #include "control.h"
+#include "eventmux.h"
+
+#define EM_MIN_SLICE_NS      50000ULL        // 50us, below that the swap itself dominates
+#define EM_ADAPTIVE_SCALE    4               // adaptive slices stay within [base/4, base*4]
+#define EM_COUNTER_MASK      0xFFFFFFFFFFFFULL
+
+/*
+ * Per-cpu time accounting of the timer based multiplexer.
+ * All times are in nanoseconds of ktime_get().
+ */
+typedef struct EM_STATE_NODE_S  EM_STATE_NODE;
+typedef        EM_STATE_NODE   *EM_STATE;
+
+struct EM_STATE_NODE_S {
+    struct hrtimer  timer;
+    U64             enabled_start;   // multiplexing started
+    U64             enabled_end;     // multiplexing stopped, 0 while running
+    U64             slice_start;     // current group went on the PMU
+    U64            *running;         // time each group spent on the PMU
+    U64            *rate;            // rarest event count per ms of each group, 0 - unknown
+    U64            *prev;            // counts of the current group at the start of its slice
+};
+
+#define EM_STATE_timer(em)           (em)->timer
+#define EM_STATE_enabled_start(em)   (em)->enabled_start
+#define EM_STATE_enabled_end(em)     (em)->enabled_end
+#define EM_STATE_slice_start(em)     (em)->slice_start
+#define EM_STATE_running(em)         (em)->running
+#define EM_STATE_rate(em)            (em)->rate
+#define EM_STATE_prev(em)            (em)->prev
 
 static PVOID     em_tables      = NULL;
 static size_t    em_tables_size = 0;
+static EM_STATE  em_state       = NULL;
+static U64      *em_state_data  = NULL;
+static U32       em_num_groups  = 0;
+static U64       em_base_slice  = 0;
+static DRV_BOOL  em_adaptive    = FALSE;    // DRV_CONFIG_em_adaptive of the running collection
+
+extern DRV_CONFIG     pcfg;
+
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -110,39 +151,162 @@ eventmux_Deallocate_Groups (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID eventmux_Timer_Callback_Thread (
+ * @fn          VOID eventmux_Update_Rate (
+ *                         EM_STATE   em,
+ *                         CPU_STATE  pcpu,
+ *                         U32        group,
+ *                         U64        elapsed
  *                         )
  *
- * @brief       Stop all the timer threads and terminate them
+ * @brief       Estimate the rate of the rarest event of the group just swapped out
  *
- * @param       none
+ * @param       em      - multiplexer state of this cpu
+ * @param       pcpu    - cpu state of this cpu
+ * @param       group   - the group which has just left the PMU
+ * @param       elapsed - length of its slice in ns
  *
  * @return      NONE
  *
  * <I>Special Notes:</I>
- *              timer routine - The event multiplexing happens here.
+ *              Relies on swap_group saving the counts of the outgoing group
+ *              to em_tables. Nothing is saved in event based counts mode,
+ *              the rates stay unknown then and every group gets the base slice.
  */
 static VOID
+eventmux_Update_Rate (
+    EM_STATE   em,
+    CPU_STATE  pcpu,
+    U32        group,
+    U64        elapsed
+)
+{
+    U32   i;
+    U32   max_gp = EVENT_CONFIG_max_gp_events(global_ec);
+    S64  *saved  = CPU_STATE_em_tables(pcpu) + group * max_gp;
+    U64   delta;
+    U64   rarest = 0;
+
+    if (elapsed == 0) {
+        return;
+    }
+    for (i = 0; i < max_gp; i++) {
+        delta = ((U64)saved[i] - EM_STATE_prev(em)[i]) & EM_COUNTER_MASK;
+        if (delta && (rarest == 0 || delta < rarest)) {
+            rarest = delta;
+        }
+    }
+    if (rarest) {
+        EM_STATE_rate(em)[group] = div64_u64(rarest * 1000000ULL, elapsed) + 1;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U64 eventmux_Next_Slice (
+ *                         EM_STATE   em,
+ *                         U32        group
+ *                         )
+ *
+ * @brief       Compute the time slice of the group going on the PMU
+ *
+ * @param       em      - multiplexer state of this cpu
+ * @param       group   - the group which is about to be counted
+ *
+ * @return      slice length in ns
+ *
+ * <I>Special Notes:</I>
+ *              In adaptive mode the slice is inversely proportional to the
+ *              rate of the rarest event of the group, relative to the mean
+ *              rate over all groups, so rare events get more coverage.
+ */
+static U64
+eventmux_Next_Slice (
+    EM_STATE   em,
+    U32        group
+)
+{
+    U32   i;
+    U32   known = 0;
+    U64   mean  = 0;
+    U64   slice;
+
+    if (!em_adaptive || EM_STATE_rate(em)[group] == 0) {
+        return em_base_slice;
+    }
+    for (i = 0; i < em_num_groups; i++) {
+        if (EM_STATE_rate(em)[i]) {
+            mean += EM_STATE_rate(em)[i];
+            known++;
+        }
+    }
+    mean  = div64_u64(mean, known);
+    slice = div64_u64(em_base_slice * mean, EM_STATE_rate(em)[group]);
+    if (slice > em_base_slice * EM_ADAPTIVE_SCALE) {
+        slice = em_base_slice * EM_ADAPTIVE_SCALE;
+    }
+    if (slice < em_base_slice / EM_ADAPTIVE_SCALE) {
+        slice = em_base_slice / EM_ADAPTIVE_SCALE;
+    }
+    if (slice < EM_MIN_SLICE_NS) {
+        slice = EM_MIN_SLICE_NS;
+    }
+
+    return slice;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          enum hrtimer_restart eventmux_Timer_Callback_Thread (
+ *                         struct hrtimer *timer
+ *                         )
+ *
+ * @brief       Swap the event groups at the end of a time slice
+ *
+ * @param       timer - the multiplexing timer of this cpu
+ *
+ * @return      HRTIMER_RESTART while multiplexing is active
+ *
+ * <I>Special Notes:</I>
+ *              timer routine - The event multiplexing happens here.
+ *              Runs in hard interrupt context on the cpu the timer is pinned to.
+ */
+static enum hrtimer_restart
 eventmux_Timer_Callback_Thread (
-    unsigned long arg
+    struct hrtimer *timer
 )
 {
     U32        this_cpu;
+    U32        group;
+    U64        now;
     CPU_STATE  pcpu;
+    EM_STATE   em;
 
-    preempt_disable();
     this_cpu = CONTROL_THIS_CPU();
     pcpu     = &pcb[this_cpu];
-    preempt_enable();
-
+    em       = &em_state[this_cpu];
 
     if (CPU_STATE_em_tables(pcpu) == NULL) {
-        return;
+        return HRTIMER_NORESTART;
     }
 
+    group = CPU_STATE_current_group(pcpu);
+    if (em_adaptive) {
+        memcpy(EM_STATE_prev(em),
+               CPU_STATE_em_tables(pcpu) + group * EVENT_CONFIG_max_gp_events(global_ec),
+               EVENT_CONFIG_max_gp_events(global_ec) * sizeof(U64));
+    }
+    now = ktime_to_ns(ktime_get());
     dispatch->swap_group(TRUE);
-    CPU_STATE_em_timer(pcpu)->expires  = jiffies+arg;
-    add_timer(CPU_STATE_em_timer(pcpu));
+
+    EM_STATE_running(em)[group] += now - EM_STATE_slice_start(em);
+    if (em_adaptive) {
+        eventmux_Update_Rate(em, pcpu, group, now - EM_STATE_slice_start(em));
+    }
+    EM_STATE_slice_start(em) = now;
+
+    hrtimer_forward_now(timer, ns_to_ktime(eventmux_Next_Slice(em, CPU_STATE_current_group(pcpu))));
+
+    return HRTIMER_RESTART;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -166,21 +330,19 @@ eventmux_Prepare_Timer_Threads (
                                 PVOID arg
 )
 {
+    U32         this_cpu;
     CPU_STATE   pcpu;
 
     // initialize and set up the timer for all cpus
     // Do not start the timer as yet.
     preempt_disable();
-    pcpu = &pcb[CONTROL_THIS_CPU()];
+    this_cpu = CONTROL_THIS_CPU();
+    pcpu     = &pcb[this_cpu];
     preempt_enable();
-    CPU_STATE_em_timer(pcpu) = (struct timer_list*)CONTROL_Allocate_Memory(sizeof(struct timer_list));
 
-    if (CPU_STATE_em_timer(pcpu) == NULL) {
-       SEP_PRINT_ERROR("eventmux_Prepare_Timer_Threads skipped pcpu=NULL\n")
-       return;
-    }
-
-    init_timer(CPU_STATE_em_timer(pcpu));
+    hrtimer_init(&EM_STATE_timer(&em_state[this_cpu]), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    EM_STATE_timer(&em_state[this_cpu]).function = eventmux_Timer_Callback_Thread;
+    CPU_STATE_em_timer(pcpu) = &EM_STATE_timer(&em_state[this_cpu]);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -197,6 +359,7 @@ eventmux_Prepare_Timer_Threads (
  *
  * <I>Special Notes:</I>
  *              Cancel all the timer threads that have been started
+ *              and close the time accounting of the last slice
  */
 static VOID
 eventmux_Cancel_Timers (
@@ -204,26 +367,38 @@ eventmux_Cancel_Timers (
 )
 {
     CPU_STATE   pcpu;
+    EM_STATE    em;
     S32         i;
+    U64         now;
 
     /*
      *  Cancel the timer for all active CPUs
      */
     for (i=0; i < GLOBAL_STATE_active_cpus(driver_state); i++) {
         pcpu = &pcb[i];
-        del_timer_sync(CPU_STATE_em_timer(pcpu));
+        em   = &em_state[i];
+        if (CPU_STATE_em_timer(pcpu) == NULL) {
+            continue;
+        }
+        hrtimer_cancel(CPU_STATE_em_timer(pcpu));
+        CPU_STATE_em_timer(pcpu) = NULL;
+        if (EM_STATE_enabled_start(em) && !EM_STATE_enabled_end(em)) {
+            now = ktime_to_ns(ktime_get());
+            EM_STATE_running(em)[CPU_STATE_current_group(pcpu)] += now - EM_STATE_slice_start(em);
+            EM_STATE_enabled_end(em) = now;
+        }
     }
 }
 
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn          VOID eventmux_Start_Timers (
- *                         long unsigned arg
+ *                         PVOID arg
  *                         )
  *
  * @brief       Start the timer on a single cpu
  *
- * @param       delay   interval time in jiffies
+ * @param       arg     NULL
  *
  * @return      NONE
  *
@@ -236,14 +411,29 @@ eventmux_Start_Timers(
                       PVOID arg
                       )
 {
+    U32           this_cpu;
     CPU_STATE     pcpu;
+    EM_STATE      em;
+
     preempt_disable();
-    pcpu = &pcb[CONTROL_THIS_CPU()];
+    this_cpu = CONTROL_THIS_CPU();
+    pcpu     = &pcb[this_cpu];
+    em       = &em_state[this_cpu];
+    if (CPU_STATE_em_timer(pcpu) != NULL) {
+        EM_STATE_enabled_start(em) = ktime_to_ns(ktime_get());
+        EM_STATE_enabled_end(em)   = 0;
+        EM_STATE_slice_start(em)   = EM_STATE_enabled_start(em);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+        hrtimer_start(CPU_STATE_em_timer(pcpu),
+                      ns_to_ktime(eventmux_Next_Slice(em, CPU_STATE_current_group(pcpu))),
+                      HRTIMER_MODE_REL_PINNED);
+#else
+        hrtimer_start(CPU_STATE_em_timer(pcpu),
+                      ns_to_ktime(eventmux_Next_Slice(em, CPU_STATE_current_group(pcpu))),
+                      HRTIMER_MODE_REL);
+#endif
+    }
     preempt_enable();
-    CPU_STATE_em_timer(pcpu)->function = eventmux_Timer_Callback_Thread;
-    CPU_STATE_em_timer(pcpu)->data     = (unsigned long)arg;
-    CPU_STATE_em_timer(pcpu)->expires  = jiffies+(unsigned long)arg;
-    add_timer(CPU_STATE_em_timer(pcpu));
 }
 
 /* ------------------------------------------------------------------------- */
@@ -267,21 +457,29 @@ EVENTMUX_Start (
     EVENT_CONFIG ec
 )
 {
-    unsigned long delay;
-
     if (EVENT_CONFIG_mode(ec) != EM_TIMER_BASED ||
-        EVENT_CONFIG_num_groups(ec) == 1) {
+        EVENT_CONFIG_num_groups(ec) == 1        ||
+        em_state == NULL) {
         return;
     }
     /*
-     * notice we want to use group 0's time slice for the initial timer
+     * em_factor is the slice in milliseconds, DRV_CONFIG_em_slice_us overrides it
      */
-    delay = msecs_to_jiffies(EVENT_CONFIG_em_factor(ec));
-    SEP_PRINT_DEBUG("EVENTMUX_Start: delay is %lu jiffies\n", delay);
+    em_adaptive = DRV_CONFIG_em_adaptive(pcfg) ? TRUE : FALSE;
+    if (DRV_CONFIG_em_slice_us(pcfg)) {
+        em_base_slice = (U64)DRV_CONFIG_em_slice_us(pcfg) * NSEC_PER_USEC;
+    }
+    else {
+        em_base_slice = (U64)EVENT_CONFIG_em_factor(ec) * NSEC_PER_MSEC;
+    }
+    if (em_base_slice < EM_MIN_SLICE_NS) {
+        em_base_slice = EM_MIN_SLICE_NS;
+    }
+    SEP_PRINT_DEBUG("EVENTMUX_Start: slice is %llu ns, adaptive %u\n", em_base_slice, em_adaptive);
     /*
      * Start the timer for all cpus
      */
-    CONTROL_Invoke_Parallel(eventmux_Start_Timers, (PVOID)delay);
+    CONTROL_Invoke_Parallel(eventmux_Start_Timers, NULL);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -307,6 +505,11 @@ EVENTMUX_Initialize (
 )
 {
     S32   size_of_vector;
+    S32   i;
+    U32   per_cpu;
+    U64  *data;
+
+    EVENTMUX_Free_Times();
     if (EVENT_CONFIG_mode(ec)       == EM_DISABLED ||
         EVENT_CONFIG_num_groups(ec) == 1) {
         return;
@@ -322,6 +525,25 @@ EVENTMUX_Initialize (
                             (VOID *)&(size_of_vector));
     
     if (EVENT_CONFIG_mode(ec) == EM_TIMER_BASED) {
+        /*
+         * running and rate per group, prev per gp event, for each cpu
+         */
+        em_num_groups = EVENT_CONFIG_num_groups(ec);
+        per_cpu       = 2 * em_num_groups + EVENT_CONFIG_max_gp_events(ec);
+        em_state      = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) * sizeof(EM_STATE_NODE));
+        em_state_data = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) * per_cpu * sizeof(U64));
+        if (em_state == NULL || em_state_data == NULL) {
+            SEP_PRINT_ERROR("EVENTMUX_Initialize: no memory for the multiplexing timers\n");
+            EVENTMUX_Free_Times();
+            return;
+        }
+        memset(em_state, 0, GLOBAL_STATE_num_cpus(driver_state) * sizeof(EM_STATE_NODE));
+        memset(em_state_data, 0, GLOBAL_STATE_num_cpus(driver_state) * per_cpu * sizeof(U64));
+        for (i = 0, data = em_state_data; i < GLOBAL_STATE_num_cpus(driver_state); i++, data += per_cpu) {
+            EM_STATE_running(&em_state[i]) = data;
+            EM_STATE_rate(&em_state[i])    = data + em_num_groups;
+            EM_STATE_prev(&em_state[i])    = data + 2 * em_num_groups;
+        }
         CONTROL_Invoke_Parallel(eventmux_Prepare_Timer_Threads, NULL);
     }
 }
@@ -341,6 +563,8 @@ EVENTMUX_Initialize (
  * <I>Special Notes:</I>
  *              if event multiplexing has been enabled, then stop and cancel all the timers
  *              free up all the memory that is associated with EM
+ *              The time accounting stays until EVENTMUX_Free_Times() so that
+ *              it can be read after the collection has stopped.
  */
 extern VOID
 EVENTMUX_Destroy (
@@ -354,7 +578,7 @@ EVENTMUX_Destroy (
         EVENT_CONFIG_num_groups(ec) == 1) {
         return;
     }
-    if (EVENT_CONFIG_mode(ec) == EM_TIMER_BASED) {
+    if (EVENT_CONFIG_mode(ec) == EM_TIMER_BASED && em_state != NULL) {
         eventmux_Cancel_Timers();
     }
 
@@ -362,3 +586,102 @@ EVENTMUX_Destroy (
     em_tables_size = 0;
     CONTROL_Invoke_Parallel(eventmux_Deallocate_Groups, (VOID *)(size_t)0);
 }
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS EVENTMUX_Get_Times (
+ *                         S32   cpu,
+ *                         U64  *times
+ *                         )
+ *
+ * @brief       Report the enabled and per group running time of a cpu
+ *
+ * @param       cpu   - cpu number
+ * @param       times - receives the enabled time followed by the running
+ *                      time of each group, all in ns
+ *
+ * @return      OS_SUCCESS, or OS_INVALID if timer based multiplexing is not active
+ *
+ * <I>Special Notes:</I>
+ *              Counts of a group scaled by enabled/running give the estimate
+ *              for the whole collection. While the collection runs the
+ *              current slice is accounted up to now.
+ */
+extern OS_STATUS
+EVENTMUX_Get_Times (
+    S32   cpu,
+    U64  *times
+)
+{
+    EM_STATE   em;
+    U64        now;
+    U32        i;
+
+    if (em_state == NULL || cpu >= GLOBAL_STATE_num_cpus(driver_state)) {
+        return OS_INVALID;
+    }
+    em  = &em_state[cpu];
+    now = EM_STATE_enabled_end(em) ? EM_STATE_enabled_end(em) : ktime_to_ns(ktime_get());
+    if (EM_STATE_enabled_start(em) == 0) {
+        memset(times, 0, (em_num_groups + 1) * sizeof(U64));
+        return OS_SUCCESS;
+    }
+
+    times[0] = now - EM_STATE_enabled_start(em);
+    for (i = 0; i < em_num_groups; i++) {
+        times[i + 1] = EM_STATE_running(em)[i];
+    }
+    if (!EM_STATE_enabled_end(em)) {
+        times[CPU_STATE_current_group(&pcb[cpu]) + 1] += now - EM_STATE_slice_start(em);
+    }
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U32 EVENTMUX_Get_Num_Groups (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Number of groups reported per cpu by EVENTMUX_Get_Times()
+ *
+ * @param       NONE
+ *
+ * @return      number of groups, 0 if timer based multiplexing is not active
+ */
+extern U32
+EVENTMUX_Get_Num_Groups (
+    VOID
+)
+{
+    return em_state ? em_num_groups : 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID EVENTMUX_Free_Times (
+ *                         VOID
+ *                         )
+ *
+ * @brief       Free the time accounting of the last collection
+ *
+ * @param       NONE
+ *
+ * @return      NONE
+ *
+ * <I>Special Notes:</I>
+ *              Cancels the timers if the collection did not do it already.
+ */
+extern VOID
+EVENTMUX_Free_Times (
+    VOID
+)
+{
+    if (em_state != NULL && pcb != NULL) {
+        eventmux_Cancel_Timers();
+    }
+    em_state      = CONTROL_Free_Memory(em_state);
+    em_state_data = CONTROL_Free_Memory(em_state_data);
+    em_num_groups = 0;
+}
@@ -30,7 +30,9 @@
 #define _CONTROL_H_
 
 #include <linux/smp.h>
+#include <linux/cpumask.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #if defined(DRV_IA32)
 #include <asm/apic.h>
 #endif
@@ -118,7 +120,7 @@ struct CPU_STATE_NODE_S {
     S64        *em_tables;           // holds the data that is saved/restored
                                      // during event multiplexing
 
-    struct timer_list *em_timer;
+    struct hrtimer *em_timer;        // event multiplexing timer, owned by eventmux
     U32         current_group;
     S32         trigger_count;
     S32         trigger_event_num;
@@ -149,6 +151,17 @@ struct CPU_STATE_NODE_S {
     U64         group_swap;
     U16         cpu_module_num;
     U16         cpu_module_master;
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    // last compact sample written to this cpu's buffer (delta base)
+    U64         last_tsc;
+    U64         last_ip;
+    U64         last_psr;
+    U32         last_pid;
+    U32         last_tid;
+    U32         last_cs;
+    U32         last_bits;
+    U32         last_seg;       // 1 + output segment the delta base belongs to, 0 for none
+#endif
 };
 
 #define CPU_STATE_apic_id(cpu)              (cpu)->apic_id
@@ -182,6 +195,14 @@ struct CPU_STATE_NODE_S {
 #define CPU_STATE_group_swap(cpu)           (cpu)->group_swap
 #define  CPU_STATE_cpu_module_num(cpu)       (cpu)->cpu_module_num
 #define  CPU_STATE_cpu_module_master(cpu)    (cpu)->cpu_module_master
+#define CPU_STATE_last_tsc(cpu)             (cpu)->last_tsc
+#define CPU_STATE_last_ip(cpu)              (cpu)->last_ip
+#define CPU_STATE_last_psr(cpu)             (cpu)->last_psr
+#define CPU_STATE_last_pid(cpu)             (cpu)->last_pid
+#define CPU_STATE_last_tid(cpu)             (cpu)->last_tid
+#define CPU_STATE_last_cs(cpu)              (cpu)->last_cs
+#define CPU_STATE_last_bits(cpu)            (cpu)->last_bits
+#define CPU_STATE_last_seg(cpu)             (cpu)->last_seg
 
 /*
  * For storing data for --read/--write-msr command line options
@@ -208,7 +229,12 @@ struct MEM_EL_NODE_S {
     char     *address;         // pointer to piece of memory we're tracking
     S32       size;            // size (bytes) of the piece of memory
     DRV_BOOL  is_addr_vmalloc; // flag to check if the memory is allocated using vmalloc
+    MEM_EL    next;            // hash chain if in use, free list otherwise
 };
+#define MEM_EL_address(el)               (el)->address
+#define MEM_EL_size(el)                  (el)->size
+#define MEM_EL_vmalloc(el)               (el)->is_addr_vmalloc
+#define MEM_EL_next(el)                  (el)->next
 
 // accessors for MEM_EL defined in terms of MEM_TRACKER below
 
@@ -228,12 +254,18 @@ struct MEM_TRACKER_NODE_S {
 #define MEM_TRACKER_mem_address(mt, i)   (MEM_TRACKER_mem(mt)[(i)].address)
 #define MEM_TRACKER_mem_size(mt, i)      (MEM_TRACKER_mem(mt)[(i)].size)
 #define MEM_TRACKER_mem_vmalloc(mt, i)   (MEM_TRACKER_mem(mt)[(i)].is_addr_vmalloc)
+#define MEM_TRACKER_mem_el(mt, i)        (&MEM_TRACKER_mem(mt)[(i)])
+
+// in-use elements are hashed by address so that lookups don't walk the list
+#define MEM_TR_HASH_BITS       8
+#define MEM_TR_HASH_SIZE       (1 << MEM_TR_HASH_BITS)
 
 /****************************************************************************
  ** Global State variables exported
  ***************************************************************************/
 extern   CPU_STATE            pcb;
-extern   U64                 *tsc_info;
+extern   S64                 *tsc_skew;
+extern   U64                 *tsc_skew_err;
 extern   GLOBAL_STATE_NODE    driver_state;
 extern   MSR_DATA             msr_data;
 extern   U32                 *core_to_package_map;
@@ -265,6 +297,18 @@ extern   U32                 **restore_qpi_direct2core;
  *  Execution Control Functions
  */
 
+/*
+ * @fn VOID CONTROL_Invoke_Cpu(cpuid, func, ctx)
+ *
+ * @param    cpuid    - the cpu that is to run the function
+ * @param    func     - function to be invoked
+ * @param    ctx      - pointer to the parameter block for the function invocation
+ *
+ * @returns  none
+ *
+ * @brief    Invoke the named function on a single cpu and wait for it to complete.
+ *
+ */
 extern VOID
 CONTROL_Invoke_Cpu (
     S32   cpuid,
@@ -272,6 +316,53 @@ CONTROL_Invoke_Cpu (
     PVOID ctx
 );
 
+/*
+ * @fn VOID CONTROL_Invoke_Mask(mask, func, ctx)
+ *
+ * @param    mask     - the cpus that are to run the function
+ * @param    func     - function to be invoked by each cpu in the mask
+ * @param    ctx      - pointer to the parameter block for each function invocation
+ *
+ * @returns  none
+ *
+ * @brief    Invoke the named function in parallel on the cpus in the mask.
+ *           Wait for all the functions to complete.
+ *
+ * <I>Special Notes:</I>
+ *        Only the cpus in the mask are interrupted.  The current cpu runs the
+ *        function directly if it is in the mask.
+ *
+ */
+extern VOID
+CONTROL_Invoke_Mask (
+    cpumask_t *mask,
+    VOID      (*func)(PVOID),
+    PVOID      ctx
+);
+
+/*
+ * @fn VOID CONTROL_Invoke_Package(func, ctx)
+ *
+ * @param    func     - function to be invoked once per package
+ * @param    ctx      - pointer to the parameter block for each function invocation
+ *
+ * @returns  none
+ *
+ * @brief    Invoke the named function on one cpu of every package.
+ *           Wait for all the functions to complete.
+ *
+ * <I>Special Notes:</I>
+ *        The current cpu stands in for its own package, the socket master
+ *        is used for every other package.  Falls back to all cpus when the
+ *        topology has not been set yet.
+ *
+ */
+extern VOID
+CONTROL_Invoke_Package (
+    VOID  (*func)(PVOID),
+    PVOID ctx
+);
+
 /*
  * @fn VOID CONTROL_Invoke_Parallel_Service(func, ctx, blocking, exclude)
  *
@@ -51,4 +51,20 @@ EVENTMUX_Destroy (
     EVENT_CONFIG ec
 );
 
+extern OS_STATUS
+EVENTMUX_Get_Times (
+    S32   cpu,
+    U64  *times
+);
+
+extern U32
+EVENTMUX_Get_Num_Groups (
+    VOID
+);
+
+extern VOID
+EVENTMUX_Free_Times (
+    VOID
+);
+
 #endif /* _EVENTMUX_H_ */
@@ -44,6 +44,22 @@
     d_path(&((vm_file)->f_path), (name), (maxlen))
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+#define FILE_DENTRY(vm_file)              (vm_file)->f_dentry
+#define FILE_VFSMNT(vm_file)              (vm_file)->f_vfsmnt
+#else
+#define FILE_DENTRY(vm_file)              (vm_file)->f_path.dentry
+#define FILE_VFSMNT(vm_file)              (vm_file)->f_path.mnt
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,25)
+#define FS_ROOT_DENTRY(fs)                (fs)->root
+#define FS_ROOT_VFSMNT(fs)                (fs)->rootmnt
+#else
+#define FS_ROOT_DENTRY(fs)                (fs)->root.dentry
+#define FS_ROOT_VFSMNT(fs)                (fs)->root.mnt
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,7,0)
 #define DRV_VM_MOD_EXECUTABLE(vma)    \
     (vma->vm_flags & VM_EXECUTABLE)
@@ -64,6 +80,55 @@
 #define FIND_VMA(mm, data)   find_vma ((mm), (U64)(data));
 #endif
 
+/*
+ *  Interned module paths.  A path node is created the first time a path
+ *  is written to the module stream and gives it an id.  A file node
+ *  remembers the d_path() result for a dentry/vfsmount pair as seen from
+ *  one root.  It holds a reference on the dentry and vfsmount, so file
+ *  nodes only live for one module enumeration.
+ */
+#define LINUXOS_PATH_BUCKETS      1024
+#define LINUXOS_MAX_PATH_NODES    65536
+#define LINUXOS_MAX_FILE_NODES    8192
+
+typedef struct LINUXOS_PATH_NODE_S  LINUXOS_PATH_NODE;
+typedef        LINUXOS_PATH_NODE   *LINUXOS_PATH;
+
+struct LINUXOS_PATH_NODE_S {
+    LINUXOS_PATH   next;
+    U32            hash;
+    U32            id;
+    DRV_BOOL       emitted;     // a record carrying the name made it into the module stream
+    U16            length;      // includes the terminating \0
+    char           name[1];
+};
+
+#define LINUXOS_PATH_next(x)                 (x)->next
+#define LINUXOS_PATH_hash(x)                 (x)->hash
+#define LINUXOS_PATH_id(x)                   (x)->id
+#define LINUXOS_PATH_emitted(x)              (x)->emitted
+#define LINUXOS_PATH_length(x)               (x)->length
+#define LINUXOS_PATH_name(x)                 (x)->name
+
+typedef struct LINUXOS_FILE_NODE_S  LINUXOS_FILE_NODE;
+typedef        LINUXOS_FILE_NODE   *LINUXOS_FILE;
+
+struct LINUXOS_FILE_NODE_S {
+    LINUXOS_FILE       next;
+    struct dentry     *dentry;
+    struct vfsmount   *mnt;
+    struct dentry     *root_dentry;   // root of the caller, only compared
+    struct vfsmount   *root_mnt;
+    LINUXOS_PATH       path;
+};
+
+#define LINUXOS_FILE_next(x)                 (x)->next
+#define LINUXOS_FILE_dentry(x)               (x)->dentry
+#define LINUXOS_FILE_mnt(x)                  (x)->mnt
+#define LINUXOS_FILE_root_dentry(x)          (x)->root_dentry
+#define LINUXOS_FILE_root_mnt(x)             (x)->root_mnt
+#define LINUXOS_FILE_path(x)                 (x)->path
+
 extern VOID
 LINUXOS_Install_Hooks (
     VOID
@@ -79,4 +144,9 @@ LINUXOS_Enum_Process_Modules (
     DRV_BOOL at_end
 );
 
+extern VOID
+LINUXOS_Free_Path_Table (
+    VOID
+);
+
 #endif 
@@ -127,6 +127,8 @@ extern VOID         **desc_data;
  *           dispatch_unc          - dispatch table
  *           em_groups_counts_unc  - # groups
  *           pcfg_unc              - config struct
+ *           uncore_acc            - uncore previous values and accumulators,
+ *                                   contiguous per cpu, indexed by event (1-based)
  */
 typedef struct LWPMU_DEVICE_NODE_S  LWPMU_DEVICE_NODE;
 typedef        LWPMU_DEVICE_NODE   *LWPMU_DEVICE;
@@ -136,8 +138,8 @@ struct LWPMU_DEVICE_NODE_S {
     DISPATCH   dispatch_unc;
     S32        em_groups_count_unc;
     VOID       *pcfg_unc;
-    U64        **acc_per_thread;
-    U64        **prev_val_per_thread;
+    U64        *uncore_acc;         // per cpu: previous values, then accumulators
+    U32        uncore_acc_stride;   // U64s per cpu, both halves are whole cache lines
     U64        counter_mask;
     U64        num_events;
     U32        num_units;
@@ -147,8 +149,12 @@ struct LWPMU_DEVICE_NODE_S {
 #define LWPMU_DEVICE_dispatch(dev)            (dev)->dispatch_unc
 #define LWPMU_DEVICE_em_groups_count(dev)     (dev)->em_groups_count_unc
 #define LWPMU_DEVICE_pcfg(dev)                (dev)->pcfg_unc
-#define LWPMU_DEVICE_acc_per_thread(dev)      (dev)->acc_per_thread
-#define LWPMU_DEVICE_prev_val_per_thread(dev) (dev)->prev_val_per_thread
+#define LWPMU_DEVICE_uncore_acc(dev)          (dev)->uncore_acc
+#define LWPMU_DEVICE_uncore_acc_stride(dev)   (dev)->uncore_acc_stride
+#define LWPMU_DEVICE_prev_val_per_thread(dev, cpu) \
+    (&(dev)->uncore_acc[(cpu) * (dev)->uncore_acc_stride])
+#define LWPMU_DEVICE_acc_per_thread(dev, cpu) \
+    (&(dev)->uncore_acc[(cpu) * (dev)->uncore_acc_stride + (dev)->uncore_acc_stride / 2])
 #define LWPMU_DEVICE_counter_mask(dev)        (dev)->counter_mask
 #define LWPMU_DEVICE_num_events(dev)          (dev)->num_events
 #define LWPMU_DEVICE_num_units(dev)           (dev)->num_units
@@ -159,7 +165,7 @@ extern LWPMU_DEVICE   devices;
 extern U64           *pmu_state;
 
 // Handy macro
-#define TSC_SKEW(this_cpu)     (tsc_info[this_cpu] - tsc_info[0])
+#define TSC_SKEW(this_cpu)     (tsc_skew[this_cpu])
 
 /*
  *  The IDT / GDT descriptor for use in identifying code segments
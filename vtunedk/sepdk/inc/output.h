@@ -32,16 +32,19 @@
 /* 
  * Initial allocation 
  * Size of buffer     = 512KB (2^19)
- * number of buffers  = 2
+ * number of buffers  = 2 by default, up to OUTPUT_MAX_BUFFERS
  * The max size of the buffer cannot exceed 1<<22 i.e. 4MB
  */
 #define OUTPUT_SMALL_BUFFER        (1<<15)
 #define OUTPUT_LARGE_BUFFER        (1<<19)
 #define OUTPUT_MEMORY_THRESHOLD    0x8000000
 
+#define OUTPUT_MIN_BUFFERS         2
+
 extern  U32                   output_buffer_size;
+extern  U32                   output_num_buffers;
 #define OUTPUT_BUFFER_SIZE    output_buffer_size
-#define OUTPUT_NUM_BUFFERS    2
+#define OUTPUT_NUM_BUFFERS    output_num_buffers
 #if defined (DRV_ANDROID)
 #define MODULE_BUFF_SIZE      1
 #else
@@ -50,23 +53,38 @@ extern  U32                   output_buffer_size;
 
 /*
  *  Data type declarations and accessors macros
+ *
+ *  The segments of an OUTPUT form a single-producer/single-consumer ring.
+ *  head and tail are free-running segment counters.  The driver works on
+ *  its own copy of the ring state and publishes it to OUTPUT_CONTROL, which
+ *  lives on its own page so that it can be mapped to user space together
+ *  with the segments; see lwpmudrv_struct.h for the protocol.  The mapped
+ *  page is user-writable, so the only value ever taken back from it is the
+ *  reader's tail, and only for segments that were handed over.
  */
 typedef struct {
-    spinlock_t    buffer_lock;
-    U32           remaining_buffer_size;
-    U32           current_buffer;
-    U32           total_buffer_size;
-    U32           next_buffer[OUTPUT_NUM_BUFFERS];
-    U32           buffer_full[OUTPUT_NUM_BUFFERS];
-    U8           *buffer[OUTPUT_NUM_BUFFERS];
+    spinlock_t       buffer_lock;
+    U32              remaining_buffer_size;
+    U32              total_buffer_size;
+    U32              head;
+    U32              tail;
+    U32              buffer_full[OUTPUT_MAX_BUFFERS];
+    U64              dropped_samples;
+    OUTPUT_CONTROL   control;
+    U8              *buffer[OUTPUT_MAX_BUFFERS];
 } OUTPUT_NODE, *OUTPUT;
 
 #define OUTPUT_buffer_lock(x)            (x)->buffer_lock
 #define OUTPUT_remaining_buffer_size(x)  (x)->remaining_buffer_size
 #define OUTPUT_total_buffer_size(x)      (x)->total_buffer_size
+#define OUTPUT_control(x)                (x)->control
 #define OUTPUT_buffer(x,y)               (x)->buffer[(y)]
 #define OUTPUT_buffer_full(x,y)          (x)->buffer_full[(y)]
-#define OUTPUT_current_buffer(x)         (x)->current_buffer
+#define OUTPUT_head(x)                   (x)->head
+#define OUTPUT_tail(x)                   (x)->tail
+#define OUTPUT_current_buffer(x)         (OUTPUT_head(x) % OUTPUT_NUM_BUFFERS)
+#define OUTPUT_read_buffer(x)            (OUTPUT_tail(x) % OUTPUT_NUM_BUFFERS)
+#define OUTPUT_dropped_samples(x)        (x)->dropped_samples
 
 /*
  *  Add an array of control buffer for per-cpu 
@@ -75,11 +93,13 @@ typedef struct {
     wait_queue_head_t queue;
     OUTPUT_NODE      outbuf;
     U32              sample_count;
+    DRV_BOOL         eof;
 } BUFFER_DESC_NODE, *BUFFER_DESC;
 
 #define BUFFER_DESC_queue(a)          (a)->queue
 #define BUFFER_DESC_outbuf(a)         (a)->outbuf
 #define BUFFER_DESC_sample_count(a)   (a)->sample_count
+#define BUFFER_DESC_eof(a)            (a)->eof
 
 extern BUFFER_DESC   cpu_buf;  // actually an array of BUFFER_DESC_NODE
 extern BUFFER_DESC   module_buf;
@@ -94,6 +114,13 @@ extern int       OUTPUT_Destroy (VOID);
 extern int       OUTPUT_Flush (VOID);
 extern ssize_t   OUTPUT_Module_Read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
 extern ssize_t   OUTPUT_Sample_Read (struct file *filp, char *buf, size_t count, loff_t *f_pos);
+extern OS_STATUS OUTPUT_Drain_Samples (char *buf, size_t count, U32 timeout_ms);
+extern int       OUTPUT_Module_Mmap (struct file *filp, struct vm_area_struct *vma);
+extern int       OUTPUT_Sample_Mmap (struct file *filp, struct vm_area_struct *vma);
+extern unsigned int OUTPUT_Module_Poll (struct file *filp, struct poll_table_struct *wait);
+extern unsigned int OUTPUT_Sample_Poll (struct file *filp, struct poll_table_struct *wait);
 extern void*     OUTPUT_Reserve_Buffer_Space (BUFFER_DESC  bd, U32 size);
+extern VOID      OUTPUT_Release_Buffer_Space (BUFFER_DESC  bd, U32 size);
+extern U64       OUTPUT_Get_Dropped_Samples (BUFFER_DESC  bd);
 
 #endif 
@@ -183,17 +183,26 @@ PEBS_Reset_Index (
     S32 this_cpu
 );
 
+extern S32
+PEBS_Find_Record (
+    S32 this_cpu,
+    U32 start,
+    U32 ovf_index
+);
+
 extern VOID
 PEBS_Modify_IP (
     void       *sample,
-    DRV_BOOL    is_64bit_addr
+    DRV_BOOL    is_64bit_addr,
+    U32         rec_idx
 );
 
 extern VOID
 PEBS_Fill_Buffer (
     S8            *buffer,
     EVENT_DESC    evt_desc,
-    DRV_BOOL      virt_phys_translation_ena
+    DRV_BOOL      virt_phys_translation_ena,
+    U32           rec_idx
 );
 
 extern U64
@@ -212,7 +221,7 @@ typedef        PEBS_DISPATCH_NODE   *PEBS_DISPATCH;
 struct PEBS_DISPATCH_NODE_S {
     VOID (*initialize_threshold)(DTS_BUFFER_EXT, U32);
     U64  (*overflow)(S32, U64);
-    VOID (*modify_ip)(void*, DRV_BOOL);
+    VOID (*modify_ip)(void*, DRV_BOOL, S8*);
 };
 
 #endif  
@@ -0,0 +1,66 @@
+/*
+    Copyright (C) 2005-2013 Intel Corporation.  All Rights Reserved.
+
+    This file is part of SEP Development Kit
+
+    SEP Development Kit is free software; you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    version 2 as published by the Free Software Foundation.
+
+    SEP Development Kit is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SEP Development Kit; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    As a special exception, you may use this file as part of a free software
+    library without restriction.  Specifically, if other files instantiate
+    templates or use macros or inline functions from this file, or you compile
+    this file and link it with other files to produce an executable, this
+    file does not by itself cause the resulting executable to be covered by
+    the GNU General Public License.  This exception does not however
+    invalidate any other reasons why the executable file might be covered by
+    the GNU General Public License.
+*/
+
+#ifndef _TSC_H_
+#define _TSC_H_
+
+#include "lwpmudrv_types.h"
+#include "lwpmudrv_struct.h"
+
+extern OS_STATUS
+TSC_Initialize (
+    VOID
+);
+
+extern VOID
+TSC_Destroy (
+    VOID
+);
+
+extern OS_STATUS
+TSC_Calibrate (
+    VOID
+);
+
+extern VOID
+TSC_Start_Drift_Tracking (
+    U32  period_ms
+);
+
+extern VOID
+TSC_Stop_Drift_Tracking (
+    VOID
+);
+
+extern OS_STATUS
+TSC_Get_Drift (
+    TSC_DRIFT_INFO  info,
+    U32             num_cpus
+);
+
+#endif /* _TSC_H_ */
@@ -0,0 +1,246 @@
+/*COPYRIGHT**
+ * -------------------------------------------------------------------------
+ *               INTEL CORPORATION PROPRIETARY INFORMATION
+ *  This software is supplied under the terms of the accompanying license
+ *  agreement or nondisclosure agreement with Intel Corporation and may not
+ *  be copied or disclosed except in accordance with the terms of that
+ *  agreement.
+ *        Copyright (c) 2007-2013 Intel Corporation.  All Rights Reserved.
+ * -------------------------------------------------------------------------
+**COPYRIGHT*/
+
+/*
+ *  User-mode decoder for compact sample streams (DRV_CONFIG_compact_samples),
+ *  see the CompactSampleRecord description in lwpmudrv_struct.h.
+ *
+ *  Keep one COMPACT_DECODER per cpu and feed it that cpu's records in the
+ *  order the driver wrote them, whether they come from read(), from mmap
+ *  segments or from DRV_OPERATION_DRAIN_SAMPLES.  Every record, compact or
+ *  legacy, comes back as the legacy SampleRecordPC layout of its descriptor.
+ */
+
+#ifndef _LWPMUDRV_COMPACT_H_
+#define _LWPMUDRV_COMPACT_H_
+
+#include <string.h>
+
+#include "lwpmudrv_types.h"
+#include "lwpmudrv_ecb.h"
+#include "lwpmudrv_struct.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct COMPACT_DECODER_NODE_S  COMPACT_DECODER_NODE;
+typedef        COMPACT_DECODER_NODE   *COMPACT_DECODER;
+
+struct COMPACT_DECODER_NODE_S {
+    const U32  *sample_size;        // legacy sample_size of each descriptor id
+    U32         num_descriptors;
+    U64         last_tsc;
+    U64         last_ip;
+    U64         last_psr;
+    U32         last_pid;
+    U32         last_tid;
+    U32         last_cs;
+    U32         last_bits;
+};
+
+#define COMPACT_DECODER_sample_size(d)         (d)->sample_size
+#define COMPACT_DECODER_num_descriptors(d)     (d)->num_descriptors
+
+#define COMPACT_UNZIGZAG(v)                    (((v) >> 1) ^ (U64)(-(S64)((v) & 1)))
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID COMPACT_Decoder_Init (COMPACT_DECODER dec,
+ *                                         const U32      *sample_size,
+ *                                         U32             num_descriptors)
+ *
+ * @param       dec             - decoder of one cpu
+ * @param       sample_size     - legacy record size, indexed by descriptor id
+ * @param       num_descriptors - number of entries in sample_size
+ *
+ * @brief       Prepare a decoder for the start of a collection
+ */
+static inline VOID
+COMPACT_Decoder_Init (
+    COMPACT_DECODER  dec,
+    const U32       *sample_size,
+    U32              num_descriptors
+)
+{
+    memset(dec, 0, sizeof(*dec));
+    COMPACT_DECODER_sample_size(dec)     = sample_size;
+    COMPACT_DECODER_num_descriptors(dec) = num_descriptors;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U32 compact_Get_Varint (const U8 *in, U32 *pos, U32 end, U64 *val)
+ *
+ * @brief       Read one little-endian base 128 value, 0 if it runs past end
+ */
+static inline U32
+compact_Get_Varint (
+    const U8  *in,
+    U32       *pos,
+    U32        end,
+    U64       *val
+)
+{
+    U64  v     = 0;
+    U32  shift = 0;
+
+    while (*pos < end && shift < 64) {
+        U8 b = in[(*pos)++];
+        v |= (U64)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            *val = v;
+            return 1;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U32 COMPACT_Decode_Sample (COMPACT_DECODER dec,
+ *                                         const U8       *in,
+ *                                         U32             in_len,
+ *                                         U8             *out,
+ *                                         U32             out_len,
+ *                                         U32            *out_size)
+ *
+ * @param       dec      - decoder of the cpu the record belongs to
+ * @param       in       - next record of the stream
+ * @param       in_len   - bytes available at in
+ * @param       out      - receives the legacy SampleRecordPC layout
+ * @param       out_len  - size of out
+ * @param       out_size - size of the record written to out
+ *
+ * @return      bytes of in consumed, 0 if the record is truncated, malformed
+ *              or does not fit in out
+ *
+ * @brief       Decode the record at the start of in
+ *
+ * <I>Special Notes:</I>
+ *              On a 0 return the decoder state is unchanged, so the call can
+ *              be repeated once more of the stream is available.
+ */
+static inline U32
+COMPACT_Decode_Sample (
+    COMPACT_DECODER  dec,
+    const U8        *in,
+    U32              in_len,
+    U8              *out,
+    U32              out_len,
+    U32             *out_size
+)
+{
+    SampleRecordPC  rec;
+    U32             first, desc_id, size, total, payload;
+    U32             pos = COMPACT_SAMPLE_FIXED_SIZE;
+    U8              flags;
+    U64             v_tsc, v_ip, v_pid, v_tid;
+    U64             psr, cs, bits;
+    U64             base_tsc, base_ip, base_psr;
+    U32             base_pid, base_tid, base_cs, base_bits;
+
+    if (in_len < 2) {
+        return 0;
+    }
+    first   = in[0] | ((U32)in[1] << 8);
+    desc_id = first & ~COMPACT_SAMPLE_MARKER;
+    if (desc_id >= COMPACT_DECODER_num_descriptors(dec)) {
+        return 0;
+    }
+    size = COMPACT_DECODER_sample_size(dec)[desc_id];
+    if (size < sizeof(SampleRecordPC) || size > out_len) {
+        return 0;
+    }
+
+    // legacy record: copied as is, the delta state does not move
+    if (!(first & COMPACT_SAMPLE_MARKER)) {
+        if (in_len < size) {
+            return 0;
+        }
+        memcpy(out, in, size);
+        *out_size = size;
+        return size;
+    }
+
+    if (in_len < COMPACT_SAMPLE_FIXED_SIZE) {
+        return 0;
+    }
+    total = in[2] | ((U32)in[3] << 8);
+    flags = in[4];
+    if (total < COMPACT_SAMPLE_FIXED_SIZE || total > in_len) {
+        return 0;
+    }
+
+    if (flags & COMPACT_SAMPLE_SEGMENT_START) {
+        base_tsc = base_ip  = base_psr = 0;
+        base_pid = base_tid = base_cs  = base_bits = 0;
+    }
+    else {
+        base_tsc  = dec->last_tsc;
+        base_ip   = dec->last_ip;
+        base_psr  = dec->last_psr;
+        base_pid  = dec->last_pid;
+        base_tid  = dec->last_tid;
+        base_cs   = dec->last_cs;
+        base_bits = dec->last_bits;
+    }
+
+    psr  = base_psr;
+    cs   = base_cs;
+    bits = base_bits;
+    if (!compact_Get_Varint(in, &pos, total, &v_tsc) ||
+        !compact_Get_Varint(in, &pos, total, &v_ip)  ||
+        !compact_Get_Varint(in, &pos, total, &v_pid) ||
+        !compact_Get_Varint(in, &pos, total, &v_tid) ||
+        ((flags & COMPACT_SAMPLE_HAS_PSR)  && !compact_Get_Varint(in, &pos, total, &psr)) ||
+        ((flags & COMPACT_SAMPLE_HAS_CS)   && !compact_Get_Varint(in, &pos, total, &cs))  ||
+        ((flags & COMPACT_SAMPLE_HAS_BITS) && !compact_Get_Varint(in, &pos, total, &bits))) {
+        return 0;
+    }
+    payload = total - pos;
+    if (payload != size - sizeof(SampleRecordPC)) {
+        return 0;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    SAMPLE_RECORD_descriptor_id(&rec)   = desc_id;
+    SAMPLE_RECORD_tsc(&rec)             = base_tsc + COMPACT_UNZIGZAG(v_tsc);
+    SAMPLE_RECORD_iip(&rec)             = base_ip  + COMPACT_UNZIGZAG(v_ip);
+    SAMPLE_RECORD_ipsr(&rec)            = psr;
+    SAMPLE_RECORD_pid_rec_index(&rec)   = base_pid + (U32)COMPACT_UNZIGZAG(v_pid);
+    SAMPLE_RECORD_tid(&rec)             = base_tid + (U32)COMPACT_UNZIGZAG(v_tid);
+    SAMPLE_RECORD_cs(&rec)              = (U16)cs;
+    SAMPLE_RECORD_cpu_and_os(&rec)      = (U16)(cs >> 16);
+    SAMPLE_RECORD_bit_fields2(&rec)     = (U32)bits;
+
+    memcpy(out, &rec, sizeof(rec));
+    memcpy(out + sizeof(rec), in + pos, payload);
+    *out_size = size;
+
+    dec->last_tsc  = SAMPLE_RECORD_tsc(&rec);
+    dec->last_ip   = SAMPLE_RECORD_iip(&rec);
+    dec->last_psr  = psr;
+    dec->last_pid  = SAMPLE_RECORD_pid_rec_index(&rec);
+    dec->last_tid  = SAMPLE_RECORD_tid(&rec);
+    dec->last_cs   = (U32)cs;
+    dec->last_bits = (U32)bits;
+
+    return total;
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* _LWPMUDRV_COMPACT_H_ */
@@ -90,6 +90,11 @@ extern "C" {
 #define DRV_OPERATION_SET_PWR_EVENT                77
 #define DRV_OPERATION_SET_DEVICE_NUM_UNITS         78
 #define DRV_OPERATION_TIMER_TRIGGER_READ           79
+#define DRV_OPERATION_GET_NUM_DROPPED_SAMPLES      80
+#define DRV_OPERATION_DRAIN_SAMPLES                81
+#define DRV_OPERATION_GET_EM_TIMES                 82
+#define DRV_OPERATION_SNAPSHOT_COUNTERS            83
+#define DRV_OPERATION_TSC_DRIFT_INFO               84
 
 // IOCTL_SETUP
 //
@@ -171,6 +176,11 @@ extern "C" {
 #define LWPMUDRV_IOCTL_SET_PWR_EVENT                LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_SET_PWR_EVENT)
 #define LWPMUDRV_IOCTL_SET_DEVICE_NUM_UNITS         LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_SET_DEVICE_NUM_UNITS)
 #define LWPMUDRV_IOCTL_TIMER_TRIGGER_READ           LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_TIMER_TRIGGER_READ)
+#define LWPMUDRV_IOCTL_GET_NUM_DROPPED_SAMPLES      LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_NUM_DROPPED_SAMPLES)
+#define LWPMUDRV_IOCTL_DRAIN_SAMPLES                LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_DRAIN_SAMPLES)
+#define LWPMUDRV_IOCTL_GET_EM_TIMES                 LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_GET_EM_TIMES)
+#define LWPMUDRV_IOCTL_SNAPSHOT_COUNTERS            LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_SNAPSHOT_COUNTERS)
+#define LWPMUDRV_IOCTL_TSC_DRIFT_INFO               LWPMUDRV_CTL_READ_CODE(DRV_OPERATION_TSC_DRIFT_INFO)
 
 #elif defined(DRV_OS_LINUX) || defined(DRV_OS_SOLARIS) || defined (DRV_OS_ANDROID)
 // IOCTL_ARGS
@@ -262,6 +272,11 @@ struct IOCTL_COMPAT_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_COMPAT_GET_NUM_SAMPLES        _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_NUM_SAMPLES, compat_uptr_t) 
 #define LWPMUDRV_IOCTL_COMPAT_SET_PWR_EVENT          _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_PWR_EVENT, compat_uptr_t)
 #define LWPMUDRV_IOCTL_COMPAT_SET_DEVICE_NUM_UNITS   _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_DEVICE_NUM_UNITS, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_GET_NUM_DROPPED_SAMPLES _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_NUM_DROPPED_SAMPLES, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_DRAIN_SAMPLES          _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_DRAIN_SAMPLES, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_GET_EM_TIMES           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_TIMES, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_SNAPSHOT_COUNTERS      _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_SNAPSHOT_COUNTERS, compat_uptr_t)
+#define LWPMUDRV_IOCTL_COMPAT_TSC_DRIFT_INFO         _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_TSC_DRIFT_INFO, compat_uptr_t)
 #endif
 
 #define LWPMUDRV_IOCTL_START                  _IO (LWPMU_IOC_MAGIC,  DRV_OPERATION_START)
@@ -324,6 +339,11 @@ struct IOCTL_COMPAT_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_SET_PWR_EVENT          _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_PWR_EVENT, IOCTL_ARGS)
 #define LWPMUDRV_IOCTL_SET_DEVICE_NUM_UNITS   _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_DEVICE_NUM_UNITS, IOCTL_ARGS)
 #define LWPMUDRV_IOCTL_TIMER_TRIGGER_READ     _IO (LWPMU_IOC_MAGIC, DRV_OPERATION_TIMER_TRIGGER_READ)
+#define LWPMUDRV_IOCTL_GET_NUM_DROPPED_SAMPLES _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_NUM_DROPPED_SAMPLES, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_DRAIN_SAMPLES          _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_DRAIN_SAMPLES, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_GET_EM_TIMES           _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_TIMES, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_SNAPSHOT_COUNTERS      _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_SNAPSHOT_COUNTERS, IOCTL_ARGS)
+#define LWPMUDRV_IOCTL_TSC_DRIFT_INFO         _IOR(LWPMU_IOC_MAGIC, DRV_OPERATION_TSC_DRIFT_INFO, IOCTL_ARGS)
 
 #elif defined(DRV_OS_FREEBSD)
 
@@ -410,6 +430,11 @@ struct IOCTL_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_SET_PWR_EVENT          _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_PWR_EVENT, IOCTL_ARGS_NODE)
 #define LWPMUDRV_IOCTL_SET_DEVICE_NUM_UNITS   _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SET_DEVICE_NUM_UNITS, IOCTL_ARGS_NODE)
 #define LWPMUDRV_IOCTL_TIMER_TRIGGER_READ     _IO (LWPMU_IOC_MAGIC, DRV_OPERATION_TIMER_TRIGGER_READ)
+#define LWPMUDRV_IOCTL_GET_NUM_DROPPED_SAMPLES _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_NUM_DROPPED_SAMPLES, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_DRAIN_SAMPLES          _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_DRAIN_SAMPLES, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_GET_EM_TIMES           _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_GET_EM_TIMES, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_SNAPSHOT_COUNTERS      _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_SNAPSHOT_COUNTERS, IOCTL_ARGS_NODE)
+#define LWPMUDRV_IOCTL_TSC_DRIFT_INFO         _IOW(LWPMU_IOC_MAGIC, DRV_OPERATION_TSC_DRIFT_INFO, IOCTL_ARGS_NODE)
 
 #elif defined(DRV_OS_MAC)
 
@@ -515,6 +540,11 @@ struct CPU_ARGS_NODE_S {
 #define LWPMUDRV_IOCTL_SET_PWR_EVENT          DRV_OPERATION_SET_PWR_EVENT
 #define LWPMUDRV_IOCTL_GET_ASLR_OFFSET        DRV_OPERATION_SET_DEVICE_NUM_UNITS
 #define LWPMUDRV_IOCTL_TIMER_TRIGGER_READ     DRV_OPERATION_TIMER_TRIGGER_READ
+#define LWPMUDRV_IOCTL_GET_NUM_DROPPED_SAMPLES DRV_OPERATION_GET_NUM_DROPPED_SAMPLES
+#define LWPMUDRV_IOCTL_DRAIN_SAMPLES          DRV_OPERATION_DRAIN_SAMPLES
+#define LWPMUDRV_IOCTL_GET_EM_TIMES           DRV_OPERATION_GET_EM_TIMES
+#define LWPMUDRV_IOCTL_SNAPSHOT_COUNTERS      DRV_OPERATION_SNAPSHOT_COUNTERS
+#define LWPMUDRV_IOCTL_TSC_DRIFT_INFO         DRV_OPERATION_TSC_DRIFT_INFO
 
 // This is only for MAC OSX
 #define LWPMUDRV_IOCTL_SET_OSX_VERSION        998
@@ -79,14 +79,15 @@ struct DRV_CONFIG_NODE_S {
 #endif
     S32          seed_name_len;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
-    U32          padding1;
+    U32          pebs_record_num;  // PEBS records buffered per PMI, 0 or 1 for one; system-wide only,
+                                   // buffered samples carry the pid/tid current at the PMI
 #endif
     U64          target_pid;
     DRV_BOOL     use_pcl;
     DRV_BOOL     enable_ebc;
     DRV_BOOL     enable_tbc;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
-    U32          padding2;
+    DRV_BOOL     intern_module_paths;  // emit each module path once, see ModuleRecord pathInterned
 #endif
     union {
         S8      *seed_name;
@@ -98,8 +99,19 @@ struct DRV_CONFIG_NODE_S {
     } u2;
     DRV_BOOL     ds_area_available;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
-    U32          padding3;
+    DRV_BOOL     compact_samples;  // emit CompactSampleRecord instead of SampleRecordPC
 #endif
+    U32          num_output_buffers;  // segments per cpu output ring, clamped to
+                                      // [OUTPUT_MIN_BUFFERS, OUTPUT_MAX_BUFFERS]
+    U32          em_slice_us;         // event multiplexing slice in microseconds, 0 - use em_factor
+    DRV_BOOL     em_adaptive;         // weight multiplexing slices by the observed event rates
+    U32          unc_sample_us;       // read the uncore from one cpu per package every that many
+                                      // microseconds, 0 - read it in every PMI
+    U32          results_size;        // uncore devices: bytes reserved at results_offset; with
+                                      // unc_sample_us set and room for the group id, the counts
+                                      // and one more U64, that U64 gets the TSC of the counts
+    U32          tsc_drift_ms;        // remeasure the TSC skews every that many milliseconds
+                                      // while collecting, 0 - measure only at start
 
 };
 
@@ -125,10 +137,14 @@ struct DRV_CONFIG_NODE_S {
 #define DRV_CONFIG_htoff_mode(cfg)                (cfg)->htoff_mode
 #define DRV_CONFIG_power_capture(cfg)             (cfg)->power_capture
 #define DRV_CONFIG_results_offset(cfg)            (cfg)->results_offset
+#define DRV_CONFIG_results_size(cfg)              (cfg)->results_size
 #define DRV_CONFIG_eventing_ip_capture(cfg)       (cfg)->eventing_ip_capture
 #define DRV_CONFIG_hle_capture(cfg)               (cfg)->hle_capture
 
 #define DRV_CONFIG_emon_unc_offset(cfg)           (cfg)->emon_unc_offset
+#define DRV_CONFIG_compact_samples(cfg)           (cfg)->compact_samples
+#define DRV_CONFIG_pebs_record_num(cfg)           (cfg)->pebs_record_num
+#define DRV_CONFIG_intern_module_paths(cfg)       (cfg)->intern_module_paths
 #else
 #define DRV_CONFIG_collect_ro(cfg)                (cfg)->collect_ro
 #endif
@@ -140,6 +156,11 @@ struct DRV_CONFIG_NODE_S {
 #define DRV_CONFIG_event_based_counts(cfg)        (cfg)->enable_ebc
 #define DRV_CONFIG_timer_based_counts(cfg)        (cfg)->enable_tbc
 #define DRV_CONFIG_ds_area_available(cfg)         (cfg)->ds_area_available
+#define DRV_CONFIG_num_output_buffers(cfg)        (cfg)->num_output_buffers
+#define DRV_CONFIG_em_slice_us(cfg)               (cfg)->em_slice_us
+#define DRV_CONFIG_em_adaptive(cfg)               (cfg)->em_adaptive
+#define DRV_CONFIG_unc_sample_us(cfg)             (cfg)->unc_sample_us
+#define DRV_CONFIG_tsc_drift_ms(cfg)              (cfg)->tsc_drift_ms
 
 /*
  *    X86 processor code descriptor
@@ -249,6 +270,45 @@ typedef struct SampleRecordPC_s {   // Program Counter section
 #define SAMPLE_RECORD_mr_index_none(x)       (x)->u3.s4.mrIndexNone
 #define SAMPLE_RECORD_tsc(x)                 (x)->tsc
 
+/*
+ *  Compact sample record (DRV_CONFIG_compact_samples, IA32/Intel(R) 64 only).
+ *
+ *  Written in place of a SampleRecordPC.  The first 16 bits hold
+ *  COMPACT_SAMPLE_MARKER | descriptor_id, which a legacy record (whose U64
+ *  descriptor_id is always below the marker) never has.  Layout:
+ *
+ *      U16      marker | descriptor_id
+ *      U16      total size of this record in bytes
+ *      U8       COMPACT_SAMPLE_HAS_* flags
+ *      varint   tsc        zigzag delta
+ *      varint   ip word    zigzag delta (first U64 of u1: iip, or eip | eflags << 32)
+ *      varint   pid        zigzag delta of the 32-bit pidRecIndex
+ *      varint   tid        zigzag delta of the 32-bit tid
+ *      varint   psr word   only if COMPACT_SAMPLE_HAS_PSR (second U64 of u1: ipsr or csd)
+ *      varint   cs word    only if COMPACT_SAMPLE_HAS_CS (cs | cpuAndOS << 16)
+ *      varint   bits word  only if COMPACT_SAMPLE_HAS_BITS (bitFields2)
+ *      U8[]     bytes sizeof(SampleRecordPC) .. sample_size of the legacy
+ *               record (PEBS, LBR, EBC, ... payload), unchanged
+ *
+ *  Varints are little-endian base 128 (high bit set on every byte but the
+ *  last).  Deltas and omitted words refer to the previous compact record of
+ *  the same cpu.  The first compact record of each per-cpu buffer segment
+ *  carries COMPACT_SAMPLE_SEGMENT_START and is taken against all-zero
+ *  values: the reset is marked in the stream itself, so a reader needs no
+ *  segment boundaries (which read() and saved sample files do not keep),
+ *  and a segment taken from mmap or DRV_OPERATION_DRAIN_SAMPLES still
+ *  decodes on its own.  Legacy records may still appear in a compact stream
+ *  (when compaction would not save space); their size is the sample_size of
+ *  their descriptor and they do not affect the delta state.  Records are
+ *  byte packed.  lwpmudrv_compact.h holds a decoder.
+ */
+#define COMPACT_SAMPLE_MARKER                0x8000
+#define COMPACT_SAMPLE_FIXED_SIZE            5
+#define COMPACT_SAMPLE_HAS_PSR               0x01
+#define COMPACT_SAMPLE_HAS_CS                0x02
+#define COMPACT_SAMPLE_HAS_BITS              0x04
+#define COMPACT_SAMPLE_SEGMENT_START         0x08
+
 // end of SampleRecord sections
 
 
@@ -303,7 +363,10 @@ typedef struct ModuleRecord_s {
                                             //  is set, the associated module indicates
                                             //  the beginning of a new process
          U32  source                 : 1;   // 0 for path in target system, 1 for path in host system (offloaded)
-         U32  reserved1              : 21;
+         U32  pathInterned           : 1;   // path holds a path id.  The first record with a given id
+                                            // ..carries the path name, later ones have pathLength 0
+                                            // ..and no name and refer back to it
+         U32  reserved1              : 20;
       } s1;
    } u2;
    U64   length64;         // module length
@@ -356,6 +419,7 @@ typedef struct ModuleRecord_s {
 #define MODULE_RECORD_segment_name_set(x)               (x)->u2.s1.segmentNameSet
 #define MODULE_RECORD_first_module_rec_in_process(x)    (x)->u2.s1.firstModuleRecInProcess
 #define MODULE_RECORD_source(x)                         (x)->u2.s1.source
+#define MODULE_RECORD_path_interned(x)                  (x)->u2.s1.pathInterned
 #define MODULE_RECORD_length64(x)                       (x)->length64
 #define MODULE_RECORD_load_addr64(x)                    (x)->loadAddr64
 #define MODULE_RECORD_pid_rec_index(x)                  (x)->pidRecIndex
@@ -363,6 +427,7 @@ typedef struct ModuleRecord_s {
 #define MODULE_RECORD_unload_sample_count(x)            (x)->u5.s2.unloadSampleCount
 #define MODULE_RECORD_unload_tsc(x)                     (x)->unloadTsc
 #define MODULE_RECORD_path(x)                           (x)->path
+#define MODULE_RECORD_path_id(x)                        (x)->path
 #define MODULE_RECORD_path_length(x)                    (x)->pathLength
 #define MODULE_RECORD_filename_offset(x)                (x)->filenameOffset
 #define MODULE_RECORD_segment_name(x)                   (x)->segmentName
@@ -941,6 +1006,7 @@ struct DRV_EVENT_MASK_NODE_S {
             U8 reserved0      : 2;
         } s1;
     } u1;
+    U8 ovf_index;    // bit of the event in IA32_PERF_GLOBAL_STATUS, used to match PEBS records
 };
 
 #define DRV_EVENT_MASK_event_idx(d)             (d)->event_idx
@@ -952,6 +1018,7 @@ struct DRV_EVENT_MASK_NODE_S {
 #define DRV_EVENT_MASK_btb_capture(d)           (d)->u1.s1.btb_capture
 #define DRV_EVENT_MASK_ipear_capture(d)         (d)->u1.s1.ipear_capture
 #define DRV_EVENT_MASK_uncore_capture(d)        (d)->u1.s1.uncore_capture
+#define DRV_EVENT_MASK_ovf_index(d)             (d)->ovf_index
 
 #define MAX_OVERFLOW_EVENTS 11    // This defines the maximum number of overflow events per interrupt.
                                   // In order to reduce memory footprint, the value should be at least
@@ -999,5 +1066,119 @@ struct EMON_SCHED_INFO_NODE_S {
 #define EMON_SCHED_INFO_num_packages(x)                        (x)->num_packages
 #define EMON_SCHED_INFO_num_units(x)                           (x)->num_units
 
+#define OUTPUT_MAX_BUFFERS 16     // maximum number of segments in a per-CPU output ring
+
+typedef struct OUTPUT_CONTROL_NODE_S  OUTPUT_CONTROL_NODE;
+typedef        OUTPUT_CONTROL_NODE    *OUTPUT_CONTROL;
+
+/*
+ * @macro OUTPUT_CONTROL_NODE_S
+ * @brief
+ * Ring state of a sample or module output buffer.  The structure occupies
+ * the first page of an mmap() of a sample or module device and is followed
+ * by num_buffers segments of buffer_size bytes each.
+ * The driver fills segment (head % num_buffers) and publishes it by setting
+ * buffer_full[] to the number of valid bytes before advancing head.
+ * The reader drains segment (tail % num_buffers) and then advances tail.
+ * The driver takes the new tail into account at the next poll() or read()
+ * of the device, and only for segments it has handed over; everything else
+ * on this page is written by the driver alone.
+ */
+struct OUTPUT_CONTROL_NODE_S {
+    volatile U32  head;
+    volatile U32  tail;
+    U32           num_buffers;
+    U32           buffer_size;
+    volatile U32  buffer_full[OUTPUT_MAX_BUFFERS];
+    volatile U64  dropped_samples;
+};
+
+#define OUTPUT_CONTROL_head(x)                (x)->head
+#define OUTPUT_CONTROL_tail(x)                (x)->tail
+#define OUTPUT_CONTROL_num_buffers(x)         (x)->num_buffers
+#define OUTPUT_CONTROL_buffer_size(x)         (x)->buffer_size
+#define OUTPUT_CONTROL_buffer_full(x,y)       (x)->buffer_full[(y)]
+#define OUTPUT_CONTROL_dropped_samples(x)     (x)->dropped_samples
+
+typedef struct OUTPUT_DRAIN_INFO_NODE_S  OUTPUT_DRAIN_INFO_NODE;
+typedef        OUTPUT_DRAIN_INFO_NODE    *OUTPUT_DRAIN_INFO;
+
+/*
+ * @macro OUTPUT_DRAIN_INFO_NODE_S
+ * @brief
+ * Header of the buffer returned by the DRAIN_SAMPLES ioctl.  It is followed
+ * by num_segments records, each an OUTPUT_SEGMENT_NODE immediately followed
+ * by length bytes of sample data from that CPU.
+ */
+struct OUTPUT_DRAIN_INFO_NODE_S {
+    U32   num_segments;
+    U32   reserved;
+    U64   size;         // total bytes written, including this header
+};
+
+#define OUTPUT_DRAIN_INFO_num_segments(x)     (x)->num_segments
+#define OUTPUT_DRAIN_INFO_size(x)             (x)->size
+
+typedef struct OUTPUT_SEGMENT_NODE_S  OUTPUT_SEGMENT_NODE;
+typedef        OUTPUT_SEGMENT_NODE    *OUTPUT_SEGMENT;
+
+struct OUTPUT_SEGMENT_NODE_S {
+    U32   cpu;
+    U32   length;
+};
+
+#define OUTPUT_SEGMENT_cpu(x)                 (x)->cpu
+#define OUTPUT_SEGMENT_length(x)              (x)->length
+
+typedef struct EMON_SNAPSHOT_NODE_S  EMON_SNAPSHOT_NODE;
+typedef        EMON_SNAPSHOT_NODE    *EMON_SNAPSHOT;
+
+/*
+ * @macro EMON_SNAPSHOT_NODE_S
+ * @brief
+ * Header of the counter snapshot area that an mmap() of the control device
+ * maps.  It is followed by data_size bytes laid out exactly like the output
+ * of the READ_MSRS ioctl.  The SNAPSHOT_COUNTERS ioctl refreshes the area:
+ * the driver makes sequence odd before it writes the data and even again
+ * when it is done.  A reader copies the data between two reads of the same
+ * even sequence value and retries otherwise.
+ */
+struct EMON_SNAPSHOT_NODE_S {
+    volatile U64  sequence;
+    U64           tsc;          // TSC of the refreshing cpu once the counters were read
+    U32           data_size;
+    U32           reserved;
+};
+
+#define EMON_SNAPSHOT_sequence(x)             (x)->sequence
+#define EMON_SNAPSHOT_tsc(x)                  (x)->tsc
+#define EMON_SNAPSHOT_data_size(x)            (x)->data_size
+#define EMON_SNAPSHOT_data(x)                 ((U64 *)((x) + 1))
+
+typedef struct TSC_DRIFT_INFO_NODE_S  TSC_DRIFT_INFO_NODE;
+typedef        TSC_DRIFT_INFO_NODE    *TSC_DRIFT_INFO;
+
+/*
+ * @macro TSC_DRIFT_INFO_NODE_S
+ * @brief
+ * Header returned by the TSC_DRIFT_INFO ioctl.  It is followed by num_cpus
+ * S64 skews against cpu 0 and num_cpus U64 error bounds, as measured at
+ * cpu 0 time tsc.  The skews applied to the samples stay the ones measured
+ * at start; the collector interpolates between the drift measurements to
+ * correct the timestamps when it merges the per-cpu streams.  generation is
+ * 0 until the first measurement of the collection completes.
+ */
+struct TSC_DRIFT_INFO_NODE_S {
+    U64   tsc;
+    U32   generation;
+    U32   num_cpus;
+};
+
+#define TSC_DRIFT_INFO_tsc(x)                 (x)->tsc
+#define TSC_DRIFT_INFO_generation(x)          (x)->generation
+#define TSC_DRIFT_INFO_num_cpus(x)            (x)->num_cpus
+#define TSC_DRIFT_INFO_skew(x)                ((S64 *)((x) + 1))
+#define TSC_DRIFT_INFO_skew_err(x)            ((U64 *)((x) + 1) + TSC_DRIFT_INFO_num_cpus(x))
+
 #endif
 
@@ -36,6 +36,12 @@
 #include <linux/mm.h>
 #include <linux/sched.h>
 #include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/mount.h>
+#include <linux/spinlock.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+#include <linux/fs_struct.h>
+#endif
 
 #include "lwpmudrv_types.h"
 #include "rise_errors.h"
@@ -49,6 +55,7 @@
 
 #include "inc/linuxos.h"
 
+extern DRV_CONFIG     pcfg;
 extern uid_t          uid;
 extern volatile pid_t control_pid;
 extern volatile S32   abnormal_terminate;
@@ -60,6 +67,20 @@ LWPMUDRV_Abnormal_Terminate(void);
 #define MY_TASK  PROFILE_TASK_EXIT
 #define MY_UNMAP PROFILE_MUNMAP
 
+/*
+ * Interned module paths, only allocated when the collection asks for them.
+ * Nodes are added under linuxos_path_lock and only freed once the whole
+ * table has been detached.  The file table caching d_path() pins what it
+ * caches, so it only exists during LINUXOS_Enum_Process_Modules.  Module records that use the table are written
+ * while holding the lock, so the record naming a path always precedes the
+ * records that refer to it in the module stream.
+ */
+static DEFINE_SPINLOCK(linuxos_path_lock);
+static LINUXOS_PATH  *linuxos_path_table = NULL;
+static LINUXOS_FILE  *linuxos_file_table = NULL;
+static U32            linuxos_path_count = 0;
+static U32            linuxos_file_count = 0;
+
 #if defined(DRV_IA32)
 static U16
 linuxos_Get_Exec_Mode (
@@ -94,6 +115,319 @@ linuxos_Get_Exec_Mode(struct task_struct *p)
 }
 #endif
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static U32 linuxos_Hash_Path(const char *name, U32 *length)
+ *
+ * @brief       FNV-1a hash of a path name
+ *
+ * @param       name   IN  - path name
+ *              length OUT - length of the name including the terminating \0
+ *
+ * @return      hash value
+ */
+static U32
+linuxos_Hash_Path (
+    const char *name,
+    U32        *length
+)
+{
+    U32  hash = 2166136261U;
+    U32  len  = 0;
+
+    while (name[len]) {
+        hash ^= (U8)name[len++];
+        hash *= 16777619U;
+    }
+    *length = len + 1;
+
+    return hash;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static LINUXOS_PATH linuxos_Intern_Path(const char *name)
+ *
+ * @brief       Find the path node for name, creating it if needed
+ *
+ * @param       name IN - path name, at most MAXNAMELEN characters
+ *
+ * @return      the path node, NULL if the table is not in use or full
+ *
+ * <I>Special Notes:</I>
+ *              Must be called with linuxos_path_lock held.
+ */
+static LINUXOS_PATH
+linuxos_Intern_Path (
+    const char *name
+)
+{
+    LINUXOS_PATH  path;
+    U32           length;
+    U32           hash;
+    U32           bucket;
+
+    if (!linuxos_path_table) {
+        return NULL;
+    }
+    hash   = linuxos_Hash_Path(name, &length);
+    bucket = hash % LINUXOS_PATH_BUCKETS;
+    for (path = linuxos_path_table[bucket]; path; path = LINUXOS_PATH_next(path)) {
+        if (LINUXOS_PATH_hash(path)   == hash   &&
+            LINUXOS_PATH_length(path) == length &&
+            !memcmp(LINUXOS_PATH_name(path), name, length)) {
+            return path;
+        }
+    }
+    if (linuxos_path_count >= LINUXOS_MAX_PATH_NODES) {
+        return NULL;
+    }
+
+    path = CONTROL_Allocate_KMemory(sizeof(LINUXOS_PATH_NODE) + length);
+    if (!path) {
+        return NULL;
+    }
+    LINUXOS_PATH_hash(path)    = hash;
+    LINUXOS_PATH_id(path)      = ++linuxos_path_count;
+    LINUXOS_PATH_emitted(path) = FALSE;
+    LINUXOS_PATH_length(path)  = (U16)length;
+    memcpy(LINUXOS_PATH_name(path), name, length);
+    LINUXOS_PATH_next(path)    = linuxos_path_table[bucket];
+    linuxos_path_table[bucket] = path;
+
+    return path;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static char *linuxos_D_Path(struct file *file, char *buf, S32 len)
+ *
+ * @brief       d_path() with a cache keyed on the dentry, vfsmount and root
+ *
+ * @param       file IN  - file to name
+ *              buf  OUT - scratch buffer for the name
+ *              len  IN  - size of buf
+ *
+ * @return      pointer to the name inside buf, or what d_path() returned
+ *
+ * <I>Special Notes:</I>
+ *              Every process mapping the same library has its own struct file
+ *              but shares the dentry, so the cache is keyed on the latter.
+ *              d_path() names the file relative to the root of the caller,
+ *              so that root is part of the key.  Cached nodes pin the dentry
+ *              and vfsmount until the file table is closed, which keeps the
+ *              key from being reused.  A rename during one enumeration is
+ *              not seen.
+ */
+static char *
+linuxos_D_Path (
+    struct file  *file,
+    char         *buf,
+    S32           len
+)
+{
+    struct dentry    *dentry = FILE_DENTRY(file);
+    struct vfsmount  *mnt    = FILE_VFSMNT(file);
+    U32               bucket = (U32)(((UIOP)dentry >> 4) ^ ((UIOP)mnt >> 4)) % LINUXOS_PATH_BUCKETS;
+    struct dentry    *root_dentry = NULL;
+    struct vfsmount  *root_mnt    = NULL;
+    LINUXOS_FILE      fnode;
+    LINUXOS_PATH      path;
+    char             *pname;
+
+    if (!linuxos_file_table) {
+        return D_PATH(file, buf, len);
+    }
+    task_lock(current);
+    if (current->fs) {
+        root_dentry = FS_ROOT_DENTRY(current->fs);
+        root_mnt    = FS_ROOT_VFSMNT(current->fs);
+    }
+    task_unlock(current);
+    if (!root_dentry) {
+        return D_PATH(file, buf, len);
+    }
+
+    spin_lock(&linuxos_path_lock);
+    if (linuxos_file_table) {
+        for (fnode = linuxos_file_table[bucket]; fnode; fnode = LINUXOS_FILE_next(fnode)) {
+            if (LINUXOS_FILE_dentry(fnode)      == dentry      &&
+                LINUXOS_FILE_mnt(fnode)         == mnt         &&
+                LINUXOS_FILE_root_dentry(fnode) == root_dentry &&
+                LINUXOS_FILE_root_mnt(fnode)    == root_mnt    &&
+                LINUXOS_PATH_length(LINUXOS_FILE_path(fnode)) <= len) {
+                memcpy(buf, LINUXOS_PATH_name(LINUXOS_FILE_path(fnode)),
+                       LINUXOS_PATH_length(LINUXOS_FILE_path(fnode)));
+                spin_unlock(&linuxos_path_lock);
+                return buf;
+            }
+        }
+    }
+    spin_unlock(&linuxos_path_lock);
+
+    pname = D_PATH(file, buf, len);
+    if (IS_ERR(pname) || pname == NULL) {
+        return pname;
+    }
+
+    spin_lock(&linuxos_path_lock);
+    if (linuxos_file_table && linuxos_file_count < LINUXOS_MAX_FILE_NODES) {
+        for (fnode = linuxos_file_table[bucket]; fnode; fnode = LINUXOS_FILE_next(fnode)) {
+            if (LINUXOS_FILE_dentry(fnode)      == dentry      &&
+                LINUXOS_FILE_mnt(fnode)         == mnt         &&
+                LINUXOS_FILE_root_dentry(fnode) == root_dentry &&
+                LINUXOS_FILE_root_mnt(fnode)    == root_mnt) {
+                break;
+            }
+        }
+        path = fnode ? NULL : linuxos_Intern_Path(pname);
+        if (path) {
+            fnode = CONTROL_Allocate_KMemory(sizeof(LINUXOS_FILE_NODE));
+            if (fnode) {
+                LINUXOS_FILE_dentry(fnode)  = dget(dentry);
+                LINUXOS_FILE_mnt(fnode)     = mntget(mnt);
+                LINUXOS_FILE_root_dentry(fnode) = root_dentry;
+                LINUXOS_FILE_root_mnt(fnode)    = root_mnt;
+                LINUXOS_FILE_path(fnode)    = path;
+                LINUXOS_FILE_next(fnode)    = linuxos_file_table[bucket];
+                linuxos_file_table[bucket]  = fnode;
+                linuxos_file_count++;
+            }
+        }
+    }
+    spin_unlock(&linuxos_path_lock);
+
+    return pname;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static VOID linuxos_Alloc_Path_Table(VOID)
+ *
+ * @brief       Set up an empty path table for a new collection
+ *
+ * @param       none
+ *
+ * @return      none
+ *
+ * <I>Special Notes:</I>
+ *              Paths are only interned when the collection asked for it.
+ *              If the buckets cannot be allocated, full module records are
+ *              written as before.
+ */
+static VOID
+linuxos_Alloc_Path_Table (
+    VOID
+)
+{
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    LINUXOS_PATH  *path_table;
+#endif
+
+    LINUXOS_Free_Path_Table();
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    if (!pcfg || !DRV_CONFIG_intern_module_paths(pcfg)) {
+        return;
+    }
+
+    path_table = CONTROL_Allocate_Memory(LINUXOS_PATH_BUCKETS * sizeof(LINUXOS_PATH));
+    if (!path_table) {
+        SEP_PRINT_WARNING("Unable to allocate the module path table, paths will not be interned\n");
+        return;
+    }
+
+    spin_lock(&linuxos_path_lock);
+    linuxos_path_table = path_table;
+    spin_unlock(&linuxos_path_lock);
+#endif
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static VOID linuxos_Open_File_Table(VOID)
+ *
+ * @brief       Start caching d_path() results for one module enumeration
+ *
+ * @param       none
+ *
+ * @return      none
+ *
+ * <I>Special Notes:</I>
+ *              Only used when paths are interned.  Without the file table
+ *              every name is looked up with d_path().
+ */
+static VOID
+linuxos_Open_File_Table (
+    VOID
+)
+{
+    LINUXOS_FILE  *file_table;
+
+    if (!linuxos_path_table) {
+        return;
+    }
+    file_table = CONTROL_Allocate_Memory(LINUXOS_PATH_BUCKETS * sizeof(LINUXOS_FILE));
+    if (!file_table) {
+        return;
+    }
+
+    spin_lock(&linuxos_path_lock);
+    if (linuxos_path_table && !linuxos_file_table) {
+        linuxos_file_table = file_table;
+        file_table         = NULL;
+    }
+    spin_unlock(&linuxos_path_lock);
+    CONTROL_Free_Memory(file_table);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static VOID linuxos_Close_File_Table(VOID)
+ *
+ * @brief       Drop the d_path() cache and the references it holds
+ *
+ * @param       none
+ *
+ * @return      none
+ *
+ * <I>Special Notes:</I>
+ *              Must not be called with locks held since the dentry and
+ *              vfsmount references are dropped here.
+ */
+static VOID
+linuxos_Close_File_Table (
+    VOID
+)
+{
+    LINUXOS_FILE  *file_table;
+    LINUXOS_FILE   fnode;
+    U32            i;
+
+    spin_lock(&linuxos_path_lock);
+    file_table         = linuxos_file_table;
+    linuxos_file_table = NULL;
+    linuxos_file_count = 0;
+    spin_unlock(&linuxos_path_lock);
+
+    if (file_table) {
+        for (i = 0; i < LINUXOS_PATH_BUCKETS; i++) {
+            while ((fnode = file_table[i])) {
+                file_table[i] = LINUXOS_FILE_next(fnode);
+                dput(LINUXOS_FILE_dentry(fnode));
+                mntput(LINUXOS_FILE_mnt(fnode));
+                CONTROL_Free_Memory(fnode);
+            }
+        }
+        CONTROL_Free_Memory(file_table);
+    }
+
+    return;
+}
+
 static S32
 linuxos_Load_Image_Notify_Routine (
     char           *name,
@@ -111,6 +445,7 @@ linuxos_Load_Image_Notify_Routine (
     char           buf[sizeof(ModuleRecord) + MAXNAMELEN + 32];
     U64            tsc_read;
     S32            local_load_event = (load_event==-1) ? 0 : load_event;
+    LINUXOS_PATH   path;
 
     mra = (ModuleRecord *) buf;
     memset(mra, '\0', sizeof(buf));
@@ -169,6 +504,26 @@ linuxos_Load_Image_Notify_Routine (
         MODULE_RECORD_exe(mra) = 1;
     }
 
+    if (linuxos_path_table) {
+        spin_lock(&linuxos_path_lock);
+        path = linuxos_Intern_Path(raw_path);
+        if (path) {
+            MODULE_RECORD_path_interned(mra) = 1;
+            MODULE_RECORD_path_id(mra)       = LINUXOS_PATH_id(path);
+            if (LINUXOS_PATH_emitted(path)) {
+                MODULE_RECORD_path_length(mra) = 0;
+                MODULE_RECORD_rec_length(mra)  = (U16) ALIGN_8(sizeof (ModuleRecord));
+            }
+            // a lost naming record must be repeated, or the id stays unresolved
+            if (OUTPUT_Module_Fill((PVOID)mra, MODULE_RECORD_rec_length(mra)) == MODULE_RECORD_rec_length(mra)) {
+                LINUXOS_PATH_emitted(path) = TRUE;
+            }
+            spin_unlock(&linuxos_path_lock);
+            return OS_SUCCESS;
+        }
+        spin_unlock(&linuxos_path_lock);
+    }
+
     OUTPUT_Module_Fill((PVOID)mra, MODULE_RECORD_rec_length(mra));
 
     return OS_SUCCESS;
@@ -197,8 +552,11 @@ linuxos_Equal_VM_Exe_File (
         return FALSE; 
     } 
  
-    pname_vm_file = D_PATH(vma->vm_file, name_vm_file, MAXNAMELEN);
-    pname_exe_file = D_PATH(vma->vm_mm->exe_file, name_exe_file, MAXNAMELEN);
+    pname_vm_file = linuxos_D_Path(vma->vm_file, name_vm_file, MAXNAMELEN);
+    pname_exe_file = linuxos_D_Path(vma->vm_mm->exe_file, name_exe_file, MAXNAMELEN);
+    if (IS_ERR(pname_vm_file) || IS_ERR(pname_exe_file) || !pname_vm_file || !pname_exe_file) {
+        return FALSE;
+    }
     return (strcmp (pname_vm_file, pname_exe_file) == 0);
 }
 #endif
@@ -232,7 +590,7 @@ linuxos_VMA_For_Process (
        return OS_SUCCESS;
     }
 
-    if (vma->vm_file) pname = D_PATH(vma->vm_file, name, MAXNAMELEN);
+    if (vma->vm_file) pname = linuxos_D_Path(vma->vm_file, name, MAXNAMELEN);
     if (!IS_ERR(pname) && pname != NULL) {
         SEP_PRINT_DEBUG("enum: %s, %d, %lx, %lx \n",
                         pname, p->pid, vma->vm_start, (vma->vm_end - vma->vm_start));
@@ -443,6 +801,7 @@ LINUXOS_Enum_Process_Modules (
     if (abnormal_terminate == 1) {
         return OS_SUCCESS;
     }
+    linuxos_Open_File_Table();
     FOR_EACH_TASK(p) {
         SEP_PRINT_DEBUG("Enum_Process_Modules looking at task %d\n", n);
         /*
@@ -470,6 +829,7 @@ LINUXOS_Enum_Process_Modules (
         }
         if (!UTILITY_down_read_mm(p)) {
             SEP_PRINT_ERROR("Linux_Enum_Process_Modules_End: unable to get lock on mmap_sem!\n");
+            linuxos_Close_File_Table();
             return OS_SUCCESS;
         }
         linuxos_Enum_Modules_For_Process(p, p->mm, at_end?-1:0);
@@ -477,6 +837,7 @@ LINUXOS_Enum_Process_Modules (
         n++;
     }
     SEP_PRINT_DEBUG("Enum_Process_Modules done with %d tasks\n", n);
+    linuxos_Close_File_Table();
 
     return OS_SUCCESS;
 }
@@ -571,6 +932,7 @@ LINUXOS_Install_Hooks (
         SEP_PRINT_DEBUG("The OS Hooks are already installed\n");
         return;
     }
+    linuxos_Alloc_Path_Table();
     err = profile_event_register(MY_UNMAP, &linuxos_exec_unmap_nb);
     err2= profile_event_register(MY_TASK,  &linuxos_exit_task_nb);
     if (err || err2) {
@@ -613,3 +975,47 @@ LINUXOS_Uninstall_Hooks (
 
     return;
 }
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID LINUXOS_Free_Path_Table(VOID)
+ * @brief       drops the interned module paths of the last collection
+ *
+ * @param       none
+ *
+ * @return      none
+ *
+ * <I>Special Notes:</I>
+ *
+ * Called once the final module enumeration is done.  Must not be called
+ * with locks held since the dentry and vfsmount references are dropped here.
+ */
+extern VOID
+LINUXOS_Free_Path_Table (
+    VOID
+)
+{
+    LINUXOS_PATH  *path_table;
+    LINUXOS_PATH   path;
+    U32            i;
+
+    linuxos_Close_File_Table();
+
+    spin_lock(&linuxos_path_lock);
+    path_table         = linuxos_path_table;
+    linuxos_path_table = NULL;
+    linuxos_path_count = 0;
+    spin_unlock(&linuxos_path_lock);
+
+    if (path_table) {
+        for (i = 0; i < LINUXOS_PATH_BUCKETS; i++) {
+            while ((path = path_table[i])) {
+                path_table[i] = LINUXOS_PATH_next(path);
+                CONTROL_Free_Memory(path);
+            }
+        }
+        CONTROL_Free_Memory(path_table);
+    }
+
+    return;
+}
@@ -34,6 +34,9 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/cache.h>
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/types.h>
@@ -81,6 +84,8 @@
 #include "linuxos.h"
 #include "sys_info.h"
 #include "eventmux.h"
+#include "tsc.h"
+#include "unc_sampler.h"
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #include "pebs.h"
 #endif
@@ -107,6 +112,10 @@ struct LWPMU_DEV_NODE_S {
 SEP_VERSION_NODE        drv_version;
 U64                    *read_counter_info     = NULL;
 U64                    *read_unc_ctr_info     = NULL;
+static EMON_SNAPSHOT    emon_snapshot         = NULL;   // persistent counter snapshot area
+static U32              emon_snapshot_size    = 0;      // bytes, header included, page multiple
+static U32              emon_snapshot_data    = 0;      // counter bytes in use, never read back from the mapping
+static atomic_t         emon_snapshot_maps    = ATOMIC_INIT(0);
 VOID                  **PMU_register_data     = NULL;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #endif
@@ -116,6 +125,7 @@ DISPATCH                dispatch              = NULL;
 #endif
 U64                     total_ram             = 0;
 U32                     output_buffer_size    = OUTPUT_LARGE_BUFFER;
+U32                     output_num_buffers    = OUTPUT_MIN_BUFFERS;
 static  S32             em_groups_count       = 0;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #endif
@@ -176,7 +186,6 @@ size_t             pcb_size            = 0;
 U32               *core_to_package_map = NULL;
 U32                num_packages        = 0;
 U64               *pmu_state           = NULL;
-U64               *tsc_info            = NULL;
 
 #if defined EMON
 static U64              cpu0_TSC       = 0;
@@ -350,51 +359,6 @@ lwpmudrv_Initialize_State (
 }
 
 
-/* ------------------------------------------------------------------------- */
-/*!
- * @fn  static void lwpmudrv_Fill_TSC_Info (PVOID param)
- *
- * @param param - pointer the buffer to fill in.
- *
- * @return none
- *
- * @brief  Read the TSC and write into the correct array slot.
- *
- * <I>Special Notes</I>
- */
-atomic_t read_now;
-static wait_queue_head_t read_tsc_now;
-static VOID
-lwpmudrv_Fill_TSC_Info (
-    PVOID   param
-)
-{
-    U32      this_cpu;
-
-    preempt_disable();
-    this_cpu = CONTROL_THIS_CPU();
-    preempt_enable();
-    //
-    // Wait until all CPU's are ready to proceed
-    // This will serve as a synchronization point to compute tsc skews.
-    //
-
-    if (atomic_read(&read_now) >= 1) {
-        if (atomic_dec_and_test(&read_now) == FALSE) {
-            wait_event_interruptible(read_tsc_now, (atomic_read(&read_now) >= 1));
-        }
-    }
-    else {
-        wake_up_interruptible_all(&read_tsc_now);
-    }
-    UTILITY_Read_TSC(&tsc_info[this_cpu]);
-    SEP_PRINT_DEBUG("lwpmudrv_Fill_TSC_Info: this cpu %d --- tsc --- 0x%llx\n",
-                    this_cpu, tsc_info[this_cpu]);
-
-    return;
-}
-
-
 /*********************************************************************
  *  Internal Driver functions
  *     Should be called only from the lwpmudrv_DeviceControl routine
@@ -470,6 +434,36 @@ lwpmudrv_Reserve (
     return status;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static VOID lwpmudrv_Snapshot_Free(void)
+ *
+ * @param none
+ *
+ * @return none
+ *
+ * @brief  Release the counter snapshot area, unless user space still maps it
+ *
+ * <I>Special Notes</I>
+ *     A mapped area is kept until the next call after it is unmapped, or
+ *     until the driver is unloaded.
+ */
+static VOID
+lwpmudrv_Snapshot_Free (
+    VOID
+)
+{
+    if (atomic_read(&emon_snapshot_maps)) {
+        return;
+    }
+    emon_snapshot      = CONTROL_Free_Memory(emon_snapshot);
+    emon_snapshot_size = 0;
+    emon_snapshot_data = 0;
+    read_unc_ctr_info  = CONTROL_Free_Memory(read_unc_ctr_info);
+
+    return;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn  static VOID lwpmudrv_Clean_Up(DRV_BOOL)
@@ -501,6 +495,7 @@ lwpmudrv_Clean_Up (
     }
 
 #if defined(DRV_IA32) || defined(DRV_EM64T)
+    UNC_SAMPLER_Destroy();
     if (devices) {
         U32           id;
         for (id = 0; id < num_devices; id++) {
@@ -512,18 +507,7 @@ lwpmudrv_Clean_Up (
             }
             LWPMU_DEVICE_pcfg(&devices[id]) = CONTROL_Free_Memory(LWPMU_DEVICE_pcfg(&devices[id]));
 
-            if (LWPMU_DEVICE_acc_per_thread(&devices[id])) {
-                for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
-                    LWPMU_DEVICE_acc_per_thread(&devices[id])[i] = CONTROL_Free_Memory(LWPMU_DEVICE_acc_per_thread(&devices[id])[i]);
-                }
-                LWPMU_DEVICE_acc_per_thread(&devices[id]) = CONTROL_Free_Memory(LWPMU_DEVICE_acc_per_thread(&devices[id]));
-            }
-            if (LWPMU_DEVICE_prev_val_per_thread(&devices[id])) {
-                for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
-                    LWPMU_DEVICE_prev_val_per_thread(&devices[id])[i] = CONTROL_Free_Memory(LWPMU_DEVICE_prev_val_per_thread(&devices[id])[i]);
-                }
-                LWPMU_DEVICE_prev_val_per_thread(&devices[id]) = CONTROL_Free_Memory(LWPMU_DEVICE_prev_val_per_thread(&devices[id]));
-            }
+            LWPMU_DEVICE_uncore_acc(&devices[id]) = CONTROL_Free_Memory(LWPMU_DEVICE_uncore_acc(&devices[id]));
         }
         devices = CONTROL_Free_Memory(devices);
     }
@@ -535,6 +519,8 @@ lwpmudrv_Clean_Up (
             CONTROL_Free_Memory(desc_data[i]);
         }
     }
+    EVENTMUX_Free_Times(); // must be done before pcb is freed
+    lwpmudrv_Snapshot_Free();
     PMU_register_data       = CONTROL_Free_Memory(PMU_register_data);
     desc_data               = CONTROL_Free_Memory(desc_data);
     global_ec               = CONTROL_Free_Memory(global_ec);
@@ -606,7 +592,8 @@ lwpmudrv_Initialize (
     /*
      *   Program State Initializations
      */
-    pcfg = CONTROL_Allocate_Memory(in_buf_len);
+    // a shorter configuration from an older collector leaves the newer fields zero
+    pcfg = CONTROL_Allocate_Memory(max((size_t)in_buf_len, sizeof(DRV_CONFIG_NODE)));
     if (!pcfg) {
         return OS_NO_MEM;
     }
@@ -650,6 +637,7 @@ lwpmudrv_Initialize (
 #if defined(DRV_IA32) || defined(DRV_EM64T)
     SEP_PRINT_DEBUG("Config : pebs_mode = %ld\n", DRV_CONFIG_pebs_mode(pcfg));
     SEP_PRINT_DEBUG("Config : pebs_capture = %ld\n", DRV_CONFIG_pebs_capture(pcfg));
+    SEP_PRINT_DEBUG("Config : pebs_record_num = %ld\n", DRV_CONFIG_pebs_record_num(pcfg));
     SEP_PRINT_DEBUG("Config : collect_lbrs = %ld\n", DRV_CONFIG_collect_lbrs(pcfg));
 #else
     SEP_PRINT_DEBUG("Config : collect_ro = %ld\n", DRV_CONFIG_collect_ro(pcfg));
@@ -666,6 +654,13 @@ lwpmudrv_Initialize (
                 return OS_NO_MEM;
             }
         }
+        output_num_buffers = DRV_CONFIG_num_output_buffers(pcfg);
+        if (output_num_buffers < OUTPUT_MIN_BUFFERS) {
+            output_num_buffers = OUTPUT_MIN_BUFFERS;
+        }
+        else if (output_num_buffers > OUTPUT_MAX_BUFFERS) {
+            output_num_buffers = OUTPUT_MAX_BUFFERS;
+        }
         /*
          * Allocate the output and control buffers for each CPU in the system
          * Allocate and set up the temp output files for each CPU in the system
@@ -782,12 +777,15 @@ lwpmudrv_Initialize_UNC (
     if (in_buf == NULL) {
         return OS_FAULT;
     }
-    if (in_buf_len != sizeof(DRV_CONFIG_NODE)) {
+    if (in_buf_len == 0) {
         SEP_PRINT_ERROR("Got in_buf_len=%d, expecting size=%d\n", in_buf_len, (int)sizeof(DRV_CONFIG_NODE));
         return OS_FAULT;
     }
-    // allocate memory
-    LWPMU_DEVICE_pcfg(&devices[cur_device]) = CONTROL_Allocate_Memory(sizeof(DRV_CONFIG_NODE));
+    // allocate memory, a shorter configuration from an older collector leaves the newer fields zero
+    LWPMU_DEVICE_pcfg(&devices[cur_device]) = CONTROL_Allocate_Memory(max((size_t)in_buf_len, sizeof(DRV_CONFIG_NODE)));
+    if (LWPMU_DEVICE_pcfg(&devices[cur_device]) == NULL) {
+        return OS_NO_MEM;
+    }
     // copy over pcfg
     if (copy_from_user(LWPMU_DEVICE_pcfg(&devices[cur_device]), in_buf, in_buf_len)) {
         SEP_PRINT_ERROR("Failed to copy from user");
@@ -913,6 +911,39 @@ lwpmudrv_Get_Driver_State (
     return status;
 }
 
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static VOID lwpmudrv_Invoke_Uncore(func, ctx)
+ *
+ * @param func - uncore dispatch routine
+ * @param ctx  - pointer to the device index
+ *
+ * @return none
+ *
+ * @brief Run an uncore control routine once per package
+ *
+ * <I>Special Notes</I>
+ *     Uncore registers are shared by all the cpus of a package, so there is
+ *     no need to interrupt every cpu.  The calling cpu is recorded in
+ *     invoking_processor_id and always takes part, for the devices that must
+ *     be programmed from exactly one cpu.
+ */
+static VOID
+lwpmudrv_Invoke_Uncore (
+    VOID  (*func)(PVOID),
+    PVOID ctx
+)
+{
+    preempt_disable();
+    invoking_processor_id = CONTROL_THIS_CPU();
+    CONTROL_Invoke_Package(func, ctx);
+    preempt_enable();
+
+    return;
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn static OS_STATUS lwpmudrv_Pause(void)
@@ -972,10 +1003,7 @@ lwpmudrv_Pause (
                  dispatch_unc                            &&
                  dispatch_unc->freeze) {
                     SEP_PRINT_DEBUG("LWP: calling UNC Pause\n");
-                    preempt_disable();
-                    invoking_processor_id = CONTROL_THIS_CPU();
-                    preempt_enable();
-                    CONTROL_Invoke_Parallel(dispatch_unc->freeze, (VOID *)&j);
+                    lwpmudrv_Invoke_Uncore(dispatch_unc->freeze, (VOID *)&j);
              }
          }
 #endif
@@ -1051,7 +1079,7 @@ lwpmudrv_Resume (
                 dispatch_unc                            &&
                 dispatch_unc->restart) {
                    SEP_PRINT_DEBUG("LWP: calling UNC Resume\n");
-                   CONTROL_Invoke_Parallel(dispatch_unc->restart, (VOID *)&j);
+                   lwpmudrv_Invoke_Uncore(dispatch_unc->restart, (VOID *)&j);
             }
        }
 #endif
@@ -1204,10 +1232,7 @@ lwpmudrv_Init_PMU (
         dispatch_unc = LWPMU_DEVICE_dispatch(&devices[i]);
         if (pcfg_unc  && dispatch_unc && dispatch_unc->write ) {
             SEP_PRINT_DEBUG("LWP: calling UNC Init\n");
-            preempt_disable();
-            invoking_processor_id = CONTROL_THIS_CPU();
-            preempt_enable();
-            CONTROL_Invoke_Parallel(dispatch_unc->write, (VOID *)&i);
+            lwpmudrv_Invoke_Uncore(dispatch_unc->write, (VOID *)&i);
         }
     }
 #endif
@@ -1426,23 +1451,66 @@ lwpmudrv_Write_MSR_All_Cores (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn static OS_STATUS lwpmudrv_Read_MSRs(IOCTL_ARG arg)
+ * @fn static OS_STATUS lwpmudrv_Snapshot_Reserve(U32 data_size)
  *
- * @param arg - pointer to the IOCTL_ARGS structure
+ * @param data_size - number of counter bytes the caller wants to read
  *
  * @return OS_STATUS
  *
- * @brief  Read all the programmed data counters and accumulate them
- * @brief  into a single buffer.
+ * @brief  Make sure the counter snapshot area holds at least data_size bytes
  *
  * <I>Special Notes</I>
+ *     The area persists across polls and only grows.  It cannot be replaced
+ *     while user space maps it.
  */
 static OS_STATUS
-lwpmudrv_Read_MSRs (
-    IOCTL_ARGS    arg
+lwpmudrv_Snapshot_Reserve (
+    U32  data_size
 )
 {
-    OS_STATUS  status = OS_SUCCESS;
+    U32  size = PAGE_ALIGN(sizeof(EMON_SNAPSHOT_NODE) + data_size);
+
+    if (emon_snapshot == NULL || emon_snapshot_size < size) {
+        if (atomic_read(&emon_snapshot_maps)) {
+            SEP_PRINT_ERROR("lwpmudrv_Snapshot_Reserve: mapped snapshot area is too small\n");
+            return OS_INVALID;
+        }
+        lwpmudrv_Snapshot_Free();
+        emon_snapshot     = CONTROL_Allocate_Memory(size);
+        read_unc_ctr_info = CONTROL_Allocate_Memory(size - sizeof(EMON_SNAPSHOT_NODE));
+        if (emon_snapshot == NULL || read_unc_ctr_info == NULL) {
+            lwpmudrv_Snapshot_Free();
+            return OS_NO_MEM;
+        }
+        emon_snapshot_size = size;
+    }
+    emon_snapshot_data                     = data_size;
+    EMON_SNAPSHOT_data_size(emon_snapshot) = data_size;
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static VOID lwpmudrv_Snapshot_Refresh(void)
+ *
+ * @param none
+ *
+ * @return none
+ *
+ * @brief  Read all the programmed data counters into the snapshot area
+ *
+ * <I>Special Notes</I>
+ *     The sequence count is odd while the data is being rewritten, see
+ *     EMON_SNAPSHOT_NODE_S for the reader side.  The header is only ever
+ *     written here, the sizes come from the kernel private statics.
+ */
+static VOID
+lwpmudrv_Snapshot_Refresh (
+    VOID
+)
+{
+    U32         data_size = emon_snapshot_data;
 #if defined(DRV_IA32) || defined(DRV_EM64T)
     DISPATCH    dispatch_unc;
     ECB         pecb_unc;
@@ -1456,22 +1524,14 @@ lwpmudrv_Read_MSRs (
     U32         num_inst_idx       = 0;
     U32         num_units          = 0;
 #endif
-    if (arg->r_len == 0 || arg->r_buf == NULL ) {
-        return status;
-    }
-    //
-    // Transfer the data in the PMU registers to the output buffer
-    //
-    read_counter_info = CONTROL_Allocate_Memory(arg->r_len);
-    if (!read_counter_info) {
-         return OS_NO_MEM;
-    }
 
-    read_unc_ctr_info = CONTROL_Allocate_Memory(arg->r_len);
-    if (!read_unc_ctr_info) {
-         return OS_NO_MEM;
-    }
-    
+    EMON_SNAPSHOT_sequence(emon_snapshot)++;
+    smp_wmb();
+
+    read_counter_info = EMON_SNAPSHOT_data(emon_snapshot);
+    memset(read_counter_info, 0, data_size);
+    memset(read_unc_ctr_info, 0, data_size);
+
     CONTROL_Invoke_Parallel(dispatch->read_data, (VOID *)(size_t)0);
 
 #if defined(DRV_IA32) || defined(DRV_EM64T)
@@ -1512,15 +1572,179 @@ lwpmudrv_Read_MSRs (
         }
     }
 #endif
-    if (copy_to_user(arg->r_buf, read_counter_info, arg->r_len)) {
+    read_counter_info = NULL;
+    UTILITY_Read_TSC(&EMON_SNAPSHOT_tsc(emon_snapshot));
+
+    smp_wmb();
+    EMON_SNAPSHOT_sequence(emon_snapshot)++;
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static OS_STATUS lwpmudrv_Read_MSRs(IOCTL_ARG arg)
+ *
+ * @param arg - pointer to the IOCTL_ARGS structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief  Read all the programmed data counters and accumulate them
+ * @brief  into a single buffer.
+ *
+ * <I>Special Notes</I>
+ *     The counters are read into the persistent snapshot area and copied
+ *     out from there.
+ */
+static OS_STATUS
+lwpmudrv_Read_MSRs (
+    IOCTL_ARGS    arg
+)
+{
+    OS_STATUS  status = OS_SUCCESS;
+
+    if (arg->r_len == 0 || arg->r_buf == NULL ) {
+        return status;
+    }
+    status = lwpmudrv_Snapshot_Reserve(arg->r_len);
+    if (status != OS_SUCCESS) {
+        return status;
+    }
+    //
+    // Transfer the data in the PMU registers to the output buffer
+    //
+    lwpmudrv_Snapshot_Refresh();
+
+    if (copy_to_user(arg->r_buf, EMON_SNAPSHOT_data(emon_snapshot), arg->r_len)) {
         status = OS_FAULT;
     }
-    read_counter_info = CONTROL_Free_Memory(read_counter_info);
-    read_unc_ctr_info = CONTROL_Free_Memory(read_unc_ctr_info);
 
     return status;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static OS_STATUS lwpmudrv_Snapshot_Counters(IOCTL_ARG arg)
+ *
+ * @param arg - pointer to the IOCTL_ARGS structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief  Refresh the counter snapshot area without copying it out
+ *
+ * <I>Special Notes</I>
+ *     r_len is the size of the counter data, as for READ_MSRS.  The result is
+ *     read through an mmap() of the control device.  The first call sizes the
+ *     area, so it has to precede the mmap().
+ */
+static OS_STATUS
+lwpmudrv_Snapshot_Counters (
+    IOCTL_ARGS    arg
+)
+{
+    OS_STATUS  status;
+
+    if (arg->r_len == 0) {
+        return OS_INVALID;
+    }
+    status = lwpmudrv_Snapshot_Reserve(arg->r_len);
+    if (status != OS_SUCCESS) {
+        return status;
+    }
+    lwpmudrv_Snapshot_Refresh();
+
+    return OS_SUCCESS;
+}
+
+static void
+lwpmudrv_Snapshot_Vma_Open (
+    struct vm_area_struct *vma
+)
+{
+    atomic_inc(&emon_snapshot_maps);
+}
+
+static void
+lwpmudrv_Snapshot_Vma_Close (
+    struct vm_area_struct *vma
+)
+{
+    atomic_dec(&emon_snapshot_maps);
+}
+
+static struct vm_operations_struct lwpmudrv_Snapshot_Vm_Ops = {
+    .open  = lwpmudrv_Snapshot_Vma_Open,
+    .close = lwpmudrv_Snapshot_Vma_Close,
+};
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn static int lwpmudrv_Snapshot_Mmap(struct file *filp, struct vm_area_struct *vma)
+ *
+ * @param filp - a file pointer
+ * @param vma  - the user mapping to populate
+ *
+ * @return 0 on success, negative errno otherwise
+ *
+ * @brief  Map the counter snapshot area to user space
+ *
+ * <I>Special Notes</I>
+ *     The mapping has to cover the whole area, header included.  Its size is
+ *     the page aligned EMON_SNAPSHOT_NODE plus the data size of the first
+ *     SNAPSHOT_COUNTERS call.  The mapping is read-only.
+ */
+static int
+lwpmudrv_Snapshot_Mmap (
+    struct file           *filp,
+    struct vm_area_struct *vma
+)
+{
+    unsigned long  uaddr = vma->vm_start;
+    unsigned long  pfn;
+    U32            offset;
+    char          *kaddr;
+    int            rc    = 0;
+
+    MUTEX_LOCK(ioctl_lock);
+    if (emon_snapshot == NULL                          ||
+        ((unsigned long)emon_snapshot & ~PAGE_MASK)    ||
+        vma->vm_pgoff != 0                             ||
+        vma->vm_end - vma->vm_start != emon_snapshot_size) {
+        SEP_PRINT_ERROR("lwpmudrv_Snapshot_Mmap: unexpected mapping size 0x%lx\n", vma->vm_end - vma->vm_start);
+        rc = -EINVAL;
+        goto end;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        SEP_PRINT_ERROR("lwpmudrv_Snapshot_Mmap: the snapshot area cannot be mapped writable\n");
+        rc = -EPERM;
+        goto end;
+    }
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTCOPY;
+
+    for (offset = 0; offset < emon_snapshot_size; offset += PAGE_SIZE) {
+        kaddr = (char *)emon_snapshot + offset;
+        if (is_vmalloc_addr(kaddr)) {
+            pfn = vmalloc_to_pfn(kaddr);
+        }
+        else {
+            pfn = virt_to_phys(kaddr) >> PAGE_SHIFT;
+        }
+        if (remap_pfn_range(vma, uaddr, pfn, PAGE_SIZE, vma->vm_page_prot)) {
+            rc = -EAGAIN;
+            goto end;
+        }
+        uaddr += PAGE_SIZE;
+    }
+    vma->vm_ops = &lwpmudrv_Snapshot_Vm_Ops;
+    lwpmudrv_Snapshot_Vma_Open(vma);
+
+end:
+    MUTEX_UNLOCK(ioctl_lock);
+
+    return rc;
+}
+
 #ifdef EMON
 /* ------------------------------------------------------------------------- */
 /*!
@@ -1877,8 +2101,6 @@ lwpmudrv_Configure_Events_UNC (
     VOID              **PMU_register_data_unc;
     S32               em_groups_count_unc;
     ECB               ecb;
-    S32               i;
-    U32               j;
 
     if (GLOBAL_STATE_current_phase(driver_state) != DRV_STATE_IDLE) {
         return OS_IN_PROGRESS;
@@ -1913,18 +2135,18 @@ lwpmudrv_Configure_Events_UNC (
         ecb = PMU_register_data_unc[0];
         LWPMU_DEVICE_num_events(&devices[cur_device]) = ECB_num_events(ecb);
 
-        LWPMU_DEVICE_acc_per_thread(&devices[cur_device]) = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) *
-                                                                                sizeof(VOID *));
-        LWPMU_DEVICE_prev_val_per_thread(&devices[cur_device]) = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) *
-                                                                                     sizeof(VOID *));
-        for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
-             LWPMU_DEVICE_acc_per_thread(&devices[cur_device])[i]      = CONTROL_Allocate_Memory((ECB_num_events(ecb) + 1)*sizeof(U64));
-             LWPMU_DEVICE_prev_val_per_thread(&devices[cur_device])[i] = CONTROL_Allocate_Memory((ECB_num_events(ecb) + 1)*sizeof(U64));
-             // initialize all values to 0
-             for (j = 0; j < ECB_num_events(ecb) + 1; j++) {
-                  LWPMU_DEVICE_acc_per_thread(&devices[cur_device])[i][j]      = 0LL;
-                  LWPMU_DEVICE_prev_val_per_thread(&devices[cur_device])[i][j] = 0LL;
-             }
+        // one zeroed block for all cpus: previous values and accumulators of a cpu
+        // each start on a cache line, so the PMI of one cpu never touches another's lines
+        LWPMU_DEVICE_uncore_acc_stride(&devices[cur_device]) =
+            2 * ALIGN((ECB_num_events(ecb) + 1) * sizeof(U64), L1_CACHE_BYTES) / sizeof(U64);
+        // all groups take the event count from group 0, so one block serves them all
+        if (!LWPMU_DEVICE_uncore_acc(&devices[cur_device])) {
+            LWPMU_DEVICE_uncore_acc(&devices[cur_device]) =
+                CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state) *
+                                        LWPMU_DEVICE_uncore_acc_stride(&devices[cur_device]) * sizeof(U64));
+            if (!LWPMU_DEVICE_uncore_acc(&devices[cur_device])) {
+                return OS_NO_MEM;
+            }
         }
  
     LWPMU_DEVICE_em_groups_count(&devices[cur_device])++;
@@ -2217,19 +2439,19 @@ lwpmudrv_Start (
         return status;
     }
 
-    atomic_set(&read_now, GLOBAL_STATE_num_cpus(driver_state));
-    init_waitqueue_head(&read_tsc_now);
-
 #ifdef EMON
 #if defined(DRV_IA32) || defined(DRV_EM64T)
     CONTROL_Invoke_Parallel(lwpmudrv_Set_CR4_PCE_Bit, (PVOID)(size_t)0);
 #endif // (DRV_IA32 || DRV_EM64T)
 #endif // EMON
-    CONTROL_Invoke_Parallel(lwpmudrv_Fill_TSC_Info, (PVOID)(size_t)0);
+    if (TSC_Calibrate() != OS_SUCCESS) {
+        SEP_PRINT_ERROR("lwpmudrv_Start: TSC skew calibration failed, keeping the previous skews\n");
+    }
+    TSC_Start_Drift_Tracking(DRV_CONFIG_tsc_drift_ms(pcfg));
 
 #ifdef EMON
     // initialize the cpu0_TSC var
-    cpu0_TSC = tsc_info[0];
+    CONTROL_Invoke_Cpu(0, lwpmudrv_Read_Specific_TSC, &cpu0_TSC);
 #endif
 
     if (DRV_CONFIG_start_paused(pcfg)) {
@@ -2255,7 +2477,14 @@ lwpmudrv_Start (
             dispatch_unc                            && 
             dispatch_unc->restart) {
             SEP_PRINT_DEBUG("LWP: calling UNC Start\n");
-            CONTROL_Invoke_Parallel(dispatch_unc->restart, (VOID *)&i);
+            lwpmudrv_Invoke_Uncore(dispatch_unc->restart, (VOID *)&i);
+        }
+    }
+    if (DRV_CONFIG_counting_mode(pcfg) == FALSE) {
+        status = UNC_SAMPLER_Start();
+        if (status != OS_SUCCESS) {
+            SEP_PRINT_WARNING("lwpmudrv_Start: uncore counters are read in the PMI\n");
+            status = OS_SUCCESS;
         }
     }
 #endif
@@ -2290,6 +2519,10 @@ lwpmudrv_Prepare_Stop (
 #endif
     SEP_PRINT_DEBUG("lwpmudrv_Prepare_Stop: About to stop sampling\n");
     GLOBAL_STATE_current_phase(driver_state) = DRV_STATE_PREPARE_STOP;
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+    UNC_SAMPLER_Stop();
+#endif
+    TSC_Stop_Drift_Tracking();
 
     if (current_state == DRV_STATE_UNINITIALIZED) {
         return OS_SUCCESS;
@@ -2341,10 +2574,7 @@ lwpmudrv_Prepare_Stop (
             dispatch_unc                            &&
             dispatch_unc->freeze) {
             SEP_PRINT_DEBUG("LWP: calling UNC Stop\n");
-            preempt_disable();
-            invoking_processor_id = CONTROL_THIS_CPU();
-            preempt_enable();
-            CONTROL_Invoke_Parallel(dispatch_unc->freeze, (VOID *)&i);
+            lwpmudrv_Invoke_Uncore(dispatch_unc->freeze, (VOID *)&i);
         }
     }
 #endif
@@ -2404,6 +2634,7 @@ lwpmudrv_Finish_Stop (
             if (current_state != DRV_STATE_IDLE && current_state != DRV_STATE_RESERVED) {
                 status = LINUXOS_Enum_Process_Modules(TRUE);
             }
+            LINUXOS_Free_Path_Table();
         }
         OUTPUT_Flush();
         /*
@@ -2618,9 +2849,10 @@ lwpmudrv_Get_TSC_Skew_Info (
     IOCTL_ARGS arg
 )
 {
-    S64    *skew_array;
-    size_t  skew_array_len;
-    S32     i;
+    S64       *skew_array;
+    size_t     skew_array_len;
+    S32        i;
+    OS_STATUS  status = OS_SUCCESS;
 
     skew_array_len = GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64);
 
@@ -2646,11 +2878,62 @@ lwpmudrv_Get_TSC_Skew_Info (
     }
 
     if (copy_to_user(arg->r_buf, skew_array, skew_array_len)) {
-        return OS_FAULT;
+        status = OS_FAULT;
+    }
+    // a buffer twice as large also receives the error bound of each skew
+    else if (arg->r_len >= 2 * skew_array_len &&
+             copy_to_user(arg->r_buf + skew_array_len, tsc_skew_err, skew_array_len)) {
+        status = OS_FAULT;
     }
 
     skew_array = CONTROL_Free_Memory(skew_array);
-    return OS_SUCCESS;
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Get_TSC_Drift_Info(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ * @brief  Return the last TSC drift measurement
+ *
+ * <I>Special Notes</I>
+ *     The reply is a TSC_DRIFT_INFO_NODE followed by the skew and the error
+ *     bound of each cpu.  Unlike TSC_SKEW_INFO it may be called while the
+ *     collection runs.
+ */
+static OS_STATUS
+lwpmudrv_Get_TSC_Drift_Info (
+    IOCTL_ARGS arg
+)
+{
+    TSC_DRIFT_INFO  info;
+    size_t          info_len;
+    U32             num_cpus = GLOBAL_STATE_num_cpus(driver_state);
+    OS_STATUS       status;
+
+    info_len = sizeof(TSC_DRIFT_INFO_NODE) + 2 * num_cpus * sizeof(U64);
+
+    if (arg->r_len < info_len || arg->r_buf == NULL) {
+        SEP_PRINT_ERROR("lwpmudrv_Get_TSC_Drift_Info: Buffer too small: %lld\n", arg->r_len);
+        return OS_FAULT;
+    }
+
+    info = CONTROL_Allocate_Memory(info_len);
+    if (info == NULL) {
+        SEP_PRINT_ERROR("lwpmudrv_Get_TSC_Drift_Info: Unable to allocate memory\n");
+        return OS_NO_MEM;
+    }
+
+    status = TSC_Get_Drift(info, num_cpus);
+    if (status == OS_SUCCESS && copy_to_user(arg->r_buf, info, info_len)) {
+        status = OS_FAULT;
+    }
+
+    info = CONTROL_Free_Memory(info);
+    return status;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -3252,6 +3535,138 @@ lwpmudrv_Get_Num_Samples (
     return put_user(samples, (U64*)args->r_buf);
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Get_Num_Dropped_Samples(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Returns, for each CPU, the number of samples dropped during the
+ * @brief       current sampling run because the output ring was full
+ *
+ * <I>Special Notes</I>
+ *       r_buf receives one U64 per CPU, indexed by CPU number.
+ */
+static OS_STATUS
+lwpmudrv_Get_Num_Dropped_Samples (
+    IOCTL_ARGS args
+)
+{
+    S32               cpu_num;
+    U64               dropped;
+
+    if (cpu_buf == NULL) {
+        SEP_PRINT_ERROR("Output buffers were not initialized\n");
+        return OS_FAULT;
+    }
+    if (args->r_buf == NULL ||
+        args->r_len < GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64)) {
+        SEP_PRINT_ERROR("Dropped samples buffer is too small\n");
+        return OS_NO_MEM;
+    }
+
+    for (cpu_num = 0; cpu_num < GLOBAL_STATE_num_cpus(driver_state); cpu_num++) {
+        dropped = OUTPUT_Get_Dropped_Samples(&cpu_buf[cpu_num]);
+        SEP_PRINT_DEBUG("Dropped samples for cpu %d = %lld\n", cpu_num, dropped);
+        if (put_user(dropped, ((U64*)args->r_buf) + cpu_num)) {
+            return OS_FAULT;
+        }
+    }
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Get_EM_Times(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Returns, for each CPU, the time event multiplexing has been
+ * @brief       enabled and the time each group has been counting
+ *
+ * <I>Special Notes</I>
+ *       r_buf receives (num_groups + 1) U64 per CPU, indexed by CPU number:
+ *       the enabled time followed by the running time of every group, in ns.
+ *       Only available for timer based multiplexing.
+ */
+static OS_STATUS
+lwpmudrv_Get_EM_Times (
+    IOCTL_ARGS args
+)
+{
+    S32               cpu_num;
+    U32               num_groups = EVENTMUX_Get_Num_Groups();
+    U64              *times;
+    OS_STATUS         status     = OS_SUCCESS;
+
+    if (num_groups == 0) {
+        SEP_PRINT_ERROR("Timer based event multiplexing is not active\n");
+        return OS_INVALID;
+    }
+    if (args->r_buf == NULL ||
+        args->r_len < GLOBAL_STATE_num_cpus(driver_state) * (num_groups + 1) * sizeof(U64)) {
+        SEP_PRINT_ERROR("EM times buffer is too small\n");
+        return OS_NO_MEM;
+    }
+    times = CONTROL_Allocate_Memory((num_groups + 1) * sizeof(U64));
+    if (times == NULL) {
+        return OS_NO_MEM;
+    }
+
+    for (cpu_num = 0; cpu_num < GLOBAL_STATE_num_cpus(driver_state); cpu_num++) {
+        status = EVENTMUX_Get_Times(cpu_num, times);
+        if (status != OS_SUCCESS) {
+            break;
+        }
+        if (copy_to_user(((U64*)args->r_buf) + cpu_num * (num_groups + 1),
+                         times, (num_groups + 1) * sizeof(U64))) {
+            status = OS_FAULT;
+            break;
+        }
+    }
+    CONTROL_Free_Memory(times);
+
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn  static OS_STATUS lwpmudrv_Drain_Samples(IOCTL_ARGS arg)
+ *
+ * @param arg - Pointer to the IOCTL structure
+ *
+ * @return OS_STATUS
+ *
+ * @brief       Drains the full sample buffers of all CPUs in one call
+ *
+ * <I>Special Notes</I>
+ *       w_buf holds a U32 timeout in milliseconds, r_buf receives the
+ *       segments (see OUTPUT_DRAIN_INFO_NODE).
+ */
+static OS_STATUS
+lwpmudrv_Drain_Samples (
+    IOCTL_ARGS args
+)
+{
+    U32     timeout_ms = 0;
+
+    if (GLOBAL_STATE_current_phase(driver_state) == DRV_STATE_UNINITIALIZED) {
+        return OS_FAULT;
+    }
+    if (args->w_len >= sizeof(U32) && args->w_buf != NULL) {
+        if (get_user(timeout_ms, (U32*)args->w_buf)) {
+            return OS_FAULT;
+        }
+    }
+
+    return OUTPUT_Drain_Samples(args->r_buf, (size_t)args->r_len, timeout_ms);
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  * @fn  static OS_STATUS lwpmudrv_Get_Num_Samples(IOCTL_ARGS arg)
@@ -3387,6 +3802,14 @@ lwpmu_Service_IOCTL (
         return status;
     }
 
+    // may block for the requested timeout, so keep it out of ioctl_lock;
+    // OUTPUT_Drain_Samples serializes against the buffer teardown itself
+    if (cmd == DRV_OPERATION_DRAIN_SAMPLES) {
+        SEP_PRINT_DEBUG("DRV_OPERATION_DRAIN_SAMPLES\n");
+        status = lwpmudrv_Drain_Samples(&local_args);
+        return status;
+    }
+
     MUTEX_LOCK(ioctl_lock);
     switch (cmd) {
 
@@ -3491,6 +3914,11 @@ lwpmu_Service_IOCTL (
             status = lwpmudrv_Get_TSC_Skew_Info(&local_args);
             break;
 
+        case DRV_OPERATION_TSC_DRIFT_INFO:
+            SEP_PRINT_DEBUG("DRV_OPERATION_TSC_DRIFT_INFO\n");
+            status = lwpmudrv_Get_TSC_Drift_Info(&local_args);
+            break;
+
         case DRV_OPERATION_COLLECT_SYS_CONFIG:
             SEP_PRINT_DEBUG("DRV_OPERATION_COLLECT_SYS_CONFIG\n");
             status = lwpmudrv_Collect_Sys_Config(&local_args);
@@ -3610,6 +4038,21 @@ lwpmu_Service_IOCTL (
             status = lwpmudrv_Get_Num_Samples(&local_args);
             break;
 
+        case DRV_OPERATION_GET_NUM_DROPPED_SAMPLES:
+            SEP_PRINT_DEBUG("DRV_OPERATION_GET_NUM_DROPPED_SAMPLES\n");
+            status = lwpmudrv_Get_Num_Dropped_Samples(&local_args);
+            break;
+
+        case DRV_OPERATION_GET_EM_TIMES:
+            SEP_PRINT_DEBUG("DRV_OPERATION_GET_EM_TIMES\n");
+            status = lwpmudrv_Get_EM_Times(&local_args);
+            break;
+
+        case DRV_OPERATION_SNAPSHOT_COUNTERS:
+            SEP_PRINT_DEBUG("DRV_OPERATION_SNAPSHOT_COUNTERS\n");
+            status = lwpmudrv_Snapshot_Counters(&local_args);
+            break;
+
         case DRV_OPERATION_SET_DEVICE_NUM_UNITS:
             SEP_PRINT_DEBUG("DRV_OPERATION_SET_DEVICE_NUM_UNITS\n");
             status = lwpmudrv_Set_Device_Num_Units(&local_args);
@@ -3834,6 +4277,7 @@ static struct file_operations lwpmu_Fops = {
 #endif
     .read =    lwpmu_Read,
     .write =   lwpmu_Write,
+    .mmap =    lwpmudrv_Snapshot_Mmap,
     .open =    lwpmu_Open,
     .release = NULL,
     .llseek =  NULL,
@@ -3846,6 +4290,8 @@ static struct file_operations lwmod_Fops = {
     .owner =   THIS_MODULE,
     IOCTL_OP = NULL,                //None needed
     .read =    OUTPUT_Module_Read,
+    .mmap =    OUTPUT_Module_Mmap,
+    .poll =    OUTPUT_Module_Poll,
     .write =   NULL,                //No writing accepted
     .open =    lwpmu_Open,
     .release = NULL,
@@ -3859,6 +4305,8 @@ static struct file_operations lwsamp_Fops = {
     .owner =   THIS_MODULE,
     IOCTL_OP = NULL,                //None needed
     .read =    OUTPUT_Sample_Read,
+    .mmap =    OUTPUT_Sample_Mmap,
+    .poll =    OUTPUT_Sample_Poll,
     .write =   NULL,                //No writing accepted
     .open =    lwpmu_Open,
     .release = NULL,
@@ -4010,10 +4458,10 @@ lwpmu_Load (
         }
     }
 
-    tsc_info            = CONTROL_Allocate_Memory(GLOBAL_STATE_num_cpus(driver_state)*sizeof(U64));
-    atomic_set(&read_now, GLOBAL_STATE_num_cpus(driver_state));
-    init_waitqueue_head(&read_tsc_now);
-    CONTROL_Invoke_Parallel(lwpmudrv_Fill_TSC_Info, (PVOID)(size_t)0);
+    if (TSC_Initialize() == OS_NO_MEM) {
+        SEP_PRINT_ERROR("Unable to allocate the TSC skew tables\n");
+        return -ENOMEM;
+    }
 
     pcb_size            = GLOBAL_STATE_num_cpus(driver_state)*sizeof(CPU_STATE_NODE);
     pcb                 = CONTROL_Allocate_Memory(pcb_size);
@@ -4086,14 +4534,16 @@ lwpmu_Unload (
 
     SEP_PRINT_DEBUG("lwpmu driver unloading...\n");
     LINUXOS_Uninstall_Hooks();
+    LINUXOS_Free_Path_Table();
     SYS_INFO_Destroy();
     OUTPUT_Destroy();
     cpu_buf             = CONTROL_Free_Memory(cpu_buf);
     module_buf          = CONTROL_Free_Memory(module_buf);
     pcb                 = CONTROL_Free_Memory(pcb);
     pcb_size            = 0;
-    tsc_info            = CONTROL_Free_Memory(tsc_info);
+    TSC_Destroy();
     core_to_package_map = CONTROL_Free_Memory(core_to_package_map);
+    lwpmudrv_Snapshot_Free();
 
 #if defined (DRV_ANDROID)
     unregister_chrdev(MAJOR(lwpmu_DevNum), SEP_DRIVER_NAME);
@@ -33,7 +33,11 @@
 #include <linux/jiffies.h>
 #include <linux/time.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 
@@ -54,6 +58,12 @@
 static wait_queue_head_t flush_queue;
 static atomic_t          flush_writers;
 static volatile int      flush = 0;
+static DECLARE_WAIT_QUEUE_HEAD(drain_queue);
+static DEFINE_MUTEX(drain_lock);
+static DRV_BOOL          drain_open    = FALSE;   // cpu_buf may be drained, protected by drain_lock
+static volatile int      drain_closing = 0;       // teardown is waiting for drain_lock
+static atomic_t          output_maps = ATOMIC_INIT(0);   // live user mappings of any output buffer
+static DEFINE_MUTEX(output_map_lock);
 
 extern S32               abnormal_terminate;
 
@@ -78,14 +88,143 @@ output_Free_Buffers (
         return;
     }
     outbuf = &BUFFER_DESC_outbuf(buffer);
-    for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
+    for (j = 0; j < OUTPUT_MAX_BUFFERS; j++) {
         CONTROL_Free_Memory(OUTPUT_buffer(outbuf,j));
         OUTPUT_buffer(outbuf,j) = NULL;
     }
+    if (OUTPUT_control(outbuf)) {
+        free_page((unsigned long)OUTPUT_control(outbuf));
+        OUTPUT_control(outbuf) = NULL;
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID output_Publish_Segment (OUTPUT outbuf, U32 seg)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *  @param  seg           IN segment whose fill size changed
+ *
+ *  @result none
+ *
+ *  Copy the fill size of seg and the head to the mapped ring state.
+ *
+ */
+static VOID
+output_Publish_Segment (
+    OUTPUT  outbuf,
+    U32     seg
+)
+{
+    OUTPUT_CONTROL  ctl = OUTPUT_control(outbuf);
+
+    OUTPUT_CONTROL_buffer_full(ctl, seg) = OUTPUT_buffer_full(outbuf, seg);
+    smp_wmb();
+    OUTPUT_CONTROL_head(ctl)             = OUTPUT_head(outbuf);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID output_Release_Segment (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *
+ *  @result none
+ *
+ *  Give the segment at tail back to the producer.
+ *
+ * <I>Special Notes:</I>
+ *     Reader side only.  The mapped tail is left alone, it may be ahead.
+ *
+ */
+static VOID
+output_Release_Segment (
+    OUTPUT  outbuf
+)
+{
+    U32  seg = OUTPUT_read_buffer(outbuf);
+
+    OUTPUT_buffer_full(outbuf, seg)                         = 0;
+    OUTPUT_CONTROL_buffer_full(OUTPUT_control(outbuf), seg) = 0;
+    smp_mb();
+    OUTPUT_tail(outbuf)++;
 
     return;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID output_Sync_Tail (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *
+ *  @result none
+ *
+ *  Take back the segments a reader of the mapping has released by moving
+ *  the mapped tail.
+ *
+ * <I>Special Notes:</I>
+ *     Reader side only.  The mapped tail is not trusted: the driver only
+ *     moves up to it across segments that it has handed over, so a bad
+ *     value can at worst give back data the reader has not consumed.
+ *
+ */
+static VOID
+output_Sync_Tail (
+    OUTPUT  outbuf
+)
+{
+    U32  rel = OUTPUT_CONTROL_tail(OUTPUT_control(outbuf));
+
+    while (OUTPUT_tail(outbuf) != rel &&
+           OUTPUT_buffer_full(outbuf, OUTPUT_read_buffer(outbuf))) {
+        output_Release_Segment(outbuf);
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  DRV_BOOL output_Hand_Over_Segment (OUTPUT outbuf)
+ *
+ *  @param  outbuf        IN output buffer to manipulate
+ *
+ *  @result TRUE if the current segment was handed over to the reader
+ *
+ *  Publish the current segment to the reader and make the next segment of
+ *  the ring current.  Fails if the next segment has not been drained yet.
+ *
+ * <I>Special Notes:</I>
+ *     Must run on the CPU owning the buffer with interrupts disabled (or,
+ *     for the module buffer, under OUTPUT_buffer_lock).
+ *
+ */
+static DRV_BOOL
+output_Hand_Over_Segment (
+    OUTPUT  outbuf
+)
+{
+    U32     head = OUTPUT_head(outbuf);
+
+    if (head + 1 - OUTPUT_tail(outbuf) >= OUTPUT_NUM_BUFFERS) {
+        return FALSE;
+    }
+    // make the segment contents visible before handing it over
+    smp_wmb();
+    OUTPUT_buffer_full(outbuf, head % OUTPUT_NUM_BUFFERS) =
+            OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+    OUTPUT_head(outbuf)                  = head + 1;
+    OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_total_buffer_size(outbuf);
+    output_Publish_Segment(outbuf, head % OUTPUT_NUM_BUFFERS);
+
+    return TRUE;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *  @fn  int OUTPUT_Reserve_Buffer_Space (OUTPUT      outbuf,
@@ -97,9 +236,13 @@ output_Free_Buffers (
  *  @result outloc - to the location where data is to be written
  *
  *  Reserve space in the output buffers for data.  If a buffer is full,
- *  signal the caller that the flush routine needs to be called.
+ *  hand it over to the reader and move on to the next segment of the ring.
  *
  * <I>Special Notes:</I>
+ *     The reserved space is not zeroed; callers that do not fill in every
+ *     field of the record must clear it themselves.
+ *     If every other segment is still waiting to be drained the record is
+ *     dropped and accounted for in OUTPUT_dropped_samples.
  *
  */
 extern void* 
@@ -112,50 +255,82 @@ OUTPUT_Reserve_Buffer_Space (
     char   *outloc      = NULL;
     OUTPUT  outbuf      = &BUFFER_DESC_outbuf(bd);
 
-    if (OUTPUT_remaining_buffer_size(outbuf) >= size) {
-        outloc = (OUTPUT_buffer(outbuf,OUTPUT_current_buffer(outbuf)) + 
-          (OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf)));
-    }
-    else {
-        U32  i, j, start;
-        OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) = 
-                OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
-
+    if (OUTPUT_remaining_buffer_size(outbuf) < size) {
         //
-        // Massive Naive assumption:  Must find a way to fix it.
-        // In spite of the loop.
-        // The next buffer to fill are monotonically increasing
-        // indicies.
+        // The next segment is only free once the reader has moved past it.
+        // Until then keep the current (partial) segment and drop the record.
         //
-        signal_full = TRUE;
-        start = OUTPUT_current_buffer(outbuf);
-        for (i = start+1; i < start+OUTPUT_NUM_BUFFERS; i++) {
-
-            j = i%OUTPUT_NUM_BUFFERS;
-
-            if (!OUTPUT_buffer_full(outbuf,j)) {
-                OUTPUT_current_buffer(outbuf) = j;
-                OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_total_buffer_size(outbuf);
-                outloc = OUTPUT_buffer(outbuf,j);
-            }
-            else {
-                signal_full = FALSE;
-            }
+        if (size > OUTPUT_total_buffer_size(outbuf) ||
+            !output_Hand_Over_Segment(outbuf)) {
+            OUTPUT_dropped_samples(outbuf)++;
+            OUTPUT_CONTROL_dropped_samples(OUTPUT_control(outbuf)) = OUTPUT_dropped_samples(outbuf);
+            return NULL;
         }
+        signal_full = TRUE;
     }
-    if (outloc) {
-        OUTPUT_remaining_buffer_size(outbuf) -= size;
-        memset(outloc, 0, size);
-    }
+    outloc = (OUTPUT_buffer(outbuf,OUTPUT_current_buffer(outbuf)) +
+      (OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf)));
+    OUTPUT_remaining_buffer_size(outbuf) -= size;
 #if !defined(CONFIG_PREEMPT_RT)
     if (signal_full) {
         wake_up_interruptible_sync(&BUFFER_DESC_queue(bd));
+        if (waitqueue_active(&drain_queue)) {
+            wake_up_interruptible(&drain_queue);
+        }
     }
 #endif
 
     return outloc;
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID OUTPUT_Release_Buffer_Space (BUFFER_DESC bd,
+ *                                         U32         size)
+ *
+ *  @param  bd            IN output buffer to manipulate
+ *  @param  size          IN number of bytes to give back
+ *
+ *  @result none
+ *
+ *  Return the unused tail of the most recent reservation to the buffer.
+ *
+ * <I>Special Notes:</I>
+ *     Only valid for the last OUTPUT_Reserve_Buffer_Space() on bd, made
+ *     from the same (non-preemptible) context, and only for bytes that
+ *     have not been handed over yet.
+ *
+ */
+extern VOID
+OUTPUT_Release_Buffer_Space (
+    BUFFER_DESC  bd,
+    U32          size
+)
+{
+    OUTPUT  outbuf = &BUFFER_DESC_outbuf(bd);
+
+    OUTPUT_remaining_buffer_size(outbuf) += size;
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  U64 OUTPUT_Get_Dropped_Samples (BUFFER_DESC bd)
+ *
+ *  @param  bd            IN output buffer to query
+ *
+ *  @result number of records dropped because the ring was full
+ *
+ */
+extern U64
+OUTPUT_Get_Dropped_Samples (
+    BUFFER_DESC  bd
+)
+{
+    return OUTPUT_dropped_samples(&BUFFER_DESC_outbuf(bd));
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *
@@ -226,6 +401,30 @@ OUTPUT_Module_Fill (
 }
 
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID  output_Signal_EOF(VOID)
+ *
+ *  @brief  Account for one buffer reader having reached end-of-file
+ *
+ *  OUTPUT_Flush waits until every active buffer has been drained to EOF.
+ *
+ */
+static VOID
+output_Signal_EOF (
+    VOID
+)
+{
+    DRV_BOOL flush_val = atomic_dec_and_test(&flush_writers);
+
+    SEP_PRINT_DEBUG("output_Signal_EOF decremented flush_writers\n");
+    if (flush_val == TRUE) {
+        wake_up_interruptible_sync(&flush_queue);
+    }
+
+    return;
+}
+
 /* ------------------------------------------------------------------------- */
 /*!
  *  @fn  ssize_t  output_Read(struct file  *filp, 
@@ -262,18 +461,16 @@ output_Read (
     ssize_t  to_copy;
     ssize_t  uncopied;
     OUTPUT   outbuf = &BUFFER_DESC_outbuf(kernel_buf);
-    U32      cur_buf, i;
+    U32      cur_buf;
 
 /* Buffer is filled by output_fill_modules. */
 
-    cur_buf = OUTPUT_current_buffer(outbuf);
-    for (i=0; i<OUTPUT_NUM_BUFFERS; i++) { //iterate through all buffers
-        cur_buf++;
-        if (cur_buf >= OUTPUT_NUM_BUFFERS) { cur_buf = 0; } //circularly
-        if ((to_copy = OUTPUT_buffer_full(outbuf, cur_buf))) {
-            break;
-        }
-    }
+    /* Take back what a reader of the mapping has consumed */
+    output_Sync_Tail(outbuf);
+
+    /* Segments are handed over in order, so only the tail can be ready */
+    cur_buf = OUTPUT_read_buffer(outbuf);
+    to_copy = OUTPUT_buffer_full(outbuf, cur_buf);
     SEP_PRINT_DEBUG("buffer %d has %d bytes ready\n", (S32)cur_buf, (S32)to_copy);
     if (!flush && to_copy == 0) {
 #if defined(CONFIG_PREEMPT_RT)
@@ -302,11 +499,15 @@ output_Read (
 
     /* Copy data to user space. Note that we use cur_buf as the source */ 
     if (abnormal_terminate == 0) {
+        smp_rmb();
         uncopied = copy_to_user(buf,
                                 OUTPUT_buffer(outbuf, cur_buf),
                                 to_copy);
-        /* Mark the buffer empty */
-        OUTPUT_buffer_full(outbuf, cur_buf) = 0;
+        /* Mark the buffer empty and give the segment back to the producer */
+        if (to_copy) {
+            output_Release_Segment(outbuf);
+            OUTPUT_CONTROL_tail(OUTPUT_control(outbuf)) = OUTPUT_tail(outbuf);
+        }
         *f_pos += to_copy-uncopied;
         if (uncopied) {
             SEP_PRINT_DEBUG("only copied %d of %lld bytes of module records\n", 
@@ -322,11 +523,7 @@ output_Read (
     // At end-of-file, decrement the count of active buffer writers
 
     if (to_copy == 0) {
-        DRV_BOOL flush_val = atomic_dec_and_test(&flush_writers);
-        SEP_PRINT_DEBUG("output_Read decremented flush_writers\n");
-        if (flush_val == TRUE) {
-            wake_up_interruptible_sync(&flush_queue);
-        }
+        output_Signal_EOF();
     }
 
     return to_copy;
@@ -408,6 +605,453 @@ OUTPUT_Sample_Read (
     return output_Read(filp, buf, count, f_pos, &(cpu_buf[i]));
 }
 
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  DRV_BOOL  output_Any_Full(VOID)
+ *
+ *  @brief  Check whether any CPU has a segment ready to be drained
+ *
+ */
+static DRV_BOOL
+output_Any_Full (
+    VOID
+)
+{
+    int     i;
+    OUTPUT  outbuf;
+
+    for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
+        outbuf = &BUFFER_DESC_outbuf(&cpu_buf[i]);
+        if (OUTPUT_buffer_full(outbuf, OUTPUT_read_buffer(outbuf))) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID  output_Close_Segment(PVOID param)
+ *
+ *  @brief  Hand over the partially filled segment of the current CPU
+ *
+ *  @param  param   unused
+ *
+ * <I>Special Notes:</I>
+ *     Invoked on every CPU.  Interrupts are disabled so that the PMI
+ *     handler, the only other writer of this ring, cannot interleave.
+ *
+ */
+static VOID
+output_Close_Segment (
+    PVOID  param
+)
+{
+    OUTPUT         outbuf = &BUFFER_DESC_outbuf(&cpu_buf[CONTROL_THIS_CPU()]);
+    unsigned long  flags;
+
+    local_irq_save(flags);
+    if (OUTPUT_remaining_buffer_size(outbuf) < OUTPUT_total_buffer_size(outbuf)) {
+        output_Hand_Over_Segment(outbuf);
+    }
+    local_irq_restore(flags);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  VOID  output_Set_Drain_Open(DRV_BOOL open)
+ *
+ *  @brief  Allow or forbid draining the cpu buffers
+ *
+ *  @param  open  TRUE once the cpu buffers are set up, FALSE before they
+ *                are reset or freed
+ *
+ *  @return none
+ *
+ * <I>Special Notes:</I>
+ *     A drainer holds drain_lock for the whole drain and may be sleeping in
+ *     the wait for a full segment.  Wake it first so that it drops the lock
+ *     soon; once this returns no drainer touches the buffers anymore.
+ */
+static VOID
+output_Set_Drain_Open (
+    DRV_BOOL  open
+)
+{
+    drain_closing = 1;
+    smp_mb();
+    wake_up_interruptible(&drain_queue);
+    mutex_lock(&drain_lock);
+    drain_open    = open;
+    drain_closing = 0;
+    mutex_unlock(&drain_lock);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  OS_STATUS  OUTPUT_Drain_Samples(char   *buf,
+ *                                       size_t  count,
+ *                                       U32     timeout_ms)
+ *
+ *  @brief  Copy every full sample segment of every CPU to user space
+ *
+ *  @param *buf         user buffer, starts with an OUTPUT_DRAIN_INFO_NODE
+ *  @param  count       size of the user buffer
+ *  @param  timeout_ms  how long to wait for a full segment
+ *
+ *  @return OS_STATUS
+ *
+ *  The OUTPUT_DRAIN_INFO_NODE header is followed by num_segments records,
+ *  each an OUTPUT_SEGMENT_NODE immediately followed by its data.  If no
+ *  segment fills up within timeout_ms, the partially filled segments are
+ *  handed over and drained instead.  Once the collection has been flushed
+ *  and every CPU is empty, a drain returning no segments is end-of-file.
+ *
+ * <I>Special Notes:</I>
+ *     This replaces one reader per sample device; the two modes must not
+ *     be mixed within a collection.  The drain runs outside ioctl_lock, so
+ *     it holds drain_lock throughout and OUTPUT_Initialize/OUTPUT_Destroy
+ *     close the drain before they touch the buffers.
+ *
+ */
+extern OS_STATUS
+OUTPUT_Drain_Samples (
+    char    *buf,
+    size_t   count,
+    U32      timeout_ms
+)
+{
+    OUTPUT_DRAIN_INFO_NODE  info;
+    OUTPUT_SEGMENT_NODE     seg;
+    OUTPUT                  outbuf;
+    BUFFER_DESC             bd;
+    size_t                  pos = sizeof(OUTPUT_DRAIN_INFO_NODE);
+    U32                     cur_buf, to_copy;
+    int                     i;
+    OS_STATUS               status = OS_SUCCESS;
+
+    if (cpu_buf == NULL || buf == NULL || count < pos) {
+        return OS_NO_MEM;
+    }
+
+    mutex_lock(&drain_lock);
+    if (!drain_open) {
+        mutex_unlock(&drain_lock);
+        return OS_FAULT;
+    }
+
+    if (!flush && timeout_ms && !drain_closing && !output_Any_Full()) {
+        if (wait_event_interruptible_timeout(drain_queue,
+                                             flush || drain_closing || output_Any_Full(),
+                                             msecs_to_jiffies(timeout_ms)) < 0) {
+            mutex_unlock(&drain_lock);
+            return OS_RESTART_SYSCALL;
+        }
+    }
+    if (drain_closing) {
+        // the buffers are about to go away, hand back what is full so far
+        goto finish_drain;
+    }
+    if (!flush && !output_Any_Full() &&
+        GLOBAL_STATE_current_phase(driver_state) == DRV_STATE_RUNNING) {
+        CONTROL_Invoke_Parallel(output_Close_Segment, NULL);
+    }
+
+    memset(&info, 0, sizeof(info));
+    for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
+        bd     = &cpu_buf[i];
+        outbuf = &BUFFER_DESC_outbuf(bd);
+        while ((to_copy = OUTPUT_buffer_full(outbuf, (cur_buf = OUTPUT_read_buffer(outbuf))))) {
+            if (pos + sizeof(seg) + to_copy > count) {
+                goto finish_drain;
+            }
+            if (abnormal_terminate == 0) {
+                OUTPUT_SEGMENT_cpu(&seg)    = i;
+                OUTPUT_SEGMENT_length(&seg) = to_copy;
+                smp_rmb();
+                if (copy_to_user(buf + pos, &seg, sizeof(seg)) ||
+                    copy_to_user(buf + pos + sizeof(seg), OUTPUT_buffer(outbuf, cur_buf), to_copy)) {
+                    status = OS_FAULT;
+                    goto finish_drain;
+                }
+                pos += sizeof(seg) + to_copy;
+                OUTPUT_DRAIN_INFO_num_segments(&info)++;
+            }
+            output_Release_Segment(outbuf);
+            OUTPUT_CONTROL_tail(OUTPUT_control(outbuf)) = OUTPUT_tail(outbuf);
+        }
+        // this CPU is fully drained after a flush: report EOF exactly once
+        if (flush && !BUFFER_DESC_eof(bd) && pcb && CPU_STATE_initial_mask(&pcb[i])) {
+            BUFFER_DESC_eof(bd) = TRUE;
+            output_Signal_EOF();
+        }
+    }
+
+finish_drain:
+    mutex_unlock(&drain_lock);
+    OUTPUT_DRAIN_INFO_size(&info) = pos;
+    if (status == OS_SUCCESS && copy_to_user(buf, &info, sizeof(info))) {
+        status = OS_FAULT;
+    }
+
+    return status;
+}
+
+static void
+output_Vma_Open (
+    struct vm_area_struct *vma
+)
+{
+    atomic_inc(&output_maps);
+}
+
+static void
+output_Vma_Close (
+    struct vm_area_struct *vma
+)
+{
+    atomic_dec(&output_maps);
+}
+
+static struct vm_operations_struct output_Vm_Ops = {
+    .open  = output_Vma_Open,
+    .close = output_Vma_Close,
+};
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  int  output_Mmap(struct vm_area_struct *vma,
+ *                        BUFFER_DESC            kernel_buf)
+ *
+ *  @brief  Map the ring state and all segments of an output buffer
+ *
+ *  @param *vma           the user mapping to populate
+ *  @param  kernel_buf    the kernel output buffer structure
+ *
+ *  @return 0 on success, negative errno otherwise
+ *
+ *  The mapping is one page of OUTPUT_CONTROL_NODE followed by every
+ *  segment, in order.  It has to cover exactly that range.
+ *
+ * <I>Special Notes:</I>
+ *     Segments may come from kmalloc or vmalloc (see CONTROL_Allocate_Memory),
+ *     so each page is remapped individually.  The pages carry no reference,
+ *     so OUTPUT_Destroy() keeps every output buffer while a mapping is live.
+ *
+ */
+static int
+output_Mmap (
+    struct vm_area_struct *vma,
+    BUFFER_DESC            kernel_buf
+)
+{
+    OUTPUT         outbuf;
+    unsigned long  uaddr = vma->vm_start;
+    unsigned long  pfn;
+    U32            j, offset;
+    char          *kaddr;
+    int            rc    = 0;
+
+    if (kernel_buf == NULL) {
+        return -EINVAL;
+    }
+    mutex_lock(&output_map_lock);
+    outbuf = &BUFFER_DESC_outbuf(kernel_buf);
+    if (OUTPUT_control(outbuf) == NULL ||
+        (OUTPUT_total_buffer_size(outbuf) & ~PAGE_MASK) ||
+        vma->vm_pgoff != 0 ||
+        vma->vm_end - vma->vm_start !=
+            PAGE_SIZE + (unsigned long)OUTPUT_NUM_BUFFERS * OUTPUT_total_buffer_size(outbuf)) {
+        SEP_PRINT_ERROR("output_Mmap: unexpected mapping size 0x%lx\n", vma->vm_end - vma->vm_start);
+        rc = -EINVAL;
+        goto end;
+    }
+    for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
+        if (((unsigned long)OUTPUT_buffer(outbuf,j)) & ~PAGE_MASK) {
+            SEP_PRINT_ERROR("output_Mmap: buffer %d is not page aligned\n", j);
+            rc = -EINVAL;
+            goto end;
+        }
+    }
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTCOPY;
+
+    pfn = virt_to_phys(OUTPUT_control(outbuf)) >> PAGE_SHIFT;
+    if (remap_pfn_range(vma, uaddr, pfn, PAGE_SIZE, vma->vm_page_prot)) {
+        rc = -EAGAIN;
+        goto end;
+    }
+    uaddr += PAGE_SIZE;
+
+    for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
+        for (offset = 0; offset < OUTPUT_total_buffer_size(outbuf); offset += PAGE_SIZE) {
+            kaddr = (char *)OUTPUT_buffer(outbuf,j) + offset;
+            if (is_vmalloc_addr(kaddr)) {
+                pfn = vmalloc_to_pfn(kaddr);
+            }
+            else {
+                pfn = virt_to_phys(kaddr) >> PAGE_SHIFT;
+            }
+            if (remap_pfn_range(vma, uaddr, pfn, PAGE_SIZE, vma->vm_page_prot)) {
+                rc = -EAGAIN;
+                goto end;
+            }
+            uaddr += PAGE_SIZE;
+        }
+    }
+    vma->vm_ops = &output_Vm_Ops;
+    output_Vma_Open(vma);
+
+end:
+    // a failed mapping is not counted, so drop what was remapped before unlocking
+    if (rc && uaddr > vma->vm_start) {
+        zap_vma_ptes(vma, vma->vm_start, uaddr - vma->vm_start);
+    }
+    mutex_unlock(&output_map_lock);
+
+    return rc;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  int  OUTPUT_Module_Mmap(struct file           *filp,
+ *                               struct vm_area_struct *vma)
+ *
+ *  @brief  Map the module buffer ring to user space
+ *
+ *  @param *filp   a file pointer
+ *  @param *vma    the user mapping to populate
+ *
+ *  @return 0 on success, negative errno otherwise
+ *
+ */
+extern int
+OUTPUT_Module_Mmap (
+    struct file           *filp,
+    struct vm_area_struct *vma
+)
+{
+    SEP_PRINT_DEBUG("mmap request for modules on minor\n");
+
+    return output_Mmap(vma, module_buf);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  int  OUTPUT_Sample_Mmap(struct file           *filp,
+ *                               struct vm_area_struct *vma)
+ *
+ *  @brief  Map the sample buffer ring of one CPU to user space
+ *
+ *  @param *filp   a file pointer
+ *  @param *vma    the user mapping to populate
+ *
+ *  @return 0 on success, negative errno otherwise
+ *
+ * <I>Special Notes:</I>
+ *     A reader that drains segments through the mapping must still call
+ *     read() once the collection is flushed; the zero-length read is what
+ *     lets OUTPUT_Flush complete.
+ *
+ */
+extern int
+OUTPUT_Sample_Mmap (
+    struct file           *filp,
+    struct vm_area_struct *vma
+)
+{
+    int     i;
+
+    i = iminor(filp->f_dentry->d_inode);
+    SEP_PRINT_DEBUG("mmap request for samples on minor %d\n", i);
+    if (cpu_buf == NULL) {
+        return -EINVAL;
+    }
+
+    return output_Mmap(vma, &(cpu_buf[i]));
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  unsigned int  output_Poll(struct file *filp,
+ *                                 poll_table  *wait,
+ *                                 BUFFER_DESC  kernel_buf)
+ *
+ *  @brief  Report whether the next segment of the ring is ready
+ *
+ *  @param *filp          a file pointer
+ *  @param *wait          the poll table
+ *  @param  kernel_buf    the kernel output buffer structure
+ *
+ *  @return poll mask
+ *
+ */
+static unsigned int
+output_Poll (
+    struct file  *filp,
+    poll_table   *wait,
+    BUFFER_DESC   kernel_buf
+)
+{
+    OUTPUT        outbuf;
+    unsigned int  mask = 0;
+
+    if (kernel_buf == NULL || OUTPUT_control(&BUFFER_DESC_outbuf(kernel_buf)) == NULL) {
+        return POLLERR;
+    }
+    outbuf = &BUFFER_DESC_outbuf(kernel_buf);
+    poll_wait(filp, &BUFFER_DESC_queue(kernel_buf), wait);
+    output_Sync_Tail(outbuf);
+    if (flush || OUTPUT_buffer_full(outbuf, OUTPUT_read_buffer(outbuf))) {
+        mask |= POLLIN | POLLRDNORM;
+    }
+
+    return mask;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  unsigned int  OUTPUT_Module_Poll(struct file *filp, poll_table *wait)
+ *
+ *  @brief  poll() entry point of the module device
+ *
+ */
+extern unsigned int
+OUTPUT_Module_Poll (
+    struct file              *filp,
+    struct poll_table_struct *wait
+)
+{
+    return output_Poll(filp, wait, module_buf);
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ *  @fn  unsigned int  OUTPUT_Sample_Poll(struct file *filp, poll_table *wait)
+ *
+ *  @brief  poll() entry point of the per-CPU sample devices
+ *
+ */
+extern unsigned int
+OUTPUT_Sample_Poll (
+    struct file              *filp,
+    struct poll_table_struct *wait
+)
+{
+    int     i;
+
+    i = iminor(filp->f_dentry->d_inode);
+    if (cpu_buf == NULL) {
+        return POLLERR;
+    }
+
+    return output_Poll(filp, wait, &(cpu_buf[i]));
+}
+
 /*
  *  @fn output_Initialized_Buffers()
  *
@@ -419,7 +1063,7 @@ OUTPUT_Sample_Read (
  *  @brief  Allocate, initialize, and return an output data structure
  *
  * <I>Special Notes:</I>
- *     Multiple (OUTPUT_NUM_BUFFERS) buffers will be allocated
+ *     Multiple (OUTPUT_NUM_BUFFERS) buffers will be allocated as a ring
  *     Each buffer is of size (OUTPUT_BUFFER_SIZE)
  *     Each field in the buffer is initialized
  *     The event queue for the OUTPUT is initialized
@@ -446,6 +1090,13 @@ output_Initialized_Buffers (
     }
     outbuf = &(BUFFER_DESC_outbuf(desc));
     spin_lock_init(&OUTPUT_buffer_lock(outbuf));
+    if (OUTPUT_control(outbuf) == NULL) {
+        OUTPUT_control(outbuf) = (OUTPUT_CONTROL)get_zeroed_page(GFP_KERNEL);
+        if (!OUTPUT_control(outbuf)) {
+            SEP_PRINT_DEBUG("OUTPUT Initialize_Buffer: Failed Allocation\n");
+            return NULL;
+        }
+    }
     for (j = 0; j < OUTPUT_NUM_BUFFERS; j++) {
         if (OUTPUT_buffer(outbuf,j) == NULL) {
             OUTPUT_buffer(outbuf,j) = CONTROL_Allocate_Memory(OUTPUT_BUFFER_SIZE * factor);
@@ -460,7 +1111,13 @@ output_Initialized_Buffers (
     /*
      *  Initialize the remaining fields in the BUFFER_DESC
      */
-    OUTPUT_current_buffer(outbuf)        = 0;
+    OUTPUT_head(outbuf)                  = 0;
+    OUTPUT_tail(outbuf)                  = 0;
+    OUTPUT_dropped_samples(outbuf)       = 0;
+    BUFFER_DESC_eof(desc)                = FALSE;
+    memset(OUTPUT_control(outbuf), 0, sizeof(OUTPUT_CONTROL_NODE));
+    OUTPUT_CONTROL_num_buffers(OUTPUT_control(outbuf)) = OUTPUT_NUM_BUFFERS;
+    OUTPUT_CONTROL_buffer_size(OUTPUT_control(outbuf)) = OUTPUT_BUFFER_SIZE * factor;
     OUTPUT_remaining_buffer_size(outbuf) = OUTPUT_BUFFER_SIZE * factor;
     OUTPUT_total_buffer_size(outbuf)     = OUTPUT_BUFFER_SIZE * factor;
     init_waitqueue_head(&BUFFER_DESC_queue(desc));
@@ -494,6 +1151,7 @@ OUTPUT_Initialize (
     OS_STATUS      status = OS_SUCCESS;
 
     flush = 0;
+    output_Set_Drain_Open(FALSE);
     for (i = 0; i < GLOBAL_STATE_num_cpus(driver_state); i++) {
         unused = output_Initialized_Buffers(&cpu_buf[i], 1);
         if (!unused) {
@@ -512,6 +1170,7 @@ OUTPUT_Initialize (
         OUTPUT_Destroy();
         return OS_NO_MEM;
     }
+    output_Set_Drain_Open(TRUE);
 
     return status;
 }
@@ -551,6 +1210,7 @@ OUTPUT_Flush (
         writers += 1;
         OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) = 
             OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+        output_Publish_Segment(outbuf, OUTPUT_current_buffer(outbuf));
     }
     atomic_set(&flush_writers, writers + OTHER_C_DEVICES);   
     // Flip the switch to terminate the output threads
@@ -563,14 +1223,17 @@ OUTPUT_Flush (
         outbuf = &BUFFER_DESC_outbuf(&cpu_buf[i]);
         OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) = 
             OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+        output_Publish_Segment(outbuf, OUTPUT_current_buffer(outbuf));
         wake_up_interruptible_sync(&BUFFER_DESC_queue(&cpu_buf[i]));
     }
+    wake_up_interruptible(&drain_queue);
 
     // Flush all data from the module buffers
 
     outbuf = &BUFFER_DESC_outbuf(module_buf);
     OUTPUT_buffer_full(outbuf,OUTPUT_current_buffer(outbuf)) = 
                               OUTPUT_total_buffer_size(outbuf) - OUTPUT_remaining_buffer_size(outbuf);
+    output_Publish_Segment(outbuf, OUTPUT_current_buffer(outbuf));
     SEP_PRINT_DEBUG("OUTPUT_Flush - waking up module_queue\n");
     wake_up_interruptible_sync(&BUFFER_DESC_queue(module_buf));
 
@@ -595,6 +1258,9 @@ OUTPUT_Flush (
  * <I>Special Notes:</I>
  *      Free the module buffers
  *      For each CPU in the system, free the sampling buffers
+ *      Nothing is freed while user space maps any of them; the buffers are
+ *      then reused by the next OUTPUT_Initialize().
+ *      A drain in progress is woken and waited for first.
  */
 extern int 
 OUTPUT_Destroy (
@@ -604,6 +1270,13 @@ OUTPUT_Destroy (
     int    i, n;
     OUTPUT outbuf;
 
+    mutex_lock(&output_map_lock);
+    if (atomic_read(&output_maps)) {
+        mutex_unlock(&output_map_lock);
+        SEP_PRINT_WARNING("OUTPUT_Destroy: output buffers are still mapped, keeping them\n");
+        return OS_IN_PROGRESS;
+    }
+    output_Set_Drain_Open(FALSE);
     if (module_buf != NULL) {
         outbuf = &BUFFER_DESC_outbuf(module_buf);
         output_Free_Buffers(module_buf, OUTPUT_total_buffer_size(outbuf));
@@ -616,6 +1289,7 @@ OUTPUT_Destroy (
             output_Free_Buffers(&cpu_buf[i], OUTPUT_total_buffer_size(outbuf));
         }
     }
+    mutex_unlock(&output_map_lock);
 
     return 0;
 }
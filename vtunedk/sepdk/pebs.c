@@ -37,12 +37,48 @@
 #include "lwpmudrv.h"
 #include "control.h"
 #include "core2.h"
+#include "ecb_iterators.h"
 #include "utility.h"
 #include "pebs.h"
 
+#define PEBS_MAX_RECORDS         64
+#define PEBS_NUM_COUNTER_RESETS  4
+
 static PEBS_DISPATCH  pebs_dispatch           = NULL;
 static PVOID          pebs_global_memory      = NULL;
 static size_t         pebs_global_memory_size = 0;
+static U32            pebs_rec_size           = 0;
+static U32            pebs_rec_num            = 1;
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          S8* pebs_Get_Record (dtes, rec_idx)
+ *
+ * @brief       Locate a record in the PEBS buffer
+ *
+ * @param       dtes    - DS area of the current cpu
+ * @param       rec_idx - index of the record, 0 is the oldest one
+ *
+ * @return      pointer to the record, NULL if the hardware has not written it
+ *
+ * <I>Special Notes:</I>
+ *              <NONE>
+ */
+static S8*
+pebs_Get_Record (
+    DTS_BUFFER_EXT   dtes,
+    U32              rec_idx
+)
+{
+    S8   *pebs_rec   = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes) + rec_idx * pebs_rec_size;
+    S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
+
+    if (pebs_rec >= pebs_index) {
+        return NULL;
+    }
+
+    return pebs_rec;
+}
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -62,7 +98,7 @@ pebs_Corei7_Initialize_Threshold (
     U32              pebs_record_size
 )
 {
-    DTS_BUFFER_EXT_pebs_threshold(dts)  = DTS_BUFFER_EXT_pebs_base(dts) + pebs_record_size;
+    DTS_BUFFER_EXT_pebs_threshold(dts)  = DTS_BUFFER_EXT_pebs_base(dts) + pebs_rec_num * pebs_record_size;
 
     return;
 }
@@ -80,7 +116,8 @@ pebs_Corei7_Initialize_Threshold (
  * <I>Special Notes:</I>
  *    Check the global overflow field of the buffer descriptor.
  *    Precise events can be allocated on any of the 4 general purpose
- *    registers.
+ *    registers.  When several records are buffered per PMI, the
+ *    overflow fields of all of them are merged.
  */
 static U64
 pebs_Corei7_Overflow (
@@ -89,16 +126,18 @@ pebs_Corei7_Overflow (
 )
 {
     DTS_BUFFER_EXT   dtes     = CPU_STATE_dts_buffer(&pcb[this_cpu]);
-    U8               status   = FALSE;
-    PEBS_REC_EXT     pebs_base;
+    PEBS_REC_EXT     pebs_rec;
+    U32              rec_idx;
 
     if (!dtes) {
         return overflow_status;
     }
-    status = (U8)((dtes) && (DTS_BUFFER_EXT_pebs_index(dtes) != DTS_BUFFER_EXT_pebs_base(dtes)));
-    if (status) {
-        pebs_base = (PEBS_REC_EXT)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        overflow_status  |= PEBS_REC_EXT_glob_perf_overflow(pebs_base);
+    for (rec_idx = 0; rec_idx < pebs_rec_num; rec_idx++) {
+        pebs_rec = (PEBS_REC_EXT)pebs_Get_Record(dtes, rec_idx);
+        if (!pebs_rec) {
+            break;
+        }
+        overflow_status |= PEBS_REC_EXT_glob_perf_overflow(pebs_rec);
     }
 
     return overflow_status;
@@ -166,12 +205,13 @@ pebs_Core2_Overflow (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID pebs_Modify_IP (sample, is_64bit_addr)
+ * @fn          VOID pebs_Modify_IP (sample, is_64bit_addr, pebs_rec)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       pebs_rec      - PEBS record to take the IP from, may be NULL
  *
  * @return      NONE
  *
@@ -181,26 +221,22 @@ pebs_Core2_Overflow (
 static VOID
 pebs_Modify_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    S8          *pebs_rec
 )
 {
     SampleRecordPC  *psamp = sample;
-    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
+    PEBS_REC_EXT     pb    = (PEBS_REC_EXT)pebs_rec;
 
-    if (dtes && psamp) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
-        SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index) {
-            PEBS_REC_EXT  pb = (PEBS_REC_EXT)pebs_base;
-            if (is_64bit_addr) {
-                SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT_linear_ip(pb);
-                SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT_r_flags(pb);
-            }
-            else {
-                SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT_linear_ip(pb) & 0xFFFFFFFF;
-                SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT_r_flags(pb) & 0xFFFFFFFF;
-            }
+    SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
+    if (pb && psamp) {
+        if (is_64bit_addr) {
+            SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT_linear_ip(pb);
+            SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT_r_flags(pb);
+        }
+        else {
+            SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT_linear_ip(pb) & 0xFFFFFFFF;
+            SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT_r_flags(pb) & 0xFFFFFFFF;
         }
     }
 
@@ -209,12 +245,13 @@ pebs_Modify_IP (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID pebs_Modify_IP_With_Eventing_IP (sample, is_64bit_addr)
+ * @fn          VOID pebs_Modify_IP_With_Eventing_IP (sample, is_64bit_addr, pebs_rec)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       pebs_rec      - PEBS record to take the IP from, may be NULL
  *
  * @return      NONE
  *
@@ -224,26 +261,22 @@ pebs_Modify_IP (
 static VOID
 pebs_Modify_IP_With_Eventing_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    S8          *pebs_rec
 )
 {
     SampleRecordPC  *psamp = sample;
-    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
+    PEBS_REC_EXT1    pb    = (PEBS_REC_EXT1)pebs_rec;
 
-    if (dtes && psamp) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
-        SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index) {
-            PEBS_REC_EXT1  pb = (PEBS_REC_EXT1)pebs_base;
-            if (is_64bit_addr) {
-                SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb);
-                SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT1_r_flags(pb);
-            }
-            else {
-                SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb) & 0xFFFFFFFF;
-                SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT1_r_flags(pb) & 0xFFFFFFFF;
-            }
+    SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
+    if (pb && psamp) {
+        if (is_64bit_addr) {
+            SAMPLE_RECORD_iip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb);
+            SAMPLE_RECORD_ipsr(psamp)   = PEBS_REC_EXT1_r_flags(pb);
+        }
+        else {
+            SAMPLE_RECORD_eip(psamp)    = PEBS_REC_EXT1_eventing_ip(pb) & 0xFFFFFFFF;
+            SAMPLE_RECORD_eflags(psamp) = PEBS_REC_EXT1_r_flags(pb) & 0xFFFFFFFF;
         }
     }
 
@@ -281,7 +314,7 @@ PEBS_DISPATCH_NODE  haswell_pebs =
      pebs_Modify_IP_With_Eventing_IP
 };
 
-#define PER_CORE_BUFFER_SIZE(record_size)  (sizeof(DTS_BUFFER_EXT_NODE) +  2 * (record_size) + 64)
+#define PER_CORE_BUFFER_SIZE(record_size)  (sizeof(DTS_BUFFER_EXT_NODE) +  (pebs_rec_num + 1) * (record_size) + 64)
 
 /* ------------------------------------------------------------------------- */
 /*!
@@ -310,7 +343,7 @@ pebs_Alloc_DTS_Buffer (
     int             this_cpu;
 
     /*
-     * one PEBS record... need 2 records so that
+     * pebs_rec_num PEBS records... need one more so that
      * threshold can be less than absolute max
      */
     preempt_disable();
@@ -337,7 +370,7 @@ pebs_Alloc_DTS_Buffer (
 
     /*
      * Program the DTES Buffer for Precise EBS.
-     * Set PEBS buffer for one PEBS record
+     * Set PEBS buffer for pebs_rec_num PEBS records
      */
     dts = (DTS_BUFFER_EXT)dts_buffer;
 
@@ -347,7 +380,11 @@ pebs_Alloc_DTS_Buffer (
     DTS_BUFFER_EXT_threshold(dts)       = 0;
     DTS_BUFFER_EXT_pebs_base(dts)       = pebs_base;
     DTS_BUFFER_EXT_pebs_index(dts)      = pebs_base;
-    DTS_BUFFER_EXT_pebs_max(dts)        = pebs_base + 2 * pebs_record_size;
+    DTS_BUFFER_EXT_pebs_max(dts)        = pebs_base + (pebs_rec_num + 1) * pebs_record_size;
+    DTS_BUFFER_EXT_counter_reset0(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset1(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset2(dts)  = 0;
+    DTS_BUFFER_EXT_counter_reset3(dts)  = 0;
 
     pebs_dispatch->initialize_threshold(dts, pebs_record_size);
 
@@ -463,7 +500,11 @@ PEBS_Overflowed (
  * @return      NONE
  *
  * <I>Special Notes:</I>
- *              reset index to next PEBS record to base of buffer
+ *              reset index to next PEBS record to base of buffer.
+ *              When several records are buffered per PMI, the hardware
+ *              reloads a precise counter from the DS area after each record
+ *              it writes, so the reload values of the current group are
+ *              also programmed here.  Must be called on this_cpu.
  */
 extern VOID
 PEBS_Reset_Index (
@@ -471,10 +512,30 @@ PEBS_Reset_Index (
 )
 {
     DTS_BUFFER_EXT   dtes = CPU_STATE_dts_buffer(&pcb[this_cpu]);
+    U64             *counter_reset;
+    U32              index;
 
     if (dtes) {
         SEP_PRINT_DEBUG("PEBS Reset Index: %d\n", this_cpu);
         DTS_BUFFER_EXT_pebs_index(dtes) = DTS_BUFFER_EXT_pebs_base(dtes);
+        if (pebs_rec_num > 1) {
+            // counter_reset0..3 are laid out back to back
+            counter_reset = &DTS_BUFFER_EXT_counter_reset0(dtes);
+            FOR_EACH_DATA_GP_REG(pecb, i) {
+                if (!ECB_entries_precise_get(pecb, i)) {
+                    continue;
+                }
+                if (ECB_entries_reg_id(pecb, i) >= IA32_FULL_PMC0) {
+                    index = ECB_entries_reg_id(pecb, i) - IA32_FULL_PMC0;
+                }
+                else {
+                    index = ECB_entries_reg_id(pecb, i) - IA32_PMC0;
+                }
+                if (index < PEBS_NUM_COUNTER_RESETS) {
+                    counter_reset[index] = ECB_entries_reg_value(pecb, i);
+                }
+            } END_FOR_EACH_DATA_GP_REG;
+        }
     }
 
     return;
@@ -482,12 +543,60 @@ PEBS_Reset_Index (
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID PEBS_Modify_IP (sample, is_64bit_addr)
+ * @fn          S32 PEBS_Find_Record (this_cpu, start, ovf_index)
+ *
+ * @brief       Find the next buffered PEBS record that belongs to an event
+ *
+ * @param       this_cpu  -- the current cpu
+ *              start     -- first record index to look at
+ *              ovf_index -- bit of the event in IA32_PERF_GLOBAL_STATUS
+ *
+ * @return      index of the record, -1 if there is none
+ *
+ * <I>Special Notes:</I>
+ *              With a single record per PMI the record at the base of the
+ *              buffer is always used, as before.  Otherwise a record belongs
+ *              to every event whose bit is set in its overflow field.
+ */
+extern S32
+PEBS_Find_Record (
+    S32    this_cpu,
+    U32    start,
+    U32    ovf_index
+)
+{
+    DTS_BUFFER_EXT   dtes = CPU_STATE_dts_buffer(&pcb[this_cpu]);
+    PEBS_REC_EXT     pebs_rec;
+    U32              rec_idx;
+
+    if (!dtes) {
+        return -1;
+    }
+    if (pebs_rec_num == 1) {
+        return (start == 0 && pebs_Get_Record(dtes, 0)) ? 0 : -1;
+    }
+    for (rec_idx = start; rec_idx < pebs_rec_num; rec_idx++) {
+        pebs_rec = (PEBS_REC_EXT)pebs_Get_Record(dtes, rec_idx);
+        if (!pebs_rec) {
+            break;
+        }
+        if (PEBS_REC_EXT_glob_perf_overflow(pebs_rec) & ((U64)1 << ovf_index)) {
+            return (S32)rec_idx;
+        }
+    }
+
+    return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID PEBS_Modify_IP (sample, is_64bit_addr, rec_idx)
  *
  * @brief       Change the IP field in the sample to that in the PEBS record
  *
  * @param       sample        - sample buffer
  * @param       is_64bit_addr - are we in a 64 bit module
+ * @param       rec_idx       - record to use, see PEBS_Find_Record
  *
  * @return      NONE
  *
@@ -497,22 +606,28 @@ PEBS_Reset_Index (
 extern VOID
 PEBS_Modify_IP (
     void        *sample,
-    DRV_BOOL     is_64bit_addr
+    DRV_BOOL     is_64bit_addr,
+    U32          rec_idx
 )
 {
-    pebs_dispatch->modify_ip(sample, is_64bit_addr);
+    DTS_BUFFER_EXT   dtes  = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
+
+    if (dtes) {
+        pebs_dispatch->modify_ip(sample, is_64bit_addr, pebs_Get_Record(dtes, rec_idx));
+    }
     return;
 }
 
 
 /* ------------------------------------------------------------------------- */
 /*!
- * @fn          VOID PEBS_Fill_Buffer (S8 *buffer, EVENT_CONFIG ec)
+ * @fn          VOID PEBS_Fill_Buffer (S8 *buffer, EVENT_CONFIG ec, rec_idx)
  *
  * @brief       Fill the buffer with the pebs data
  *
  * @param       buffer  -  area to write the data into
  *              ec      -  current event config
+ *              rec_idx -  record to use, see PEBS_Find_Record
  *
  * @return      NONE
  *
@@ -523,7 +638,8 @@ extern VOID
 PEBS_Fill_Buffer (
     S8           *buffer,
     EVENT_DESC    evt_desc,
-    DRV_BOOL      virt_phys_translation_ena
+    DRV_BOOL      virt_phys_translation_ena,
+    U32           rec_idx
 )
 {
     DTS_BUFFER_EXT   dtes       = CPU_STATE_dts_buffer(&pcb[CONTROL_THIS_CPU()]);
@@ -531,10 +647,9 @@ PEBS_Fill_Buffer (
     PEBS_REC_EXT1    pebs_base_ext1;
 
     if (dtes) {
-        S8   *pebs_base  = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_base(dtes);
-        S8   *pebs_index = (S8 *)(UIOP)DTS_BUFFER_EXT_pebs_index(dtes);
+        S8   *pebs_base  = pebs_Get_Record(dtes, rec_idx);
         SEP_PRINT_DEBUG("In PEBS Fill Buffer: cpu %d\n", CONTROL_THIS_CPU());
-        if (pebs_base != pebs_index){
+        if (pebs_base) {
             if (EVENT_DESC_pebs_offset(evt_desc)) {
                 SEP_PRINT_DEBUG("PEBS buffer has data available\n");
                 memcpy(buffer + EVENT_DESC_pebs_offset(evt_desc),
@@ -583,6 +698,7 @@ PEBS_Initialize (
 )
 {
     U32 pebs_record_size =0;
+    U32 max_records      =1;
 
     if (DRV_CONFIG_pebs_mode(pcfg)) {
         switch (DRV_CONFIG_pebs_mode(pcfg)) {
@@ -595,6 +711,7 @@ PEBS_Initialize (
                 SEP_PRINT_DEBUG("Set up the Nehalem dispatch\n");
                 pebs_dispatch = &corei7_pebs;
                 pebs_record_size = sizeof(PEBS_REC_EXT_NODE);
+                max_records = PEBS_MAX_RECORDS;
                 break;
             case 3:
                 SEP_PRINT_DEBUG("Set up the Core2 (PNR) dispatch table\n");
@@ -605,12 +722,32 @@ PEBS_Initialize (
                 SEP_PRINT_DEBUG("Set up the Haswell dispatch table\n");
                 pebs_dispatch = &haswell_pebs;
                 pebs_record_size = sizeof(PEBS_REC_EXT1_NODE);
+                max_records = PEBS_MAX_RECORDS;
                 break;                
             default:
                 SEP_PRINT_DEBUG("Unknown PEBS type. Will not collect PEBS information\n");
                 break;
         }
         if (pebs_dispatch) {
+            /*
+             * Core2 records carry no overflow field, so they cannot be
+             * matched to events once more than one is buffered.
+             * Buffered records are attributed to the task current at the
+             * PMI, which may not be the one that took them, so buffering
+             * is refused for collections attached to a process.
+             */
+            pebs_rec_size = pebs_record_size;
+            pebs_rec_num  = 1;
+            if (DRV_CONFIG_pebs_record_num(pcfg) > 1 && DRV_CONFIG_target_pid(pcfg) > 0) {
+                SEP_PRINT_WARNING("PEBS record buffering needs a system-wide collection, using one record per PMI\n");
+            }
+            else if (DRV_CONFIG_pebs_record_num(pcfg) > 1) {
+                pebs_rec_num = DRV_CONFIG_pebs_record_num(pcfg);
+                if (pebs_rec_num > max_records) {
+                    pebs_rec_num = max_records;
+                }
+            }
+            SEP_PRINT_DEBUG("PEBS records per PMI: %d\n", pebs_rec_num);
             pebs_global_memory_size = GLOBAL_STATE_num_cpus(driver_state) * PER_CORE_BUFFER_SIZE(pebs_record_size);
             pebs_global_memory = (PVOID)CONTROL_Allocate_KMemory(pebs_global_memory_size);
             CONTROL_Invoke_Parallel(pebs_Allocate_Buffers, (VOID *)&pebs_record_size);
@@ -642,6 +779,7 @@ PEBS_Destroy (
         CONTROL_Invoke_Parallel(pebs_Deallocate_Buffers, (VOID *)(size_t)0);
         pebs_global_memory = CONTROL_Free_Memory(pebs_global_memory);
         pebs_global_memory_size = 0;
+        pebs_rec_num = 1;
     }
 
     return;
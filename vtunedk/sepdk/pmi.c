@@ -46,6 +46,7 @@
 #include "control.h"
 #include "pmi.h"
 #include "utility.h"
+#include "unc_sampler.h"
 #if defined(DRV_IA32) || defined(DRV_EM64T)
 #include "pebs.h"
 #endif
@@ -66,6 +67,219 @@ extern uid_t          uid;
  * Global Variables / State
  *********************************************************************/
 
+#if defined(DRV_IA32) || defined(DRV_EM64T)
+
+#define COMPACT_ZIGZAG(d)         ((((U64)(d)) << 1) ^ (U64)(((S64)(d)) >> 63))
+#define COMPACT_MAX_HEADER_SIZE   (COMPACT_SAMPLE_FIXED_SIZE + 7*10)
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static U32 pmi_Put_Varint(U8 *out, U64 val)
+ *
+ * @param       out - where to write the encoded value
+ * @param       val - value to encode
+ *
+ * @return      number of bytes written (at most 10)
+ *
+ * @brief       Little-endian base 128 encoding used by compact sample records
+ */
+static U32
+pmi_Put_Varint (
+    U8   *out,
+    U64   val
+)
+{
+    U32   len = 0;
+
+    while (val >= 0x80) {
+        out[len++] = (U8)(val | 0x80);
+        val      >>= 7;
+    }
+    out[len++] = (U8)val;
+
+    return len;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static VOID pmi_Compact_Sample(CPU_STATE pcpu, BUFFER_DESC bd,
+ *                                             SampleRecordPC *psamp, U32 sample_size)
+ *
+ * @param       pcpu        - per-cpu state holding the delta base
+ * @param       bd          - buffer psamp was reserved from
+ * @param       psamp       - fully populated legacy sample
+ * @param       sample_size - size reserved for psamp
+ *
+ * @return      none
+ *
+ * @brief       Rewrite psamp in place as a CompactSampleRecord (see
+ *              lwpmudrv_struct.h) and give the saved bytes back to bd.
+ *
+ * <I>Special Notes:</I>
+ *              psamp must be the last reservation made on bd.  The sample
+ *              is left untouched if compaction would not make it smaller.
+ */
+static VOID
+pmi_Compact_Sample (
+    CPU_STATE        pcpu,
+    BUFFER_DESC      bd,
+    SampleRecordPC  *psamp,
+    U32              sample_size
+)
+{
+    U8      hdr[COMPACT_MAX_HEADER_SIZE];
+    U32     len     = COMPACT_SAMPLE_FIXED_SIZE;
+    U32     payload = sample_size - sizeof(SampleRecordPC);
+    U8      flags   = 0;
+    OUTPUT  outbuf  = &BUFFER_DESC_outbuf(bd);
+    U32     seg     = OUTPUT_head(outbuf) + 1;
+    // the u1 union is encoded as two raw words whatever the addressing mode
+    U64     ip      = SAMPLE_RECORD_iip(psamp);
+    U64     psr     = SAMPLE_RECORD_ipsr(psamp);
+    U32     cs      = SAMPLE_RECORD_cs(psamp) | ((U32)SAMPLE_RECORD_cpu_and_os(psamp) << 16);
+    U32     bits    = SAMPLE_RECORD_bit_fields2(psamp);
+    U64     last_tsc, last_ip, last_psr;
+    U32     last_pid, last_tid, last_cs, last_bits;
+
+    if (SAMPLE_RECORD_descriptor_id(psamp) >= COMPACT_SAMPLE_MARKER) {
+        return;
+    }
+
+    // first compact record of a segment: restart the delta chain and say so
+    if (CPU_STATE_last_seg(pcpu) != seg) {
+        flags    |= COMPACT_SAMPLE_SEGMENT_START;
+        last_tsc  = last_ip  = last_psr = 0;
+        last_pid  = last_tid = last_cs  = last_bits = 0;
+    }
+    else {
+        last_tsc  = CPU_STATE_last_tsc(pcpu);
+        last_ip   = CPU_STATE_last_ip(pcpu);
+        last_psr  = CPU_STATE_last_psr(pcpu);
+        last_pid  = CPU_STATE_last_pid(pcpu);
+        last_tid  = CPU_STATE_last_tid(pcpu);
+        last_cs   = CPU_STATE_last_cs(pcpu);
+        last_bits = CPU_STATE_last_bits(pcpu);
+    }
+
+    len += pmi_Put_Varint(&hdr[len], COMPACT_ZIGZAG(SAMPLE_RECORD_tsc(psamp) - last_tsc));
+    len += pmi_Put_Varint(&hdr[len], COMPACT_ZIGZAG(ip - last_ip));
+    len += pmi_Put_Varint(&hdr[len], COMPACT_ZIGZAG((S32)(SAMPLE_RECORD_pid_rec_index(psamp) - last_pid)));
+    len += pmi_Put_Varint(&hdr[len], COMPACT_ZIGZAG((S32)(SAMPLE_RECORD_tid(psamp) - last_tid)));
+    if (psr != last_psr) {
+        flags |= COMPACT_SAMPLE_HAS_PSR;
+        len   += pmi_Put_Varint(&hdr[len], psr);
+    }
+    if (cs != last_cs) {
+        flags |= COMPACT_SAMPLE_HAS_CS;
+        len   += pmi_Put_Varint(&hdr[len], cs);
+    }
+    if (bits != last_bits) {
+        flags |= COMPACT_SAMPLE_HAS_BITS;
+        len   += pmi_Put_Varint(&hdr[len], bits);
+    }
+
+    if (len >= sizeof(SampleRecordPC) || len + payload > 0xFFFF) {
+        return;
+    }
+
+    *(U16 *)&hdr[0] = (U16)(COMPACT_SAMPLE_MARKER | SAMPLE_RECORD_descriptor_id(psamp));
+    *(U16 *)&hdr[2] = (U16)(len + payload);
+    hdr[4]          = flags;
+
+    CPU_STATE_last_tsc(pcpu)  = SAMPLE_RECORD_tsc(psamp);
+    CPU_STATE_last_ip(pcpu)   = ip;
+    CPU_STATE_last_psr(pcpu)  = psr;
+    CPU_STATE_last_pid(pcpu)  = SAMPLE_RECORD_pid_rec_index(psamp);
+    CPU_STATE_last_tid(pcpu)  = SAMPLE_RECORD_tid(psamp);
+    CPU_STATE_last_cs(pcpu)   = cs;
+    CPU_STATE_last_bits(pcpu) = bits;
+    CPU_STATE_last_seg(pcpu)  = seg;
+
+    // payload moves down, header overwrites what is left of the legacy header
+    memmove((U8 *)psamp + len, (U8 *)psamp + sizeof(SampleRecordPC), payload);
+    memcpy(psamp, hdr, len);
+
+    OUTPUT_Release_Buffer_Space(bd, sizeof(SampleRecordPC) - len);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static U32 pmi_Uncore_Tsc_Slot(DRV_CONFIG pcfg_unc, U32 dev_idx, U32 sample_size)
+ *
+ * @param       pcfg_unc    - configuration of the uncore device
+ * @param       dev_idx     - uncore device
+ * @param       sample_size - size of the sample record
+ *
+ * @return      index of the snapshot TSC in the device's results, 0 if there is none
+ *
+ * @brief       Find where the TSC of the uncore counts goes, if the collector made room
+ *
+ * <I>Special Notes</I>
+ *              The TSC follows the group id and the counts.  It is only written
+ *              when the package leaders sample the uncore and the collector
+ *              reserved results_size bytes that hold it inside the record.
+ */
+static U32
+pmi_Uncore_Tsc_Slot (
+    DRV_CONFIG  pcfg_unc,
+    U32         dev_idx,
+    U32         sample_size
+)
+{
+    U32  slot = (U32)LWPMU_DEVICE_num_events(&devices[dev_idx]) + 1;
+
+    if (!DRV_CONFIG_unc_sample_us(pcfg)                                                   ||
+        DRV_CONFIG_results_size(pcfg_unc) < (slot + 1) * sizeof(U64)                      ||
+        DRV_CONFIG_results_offset(pcfg_unc) + DRV_CONFIG_results_size(pcfg_unc) > sample_size) {
+        return 0;
+    }
+
+    return slot;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          static VOID pmi_Accumulate_Uncore(U64 *result, U64 *prev, U64 *acc,
+ *                                                U64 mask, U32 num_events)
+ *
+ * @param       result     - counts read into the sample, replaced by the accumulated values
+ * @param       prev       - counts read at the previous sample of this cpu
+ * @param       acc        - accumulators of this cpu
+ * @param       mask       - counter width mask of the device
+ * @param       num_events - number of events, element 0 (group id) is skipped
+ *
+ * @return      None
+ *
+ * @brief       Turn free running uncore counts into per-thread accumulated counts
+ *
+ * <I>Special Notes</I>
+ *              The delta is taken modulo the counter width, so a wraparound
+ *              needs no branch. All three arrays are contiguous for the cpu.
+ */
+static VOID
+pmi_Accumulate_Uncore (
+    U64  *result,
+    U64  *prev,
+    U64  *acc,
+    U64   mask,
+    U32   num_events
+)
+{
+    U32  i;
+    U64  cur;
+
+    for (i = 1; i <= num_events; i++) {
+        cur       = result[i];
+        acc[i]   += (cur - prev[i]) & mask;
+        prev[i]   = cur;
+        result[i] = acc[i];
+    }
+}
+
+#endif
+
 /*********************************************************************
  * Interrupt Handler
  *********************************************************************/
@@ -107,11 +321,12 @@ PMI_Interrupt_Handler (
 #endif
     U32              accept_interrupt = 1;
     U32              dev_idx;
-    U32              event_idx;
     DRV_CONFIG       pcfg_unc;
     DISPATCH         dispatch_unc;
     U64             *result_buffer;
-    U64              diff;
+    U64              unc_tsc;
+    U32              tsc_slot;
+    S32              pebs_rec;
 
     this_cpu = CONTROL_THIS_CPU();
     pcpu     = &pcb[this_cpu];
@@ -142,113 +357,134 @@ PMI_Interrupt_Handler (
             for (i = 0; i < event_mask.masks_num; i++) {
                 desc_id  = COMPUTE_DESC_ID(DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
                 evt_desc = desc_data[desc_id];
-                psamp = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
-                                                 EVENT_DESC_sample_size(evt_desc));
-
-                if (!psamp) {
-                    continue;
+                /*
+                 * With several PEBS records buffered per PMI, a precise
+                 * event gets one sample per record it owns.  Everything but
+                 * the PEBS derived fields is taken at PMI time.
+                 */
+                pebs_rec = -1;
+                if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i])) {
+                    pebs_rec = PEBS_Find_Record(this_cpu, 0, DRV_EVENT_MASK_ovf_index(&event_mask.eventmasks[i]));
                 }
-                CPU_STATE_num_samples(pcpu)           += 1;
-                SAMPLE_RECORD_descriptor_id(psamp)     = desc_id;
-                SAMPLE_RECORD_tsc(psamp)               = tsc;
-                SAMPLE_RECORD_pid_rec_index_raw(psamp) = 1;
-                SAMPLE_RECORD_pid_rec_index(psamp)     = pid;
-                SAMPLE_RECORD_tid(psamp)               = tid;
-                SAMPLE_RECORD_eip(psamp)               = REGS_eip(regs);
-                SAMPLE_RECORD_eflags(psamp)            = REGS_eflags(regs);
-                SAMPLE_RECORD_cpu_num(psamp)           = (U16) this_cpu;
-                SAMPLE_RECORD_cs(psamp)                = (U16) REGS_xcs(regs);
+                do {
+                    psamp = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
+                                                     EVENT_DESC_sample_size(evt_desc));
 
-                if (SAMPLE_RECORD_eflags(psamp) & EFLAGS_V86_MASK) {
-                    csdlo = 0;
-                    csdhi = 0;
-                }
-                else {
-                    seg_cs = SAMPLE_RECORD_cs(psamp);
-                    SYS_Get_CSD(seg_cs, &csdlo, &csdhi);
-                }
-                SAMPLE_RECORD_csd(psamp).u1.lowWord  = csdlo;
-                SAMPLE_RECORD_csd(psamp).u2.highWord = csdhi;
+                    if (!psamp) {
+                        break;
+                    }
 
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_pid_rec_index(psamp)  %x\n", SAMPLE_RECORD_pid_rec_index(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_tid(psamp) %x\n", SAMPLE_RECORD_tid(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_eip(psamp) %x\n", SAMPLE_RECORD_eip(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_eflags(psamp) %x\n", SAMPLE_RECORD_eflags(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_cpu_num(psamp) %x\n", SAMPLE_RECORD_cpu_num(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_cs(psamp) %x\n", SAMPLE_RECORD_cs(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).lowWord %x\n", SAMPLE_RECORD_csd(psamp).u1.lowWord);
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).highWord %x\n", SAMPLE_RECORD_csd(psamp).u2.highWord);
-
-                SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
-                if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i]) == 1) {
-                    if (EVENT_DESC_pebs_offset(evt_desc) ||
-                        EVENT_DESC_latency_offset_in_sample(evt_desc)) {
-                        PEBS_Fill_Buffer((S8 *)psamp,
-                                     evt_desc,
-                                     DRV_CONFIG_virt_phys_translation(pcfg));
+                    /*
+                     * The header is written field by field below.  Only the payload
+                     * is cleared: the PEBS, LBR and counter readers write at fixed
+                     * offsets inside it and may leave gaps.
+                     */
+                    memset(psamp + 1, 0, EVENT_DESC_sample_size(evt_desc) - sizeof(SampleRecordPC));
+
+                    CPU_STATE_num_samples(pcpu)           += 1;
+                    /* Init bitfields. */
+                    SAMPLE_RECORD_cpu_and_os(psamp)        = 0;
+                    SAMPLE_RECORD_bit_fields2(psamp)       = 0;
+                    SAMPLE_RECORD_descriptor_id(psamp)     = desc_id;
+                    SAMPLE_RECORD_tsc(psamp)               = tsc;
+                    SAMPLE_RECORD_pid_rec_index_raw(psamp) = 1;
+                    SAMPLE_RECORD_pid_rec_index(psamp)     = pid;
+                    SAMPLE_RECORD_tid(psamp)               = tid;
+                    SAMPLE_RECORD_eip(psamp)               = REGS_eip(regs);
+                    SAMPLE_RECORD_eflags(psamp)            = REGS_eflags(regs);
+                    SAMPLE_RECORD_cpu_num(psamp)           = (U16) this_cpu;
+                    SAMPLE_RECORD_cs(psamp)                = (U16) REGS_xcs(regs);
+
+                    if (SAMPLE_RECORD_eflags(psamp) & EFLAGS_V86_MASK) {
+                        csdlo = 0;
+                        csdhi = 0;
+                    }
+                    else {
+                        seg_cs = SAMPLE_RECORD_cs(psamp);
+                        SYS_Get_CSD(seg_cs, &csdlo, &csdhi);
+                    }
+                    SAMPLE_RECORD_csd(psamp).u1.lowWord  = csdlo;
+                    SAMPLE_RECORD_csd(psamp).u2.highWord = csdhi;
+
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_pid_rec_index(psamp)  %x\n", SAMPLE_RECORD_pid_rec_index(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_tid(psamp) %x\n", SAMPLE_RECORD_tid(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_eip(psamp) %x\n", SAMPLE_RECORD_eip(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_eflags(psamp) %x\n", SAMPLE_RECORD_eflags(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_cpu_num(psamp) %x\n", SAMPLE_RECORD_cpu_num(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_cs(psamp) %x\n", SAMPLE_RECORD_cs(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).lowWord %x\n", SAMPLE_RECORD_csd(psamp).u1.lowWord);
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).highWord %x\n", SAMPLE_RECORD_csd(psamp).u2.highWord);
+
+                    SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
+                    if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i]) && pebs_rec >= 0) {
+                        if (EVENT_DESC_pebs_offset(evt_desc) ||
+                            EVENT_DESC_latency_offset_in_sample(evt_desc)) {
+                            PEBS_Fill_Buffer((S8 *)psamp,
+                                         evt_desc,
+                                         DRV_CONFIG_virt_phys_translation(pcfg),
+                                         (U32)pebs_rec);
+                        }
+                        PEBS_Modify_IP((S8 *)psamp, FALSE, (U32)pebs_rec);
+                    }
+                    if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
+                        dispatch->read_lbrs(((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
+                    }
+                    if (DRV_CONFIG_power_capture(pcfg)) {
+                        dispatch->read_power(((S8 *)(psamp)+EVENT_DESC_power_offset_in_sample(evt_desc)));
                     }
-                    PEBS_Modify_IP((S8 *)psamp, FALSE);
-                }
-                if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
-                    dispatch->read_lbrs(((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
-                }
-                if (DRV_CONFIG_power_capture(pcfg)) {
-                    dispatch->read_power(((S8 *)(psamp)+EVENT_DESC_power_offset_in_sample(evt_desc)));
-                }
 #if defined(BUILD_CHIPSET)
-                if (DRV_CONFIG_enable_chipset(pcfg)) {
-                    cs_dispatch->read_counters(((S8 *)(psamp)+DRV_CONFIG_chipset_offset(pcfg)));
-                }
+                    if (DRV_CONFIG_enable_chipset(pcfg)) {
+                        cs_dispatch->read_counters(((S8 *)(psamp)+DRV_CONFIG_chipset_offset(pcfg)));
+                    }
 #endif
-                if (DRV_CONFIG_event_based_counts(pcfg)) {
-                    dispatch->read_counts(((S8 *)(psamp)+EVENT_DESC_ebc_offset(evt_desc)), DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
-                }
-                // need to do this per device
-                for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
-                    pcfg_unc = LWPMU_DEVICE_pcfg(&devices[dev_idx]);
-                    dispatch_unc = LWPMU_DEVICE_dispatch(&devices[dev_idx]);
-                    if (pcfg_unc && DRV_CONFIG_event_based_counts(pcfg_unc)) {
-                        dispatch_unc->read_counts(((S8 *)(psamp)+DRV_CONFIG_results_offset(pcfg_unc)), dev_idx);
-                        SAMPLE_RECORD_uncore_valid(psamp) = 1;
-
-                        // skip first element because it's the group number
-                        result_buffer = (U64*) ((S8*)(psamp) + DRV_CONFIG_results_offset(pcfg_unc));
-                        for (event_idx = 1;
-                             event_idx < LWPMU_DEVICE_num_events(&devices[dev_idx]) + 1; // need to account for 1st element being group id
-                             event_idx++) {
-
-                            // check for overflow
-                            if (result_buffer[event_idx] < LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx]) {
-                                // overflow occurred!  need to compensate
-                                diff  = LWPMU_DEVICE_counter_mask(&devices[dev_idx])
-                                      - LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx];
-                                diff += result_buffer[event_idx];
+                    if (DRV_CONFIG_event_based_counts(pcfg)) {
+                        dispatch->read_counts(((S8 *)(psamp)+EVENT_DESC_ebc_offset(evt_desc)), DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
+                    }
+                    // need to do this per device
+                    for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
+                        pcfg_unc = LWPMU_DEVICE_pcfg(&devices[dev_idx]);
+                        dispatch_unc = LWPMU_DEVICE_dispatch(&devices[dev_idx]);
+                        if (pcfg_unc && DRV_CONFIG_event_based_counts(pcfg_unc)) {
+                            // the package leader's latest snapshot, if it samples the uncore
+                            result_buffer = (U64*) ((S8*)(psamp) + DRV_CONFIG_results_offset(pcfg_unc));
+                            if (!UNC_SAMPLER_Read(this_cpu, dev_idx, result_buffer, &unc_tsc)) {
+                                dispatch_unc->read_counts(result_buffer, dev_idx);
+                                unc_tsc = tsc;
                             }
-                            else {
-                                diff = result_buffer[event_idx] - LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx];
+                            // the snapshot may be up to unc_sample_us older than the sample
+                            if ((tsc_slot = pmi_Uncore_Tsc_Slot(pcfg_unc, dev_idx, EVENT_DESC_sample_size(evt_desc)))) {
+                                result_buffer[tsc_slot] = unc_tsc;
                             }
-                            // accumulate current results into accumulator
-                            LWPMU_DEVICE_acc_per_thread(&devices[dev_idx])[this_cpu][event_idx] += diff;                            
-                            // update previous results array
-                            LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx] = result_buffer[event_idx];
-                            // update results buffer for this thread
-                            result_buffer[event_idx] = LWPMU_DEVICE_acc_per_thread(&devices[dev_idx])[this_cpu][event_idx];
+                            SAMPLE_RECORD_uncore_valid(psamp) = 1;
+
+                            // skip first element because it's the group number
+                            pmi_Accumulate_Uncore(result_buffer,
+                                                  LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx], this_cpu),
+                                                  LWPMU_DEVICE_acc_per_thread(&devices[dev_idx], this_cpu),
+                                                  LWPMU_DEVICE_counter_mask(&devices[dev_idx]) ? LWPMU_DEVICE_counter_mask(&devices[dev_idx]) : ~0ULL,
+                                                  (U32)LWPMU_DEVICE_num_events(&devices[dev_idx]));
                         }
                     }
-                }
+                    if (DRV_CONFIG_compact_samples(pcfg)) {
+                        pmi_Compact_Sample(pcpu, bd, psamp, EVENT_DESC_sample_size(evt_desc));
+                    }
+                    if (pebs_rec >= 0) {
+                        pebs_rec = PEBS_Find_Record(this_cpu, (U32)pebs_rec + 1, DRV_EVENT_MASK_ovf_index(&event_mask.eventmasks[i]));
+                    }
+                } while (pebs_rec >= 0);
             } // for
         }
     } 
-    if (DRV_CONFIG_pebs_mode(pcfg)) {
-        PEBS_Reset_Index(this_cpu);
-    }
-
     APIC_Ack_Eoi();
 
     // Reset the data counters
     if (CPU_STATE_trigger_count(&pcb[this_cpu]) == 0) {
         dispatch->swap_group(FALSE);
     }
+    // after the swap so that PEBS reload values match the new group
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
+    }
     // Re-enable the counter control
     dispatch->restart(NULL);
     atomic_set(&CPU_STATE_in_interrupt(&pcb[this_cpu]), 0);
@@ -338,9 +574,10 @@ PMI_Interrupt_Handler (
     DRV_CONFIG       pcfg_unc;
     DISPATCH         dispatch_unc;
     U32              dev_idx;
-    U32              event_idx;
     U64             *result_buffer;
-    U64              diff;
+    U64              unc_tsc;
+    U32              tsc_slot;
+    S32              pebs_rec;
 
     // Disable the counter control
     dispatch->freeze(NULL);
@@ -369,116 +606,137 @@ PMI_Interrupt_Handler (
             for (i = 0; i < event_mask.masks_num; i++) {
                 desc_id  = COMPUTE_DESC_ID(DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
                 evt_desc = desc_data[desc_id];
-                psamp = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
-                                            EVENT_DESC_sample_size(evt_desc));
-                if (!psamp) {
-                    continue;
+                /*
+                 * With several PEBS records buffered per PMI, a precise
+                 * event gets one sample per record it owns.  Everything but
+                 * the PEBS derived fields is taken at PMI time.
+                 */
+                pebs_rec = -1;
+                if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i])) {
+                    pebs_rec = PEBS_Find_Record(this_cpu, 0, DRV_EVENT_MASK_ovf_index(&event_mask.eventmasks[i]));
                 }
-                CPU_STATE_num_samples(pcpu)           += 1;
-                SAMPLE_RECORD_descriptor_id(psamp)     = desc_id;
-                SAMPLE_RECORD_tsc(psamp)               = tsc;
-                SAMPLE_RECORD_pid_rec_index_raw(psamp) = 1;
-                SAMPLE_RECORD_pid_rec_index(psamp)     = pid;
-                SAMPLE_RECORD_tid(psamp)               = tid;
-                SAMPLE_RECORD_cpu_num(psamp)           = (U16) this_cpu;
-                SAMPLE_RECORD_cs(psamp)                = (U16) REGS_cs(regs);
+                do {
+                    psamp = (SampleRecordPC *)OUTPUT_Reserve_Buffer_Space(bd,
+                                                EVENT_DESC_sample_size(evt_desc));
+                    if (!psamp) {
+                        break;
+                    }
 
-                pmi_Get_CSD(SAMPLE_RECORD_cs(psamp),
-                        &SAMPLE_RECORD_csd(psamp).u1.lowWord,
-                        &SAMPLE_RECORD_csd(psamp).u2.highWord);
+                    /*
+                     * The header is written field by field below.  Only the payload
+                     * is cleared: the PEBS, LBR and counter readers write at fixed
+                     * offsets inside it and may leave gaps.
+                     */
+                    memset(psamp + 1, 0, EVENT_DESC_sample_size(evt_desc) - sizeof(SampleRecordPC));
+
+                    CPU_STATE_num_samples(pcpu)           += 1;
+                    /* Init bitfields. */
+                    SAMPLE_RECORD_cpu_and_os(psamp)        = 0;
+                    SAMPLE_RECORD_bit_fields2(psamp)       = 0;
+                    SAMPLE_RECORD_descriptor_id(psamp)     = desc_id;
+                    SAMPLE_RECORD_tsc(psamp)               = tsc;
+                    SAMPLE_RECORD_pid_rec_index_raw(psamp) = 1;
+                    SAMPLE_RECORD_pid_rec_index(psamp)     = pid;
+                    SAMPLE_RECORD_tid(psamp)               = tid;
+                    SAMPLE_RECORD_cpu_num(psamp)           = (U16) this_cpu;
+                    SAMPLE_RECORD_cs(psamp)                = (U16) REGS_cs(regs);
+
+                    pmi_Get_CSD(SAMPLE_RECORD_cs(psamp),
+                            &SAMPLE_RECORD_csd(psamp).u1.lowWord,
+                            &SAMPLE_RECORD_csd(psamp).u2.highWord);
+
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_pid_rec_index(psamp)  %x\n", SAMPLE_RECORD_pid_rec_index(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_tid(psamp) %x\n", SAMPLE_RECORD_tid(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_cpu_num(psamp) %x\n", SAMPLE_RECORD_cpu_num(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_cs(psamp) %x\n", SAMPLE_RECORD_cs(psamp));
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).lowWord %x\n", SAMPLE_RECORD_csd(psamp).u1.lowWord);
+                    SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).highWord %x\n", SAMPLE_RECORD_csd(psamp).u2.highWord);
 
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_pid_rec_index(psamp)  %x\n", SAMPLE_RECORD_pid_rec_index(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_tid(psamp) %x\n", SAMPLE_RECORD_tid(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_cpu_num(psamp) %x\n", SAMPLE_RECORD_cpu_num(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_cs(psamp) %x\n", SAMPLE_RECORD_cs(psamp));
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).lowWord %x\n", SAMPLE_RECORD_csd(psamp).u1.lowWord);
-                SEP_PRINT_DEBUG("SAMPLE_RECORD_csd(psamp).highWord %x\n", SAMPLE_RECORD_csd(psamp).u2.highWord);
-
-                is_64bit_addr = (SAMPLE_RECORD_csd(psamp).u2.s2.reserved_0 == 1);
-                if (is_64bit_addr) {
-                    SAMPLE_RECORD_iip(psamp)           = REGS_rip(regs);
-                    SAMPLE_RECORD_ipsr(psamp)          = (REGS_eflags(regs) & 0xffffffff) |
-                        (((U64) SAMPLE_RECORD_csd(psamp).u2.s2.dpl) << 32);
-                    SAMPLE_RECORD_ia64_pc(psamp)       = TRUE;
-                }
-                else {
-                    SAMPLE_RECORD_eip(psamp)           = REGS_rip(regs);
-                    SAMPLE_RECORD_eflags(psamp)        = REGS_eflags(regs);
-                    SAMPLE_RECORD_ia64_pc(psamp)       = FALSE;
+                    is_64bit_addr = (SAMPLE_RECORD_csd(psamp).u2.s2.reserved_0 == 1);
+                    if (is_64bit_addr) {
+                        SAMPLE_RECORD_iip(psamp)           = REGS_rip(regs);
+                        SAMPLE_RECORD_ipsr(psamp)          = (REGS_eflags(regs) & 0xffffffff) |
+                            (((U64) SAMPLE_RECORD_csd(psamp).u2.s2.dpl) << 32);
+                        SAMPLE_RECORD_ia64_pc(psamp)       = TRUE;
+                    }
+                    else {
+                        SAMPLE_RECORD_eip(psamp)           = REGS_rip(regs);
+                        SAMPLE_RECORD_eflags(psamp)        = REGS_eflags(regs);
+                        SAMPLE_RECORD_ia64_pc(psamp)       = FALSE;
 
-                    SEP_PRINT_DEBUG("SAMPLE_RECORD_eip(psamp) %x\n", SAMPLE_RECORD_eip(psamp));
-                    SEP_PRINT_DEBUG("SAMPLE_RECORD_eflags(psamp) %x\n", SAMPLE_RECORD_eflags(psamp));
-                }
+                        SEP_PRINT_DEBUG("SAMPLE_RECORD_eip(psamp) %x\n", SAMPLE_RECORD_eip(psamp));
+                        SEP_PRINT_DEBUG("SAMPLE_RECORD_eflags(psamp) %x\n", SAMPLE_RECORD_eflags(psamp));
+                    }
 
-                SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
-                if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i])) {
-                    if ( EVENT_DESC_pebs_offset(evt_desc) ||
-                         EVENT_DESC_latency_offset_in_sample(evt_desc)) {
-                         PEBS_Fill_Buffer((S8 *)psamp,
-                                     evt_desc,
-                                     DRV_CONFIG_virt_phys_translation(pcfg));
+                    SAMPLE_RECORD_event_index(psamp) = DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]);
+                    if (DRV_EVENT_MASK_precise(&event_mask.eventmasks[i]) && pebs_rec >= 0) {
+                        if ( EVENT_DESC_pebs_offset(evt_desc) ||
+                             EVENT_DESC_latency_offset_in_sample(evt_desc)) {
+                             PEBS_Fill_Buffer((S8 *)psamp,
+                                         evt_desc,
+                                         DRV_CONFIG_virt_phys_translation(pcfg),
+                                         (U32)pebs_rec);
+                        }
+                        PEBS_Modify_IP((S8 *)psamp, is_64bit_addr, (U32)pebs_rec);
+                    }
+                    if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
+                        dispatch->read_lbrs(((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
+                    }
+                    if (DRV_CONFIG_power_capture(pcfg)) {
+                        dispatch->read_power(((S8 *)(psamp)+EVENT_DESC_power_offset_in_sample(evt_desc)));
                     }
-                    PEBS_Modify_IP((S8 *)psamp, is_64bit_addr);
-                }
-                if (DRV_CONFIG_collect_lbrs(pcfg) && (DRV_EVENT_MASK_lbr_capture(&event_mask.eventmasks[i]))) {
-                    dispatch->read_lbrs(((S8 *)(psamp)+EVENT_DESC_lbr_offset(evt_desc)));
-                }
-                if (DRV_CONFIG_power_capture(pcfg)) {
-                    dispatch->read_power(((S8 *)(psamp)+EVENT_DESC_power_offset_in_sample(evt_desc)));
-                }
 #if defined(BUILD_CHIPSET)
-                if (DRV_CONFIG_enable_chipset(pcfg)) {
-                    cs_dispatch->read_counters(((S8 *)(psamp)+DRV_CONFIG_chipset_offset(pcfg)));
-                }
+                    if (DRV_CONFIG_enable_chipset(pcfg)) {
+                        cs_dispatch->read_counters(((S8 *)(psamp)+DRV_CONFIG_chipset_offset(pcfg)));
+                    }
 #endif
-                if (DRV_CONFIG_event_based_counts(pcfg)) {
-                    dispatch->read_counts(((S8 *)(psamp)+EVENT_DESC_ebc_offset(evt_desc)), DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
-                }
-                for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
-                    pcfg_unc = LWPMU_DEVICE_pcfg(&devices[dev_idx]);
-                    dispatch_unc = LWPMU_DEVICE_dispatch(&devices[dev_idx]);
-                    if (pcfg_unc && DRV_CONFIG_event_based_counts(pcfg_unc)) {
-                        dispatch_unc->read_counts(((S8 *)(psamp)+DRV_CONFIG_results_offset(pcfg_unc)), dev_idx);
-                        SAMPLE_RECORD_uncore_valid(psamp) = 1;
-
-                        // skip first element because it's the group number
-                        result_buffer = (U64*) ((S8*)(psamp) + DRV_CONFIG_results_offset(pcfg_unc));
-                        for (event_idx = 1;
-                             event_idx < LWPMU_DEVICE_num_events(&devices[dev_idx]) + 1; // need to account for 1st element being group id
-                             event_idx++) {
-
-                            // check for overflow
-                            if (result_buffer[event_idx] < LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx]) {
-                                // overflow occurred!  need to compensate
-                                diff  = LWPMU_DEVICE_counter_mask(&devices[dev_idx])
-                                      - LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx];
-                                diff += result_buffer[event_idx];
+                    if (DRV_CONFIG_event_based_counts(pcfg)) {
+                        dispatch->read_counts(((S8 *)(psamp)+EVENT_DESC_ebc_offset(evt_desc)), DRV_EVENT_MASK_event_idx(&event_mask.eventmasks[i]));
+                    }
+                    for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
+                        pcfg_unc = LWPMU_DEVICE_pcfg(&devices[dev_idx]);
+                        dispatch_unc = LWPMU_DEVICE_dispatch(&devices[dev_idx]);
+                        if (pcfg_unc && DRV_CONFIG_event_based_counts(pcfg_unc)) {
+                            // the package leader's latest snapshot, if it samples the uncore
+                            result_buffer = (U64*) ((S8*)(psamp) + DRV_CONFIG_results_offset(pcfg_unc));
+                            if (!UNC_SAMPLER_Read(this_cpu, dev_idx, result_buffer, &unc_tsc)) {
+                                dispatch_unc->read_counts(result_buffer, dev_idx);
+                                unc_tsc = tsc;
                             }
-                            else {
-                                diff = result_buffer[event_idx] - LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx];
+                            // the snapshot may be up to unc_sample_us older than the sample
+                            if ((tsc_slot = pmi_Uncore_Tsc_Slot(pcfg_unc, dev_idx, EVENT_DESC_sample_size(evt_desc)))) {
+                                result_buffer[tsc_slot] = unc_tsc;
                             }
-                            // accumulate current results into accumulator
-                            LWPMU_DEVICE_acc_per_thread(&devices[dev_idx])[this_cpu][event_idx] += diff;                            
-                            // update previous results array
-                            LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[this_cpu][event_idx] = result_buffer[event_idx];
-                            // update results buffer for this thread
-                            result_buffer[event_idx] = LWPMU_DEVICE_acc_per_thread(&devices[dev_idx])[this_cpu][event_idx];
+                            SAMPLE_RECORD_uncore_valid(psamp) = 1;
+
+                            // skip first element because it's the group number
+                            pmi_Accumulate_Uncore(result_buffer,
+                                                  LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx], this_cpu),
+                                                  LWPMU_DEVICE_acc_per_thread(&devices[dev_idx], this_cpu),
+                                                  LWPMU_DEVICE_counter_mask(&devices[dev_idx]) ? LWPMU_DEVICE_counter_mask(&devices[dev_idx]) : ~0ULL,
+                                                  (U32)LWPMU_DEVICE_num_events(&devices[dev_idx]));
                         }
                     }
-                }
+                    if (DRV_CONFIG_compact_samples(pcfg)) {
+                        pmi_Compact_Sample(pcpu, bd, psamp, EVENT_DESC_sample_size(evt_desc));
+                    }
+                    if (pebs_rec >= 0) {
+                        pebs_rec = PEBS_Find_Record(this_cpu, (U32)pebs_rec + 1, DRV_EVENT_MASK_ovf_index(&event_mask.eventmasks[i]));
+                    }
+                } while (pebs_rec >= 0);
             }
         }
     }
-    if (DRV_CONFIG_pebs_mode(pcfg)) {
-        PEBS_Reset_Index(this_cpu);
-    }
-
     APIC_Ack_Eoi();
 
     // Reset the data counters
     if (CPU_STATE_trigger_count(&pcb[this_cpu]) == 0) {
         dispatch->swap_group(FALSE);
     }
+    // after the swap so that PEBS reload values match the new group
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
+    }
     // Re-enable the counter control
     dispatch->restart(NULL);
     atomic_set(&CPU_STATE_in_interrupt(&pcb[this_cpu]), 0);
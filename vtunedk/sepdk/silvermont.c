@@ -149,6 +149,9 @@ silvermont_Write_PMU (
         }
     }
 #endif
+    if (DRV_CONFIG_pebs_mode(pcfg)) {
+        PEBS_Reset_Index(this_cpu);
+    }
     return;
 }
 
@@ -349,6 +352,7 @@ silvermont_Check_Overflow (
             if (DRV_MASKS_masks_num(masks) < MAX_OVERFLOW_EVENTS) {
                 DRV_EVENT_MASK_bitFields1(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = DRV_EVENT_MASK_bitFields1(&event_flag);
                 DRV_EVENT_MASK_event_idx(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = ECB_entries_event_id_index(pecb, i);
+                DRV_EVENT_MASK_ovf_index(DRV_MASKS_eventmasks(masks) + DRV_MASKS_masks_num(masks)) = (U8)index;
                 DRV_MASKS_masks_num(masks)++;
             } 
             else {
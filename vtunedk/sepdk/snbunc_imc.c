@@ -133,9 +133,9 @@ snbunc_imc_Write_PMU (
             event_id                            = ECB_entries_event_id_index_local(pecb,i);
             tmp_value                           = readl((U32*)((char*)(virtual_address) + offset_delta));
             for ( j = 0; j < (U32)GLOBAL_STATE_num_cpus(driver_state) ; j++) {
-                   LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[j][event_id + 1] = tmp_value; // need to account for group id
+                   LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx], j)[event_id + 1] = tmp_value; // need to account for group id
 #if defined(MYDEBUG)
-                   SEP_PRINT_DEBUG("initial value for i =%d is 0x%x\n",i,LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx])[j][i]);
+                   SEP_PRINT_DEBUG("initial value for i =%d is 0x%x\n",i,LWPMU_DEVICE_prev_val_per_thread(&devices[dev_idx], j)[i]);
 
 #endif
             }
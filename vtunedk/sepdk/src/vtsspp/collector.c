@@ -222,13 +222,79 @@ static void vtss_mmap_all(struct vtss_task_data*, struct task_struct*);
 static void vtss_kmap_all(struct vtss_task_data*);
 
 #ifdef CONFIG_PREEMPT_RT
-static DEFINE_RAW_RWLOCK(vtss_recovery_rwlock);
 static DEFINE_RAW_RWLOCK(vtss_transtort_init_rwlock);
 #else
-static DEFINE_RWLOCK(vtss_recovery_rwlock);
 static DEFINE_RWLOCK(vtss_transport_init_rwlock);
 #endif
-static DEFINE_PER_CPU_SHARED_ALIGNED(struct vtss_task_data*, vtss_recovery_tskd);
+
+/*
+ * Per-CPU recovery slot: the task that is in context on the CPU.
+ * The slot is only set and used by its own CPU (with irqs off);
+ * other CPUs may only clear it with cmpxchg(). 'busy' tells
+ * vtss_recovery_drop() that the owner still dereferences 'tskd'.
+ */
+struct vtss_recovery
+{
+    struct vtss_task_data* tskd;
+    int busy;
+};
+static DEFINE_PER_CPU_SHARED_ALIGNED(struct vtss_recovery, vtss_recovery);
+/* Swap-ins that found the slot still naming another task */
+static atomic_t vtss_recovery_stale = ATOMIC_INIT(0);
+
+/* Owner CPU: pin and return the task in the recovery slot */
+static inline struct vtss_task_data* vtss_recovery_get(int cpu, unsigned long* flags)
+{
+    struct vtss_recovery* rcv = &per_cpu(vtss_recovery, cpu);
+
+    local_irq_save(*flags);
+    rcv->busy = 1;
+    smp_mb(); /* pairs with vtss_recovery_drop() */
+    return ACCESS_ONCE(rcv->tskd);
+}
+
+static inline void vtss_recovery_put(int cpu, unsigned long flags)
+{
+    smp_mb();
+    per_cpu(vtss_recovery, cpu).busy = 0;
+    local_irq_restore(flags);
+}
+
+/*
+ * Owner CPU: 'tskd' is now in context. A task that left without
+ * clearing its slot is replaced (a remote vtss_recovery_drop() of it
+ * then finds nothing to wait for) and counted, so the leak shows up.
+ */
+static inline void vtss_recovery_set(int cpu, struct vtss_task_data* tskd)
+{
+    struct vtss_task_data* old = xchg(&per_cpu(vtss_recovery, cpu).tskd, tskd);
+
+    if (unlikely(old != NULL && old != tskd)) {
+        atomic_inc(&vtss_recovery_stale);
+        TRACE("cpu%d: replaced stale recovery task %p with %p", cpu, old, tskd);
+    }
+}
+
+static inline void vtss_recovery_clear(int cpu, struct vtss_task_data* tskd)
+{
+    cmpxchg(&per_cpu(vtss_recovery, cpu).tskd, tskd, NULL);
+}
+
+/* Any CPU: forget tskd everywhere before it goes away */
+static void vtss_recovery_drop(struct vtss_task_data* tskd)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct vtss_recovery* rcv = &per_cpu(vtss_recovery, cpu);
+
+        if (cmpxchg(&rcv->tskd, tskd, NULL) == tskd) {
+            /* cmpxchg() is a full barrier: the owner either sees NULL or is busy */
+            while (ACCESS_ONCE(rcv->busy))
+                cpu_relax();
+        }
+    }
+}
 
 #if defined(CONFIG_PREEMPT_NOTIFIERS) && defined(VTSS_USE_PREEMPT_NOTIFIERS)
 static void vtss_notifier_sched_in (struct preempt_notifier *notifier, int cpu);
@@ -631,7 +697,6 @@ static void vtss_profiling_resume(vtss_task_map_item_t* item, int bts_resume)
 
 static void vtss_target_dtr(vtss_task_map_item_t* item, void* args)
 {
-    int cpu;
     unsigned long flags;
     struct vtss_task_data* tskd = (struct vtss_task_data*)&item->data;
     TRACE(" (%d:%d): fini='%s'", tskd->tid, tskd->pid, tskd->filename);
@@ -648,12 +713,7 @@ static void vtss_target_dtr(vtss_task_map_item_t* item, void* args)
     }
 #endif
     /* Clear per_cpu recovery data for this tskd */
-    write_lock_irqsave(&vtss_recovery_rwlock, flags);
-    for_each_possible_cpu(cpu) {
-        if (per_cpu(vtss_recovery_tskd, cpu) == tskd)
-            per_cpu(vtss_recovery_tskd, cpu) = NULL;
-    }
-    write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+    vtss_recovery_drop(tskd);
     /* Finish trace transport */
     read_lock_irqsave(&vtss_transport_init_rwlock, flags);
     if (atomic_read(&vtss_transport_initialized) != 0 && tskd->trnd != NULL) {
@@ -1365,9 +1425,7 @@ static void vtss_sched_switch_from(vtss_task_map_item_t* item, struct task_struc
         else
             VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPOUT);
         if (likely(!VTSS_ERROR_STORE_SWAPOUT(tskd))) {
-            write_lock_irqsave(&vtss_recovery_rwlock, flags);
-            per_cpu(vtss_recovery_tskd, tskd->cpu) = NULL;
-            write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+            vtss_recovery_clear(tskd->cpu, tskd);
             tskd->state &= ~VTSS_ST_IN_CONTEXT;
 
             if (likely(!VTSS_IS_COMPLETE(tskd) &&
@@ -1462,8 +1520,7 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
         unsigned long flags;
         struct vtss_task_data* cpu_tskd;
 
-        write_lock_irqsave(&vtss_recovery_rwlock, flags);
-        cpu_tskd = per_cpu(vtss_recovery_tskd, cpu);
+        cpu_tskd = vtss_recovery_get(cpu, &flags);
         if (unlikely((reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX) &&
             cpu_tskd != NULL &&
             VTSS_IN_CONTEXT(cpu_tskd) &&
@@ -1471,12 +1528,12 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
         {
             VTSS_STORE_SWAPOUT(cpu_tskd, 1, NOT_SAFE);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(cpu_tskd))) {
-                per_cpu(vtss_recovery_tskd, cpu) = NULL;
+                vtss_recovery_clear(cpu, cpu_tskd);
                 cpu_tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 cpu_tskd = NULL;
             }
         }
-        write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+        vtss_recovery_put(cpu, flags);
         /* Exit from context for the task if error was */
         if (unlikely(VTSS_IN_CONTEXT(tskd) && VTSS_ERROR_STORE_SWAPOUT(tskd))) {
             if (reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX)
@@ -1484,9 +1541,7 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
             else
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPOUT);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, tskd->cpu) = NULL;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_clear(tskd->cpu, tskd);
                 tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 if (unlikely(cpu == tskd->cpu))
                     cpu_tskd = NULL;
@@ -1513,9 +1568,7 @@ static void vtss_sched_switch_to(vtss_task_map_item_t* item, struct task_struct*
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPIN);
             }
             if (likely(!VTSS_ERROR_STORE_SWAPIN(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, cpu) = tskd;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_set(cpu, tskd);
                 tskd->state |= VTSS_ST_IN_CONTEXT;
                 tskd->cpu = cpu;
                 if (likely(VTSS_NEED_STACK_SAVE(tskd) &&
@@ -1645,8 +1698,7 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
         unsigned long flags;
         struct vtss_task_data* cpu_tskd;
 
-        write_lock_irqsave(&vtss_recovery_rwlock, flags);
-        cpu_tskd = per_cpu(vtss_recovery_tskd, cpu);
+        cpu_tskd = vtss_recovery_get(cpu, &flags);
         if (unlikely((reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_CTX) &&
             cpu_tskd != NULL && cpu_tskd != tskd &&
             VTSS_IN_CONTEXT(cpu_tskd) &&
@@ -1654,12 +1706,12 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
         {
             VTSS_STORE_SWAPOUT(cpu_tskd, 1, NOT_SAFE);
             if (likely(!VTSS_ERROR_STORE_SWAPOUT(cpu_tskd))) {
-                per_cpu(vtss_recovery_tskd, cpu) = NULL;
+                vtss_recovery_clear(cpu, cpu_tskd);
                 cpu_tskd->state &= ~VTSS_ST_IN_CONTEXT;
                 cpu_tskd = NULL;
             }
         }
-        write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+        vtss_recovery_put(cpu, flags);
         /* Enter in context for the task if CPU is free and no error */
         if (unlikely(cpu_tskd == NULL &&
             !VTSS_IN_CONTEXT(tskd) &&
@@ -1672,9 +1724,7 @@ static void vtss_pmi_record(struct pt_regs* regs, vtss_task_map_item_t* item, in
             else
                 VTSS_STORE_STATE(tskd, 0, VTSS_ST_SWAPIN);
             if (likely(!VTSS_ERROR_STORE_SWAPIN(tskd))) {
-                write_lock_irqsave(&vtss_recovery_rwlock, flags);
-                per_cpu(vtss_recovery_tskd, cpu) = tskd;
-                write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
+                vtss_recovery_set(cpu, tskd);
                 tskd->state |= VTSS_ST_IN_CONTEXT;
                 tskd->cpu = cpu;
                 if (unlikely(VTSS_NEED_STACK_SAVE(tskd) &&
@@ -1812,6 +1862,7 @@ cycles_t vtss_profile_cnt_vma  = 0;
 cycles_t vtss_profile_clk_vma  = 0;
 cycles_t vtss_profile_cnt_pgp  = 0;
 cycles_t vtss_profile_clk_pgp  = 0;
+cycles_t vtss_profile_cnt_pgh  = 0;
 cycles_t vtss_profile_cnt_cpy  = 0;
 cycles_t vtss_profile_clk_cpy  = 0;
 cycles_t vtss_profile_cnt_vld  = 0;
@@ -1820,6 +1871,12 @@ cycles_t vtss_profile_cnt_unw  = 0;
 cycles_t vtss_profile_clk_unw  = 0;
 #endif
 
+DEFINE_PER_CPU(vtss_latency_t, vtss_latency);
+
+static const char* vtss_latency_name[vtss_latency_count] = {
+    "pmi", "ctx", "stk", "pmu", "sys", "bts", "vma"
+};
+
 int vtss_cmd_open(void)
 {
     return 0;
@@ -1914,6 +1971,7 @@ int vtss_cmd_start(void)
     }
 
     INFO("Starting vtss++ collection");
+    atomic_set(&vtss_recovery_stale, 0);
 #ifdef VTSS_DEBUG_PROFILE
     vtss_profile_cnt_stk  = 0;
     vtss_profile_clk_stk  = 0;
@@ -1931,6 +1989,7 @@ int vtss_cmd_start(void)
     vtss_profile_clk_vma  = 0;
     vtss_profile_cnt_pgp  = 0;
     vtss_profile_clk_pgp  = 0;
+    vtss_profile_cnt_pgh  = 0;
     vtss_profile_cnt_cpy  = 0;
     vtss_profile_clk_cpy  = 0;
     vtss_profile_cnt_vld  = 0;
@@ -2089,9 +2148,10 @@ int vtss_debug_info(struct seq_file *s)
 {
     int rc = 0;
 
-    seq_printf(s, "[collector]\nstate=%s\ntargets=%d\ncpu_mask=",
+    seq_printf(s, "[collector]\nstate=%s\ntargets=%d\nrecovery_stale=%d\ncpu_mask=",
                 state_str[atomic_read(&vtss_collector_state)],
-                atomic_read(&vtss_target_count));
+                atomic_read(&vtss_target_count),
+                atomic_read(&vtss_recovery_stale));
     seq_cpumask_list(s, &vtss_collector_cpumask);
     seq_putc(s, '\n');
 
@@ -2118,6 +2178,41 @@ int vtss_target_pids(struct seq_file *s)
     return vtss_task_map_foreach(vtss_target_pids_item, s);
 }
 
+int vtss_latency_info(struct seq_file *s)
+{
+    int cpu, path, i;
+    unsigned long hist[VTSS_LATENCY_BUCKETS];
+    unsigned long total;
+
+    seq_puts(s, "#path       calls  log2(cycles):calls\n");
+    for (path = 0; path < vtss_latency_count; path++) {
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            vtss_latency_t* lat = &per_cpu(vtss_latency, cpu);
+            for (i = 0; i < VTSS_LATENCY_BUCKETS; i++)
+                hist[i] += lat->hist[path][i];
+        }
+        for (i = 0, total = 0; i < VTSS_LATENCY_BUCKETS; i++)
+            total += hist[i];
+        seq_printf(s, "%s %12lu ", vtss_latency_name[path], total);
+        for (i = 0; i < VTSS_LATENCY_BUCKETS; i++) {
+            if (hist[i])
+                seq_printf(s, " %d:%lu", i, hist[i]);
+        }
+        seq_putc(s, '\n');
+    }
+    return 0;
+}
+
+void vtss_latency_reset(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(&per_cpu(vtss_latency, cpu), 0, sizeof(vtss_latency_t));
+    }
+}
+
 void vtss_fini(void)
 {
     vtss_cmd_stop();
@@ -2131,7 +2226,6 @@ void vtss_fini(void)
 int vtss_init(void)
 {
     int cpu, rc = 0;
-    unsigned long flags;
 
 #ifdef VTSS_GET_TASK_STRUCT
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39)
@@ -2153,11 +2247,10 @@ int vtss_init(void)
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,39) */
 #endif /* VTSS_GET_TASK_STRUCT */
 
-    write_lock_irqsave(&vtss_recovery_rwlock, flags);
     for_each_possible_cpu(cpu) {
-        per_cpu(vtss_recovery_tskd, cpu) = NULL;
+        per_cpu(vtss_recovery, cpu).tskd = NULL;
+        per_cpu(vtss_recovery, cpu).busy = 0;
     }
-    write_unlock_irqrestore(&vtss_recovery_rwlock, flags);
     cpumask_copy(&vtss_collector_cpumask, cpu_present_mask);
 
     rc |= vtss_globals_init();
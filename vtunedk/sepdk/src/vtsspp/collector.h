@@ -71,6 +71,8 @@ int vtss_cmd_mark(void);
 
 int vtss_debug_info(struct seq_file *s);
 int vtss_target_pids(struct seq_file *s);
+int vtss_latency_info(struct seq_file *s);
+void vtss_latency_reset(void);
 
 int  vtss_init(void);
 void vtss_fini(void);
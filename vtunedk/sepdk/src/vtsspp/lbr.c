@@ -33,6 +33,9 @@
 #include "record.h"
 #include "time.h"
 
+#include <linux/slab.h>
+#include <linux/jhash.h>
+
 #define DEBUGCTL_MSR        0x01d9
 #define LBR_ENABLE_MASK_P4  0x0021
 #define LBR_ENABLE_MASK_P6  0x0201  ///0x0001
@@ -60,6 +63,30 @@ typedef struct
 
 } clrstk_trace_record_t;
 
+#define VTSS_LBR_STKID_SIZE    64   /* stacks cached per cpu, must be power of 2 */
+#define VTSS_LBR_STKID_REFRESH 4096 /* re-emit a cached stack after so many references */
+#define VTSS_LBR_STKID_NONE    0xffffffff
+
+/// recently emitted LBR call stack
+typedef struct
+{
+    unsigned int   trid;    /* id of transport the stack was emitted to, 0 - empty */
+    unsigned int   hash;
+    unsigned int   refs;
+    unsigned short size;
+    unsigned char  data[VTSS_MAX_LBRS * (sizeof(size_t) + 1)];
+
+} vtss_lbr_stkid_entry_t;
+
+typedef struct
+{
+    int busy;
+    vtss_lbr_stkid_entry_t entry[VTSS_LBR_STKID_SIZE];
+
+} vtss_lbr_stkid_t;
+
+static DEFINE_PER_CPU_SHARED_ALIGNED(vtss_lbr_stkid_t*, vtss_lbr_stkid_per_cpu);
+
 static long long read_msr(int idx)
 {
     long long val;
@@ -67,12 +94,61 @@ static long long read_msr(int idx)
     return val;
 }
 
+/**
+ * Look up the compressed stack in the cpu cache. Returns the stack ID and
+ * sets *is_ref if the stack has been emitted to this transport already, so
+ * a reference is enough. On a miss the slot is returned with *entry set, it
+ * has to be filled by vtss_lbr_stkid_update() once the stack is committed.
+ */
+static unsigned int vtss_lbr_stkid_lookup(vtss_lbr_stkid_t* cache, unsigned int trid, char* data, int size, int* is_ref, vtss_lbr_stkid_entry_t** entry)
+{
+    unsigned int hash = jhash(data, size, trid);
+    unsigned int stkid = hash & (VTSS_LBR_STKID_SIZE - 1);
+    vtss_lbr_stkid_entry_t* e = &cache->entry[stkid];
+
+    *is_ref = 0;
+    *entry  = NULL;
+    if (e->trid == trid && e->hash == hash && e->size == size && !memcmp(e->data, data, size)) {
+        if (++e->refs < VTSS_LBR_STKID_REFRESH) {
+            *is_ref = 1;
+            return stkid;
+        }
+        /* time to resync with the reader, it might have lost the stack */
+    }
+    *entry  = e;
+    e->trid = 0;
+    e->hash = hash;
+    return stkid;
+}
+
+static void vtss_lbr_stkid_update(vtss_lbr_stkid_entry_t* e, unsigned int trid, char* data, int size)
+{
+    memcpy(e->data, data, size);
+    e->size = (unsigned short)size;
+    e->refs = 0;
+    e->trid = trid;
+}
+
 int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk, pid_t tid, int cpu, int is_safe)
 {
     int rc = 0;
     int i, j, k;
     int lbridx;
 
+    int is_ref = 0;
+    unsigned int trid = 0;
+    unsigned int stkid = VTSS_LBR_STKID_NONE;
+    vtss_lbr_stkid_t* cache = NULL;
+    vtss_lbr_stkid_entry_t* entry = NULL;
+    unsigned short type;
+    int len;
+#ifdef VTSS_USE_UEC
+    clrstk_trace_record_t stkrec;
+#else
+    void* trentry;
+    clrstk_trace_record_t* stkrec;
+#endif
+
     int sign;
     int prefix;
     size_t value;
@@ -132,11 +208,35 @@ int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk
         }
         else
         {
+            /// replace a recently emitted stack with its ID
+            if(reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_LBRSTKID)
+            {
+                cache = per_cpu(vtss_lbr_stkid_per_cpu, cpu);
+                if(cache != NULL && !cache->busy)
+                {
+                    /// nested sample (e.g. PMI in context switch) goes uncached
+                    cache->busy = 1;
+                    trid = vtss_transport_get_id(trnd);
+                    stkid = vtss_lbr_stkid_lookup(cache, trid, compressed, i, &is_ref, &entry);
+                }
+                else
+                {
+                    cache = NULL;
+                }
+            }
+            if(is_ref)
+            {
+                type = sizeof(void*) == 8 ? UECSYSTRACE_CLEAR_STACK_ID64 : UECSYSTRACE_CLEAR_STACK_ID32;
+                len  = 0;
+            }
+            else
+            {
+                type = sizeof(void*) == 8 ? UECSYSTRACE_CLEAR_STACK64 : UECSYSTRACE_CLEAR_STACK32;
+                len  = i;
+            }
 
 #ifdef VTSS_USE_UEC
 
-            clrstk_trace_record_t stkrec;
-
             /// save current alt. stack in UEC: [flagword - 4b][residx][cpuidx - 4b][tsc - 8b]
             ///                                 ...[sampled address - 8b][systrace{sts}]
             ///                                                          [length - 2b][type - 2b]...
@@ -146,11 +246,11 @@ int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk
             stkrec.cputsc = vtss_time_cpu();
             stkrec.execaddr = (unsigned long long)stk->user_ip.szt;
 
-            stkrec.size = 4 + 4 + (unsigned short)i;
-            stkrec.type = sizeof(void*) == 8 ? UECSYSTRACE_CLEAR_STACK64 : UECSYSTRACE_CLEAR_STACK32;
-            stkrec.merge_node = 0xffffffff;
+            stkrec.size = 4 + 4 + (unsigned short)len;
+            stkrec.type = type;
+            stkrec.merge_node = stkid;
 
-            if (vtss_transport_record_write(trnd, &stkrec, sizeof(stkrec), compressed, i, is_safe))
+            if (vtss_transport_record_write(trnd, &stkrec, sizeof(stkrec), compressed, len, is_safe))
             {
                 TRACE("STACK_record_write() FAIL");
                 rc = -EFAULT;
@@ -158,8 +258,7 @@ int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk
 
 #else  // VTSS_USE_UEC 
 
-            void* entry;
-            clrstk_trace_record_t* stkrec = (clrstk_trace_record_t*)vtss_transport_record_reserve(trnd, &entry, sizeof(clrstk_trace_record_t) + i);
+            stkrec = (clrstk_trace_record_t*)vtss_transport_record_reserve(trnd, &trentry, sizeof(clrstk_trace_record_t) + len);
 
             if(likely(stkrec))
             {
@@ -172,13 +271,13 @@ int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk
                 stkrec->cputsc   = vtss_time_cpu();
                 stkrec->execaddr = (unsigned long long)stk->user_ip.szt;
 
-                stkrec->size = 4 + 4 + (unsigned short)i;
-                stkrec->type = sizeof(void*) == 8 ? UECSYSTRACE_CLEAR_STACK64 : UECSYSTRACE_CLEAR_STACK32;
-                stkrec->merge_node = 0xffffffff;
+                stkrec->size = 4 + 4 + (unsigned short)len;
+                stkrec->type = type;
+                stkrec->merge_node = stkid;
 
-                memcpy((char*)stkrec + sizeof(clrstk_trace_record_t), stk->compressed, i);
+                memcpy((char*)stkrec + sizeof(clrstk_trace_record_t), stk->compressed, len);
 
-                rc = vtss_transport_record_commit(trnd, entry, is_safe);
+                rc = vtss_transport_record_commit(trnd, trentry, is_safe);
             }
             else
             {
@@ -188,6 +287,15 @@ int vtss_stack_record_lbr(struct vtss_transport_data* trnd, stack_control_t* stk
 
 #endif //  VTSS_USE_UEC
 
+            if(cache != NULL)
+            {
+                /// remember the stack only when the reader is going to see it
+                if(entry != NULL && !rc)
+                {
+                    vtss_lbr_stkid_update(entry, trid, compressed, i);
+                }
+                cache->busy = 0;
+            }
         }
     }
     return rc;
@@ -288,6 +396,17 @@ void vtss_lbr_disable_save(lbr_control_t* lbrctl)
     }
 }
 
+static void vtss_lbr_stkid_free(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        if (per_cpu(vtss_lbr_stkid_per_cpu, cpu) != NULL)
+            kfree(per_cpu(vtss_lbr_stkid_per_cpu, cpu));
+        per_cpu(vtss_lbr_stkid_per_cpu, cpu) = NULL;
+    }
+}
+
 /* initialize the architectural LBR parameters */
 int vtss_lbr_init(void)
 {
@@ -360,6 +479,23 @@ int vtss_lbr_init(void)
     }
     TRACE("no=%d, ctl=0x%X, from=0x%X, to=0x%X, tos=0x%X",
           vtss_lbr_no, vtss_lbr_msr_ctl, vtss_lbr_msr_from, vtss_lbr_msr_to, vtss_lbr_msr_tos);
+
+    /* stack ID cache is optional, go without it on allocation failure */
+    if (vtss_lbr_no && !vtss_lbr_msr_ctl &&
+        (reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_LBRCSTK) &&
+        (reqcfg.trace_cfg.trace_flags & VTSS_CFGTRACE_LBRSTKID))
+    {
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+            per_cpu(vtss_lbr_stkid_per_cpu, cpu) = (vtss_lbr_stkid_t*)kmalloc_node(sizeof(vtss_lbr_stkid_t), (GFP_KERNEL | __GFP_ZERO), cpu_to_node(cpu));
+            if (per_cpu(vtss_lbr_stkid_per_cpu, cpu) == NULL) {
+                ERROR("Not enough memory for LBR stack ID cache");
+                vtss_lbr_stkid_free();
+                break;
+            }
+        }
+    }
     return 0;
 }
 
@@ -371,4 +507,5 @@ static void vtss_lbr_on_each_cpu_func(void* ctx)
 void vtss_lbr_fini(void)
 {
     on_each_cpu(vtss_lbr_on_each_cpu_func, NULL, SMP_CALL_FUNCTION_ARGS);
+    vtss_lbr_stkid_free();
 }
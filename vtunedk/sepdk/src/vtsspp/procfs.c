@@ -45,6 +45,7 @@
 
 #define VTSS_PROCFS_CTRL_NAME      ".control"
 #define VTSS_PROCFS_DEBUG_NAME     ".debug"
+#define VTSS_PROCFS_LATENCY_NAME   ".latency"
 #define VTSS_PROCFS_CPUMASK_NAME   ".cpu_mask"
 #define VTSS_PROCFS_DEFSAV_NAME    ".def_sav"
 #define VTSS_PROCFS_TARGETS_NAME   ".targets"
@@ -575,6 +576,66 @@ static const struct file_operations vtss_procfs_debug_fops = {
 
 /* ************************************************************************* */
 
+static void *latency_info = NULL;
+
+static int vtss_procfs_latency_show(struct seq_file *s, void *v)
+{
+    return vtss_latency_info(s);
+}
+
+static void *vtss_procfs_latency_start(struct seq_file *s, loff_t *pos)
+{
+    return (*pos) ? NULL : &latency_info;
+}
+
+static void *vtss_procfs_latency_next(struct seq_file *s, void *v, loff_t *pos)
+{
+    return NULL;
+}
+
+static void vtss_procfs_latency_stop(struct seq_file *s, void *v)
+{
+}
+
+static const struct seq_operations vtss_procfs_latency_sops = {
+    .start = vtss_procfs_latency_start,
+    .next  = vtss_procfs_latency_next,
+    .stop  = vtss_procfs_latency_stop,
+    .show  = vtss_procfs_latency_show,
+};
+
+static int vtss_procfs_latency_open(struct inode *inode, struct file *file)
+{
+    return seq_open(file, &vtss_procfs_latency_sops);
+}
+
+static ssize_t vtss_procfs_latency_write(struct file *file, const char __user * buf, size_t count, loff_t * ppos)
+{
+    char val[8];
+
+    if (count < 1 || vtss_copy_from_user(val, buf, 1)) {
+        ERROR("Error in copy_from_user()");
+        return -EFAULT;
+    }
+    /* "0" or "reset" clears all histograms */
+    if (val[0] != '0' && val[0] != 'r')
+        return -EINVAL;
+    vtss_latency_reset();
+    TRACE("latency histograms are reset");
+    return count;
+}
+
+static const struct file_operations vtss_procfs_latency_fops = {
+    .owner   = THIS_MODULE,
+    .open    = vtss_procfs_latency_open,
+    .read    = seq_read,
+    .write   = vtss_procfs_latency_write,
+    .llseek  = seq_lseek,
+    .release = seq_release,
+};
+
+/* ************************************************************************* */
+
 const struct cpumask* vtss_procfs_cpumask(void)
 {
     return &vtss_procfs_cpumask_;
@@ -959,6 +1020,7 @@ void vtss_procfs_fini(void)
     if (vtss_procfs_root != NULL) {
         remove_proc_entry(VTSS_PROCFS_CTRL_NAME,      vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_DEBUG_NAME,     vtss_procfs_root);
+        remove_proc_entry(VTSS_PROCFS_LATENCY_NAME,   vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_CPUMASK_NAME,   vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_DEFSAV_NAME,    vtss_procfs_root);
         remove_proc_entry(VTSS_PROCFS_TARGETS_NAME,   vtss_procfs_root);
@@ -1015,6 +1077,7 @@ int vtss_procfs_init(void)
     }
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_CTRL_NAME,      &vtss_procfs_ctrl_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_DEBUG_NAME,     &vtss_procfs_debug_fops);
+    rc |= vtss_procfs_create_entry(VTSS_PROCFS_LATENCY_NAME,   &vtss_procfs_latency_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_CPUMASK_NAME,   &vtss_procfs_cpumask_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_DEFSAV_NAME,    &vtss_procfs_defsav_fops);
     rc |= vtss_procfs_create_entry(VTSS_PROCFS_TARGETS_NAME,   &vtss_procfs_targets_fops);
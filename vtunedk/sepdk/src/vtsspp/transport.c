@@ -28,6 +28,7 @@
 #include "vtss_config.h"
 #include "transport.h"
 #include "procfs.h"
+#include "time.h"
 #ifdef VTSS_USE_UEC
 #include "uec.h"
 #else
@@ -61,36 +62,49 @@
 
 struct vtss_transport_entry
 {
-    unsigned long  seqnum;
-    unsigned short size;
-    char           data[0];
+    unsigned long long stamp;  /* TSC at reserve, the merge key across cpus */
+    unsigned short     size;
+    char               data[0];
 };
 
 struct vtss_transport_temp
 {
-    struct vtss_transport_temp* prev;
-    struct vtss_transport_temp* next;
-    unsigned long seq_begin;
-    unsigned long seq_end;
     size_t        size;
     unsigned int  order;
     char          data[0];
 };
 
+/*
+ * Per-cpu stamp state of the writers.  'floor' is the stamp of the
+ * outermost record reserved but not yet committed on the cpu (~0 if
+ * none), the reader never merges past it.  Records reserved from an
+ * interrupt nested inside an open one inherit its stamp, so stamps
+ * never decrease in ring order whichever of the two reserves first.
+ */
+struct vtss_transport_stamp
+{
+    local_t            nest;
+    unsigned long long floor;
+    unsigned long long last;
+};
+
+/* Head of one per-cpu ring in the reader's merge heap */
+struct vtss_transport_head
+{
+    unsigned long long stamp;
+    int                cpu;
+};
+
 /* The value was gotten from the kernel's ring_buffer code. */
 #define VTSS_RING_BUFFER_PAGE_SIZE      4080
 #define VTSS_TRANSPORT_MAX_RESERVE_SIZE (VTSS_RING_BUFFER_PAGE_SIZE - \
                                         sizeof(struct ring_buffer_event) - \
                                         sizeof(struct vtss_transport_entry) - 64)
-#define VTSS_TRANSPORT_IS_EMPTY(trnd)   (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) == 0)
-#define VTSS_TRANSPORT_DATA_READY(trnd) (1 + (atomic_read(&trnd->seqnum) - trnd->seqdone) > VTSS_MERGE_MEM_LIMIT/4)
-
-struct rb_page
-{
-    u64     ts;
-    local_t commit;
-    char    data[VTSS_RING_BUFFER_PAGE_SIZE];
-};
+#define VTSS_TRANSPORT_IS_EMPTY(trnd)   ring_buffer_empty(trnd->buffer)
+#define VTSS_TRANSPORT_DATA_READY(trnd) (vtss_transport_seqnum(trnd) - trnd->seqdone > VTSS_MERGE_MEM_LIMIT/4)
+/* Writer side check, looks at the own cpu counters only */
+#define VTSS_TRANSPORT_CPU_READY(trnd, cpu) \
+    (local_read(per_cpu_ptr(trnd->seqnum, cpu)) - trnd->seqcpu[cpu] > VTSS_MERGE_MEM_LIMIT/4)
 
 #endif /* VTSS_USE_UEC */
 
@@ -108,6 +122,7 @@ static DEFINE_SPINLOCK(vtss_transport_list_lock);
 static LIST_HEAD(vtss_transport_list);
 
 static atomic_t vtss_transport_npages = ATOMIC_INIT(0);
+static atomic_t vtss_transport_lastid = ATOMIC_INIT(0);
 
 #define VTSS_TR_REG    (1<<0)
 #define VTSS_TR_CFG    (1<<1) /* aux */
@@ -128,16 +143,89 @@ struct vtss_transport_data
 #ifdef VTSS_USE_UEC
     uec_t*              uec;
 #else
-    struct vtss_transport_temp* head;
     struct ring_buffer* buffer;
-    unsigned long       seqdone;
-    unsigned long       seqcpu[NR_CPUS];
-    atomic_t            seqnum;
-    int                 is_abort;
+    struct vtss_transport_head* merge; /* nr_cpu_ids entries, reader only */
+    unsigned long       seqdone;         /* records read out */
+    unsigned long       seqcpu[NR_CPUS]; /* records read out per cpu */
+    local_t __percpu*   seqnum;          /* records committed per cpu */
+    struct vtss_transport_stamp __percpu* stamps;
 #endif
     int type;
+    unsigned int id;
 };
 
+#ifndef VTSS_USE_UEC
+static unsigned long vtss_transport_seqnum(struct vtss_transport_data* trnd)
+{
+    int cpu;
+    unsigned long seqnum = 0;
+
+    for_each_possible_cpu(cpu)
+        seqnum += local_read(per_cpu_ptr(trnd->seqnum, cpu));
+    return seqnum;
+}
+
+/* Take the stamp of a record about to be reserved on this cpu */
+static unsigned long long vtss_transport_stamp_open(struct vtss_transport_data* trnd)
+{
+    unsigned long flags;
+    unsigned long long stamp;
+    struct vtss_transport_stamp* st;
+
+    preempt_disable();
+    st = per_cpu_ptr(trnd->stamps, smp_processor_id());
+    local_irq_save(flags);
+    if (local_inc_return(&st->nest) == 1) {
+        /*
+         * The stamp can only be at or above the last one, so that is a safe
+         * floor until the stamp is known.  It has to be visible before the
+         * clock is read: a reader whose horizon is taken after our clock
+         * read must see a floor below our stamp.
+         */
+        st->floor = st->last;
+        smp_mb();
+        stamp = vtss_time_cpu();
+        if (stamp < st->last)
+            stamp = st->last;
+        st->last  = stamp;
+        st->floor = stamp;
+        smp_wmb(); /* publish the floor before the record can be reserved */
+    } else {
+        stamp = st->floor;
+    }
+    local_irq_restore(flags);
+    return stamp;
+}
+
+/* The record is committed (or was never reserved) */
+static void vtss_transport_stamp_close(struct vtss_transport_data* trnd)
+{
+    unsigned long flags;
+    struct vtss_transport_stamp* st = per_cpu_ptr(trnd->stamps, smp_processor_id());
+
+    local_irq_save(flags);
+    if (local_dec_return(&st->nest) == 0) {
+        smp_wmb(); /* the commit is visible before the floor is lifted */
+        st->floor = ~0ULL;
+    }
+    local_irq_restore(flags);
+    preempt_enable();
+}
+
+/* Oldest stamp a record still open on the cpu can carry */
+static unsigned long long vtss_transport_stamp_floor(struct vtss_transport_data* trnd, int cpu)
+{
+    unsigned long long floor;
+    struct vtss_transport_stamp* st = per_cpu_ptr(trnd->stamps, cpu);
+
+    do { /* the 64-bit value may be torn on 32-bit */
+        floor = st->floor;
+        smp_rmb();
+    } while (floor != st->floor);
+    return floor;
+}
+#endif
+
 void vtss_transport_addref(struct vtss_transport_data* trnd)
 {
     atomic_inc(&trnd->refcount);
@@ -153,6 +241,11 @@ char *vtss_transport_get_filename(struct vtss_transport_data* trnd)
     return trnd->name;
 }
 
+unsigned int vtss_transport_get_id(struct vtss_transport_data* trnd)
+{
+    return trnd->id;
+}
+
 int vtss_transport_is_overflowing(struct vtss_transport_data* trnd)
 {
     return atomic_read(&trnd->is_overflow);
@@ -169,22 +262,8 @@ void vtss_transport_callback(uec_t* uec, int reason, void *context)
     TRACE("context=0x%p, reason=%d", context, reason);
 }
 
-#define UEC_FREE_SIZE(uec) \
-({ (uec->tail <= uec->head) ? \
-        uec->hsize - (size_t)(uec->head - uec->tail) \
-    : \
-        (size_t)(uec->tail - uec->head); \
-})
-
-#define UEC_FILLED_SIZE(uec) \
-({  size_t tsize = 0; \
-    if (uec->head > uec->tail) { \
-        tsize = (size_t)(uec->head - uec->tail); \
-    } else if (uec->head < uec->tail || (uec->head == uec->tail && uec->ovfl)) { \
-        tsize = (size_t)(uec->tsize - (uec->tail - uec->buffer)); \
-    } \
-    tsize; \
-})
+#define UEC_FREE_SIZE(uec)   (uec->hsize - (size_t)(uec->head - uec->tail))
+#define UEC_FILLED_SIZE(uec) ((size_t)(uec->head - uec->tail))
 
 #define VTSS_TRANSPORT_IS_EMPTY(trnd)   (UEC_FILLED_SIZE(trnd->uec) == 0)
 #define VTSS_TRANSPORT_DATA_READY(trnd) (UEC_FILLED_SIZE(trnd->uec) != 0)
@@ -223,6 +302,7 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
 {
     struct ring_buffer_event* event;
     struct vtss_transport_entry* data;
+    unsigned long long stamp;
 
     if (unlikely(trnd == NULL || entry == NULL)) {
         ERROR("Transport or Entry is NULL");
@@ -239,6 +319,7 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
         return NULL;
     }
 
+    stamp = vtss_transport_stamp_open(trnd);
     if (likely(size < VTSS_TRANSPORT_MAX_RESERVE_SIZE)) {
 #if 0
         if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT/2) {
@@ -256,13 +337,13 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
             atomic_inc(&trnd->loscount);
             atomic_inc(&trnd->is_overflow);
             TRACE("'%s' ring_buffer_lock_reserve failed 1, size = %d", trnd->name, (int)(size + sizeof(struct vtss_transport_entry)));
-//            ERROR("'%s' ring_buffer_lock_reserve failed 1, size = %d, reserved = %d, seqnum=%d", trnd->name, (int)(size + sizeof(struct vtss_transport_entry)), trnd->reserved, (int)atomic_read(&trnd->seqnum));
+            vtss_transport_stamp_close(trnd);
             return NULL;
         }
         *entry = (void*)event;
         data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
-        data->seqnum = atomic_inc_return(&trnd->seqnum);
-        data->size   = size;
+        data->stamp = stamp;
+        data->size  = size;
         return (void*)data->data;
     } else { /* blob */
         unsigned int order = get_order(size + sizeof(struct vtss_transport_temp));
@@ -272,6 +353,7 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
             TRACE("'%s' memory limit for blob %zu bytes", trnd->name, size);
 //            ERROR("'%s' memory limit for blob %zu bytes", trnd->name, size);
             atomic_inc(&trnd->loscount);
+            vtss_transport_stamp_close(trnd);
             return NULL;
         }
         blob = (struct vtss_transport_temp*)__get_free_pages((GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN), order);
@@ -279,6 +361,7 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
             TRACE("'%s' no memory for blob %zu bytes", trnd->name, size);
 //            ERROR("'%s' no memory for blob %zu bytes", trnd->name, size);
             atomic_inc(&trnd->loscount);
+            vtss_transport_stamp_close(trnd);
             return NULL;
         }
         atomic_add(1<<order, &vtss_transport_npages);
@@ -296,12 +379,13 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
             atomic_inc(&trnd->is_overflow);
             TRACE("'%s' ring_buffer_lock_reserve failed overflow", trnd->name);
 //            ERROR("'%s' ring_buffer_lock_reserve failed overflow", trnd->name);
+            vtss_transport_stamp_close(trnd);
             return NULL;
         }
         *entry = (void*)event;
         data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
-        data->seqnum = atomic_inc_return(&trnd->seqnum);
-        data->size   = 0;
+        data->stamp = stamp;
+        data->size  = 0;
         *((void**)&(data->data)) = (void*)blob;
         return (void*)blob->data;
     }
@@ -310,12 +394,16 @@ void* vtss_transport_record_reserve(struct vtss_transport_data* trnd, void** ent
 int vtss_transport_record_commit(struct vtss_transport_data* trnd, void* entry, int is_safe)
 {
     int rc = 0;
+    int cpu;
     struct ring_buffer_event* event = (struct ring_buffer_event*)entry;
 
     if (unlikely(trnd == NULL || entry == NULL)) {
         ERROR("Transport or Entry is NULL");
         return -EINVAL;
     }
+    /* Preemption is still disabled by the reserve, so the cpu is stable */
+    cpu = smp_processor_id();
+    local_inc(per_cpu_ptr(trnd->seqnum, cpu));
 #ifdef VTSS_AUTOCONF_RING_BUFFER_FLAGS
     rc = ring_buffer_unlock_commit(trnd->buffer, event, 0);
 #else
@@ -323,9 +411,10 @@ int vtss_transport_record_commit(struct vtss_transport_data* trnd, void* entry,
 #endif
     if (rc) {
         struct vtss_transport_entry* data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
-        ERROR("'%s' commit error: seq=%lu, size=%u", trnd->name, data->seqnum, data->size);
+        ERROR("'%s' commit error: stamp=%llu, size=%u", trnd->name, data->stamp, data->size);
     }
-    if (unlikely(is_safe && VTSS_TRANSPORT_DATA_READY(trnd))) {
+    vtss_transport_stamp_close(trnd);
+    if (unlikely(is_safe && VTSS_TRANSPORT_CPU_READY(trnd, cpu))) {
         if (waitqueue_active(&trnd->waitq))
         {
             wake_up_interruptible(&trnd->waitq);
@@ -394,187 +483,6 @@ int vtss_transport_record_write_all(void* part0, size_t size0, void* part1, size
 
 #ifndef VTSS_USE_UEC
 
-static void vtss_transport_temp_free_all(struct vtss_transport_data* trnd, struct vtss_transport_temp** head)
-{
-    struct vtss_transport_temp* temp;
-    struct vtss_transport_temp** pstore = head;
-
-    while ((temp = *pstore) != NULL) {
-        if (temp->prev) {
-            pstore = &(temp->prev);
-            continue;
-        }
-        if (temp->next) {
-            pstore = &(temp->next);
-            continue;
-        }
-        TRACE("'%s' [%lu, %lu), size=%zu of %zu",
-                trnd->name, temp->seq_begin, temp->seq_end,
-                temp->size, (PAGE_SIZE << temp->order));
-        free_pages((unsigned long)temp, temp->order);
-        atomic_sub(1<<temp->order, &vtss_transport_npages);
-        *pstore = NULL;
-        pstore = head; /* restart from head */
-    }
-}
-
-static struct vtss_transport_temp* vtss_transport_temp_merge(struct vtss_transport_data* trnd, struct vtss_transport_temp** pstore)
-{
-    struct vtss_transport_temp* temp = *pstore;
-
-    if (temp != NULL) {
-        struct vtss_transport_temp* prev = temp->prev;
-        struct vtss_transport_temp* next = temp->next;
-
-        /* try to merge with prev element... */
-        if (prev != NULL && (prev->seq_end == temp->seq_begin) &&
-            /* check for enough space in buffer */
-            ((prev->size + temp->size + sizeof(struct vtss_transport_temp)) < (PAGE_SIZE << prev->order)))
-        {
-            TRACE("'%s' [%lu - %lu), size=%zu <+ [%lu - %lu), size=%zu", trnd->name,
-                prev->seq_begin, prev->seq_end, prev->size,
-                temp->seq_begin, temp->seq_end, temp->size);
-            memcpy(&(prev->data[prev->size]), temp->data, temp->size);
-            prev->size += temp->size;
-            prev->seq_end = temp->seq_end;
-            if (prev->next) {
-                ERROR("'%s' [%lu, %lu) incorrect next link", trnd->name,
-                        prev->seq_begin, prev->seq_end);
-                vtss_transport_temp_free_all(trnd, &(prev->next));
-            }
-            prev->next = temp->next;
-            *pstore = prev;
-            free_pages((unsigned long)temp, temp->order);
-            atomic_sub(1<<temp->order, &vtss_transport_npages);
-            return prev;
-        }
-        /* try to merge with next element... */
-        if (next != NULL && (next->seq_begin == temp->seq_end) &&
-            /* check for enough space in buffer */
-            ((next->size + temp->size + sizeof(struct vtss_transport_temp)) < (PAGE_SIZE << temp->order)))
-        {
-            TRACE("'%s' [%lu - %lu), size=%zu +> [%lu - %lu), size=%zu", trnd->name,
-                temp->seq_begin, temp->seq_end, temp->size,
-                next->seq_begin, next->seq_end, next->size);
-            memcpy(&(temp->data[temp->size]), next->data, next->size);
-            temp->size += next->size;
-            temp->seq_end = next->seq_end;
-            temp->next = next->next;
-            if (next->prev) {
-                ERROR("'%s' [%lu, %lu) incorrect prev link", trnd->name,
-                        next->seq_begin, next->seq_end);
-                vtss_transport_temp_free_all(trnd, &(next->prev));
-            }
-            free_pages((unsigned long)next, next->order);
-            atomic_sub(1<<next->order, &vtss_transport_npages);
-            return temp;
-        }
-    }
-    return temp;
-}
-
-static int vtss_transport_temp_store_data(struct vtss_transport_data* trnd, unsigned long seqnum, void* data, unsigned short size)
-{
-    struct vtss_transport_temp* temp;
-    struct vtss_transport_temp** pstore = &(trnd->head);
-    unsigned int order = get_order(size + sizeof(struct vtss_transport_temp));
-    while (((temp = vtss_transport_temp_merge(trnd, pstore)) != NULL) && (seqnum != temp->seq_end)) {
-        pstore = (seqnum < temp->seq_begin) ? &(temp->prev) : &(temp->next);
-    }
-    if (temp == NULL) {
-        struct vtss_transport_temp* temp1;
-        struct vtss_transport_temp** pstore1 = &(trnd->head);
-        while (((temp1 = *pstore1) != NULL) && ((seqnum + 1) != temp1->seq_begin)) {
-            pstore1 = (seqnum < temp1->seq_begin) ? &(temp1->prev) : &(temp1->next);
-        }
-        if (temp1 != NULL) { /* try to prepend */
-            /* check for enough space in buffer */
-            if ((temp1->size + size + sizeof(struct vtss_transport_temp)) < (PAGE_SIZE << temp1->order)) {
-                TRACE("'%s' [%lu - %lu), size=%u +> [%lu - %lu), size=%zu",
-                        trnd->name, seqnum, seqnum + 1, size,
-                        temp1->seq_begin, temp1->seq_end, temp1->size);
-                memmove(&(temp1->data[size]), temp1->data, temp1->size);
-                memcpy(temp1->data, data, size);
-                temp1->seq_begin = seqnum;
-                temp1->size += size;
-                vtss_transport_temp_merge(trnd, pstore1);
-                return 0;
-            }
-        }
-        TRACE("'%s' new [%lu - %lu), size=%u", trnd->name, seqnum, seqnum + 1, size);
-        temp = (struct vtss_transport_temp*)__get_free_pages((GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN), order);
-        if (temp == NULL) {
-            return -ENOMEM;
-        }
-        atomic_add(1<<order, &vtss_transport_npages);
-        temp->prev  = NULL;
-        temp->next  = NULL;
-        temp->seq_begin = seqnum;
-        temp->size  = 0;
-        temp->order = order;
-        if (*pstore) {
-            ERROR("'%s' new [%lu - %lu), size=%u ==> [%lu - %lu)", trnd->name,
-                    seqnum, seqnum + 1, size, (*pstore)->seq_begin, (*pstore)->seq_end);
-        }
-        *pstore = temp;
-    } else {
-        /* check for enough space in buffer */
-        if ((temp->size + size + sizeof(struct vtss_transport_temp)) >= (PAGE_SIZE << temp->order)) {
-            struct vtss_transport_temp* next;
-            TRACE("'%s' new [%lu - %lu), size=%u, temp->size=%zu", trnd->name,
-                    seqnum, seqnum + 1, size, temp->size);
-            next = (struct vtss_transport_temp*)__get_free_pages((GFP_NOWAIT | __GFP_NORETRY | __GFP_NOWARN), order);
-            if (next == NULL) {
-                return -ENOMEM;
-            }
-            atomic_add(1<<order, &vtss_transport_npages);
-            next->prev  = NULL;
-            next->next  = temp->next;
-            next->seq_begin = seqnum;
-            next->size  = 0;
-            next->order = order;
-            temp->next  = next;
-            pstore = &(temp->next);
-            temp = next;
-        } else {
-            TRACE("'%s' [%lu - %lu), size=%zu <+ [%lu - %lu), size=%u", trnd->name,
-                    temp->seq_begin, temp->seq_end, temp->size,
-                    seqnum, seqnum + 1, size);
-        }
-    }
-    memcpy(&(temp->data[temp->size]), data, size);
-    temp->seq_end = seqnum + 1;
-    temp->size += size;
-    vtss_transport_temp_merge(trnd, pstore);
-    return 0;
-}
-
-static int vtss_transport_temp_store_blob(struct vtss_transport_data* trnd, unsigned long seqnum, struct vtss_transport_temp* blob)
-{
-    struct vtss_transport_temp* temp;
-    struct vtss_transport_temp** pstore = &(trnd->head);
-
-    TRACE("'%s' blob [%lu - %lu), size=%zu", trnd->name, seqnum, seqnum + 1, blob->size);
-    while (((temp = vtss_transport_temp_merge(trnd, pstore)) != NULL) && (seqnum != temp->seq_end)) {
-        pstore = (seqnum < temp->seq_begin) ? &(temp->prev) : &(temp->next);
-    }
-    blob->prev      = NULL;
-    blob->seq_begin = seqnum;
-    blob->seq_end   = seqnum + 1;
-    if (temp == NULL) {
-        blob->next = NULL;
-        if (*pstore) {
-            ERROR("'%s' blob [%lu - %lu), size=%zu ==> [%lu - %lu)", trnd->name,
-                    seqnum, seqnum + 1, blob->size, (*pstore)->seq_begin, (*pstore)->seq_end);
-        }
-        *pstore = blob;
-    } else {
-        blob->next = temp->next;
-        temp->next = blob;
-    }
-    return 0;
-}
-
 #define VTSS_TRANSPORT_COPY_TO_USER(src, len) do { \
     if (copy_to_user(buf, (void*)(src), (len))) { \
         ERROR("copy_to_user(0x%p, 0x%p, %zu): error", buf, (src), (len)); \
@@ -584,121 +492,80 @@ static int vtss_transport_temp_store_blob(struct vtss_transport_data* trnd, unsi
     rc += (len); \
 } while (0)
 
-static size_t vtss_transport_temp_flush(struct vtss_transport_data* trnd, char __user* buf, size_t size)
+static struct vtss_transport_entry* vtss_transport_peek(struct vtss_transport_data* trnd, int cpu)
 {
-    size_t rc = 0;
-
-    if (!trnd->is_abort) {
-        struct vtss_transport_temp* temp;
-        struct vtss_transport_temp** pstore = &(trnd->head);
-
-        TRACE("'%s' -== flush begin ==- :: %u (%lu bytes) at seq=%lu", trnd->name,
-                atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE, trnd->seqdone);
-        /* Look for output seq with merge on the way */
-        while ((temp = vtss_transport_temp_merge(trnd, pstore)) != NULL) {
-            if (trnd->seqdone == temp->seq_begin) {
-                if (size < temp->size)
-                    break;
-                TRACE("'%s' output [%lu, %lu), size=%zu", trnd->name,
-                        temp->seq_begin, temp->seq_end, temp->size);
-                VTSS_TRANSPORT_COPY_TO_USER(temp->data, temp->size);
-                trnd->seqdone = temp->seq_end;
-                *pstore = temp->next;
-                if (temp->prev) {
-                    ERROR("'%s' [%lu, %lu) incorrect prev link", trnd->name, temp->seq_begin, temp->seq_end);
-                    vtss_transport_temp_free_all(trnd, &(temp->prev));
-                }
-                free_pages((unsigned long)temp, temp->order);
-                atomic_sub(1<<temp->order, &vtss_transport_npages);
-                pstore = &(trnd->head); /* restart from head */
-            } else {
-                pstore = (trnd->seqdone < temp->seq_begin) ? &(temp->prev) : &(temp->next);
-            }
-        }
-        TRACE("'%s' -== flush  end  ==- :: %u (%lu bytes) at seq=%lu", trnd->name,
-                atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE, trnd->seqdone);
-    }
-    return rc;
+    u64 ts;
+    struct ring_buffer_event* event;
+
+#ifdef VTSS_AUTOCONF_RING_BUFFER_LOST_EVENTS
+    event = ring_buffer_peek(trnd->buffer, cpu, &ts, NULL);
+#else
+    event = ring_buffer_peek(trnd->buffer, cpu, &ts);
+#endif
+    return event ? (struct vtss_transport_entry*)ring_buffer_event_data(event) : NULL;
 }
 
-static size_t vtss_transport_temp_parse_event(struct vtss_transport_data* trnd, struct ring_buffer_event* event, char __user* buf, size_t size, int cpu)
+static void vtss_transport_consume(struct vtss_transport_data* trnd, int cpu)
 {
-    size_t rc = 0;
-    struct vtss_transport_entry* data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
-    unsigned long seqnum = data->seqnum;
+    u64 ts;
 
-    trnd->seqcpu[cpu] = seqnum;
-    if (trnd->is_abort || trnd->seqdone > seqnum) {
-        if (data->size) {
-            TRACE("DROP seq=%lu, size=%u, from cpu%d", seqnum, data->size, cpu);
-        } else { /* blob */
-            struct vtss_transport_temp* blob = *((struct vtss_transport_temp**)(data->data));
-            TRACE("DROP seq=%lu, size=%zu, from cpu%d", seqnum, blob->size, cpu);
-            free_pages((unsigned long)blob, blob->order);
-            atomic_sub(1<<blob->order, &vtss_transport_npages);
-        }
-#ifndef VTSS_NO_MERGE
-    } else if (trnd->seqdone != seqnum) { /* disordered event */
-        if (data->size) {
-            if (vtss_transport_temp_store_data(trnd, seqnum, data->data, data->size)) {
-                ERROR("'%s' seq=%lu => store data seq=%lu error", trnd->name, trnd->seqdone, seqnum);
-            }
-        } else { /* blob */
-            struct vtss_transport_temp* blob = *((struct vtss_transport_temp**)(data->data));
-            if (vtss_transport_temp_store_blob(trnd, seqnum, blob)) {
-                ERROR("'%s' seq=%lu => store blob seq=%lu error", trnd->name, trnd->seqdone, seqnum);
-            }
-        }
-#endif
-    } else { /* ordered event */
-        if (data->size) {
-            TRACE("'%s' output [%lu - %lu), size=%u from cpu%d", trnd->name, seqnum, seqnum+1, data->size, cpu);
-#ifndef VTSS_NO_MERGE
-            if (size < data->size) {
-                if (vtss_transport_temp_store_data(trnd, seqnum, data->data, data->size)) {
-                    ERROR("'%s' seq=%lu => store data seq=%lu error", trnd->name, trnd->seqdone, seqnum);
-                }
-            } else
-#endif
-            {
-                VTSS_TRANSPORT_COPY_TO_USER(data->data, (size_t)data->size);
-                trnd->seqdone++;
-            }
-        } else { /* blob */
-            struct vtss_transport_temp* blob = *((struct vtss_transport_temp**)(data->data));
-            TRACE("'%s' output [%lu - %lu), size=%zu from cpu%d", trnd->name, seqnum, seqnum+1, blob->size, cpu);
-#ifndef VTSS_NO_MERGE
-            if (size < blob->size) {
-                if (vtss_transport_temp_store_blob(trnd, seqnum, blob)) {
-                    ERROR("'%s' seq=%lu => store blob seq=%lu error", trnd->name, trnd->seqdone, seqnum);
-                }
-            } else
-#endif
-            {
-                VTSS_TRANSPORT_COPY_TO_USER(blob->data,
-#ifndef VTSS_NO_MERGE
-                    blob->size
+#ifdef VTSS_AUTOCONF_RING_BUFFER_LOST_EVENTS
+    ring_buffer_consume(trnd->buffer, cpu, &ts, NULL);
 #else
-                    (size_t)8UL /* FIXME: just something is not overflowed output buffer */
+    ring_buffer_consume(trnd->buffer, cpu, &ts);
 #endif
-                );
+}
+
+static void vtss_transport_merge_sift(struct vtss_transport_head* heap, int n, int i)
+{
+    int child;
+    struct vtss_transport_head head = heap[i];
+
+    while ((child = 2*i + 1) < n) {
+        if (child + 1 < n && heap[child + 1].stamp < heap[child].stamp)
+            child++;
+        if (head.stamp <= heap[child].stamp)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = head;
+}
+
+/* Throw away what the reader has not taken, blobs live outside the ring */
+static void vtss_transport_drop_all(struct vtss_transport_data* trnd)
+{
+    int cpu;
+    struct vtss_transport_entry* data;
+
+    for_each_possible_cpu(cpu) {
+        while ((data = vtss_transport_peek(trnd, cpu)) != NULL) {
+            if (!data->size) {
+                struct vtss_transport_temp* blob = *((struct vtss_transport_temp**)(data->data));
                 free_pages((unsigned long)blob, blob->order);
                 atomic_sub(1<<blob->order, &vtss_transport_npages);
-                trnd->seqdone++;
             }
+            vtss_transport_consume(trnd, cpu);
         }
     }
-    return rc;
 }
 
 #endif /* VTSS_USE_UEC */
 
 static ssize_t vtss_transport_read(struct file *file, char __user* buf, size_t size, loff_t* ppos)
 {
-    int i, cpu;
-    size_t len;
+    int i = 0;
     ssize_t rc;
     struct vtss_transport_data* trnd = (struct vtss_transport_data*)file->private_data;
+#ifndef VTSS_USE_UEC
+    int n, cpu;
+    size_t len;
+    void* src;
+    unsigned long long horizon;
+    struct vtss_transport_entry* data;
+    struct vtss_transport_temp* blob;
+    struct vtss_transport_head* heap;
+#endif
 
     if (unlikely(trnd == NULL || buf == NULL))
         return -EINVAL;
@@ -714,164 +581,70 @@ static ssize_t vtss_transport_read(struct file *file, char __user* buf, size_t s
     rc = trnd->uec->pull(trnd->uec, buf, size);
 #else
     rc = 0;
-    preempt_disable();
-#ifndef VTSS_NO_MERGE
-    /* Flush buffers if possible first of all */
-    len = vtss_transport_temp_flush(trnd, buf, size);
-    size -= len;
-    buf += len;
-    rc += len;
-#endif
-    for (i = 0;
-        (i < 30*num_online_cpus()) && /* no more 30 loops on each online cpu */
-        (size >= VTSS_RING_BUFFER_PAGE_SIZE) && /* while buffer size is enough */
-        !VTSS_TRANSPORT_IS_EMPTY(trnd) /* have something to output */
-        ; i++)
-    {
-        int fast = 1;
-        void* bpage;
-        struct ring_buffer_event *event;
-
-        for_each_online_cpu(cpu) {
-            if (ring_buffer_entries_cpu(trnd->buffer, cpu) == 0)
-                continue; /* nothing to read on this cpu */
-            if  (trnd->seqcpu[cpu] > trnd->seqdone &&
-                (1 + trnd->seqcpu[cpu] - trnd->seqdone) > VTSS_MERGE_MEM_LIMIT/3 &&
-                !trnd->is_abort && !atomic_read(&trnd->is_complete))
-            {
-                TRACE("'%s' cpu%d=%lu :: %u (%lu bytes) at seq=%lu", trnd->name,
-                        cpu, trnd->seqcpu[cpu], atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE, trnd->seqdone);
-                continue; /* skip it for a while */
-            }
-            if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT) {
-                atomic_inc(&trnd->is_overflow);
-                ring_buffer_record_disable(trnd->buffer);
-                ERROR("'%s' abort. Buffers %u (%lu bytes) at seq=%lu",
-                        trnd->name, atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE, trnd->seqdone);
-                vtss_transport_temp_free_all(trnd, &(trnd->head));
-                trnd->is_abort = 1;
-            } else if (atomic_read(&vtss_transport_npages) > VTSS_MERGE_MEM_LIMIT/2) {
-                atomic_inc(&trnd->is_overflow);
-                TRACE("'%s' cpu%d=%lu :: %u (%lu bytes) at seq=%lu", trnd->name,
-                        cpu, trnd->seqcpu[cpu], atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE, trnd->seqdone);
-                fast = 0; /* Carefully get events to avoid memory overflow */
-            }
-#ifdef VTSS_AUTOCONF_RING_BUFFER_ALLOC_READ_PAGE
-            bpage = ring_buffer_alloc_read_page(trnd->buffer, cpu);
-#else
-            bpage = ring_buffer_alloc_read_page(trnd->buffer);
-#endif
-            if (bpage == NULL) {
-                preempt_enable_no_resched();
-                ERROR("'%s' cannot allocate free rb read page", trnd->name);
-                return -EFAULT;
-            }
-            if (fast && ring_buffer_read_page(trnd->buffer, &bpage, PAGE_SIZE, cpu, (!trnd->is_abort && !atomic_read(&trnd->is_complete))) >= 0) {
-                int i, inc;
-                struct rb_page* rpage = (struct rb_page*)bpage;
-                /* The commit may have missed event flags set, clear them */
-                unsigned long commit = local_read(&rpage->commit) & 0xfffff;
-
-                TRACE("page[%d]=[0 - %4lu) :: rc=%zd, size=%zu", cpu, commit, rc, size);
-                for (i = 0; i < commit; i += inc) {
-                    if (i >= (PAGE_SIZE - offsetof(struct rb_page, data))) {
-                        ERROR("'%s' incorrect data index", trnd->name);
-                        break;
-                    }
-                    inc = -1;
-                    event = (void*)&rpage->data[i];
-                    switch (event->type_len) {
-                    case RINGBUF_TYPE_PADDING:
-                        /* failed writes or may be discarded events */
-                        inc = event->array[0] + 4;
-                        break;
-                    case RINGBUF_TYPE_TIME_EXTEND:
-                        inc = 8;
-                        break;
-                    case 0:
-                        len = vtss_transport_temp_parse_event(trnd, event, buf, size, cpu);
-                        size -= len;
-                        buf += len;
-                        rc += len;
-                        if (!event->array[0]) {
-                            ERROR("'%s' incorrect event data", trnd->name);
-                            break;
-                        }
-                        inc = event->array[0] + 4;
-                        break;
-                    default:
-                        len = vtss_transport_temp_parse_event(trnd, event, buf, size, cpu);
-                        size -= len;
-                        buf += len;
-                        rc += len;
-                        inc = ((event->type_len + 1) * 4);
-                    }
-                    if (inc <= 0) {
-                        ERROR("'%s' incorrect next data index", trnd->name);
-                        break;
-                    }
-                } /* for each event in page */
-                TRACE("page[%d] -==end==-  :: rc=%zd, size=%zu", cpu, rc, size);
-            } else { /* reader page is not full of careful, so read one by one */
-                u64 ts;
-                int count;
-
-                for (count = 0; count < 10 && NULL !=
-#ifdef VTSS_AUTOCONF_RING_BUFFER_LOST_EVENTS
-                    (event = ring_buffer_peek(trnd->buffer, cpu, &ts, NULL))
-#else
-                    (event = ring_buffer_peek(trnd->buffer, cpu, &ts))
-#endif
-                    ; count++)
-                {
-                    struct vtss_transport_entry* data = (struct vtss_transport_entry*)ring_buffer_event_data(event);
-
-                    trnd->seqcpu[cpu] = data->seqnum;
-                    if ((1 + trnd->seqcpu[cpu] - trnd->seqdone) > VTSS_MERGE_MEM_LIMIT/4 &&
-                        !trnd->is_abort && !atomic_read(&trnd->is_complete))
-                    {
-                        break; /* will not read this event */
-                    }
-#ifdef VTSS_AUTOCONF_RING_BUFFER_LOST_EVENTS
-                    event = ring_buffer_consume(trnd->buffer, cpu, &ts, NULL);
-#else
-                    event = ring_buffer_consume(trnd->buffer, cpu, &ts);
-#endif
-                    if (event != NULL) {
-                        len = vtss_transport_temp_parse_event(trnd, event, buf, size, cpu);
-                        size -= len;
-                        buf += len;
-                        rc += len;
-                    }
-                } /* for */
-            }
-            ring_buffer_free_read_page(trnd->buffer, bpage);
-#ifndef VTSS_NO_MERGE
-            /* Flush buffers if possible */
-            len = vtss_transport_temp_flush(trnd, buf, size);
-            size -= len;
-            buf += len;
-            rc += len;
-#endif
-            if (size < VTSS_RING_BUFFER_PAGE_SIZE) {
-                preempt_enable_no_resched();
-                TRACE("'%s' read %zd bytes [%d]...", trnd->name, rc, i);
-                return rc;
-            }
-        } /* for each online cpu */
-    } /* while have something to output */
-    preempt_enable_no_resched();
-    if (rc == 0 && !trnd->is_abort && !atomic_read(&trnd->is_complete)) { /* !!! something wrong !!! */
-        ERROR("'%s' [%d] rb=%lu :: %u (%lu bytes) evtstore=%lu of %d", trnd->name, i,
-                ring_buffer_entries(trnd->buffer), atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE,
-                trnd->seqdone-1, atomic_read(&trnd->seqnum));
-        if (!ring_buffer_empty(trnd->buffer)) {
-            for_each_online_cpu(cpu) {
-                unsigned long count = ring_buffer_entries_cpu(trnd->buffer, cpu);
-                if (count)
-                    ERROR("'%s' evtcount[%03d]=%lu", trnd->name, cpu, count);
-            }
+    heap = trnd->merge;
+    /*
+     * Each cpu ring is already in stamp order, so a k-way merge of the ring
+     * heads gives the global order without copying anything aside.
+     * Records stamped after the horizon are left for the next read, which
+     * keeps a cpu that is just now writing from being overtaken.  The
+     * horizon is also kept below every record still open on some cpu:
+     * it is in no ring yet but its stamp is already taken.
+     */
+    horizon = atomic_read(&trnd->is_complete) ? ~0ULL : vtss_time_cpu();
+    smp_mb(); /* pairs with the one in vtss_transport_stamp_open() */
+    for_each_possible_cpu(cpu) {
+        unsigned long long floor = vtss_transport_stamp_floor(trnd, cpu);
+        if (floor != ~0ULL && floor <= horizon)
+            horizon = floor ? floor - 1 : 0;
+    }
+    n = 0;
+    for_each_online_cpu(cpu) {
+        if ((data = vtss_transport_peek(trnd, cpu)) != NULL) {
+            heap[n].stamp = data->stamp;
+            heap[n].cpu   = cpu;
+            n++;
+        }
+    }
+    for (i = n/2 - 1; i >= 0; i--)
+        vtss_transport_merge_sift(heap, n, i);
+    for (i = 0; n > 0 && heap[0].stamp <= horizon; i++) {
+        cpu  = heap[0].cpu;
+        data = vtss_transport_peek(trnd, cpu);
+        if (data == NULL) { /* cannot happen, we are the only reader */
+            ERROR("'%s' cpu%d lost its head", trnd->name, cpu);
+            heap[0] = heap[--n];
+            vtss_transport_merge_sift(heap, n, 0);
+            continue;
+        }
+        if (data->size) {
+            blob = NULL;
+            src  = data->data;
+            len  = (size_t)data->size;
+        } else { /* blob */
+            blob = *((struct vtss_transport_temp**)(data->data));
+            src  = blob->data;
+            len  = blob->size;
         }
+        if (len > size)
+            break; /* leave it in the ring for the next read */
+        VTSS_TRANSPORT_COPY_TO_USER(src, len);
+        if (blob != NULL) {
+            free_pages((unsigned long)blob, blob->order);
+            atomic_sub(1<<blob->order, &vtss_transport_npages);
+        }
+        vtss_transport_consume(trnd, cpu);
+        trnd->seqcpu[cpu]++;
+        trnd->seqdone++;
+        if ((data = vtss_transport_peek(trnd, cpu)) != NULL)
+            heap[0].stamp = data->stamp;
+        else
+            heap[0] = heap[--n];
+        vtss_transport_merge_sift(heap, n, 0);
+    }
+    if (rc == 0 && !atomic_read(&trnd->is_complete)) {
+        TRACE("'%s' rb=%lu :: %u (%lu bytes) evtstore=%lu of %lu", trnd->name,
+                ring_buffer_entries(trnd->buffer), atomic_read(&vtss_transport_npages), atomic_read(&vtss_transport_npages)*PAGE_SIZE,
+                trnd->seqdone, vtss_transport_seqnum(trnd));
         /* We cannot return 0 if transport is not complete, so write the magic */
         *((unsigned int*)buf) = UEC_MAGIC;
         buf += sizeof(unsigned int);
@@ -996,6 +769,7 @@ struct vtss_transport_data* vtss_transport_create_trnd(void)
     atomic_set(&trnd->is_overflow, 0);
     trnd->file = NULL;
     trnd->type = VTSS_TR_REG;
+    trnd->id   = atomic_inc_return(&vtss_transport_lastid); /* starts from 1 */
 #ifdef VTSS_USE_UEC
     trnd->uec = (uec_t*)kmalloc(sizeof(uec_t), GFP_KERNEL);
     if (trnd->uec != NULL) {
@@ -1018,13 +792,31 @@ struct vtss_transport_data* vtss_transport_create_trnd(void)
         return NULL;
     }
 #else
-    trnd->is_abort = 0;
-    trnd->seqdone  = 1;
-    trnd->head     = NULL;
-    atomic_set(&trnd->seqnum, 0);
+    trnd->seqdone = 0;
+    trnd->seqnum  = alloc_percpu(local_t);
+    trnd->stamps  = alloc_percpu(struct vtss_transport_stamp);
+    trnd->merge   = (struct vtss_transport_head*)kmalloc(nr_cpu_ids*sizeof(struct vtss_transport_head), GFP_KERNEL);
+    if (trnd->seqnum == NULL || trnd->stamps == NULL || trnd->merge == NULL) {
+        ERROR("Not enough memory for transport merge data");
+        if (trnd->seqnum != NULL)
+            free_percpu(trnd->seqnum);
+        if (trnd->stamps != NULL)
+            free_percpu(trnd->stamps);
+        kfree(trnd->merge);
+        kfree(trnd);
+        return NULL;
+    }
+    {
+        int cpu;
+        for_each_possible_cpu(cpu)
+            per_cpu_ptr(trnd->stamps, cpu)->floor = ~0ULL; /* nothing open */
+    }
     trnd->buffer = ring_buffer_alloc(rb_size*PAGE_SIZE, 0);
     if (trnd->buffer == NULL) {
         ERROR("Unable to allocate %d * %lu bytes for transport buffer", num_present_cpus(), rb_size*PAGE_SIZE);
+        free_percpu(trnd->seqnum);
+        free_percpu(trnd->stamps);
+        kfree(trnd->merge);
         kfree(trnd);
         return NULL;
     }
@@ -1039,7 +831,11 @@ static void vtss_transport_destroy_trnd(struct vtss_transport_data* trnd)
         kfree(trnd->uec);
 #else
 	printk("buffer deallocated %d \n", num_present_cpus());
+        vtss_transport_drop_all(trnd);
         ring_buffer_free(trnd->buffer);
+        free_percpu(trnd->seqnum);
+        free_percpu(trnd->stamps);
+        kfree(trnd->merge);
 #endif
         kfree(trnd);
 }
@@ -1211,8 +1007,7 @@ int vtss_transport_debug_info(struct seq_file *s)
                     seq_printf(s, "evtcount[%03d]=%lu\n", cpu, count);
             }
         }
-        seq_printf(s, "evtstore=%lu of %d\n", trnd->seqdone-1, atomic_read(&trnd->seqnum));
-        seq_printf(s, "is_abort=%s\n", trnd->is_abort ? "true" : "false");
+        seq_printf(s, "evtstore=%lu of %lu\n", trnd->seqdone, vtss_transport_seqnum(trnd));
 #endif /* VTSS_USE_UEC */
     }
     spin_unlock_irqrestore(&vtss_transport_list_lock, flags);
@@ -1282,12 +1077,15 @@ again:
         destroy_uec(trnd->uec);
         kfree(trnd->uec);
 #else
-        count = atomic_read(&trnd->seqnum);
-        if ((trnd->seqdone - 1) != count) {
-            ERROR("'%s' drop %lu events", trnd->name, (count - trnd->seqdone - 1));
+        count = vtss_transport_seqnum(trnd);
+        if (trnd->seqdone != count) {
+            ERROR("'%s' drop %lu events", trnd->name, (count - trnd->seqdone));
         }
-        vtss_transport_temp_free_all(trnd, &(trnd->head));
+        vtss_transport_drop_all(trnd);
         ring_buffer_free(trnd->buffer);
+        free_percpu(trnd->seqnum);
+        free_percpu(trnd->stamps);
+        kfree(trnd->merge);
 #endif
         kfree(trnd);
         wait_count = VTSS_TRANSPORT_COMPLETE_TIMEOUT;
@@ -48,6 +48,7 @@ struct vtss_transport_data* vtss_transport_create(pid_t ppid, pid_t pid, uid_t c
 struct vtss_transport_data* vtss_transport_create_aux(struct vtss_transport_data* main_trnd, uid_t cuid, gid_t cgid);
 
 char* vtss_transport_get_filename(struct vtss_transport_data* trnd);
+unsigned int vtss_transport_get_id(struct vtss_transport_data* trnd);
 int   vtss_transport_is_overflowing(struct vtss_transport_data* trnd);
 int   vtss_transport_is_active(struct vtss_transport_data* trnd);
 int   vtss_transport_debug_info(struct seq_file *s);
@@ -56,17 +56,15 @@ int init_uec(uec_t* uec, size_t size, char *name, int instance)
         return VTSS_ERR_INTERNAL;
     }
     order = get_order(size);
-    if (!(uec->buffer = (char*)__get_free_pages((GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN), order))) {
+    /// zeroed, a slot header reads as published once it is non-zero
+    if (!(uec->buffer = (char*)__get_free_pages((GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN | __GFP_ZERO), order))) {
         return VTSS_ERR_NOMEMORY;
     }
-    uec->last_rec_ptr = uec->head = uec->head_ = uec->tail = uec->tail_ = uec->buffer;
+    uec->head = uec->tail = 0;
     uec->hsize = uec->tsize = (PAGE_SIZE << order);
     uec->ovfl = 0;
     uec->spill_active = 0;
-    uec->writer_count = 0;
     uec->reader_count = 0;
-
-    spin_lock_init(&uec->lock);
     /// notify on the creation of a new trace
 //    uec->callback(uec, UECCB_NEWTRACE, uec->context);
     return 0;
@@ -82,140 +80,92 @@ void destroy_uec(uec_t* uec)
     }
 }
 
-#define safe_memcpy(dst, src, size) memcpy(dst, src, size)
-#define spill_uec() /* empty */
-
-int put_record_async(uec_t* uec, void *part0, size_t size0, void *part1, size_t size1, int mode)
+/// copy into the buffer at a free-running offset, wrapping at the end
+static void uec_copy_in(uec_t* uec, unsigned long pos, void *src, size_t size)
 {
-    size_t tsize;                  /// total record size
-    size_t fsize = 0;              /// free area length
-    size_t psize;                  /// partial size
-    size_t tmp;
-    char *last_rec_ptr;
-    char *head = 0;
-    char *tail = 0;
-    size_t hsize = 0;
-    unsigned long flags;
+    size_t offset = UEC_OFFSET(uec, pos);
+    size_t psize  = uec->hsize - offset;
 
-    if (!uec->buffer || !part0 || !size0 || ((!size1) ^ (!part1))) {
-        return VTSS_ERR_BADARG;
+    if (psize >= size) {
+        memcpy(&uec->buffer[offset], src, size);
+    } else {
+        memcpy(&uec->buffer[offset], src, psize);
+        memcpy(uec->buffer, ((char*)src) + psize, size - psize);
     }
-    tsize = size0 + size1;
-
-    /// lock UEC
-    uec_lock(&uec->lock);
+}
 
-    /// sample the uec variables
-    head = (char*)uec->head_;
-    tail = (char*)uec->tail;
-    last_rec_ptr = head;
-    hsize = uec->hsize;
+/// copy out of the buffer at a free-running offset, wrapping at the end
+static int uec_copy_out(uec_t* uec, char __user* dst, unsigned long pos, size_t size)
+{
+    size_t offset = UEC_OFFSET(uec, pos);
+    size_t psize  = uec->hsize - offset;
 
-    /// is buffer full?
-    if (uec->ovfl) {
-        *((unsigned int*)uec->last_rec_ptr) |= UEC_OVERFLOW;
-        /// signal overflow to overlying components
-//        uec->callback(uec, UECCB_OVERFLOW, uec->context);
-        uec_unlock(&uec->lock);
-        spill_uec();
-        return VTSS_ERR_BUFFERFULL;
+    if (psize >= size) {
+        return copy_to_user(dst, &uec->buffer[offset], size) ? -1 : 0;
     }
-    /// compute free size
-    if (tail <= head) {
-        fsize = uec->hsize - (size_t)(head - tail);
-    } else {
-        fsize = (size_t)(tail - head);
+    if (copy_to_user(dst, &uec->buffer[offset], psize)) {
+        return -1;
     }
-    /// handle 'no room' case
-    if (fsize < tsize) {
-        uec->ovfl = 1;
-        *((unsigned int*)uec->last_rec_ptr) |= UEC_OVERFLOW;
-        /// signal overflow to overlying components
-//        uec->callback(uec, UECCB_OVERFLOW, uec->context);
-        uec_unlock(&uec->lock);
-        spill_uec();
-        return VTSS_ERR_NOMEMORY;
-    }
-    /// allocate uec region
-    psize = (size_t)(uec->buffer + hsize - head);
+    return copy_to_user(dst + psize, uec->buffer, size - psize) ? -1 : 0;
+}
 
-    if (psize > tsize) {
-        uec->head_ = head + tsize;
+/// zero the buffer at a free-running offset, wrapping at the end
+static void uec_zero(uec_t* uec, unsigned long pos, size_t size)
+{
+    size_t offset = UEC_OFFSET(uec, pos);
+    size_t psize  = uec->hsize - offset;
+
+    if (psize >= size) {
+        memset(&uec->buffer[offset], 0, size);
     } else {
-        uec->head_ = uec->buffer + tsize - psize;
+        memset(&uec->buffer[offset], 0, psize);
+        memset(uec->buffer, 0, size - psize);
     }
-    if (uec->head_ == tail) {
-        uec->ovfl = 1;
-    }
-    /// increment the writers' count
-    uec->writer_count++;
-
-    /// unlock UEC
-    uec_unlock(&uec->lock);
-
-    /// do the write to the allocated uec region
+}
 
-    if (tail <= head) {
-        if (psize > tsize) {
-            memcpy(head, part0, size0);
-            head += size0;
-            if (size1) {
-                safe_memcpy(head, part1, size1);
-                head += size1;
-            }
-        } else {
-            tmp = size0 > psize ? psize : size0;
-            memcpy(head, part0, tmp);
-            head += tmp;
+int put_record_async(uec_t* uec, void *part0, size_t size0, void *part1, size_t size1, int mode)
+{
+    size_t tsize;                  /// total record size
+    size_t ssize;                  /// slot size
+    unsigned long head;
+    unsigned long tail;
+    uec_slot_t *slot;
 
-            if (tmp == psize) {
-                head = uec->buffer;
-                if ((size0 - tmp) > 0) {
-                    memcpy(head, ((char*)part0) + tmp, size0 - tmp);
-                    head += size0 - tmp;
-                }
-            }
-            if (size1) {
-                psize -= tmp;
-                if (psize) {
-                    safe_memcpy(head, part1, psize);
-                    head = uec->buffer;
-                    if ((size1 - psize) > 0) {
-                        memcpy(head, ((char*)part1) + psize, size1 - psize);
-                        head += size1 - psize;
-                    }
-                } else {
-                    safe_memcpy(head, part1, size1);
-                    head += size1;
-                }
+    if (!uec->buffer || !part0 || !size0 || ((!size1) ^ (!part1))) {
+        return VTSS_ERR_BADARG;
+    }
+    tsize = size0 + size1;
+    ssize = UEC_SLOT_SIZE(tsize);
+
+    /// reserve the slot, writers on other cpus only race for the head
+    do {
+        head = uec->head;
+        tail = uec->tail;
+        /// handle 'no room' case
+        if (head + ssize - tail > uec->hsize) {
+            if (uec->ovfl) {
+                return VTSS_ERR_BUFFERFULL;
             }
+            /// the next successful record carries the overflow flag
+            uec->ovfl = 1;
+            return VTSS_ERR_NOMEMORY;
         }
-    } else /// tail > head
-    {
-        memcpy(head, part0, size0);
-        head += size0;
-        if (size1) {
-            safe_memcpy(head, part1, size1);
-            head += size1;
-        }
-    }
-
-    /// lock UEC
-    uec_lock(&uec->lock);
+    } while (cmpxchg(&uec->head, head, head + ssize) != head);
 
-    /// decrement the writers' count
-    uec->writer_count--;
-
-    uec->last_rec_ptr = last_rec_ptr;
-
-    /// update uec variables
-    if (!uec->writer_count) {
-        uec->head = uec->head_;
+    /// do the write to the allocated uec region
+    slot = (uec_slot_t*)&uec->buffer[UEC_OFFSET(uec, head)];
+    head += sizeof(uec_slot_t);
+    uec_copy_in(uec, head, part0, size0);
+    if (size1) {
+        uec_copy_in(uec, head + size0, part1, size1);
     }
-    /// unlock UEC
-    uec_unlock(&uec->lock);
-
-    spill_uec();
+    /// the record flagword is never split, the payload starts aligned
+    if (unlikely(uec->ovfl) && xchg(&uec->ovfl, 0) && size0 >= sizeof(unsigned int)) {
+        *((unsigned int*)&uec->buffer[UEC_OFFSET(uec, head)]) |= UEC_OVERFLOW;
+    }
+    /// publish the slot
+    smp_wmb();
+    slot->size = (unsigned int)tsize;
 
     return 0;
 }
@@ -223,79 +173,48 @@ int put_record_async(uec_t* uec, void *part0, size_t size0, void *part1, size_t
 int pull_uec(uec_t* uec, char __user* buffer, size_t len)
 {
     int rc = 0;
-    char *head;
-    char *tail;
+    unsigned long head;
+    unsigned long tail;
     size_t size;
-    int ovfl;
-
     size_t copylen = 0;
-    size_t partlen;
+    uec_slot_t *slot;
 
-    unsigned long flags;
-
-    /// sample the UEC state, copy the sampled contents to the specified buffer,
+    /// copy the published records to the specified buffer,
     /// and free the read part of the UEC buffer
 
     if (!uec->buffer || !buffer || !len) {
         return VTSS_ERR_BADARG;
     }
-    /// sample data region
-    uec_lock(&uec->lock);
-
-    if (uec->spill_active) {
-        uec_unlock(&uec->lock);
+    if (cmpxchg(&uec->spill_active, 0, 1) != 0) {
         return VTSS_ERR_BUSY;
     }
-    uec->spill_active = 1;
-
-    head = (char*)uec->head;
-    tail = (char*)uec->tail;
-    size = uec->tsize;
-    ovfl = uec->ovfl;
-
-    if ((head == tail && !ovfl) || (head == tail && ovfl && head != uec->head_)) {
-        uec->spill_active = 0;
-        uec_unlock(&uec->lock);
-        return 0; ///empty
-    }
-
-    uec_unlock(&uec->lock);
-
-    /// spill the sampled region
-    if (head > tail) {
-        copylen = (size_t)(head - tail);
-        copylen = copylen > len ? len : copylen;
-
-        rc = copy_to_user(buffer, (void*)tail, copylen);
-
-        tail += copylen;
-    } else if (head < tail || (head == tail && ovfl)) {
-        copylen = partlen = (size_t)(size - (tail - uec->buffer));
-        copylen = copylen > len ? len : copylen;
-
-        rc = copy_to_user(buffer, (void*)tail, copylen);
-
-        tail += copylen;
-
-        if (copylen == partlen && copylen < len) {
-            /// copy the second part
-            partlen = (size_t)(head - uec->buffer);
-            partlen = partlen > (len - copylen) ? (len - copylen) : partlen;
-
-            rc |= copy_to_user(&((char*)buffer)[copylen], (void*)uec->buffer, partlen);
-
-            copylen += partlen;
-            /// assert(copylen <= len);
-
-            tail = uec->buffer + partlen;
+    head = uec->head;
+    tail = uec->tail;
+
+    while (tail != head) {
+        slot = (uec_slot_t*)&uec->buffer[UEC_OFFSET(uec, tail)];
+        size = slot->size;
+        if (!size) {
+            break; /// the writer has not finished yet
+        }
+        if (UEC_SLOT_SIZE(size) > head - tail) {
+            ERROR("UEC slot at %lu claims %lu bytes, %lu reserved", tail, (unsigned long)size, head - tail);
+            break;
         }
+        smp_rmb();
+        if (copylen + size > len) {
+            break;
+        }
+        rc |= uec_copy_out(uec, &buffer[copylen], tail + sizeof(uec_slot_t), size);
+        copylen += size;
+        /// the next lap may put a header anywhere in this slot
+        uec_zero(uec, tail, UEC_SLOT_SIZE(size));
+        tail += UEC_SLOT_SIZE(size);
     }
-
-    uec_lock(&uec->lock);
+    /// release the space only after the slots are cleared
+    smp_mb();
     uec->tail = tail;
-    uec->ovfl = 0;
     uec->spill_active = 0;
-    uec_unlock(&uec->lock);
 
     return rc ? -1 : copylen;
 }
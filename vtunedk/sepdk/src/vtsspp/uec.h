@@ -28,10 +28,7 @@
 #ifndef _UEC_H_
 #define _UEC_H_
 
-#include <linux/spinlock.h>
-typedef spinlock_t sal_spinlock_t;
-#define uec_lock(x)   spin_lock_irqsave((x), flags)
-#define uec_unlock(x) spin_unlock_irqrestore((x), flags)
+#include <linux/types.h>
 
 /**
 //
@@ -49,22 +46,33 @@ typedef struct _uec_t
 
     /// elements
     char *buffer;               /// collector buffer
-    volatile char *head;        /// head-pointer to write to
-    volatile char *tail;        /// tail-pointer to read from
-    volatile char *head_;       /// head-pointer for asynchronous writes
-    volatile char *tail_;       /// tail-pointer for asynchronous reads
+    volatile unsigned long head;/// free-running offset reserved by writers (cmpxchg)
+    volatile unsigned long tail;/// free-running offset released by the reader
     size_t tsize;               /// size of buffer for read operations
-    size_t hsize;               /// size of buffer for write operations
-    volatile int ovfl;          /// indicates buffer overflow
-    volatile char *last_rec_ptr;/// points to the last successfully written record
-    volatile int spill_active;  /// set when spill-method is invoked by put_record-method
-    volatile int writer_count;  /// the number of active writers
+    size_t hsize;               /// size of buffer for write operations, power of 2
+    volatile int ovfl;          /// records were dropped since the last successful write
+    volatile int spill_active;  /// set while the reader pulls the buffer
     volatile int reader_count;  /// the number of active readers
     void *context;              /// callback context
-
-    sal_spinlock_t lock;        /// spin lock protection
 } uec_t;
 
+/**
+// Every record sits in a slot: a header followed by the record bytes,
+// padded up to the header alignment. The writer fills the slot and then
+// stores the record size into the header, which publishes it. The reader
+// takes slots in order, stops at the first unpublished one and zeroes the
+// whole slot before it gives the space back, so that a header of the next
+// lap never lands on stale record bytes.
+*/
+typedef struct _uec_slot_t
+{
+    volatile unsigned int size; /// record size, 0 while the slot is being written
+    unsigned int reserved;
+} uec_slot_t;
+
+#define UEC_SLOT_SIZE(size) ((sizeof(uec_slot_t) + (size) + sizeof(uec_slot_t) - 1) & ~(sizeof(uec_slot_t) - 1))
+#define UEC_OFFSET(uec, pos) ((size_t)(pos) & ((uec)->hsize - 1))
+
 int  init_uec(uec_t* uec, size_t size, char *name, int instance);
 void destroy_uec(uec_t* uec);
 int  put_record_async(uec_t* uec, void *part0, size_t size0, void *part1, size_t size1, int mode);
@@ -111,6 +111,33 @@ static void clear_stack(stack_control_t* stk)
     stk->stkmap_end = stk->stkmap_start = stk->stkmap_common = (stkmap_t*)stk->compressed;
 }
 
+/// read a stack word through the read-ahead window
+static int read_stack(stack_control_t* stk, char* addr, size_t* value, int stride)
+{
+    char* p;
+
+    if(addr < stk->win_start.chp || addr + stride > stk->win_end.chp)
+    {
+        /// refill the window with the stack contents from addr up to the base
+        size_t len = min((size_t)(stk->bp.chp - addr), sizeof(stk->window));
+
+        if(len < (size_t)stride)
+        {
+            len = stride;
+        }
+        len = stk->acc->read(stk->acc, addr, stk->window, len);
+        stk->win_start.chp = addr;
+        stk->win_end.chp = addr + len;
+        if(len < (size_t)stride)
+        {
+            return -1;
+        }
+    }
+    p = (char*)stk->window + (addr - stk->win_start.chp);
+    *value = (stride == sizeof(size_t)) ? *(size_t*)p : (size_t)*(unsigned int*)p;
+    return 0;
+}
+
 /// build an incremental map of stack, frame, and instruction pointers
 
 ///#define SWAP(a, b) (a) += (b); (b) = (a) - (b); (a) = (a) - (b)
@@ -148,6 +175,9 @@ static int unwind_stack_fwd(stack_control_t* stk)
         return VTSS_ERR_NOMEMORY;
     }
 
+    /// the stack contents may have changed since the previous sample
+    stk->win_start.chp = stk->win_end.chp = 0;
+
     /* do argument corrections */
 
     /// align sp to machine word size
@@ -210,8 +240,7 @@ static int unwind_stack_fwd(stack_control_t* stk)
                     continue;
                 }
                 /// read in the actual stack contents
-                value.szt = 0;
-                if (stk->acc->read(stk->acc, stkmap_curr->sp.szp, &value.szt, stride) != stride) {
+                if (read_stack(stk, stkmap_curr->sp.chp, &value.szt, stride)) {
                     TRACE("SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p", stkmap_curr->sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
                     /// clear the stack map
                     stkmap_common = stkmap_end = stkmap_start;
@@ -274,8 +303,7 @@ static int unwind_stack_fwd(stack_control_t* stk)
                             /// search for IPs from the same module
                             for(search_sp.chp = stkmap_curr->sp.chp + stride; search_sp.chp < search_border.chp; search_sp.chp += stride)
                             {
-                                value.szt = 0;
-                                if (stk->acc->read(stk->acc, search_sp.szp, &value.szt, stride) != stride) {
+                                if (read_stack(stk, search_sp.chp, &value.szt, stride)) {
                                     TRACE("SP=0x%p: break search, [0x%p - 0x%p], ip=0x%p", search_sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
                                     /// clear the stack map
                                     stkmap_common = stkmap_end = stkmap_start;
@@ -342,8 +370,7 @@ end_of_search:
         ///__try
         ///{
             /// read a value from the stack
-            value.szt = 0;
-            if (stk->acc->read(stk->acc, search_sp.szp, &value.szt, stride) != stride) {
+            if (read_stack(stk, search_sp.chp, &value.szt, stride)) {
                 TRACE("SP=0x%p: skip page, [0x%p - 0x%p], ip=0x%p", search_sp.szp, stk->user_sp.vdp, stk->bp.vdp, stk->user_ip.vdp);
 #ifdef VTSS_MEM_FAULT_BREAK
                 break;
@@ -424,6 +451,18 @@ static int is_full_stack(stack_control_t* stk)
     return stk->stkmap_common == stk->stkmap_end;
 }
 
+/// store the low bytes of a value in little-endian order, return the end of the chunk
+static inline unsigned char* put_stack_chunk(unsigned char* p, size_t value, int bytes)
+{
+#if BITS_PER_LONG == 64
+    __le64 le = cpu_to_le64((u64)value);
+#else
+    __le32 le = cpu_to_le32((u32)value);
+#endif
+    memcpy(p, &le, bytes);
+    return p + bytes;
+}
+
 /// compress the collected stack map
 static int compress_stack(stack_control_t* stk)
 {
@@ -433,7 +472,8 @@ static int compress_stack(stack_control_t* stk)
     size_t sp;
     size_t fp;
     unsigned char* compressed;
-    int i, j;
+    int i;
+    int bytes;
     int prefix;
     size_t value;
     size_t base;
@@ -489,22 +529,9 @@ static int compress_stack(stack_control_t* stk)
         }
         else
         {
-
-            for(j = sizeof(size_t) - 1; j >= 0; j--)
-            {
-                if(value & (((size_t)0xff) << (j << 3)))
-                {
-                    break;
-                }
-            }
-            prefix = j + 1;
-            *compressed++ = (unsigned char)prefix;
-
-            for(; j >= 0; j--)
-            {
-                *compressed++ = (unsigned char)(value & 0xff);
-                value >>= 8;
-            }
+            bytes = (fls64((u64)value) + 7) >> 3;
+            *compressed++ = (unsigned char)bytes;
+            compressed = put_stack_chunk(compressed, value, bytes);
         }
         sp = map[i++];
 
@@ -540,24 +567,13 @@ static int compress_stack(stack_control_t* stk)
             prefix = 0;
             value -= offset;
         }
-        sign = (value & (((size_t)1) << ((sizeof(size_t) << 3) - 1))) ? 0xff : 0;
-
-        for(j = sizeof(size_t) - 1; j >= 0; j--)
-        {
-            if(((value >> (j << 3)) & 0xff) != sign)
-            {
-                break;
-            }
-        }
+        sign = (value & (((size_t)1) << ((sizeof(size_t) << 3) - 1))) ? 1 : 0;
+        /// drop the leading bytes equal to the sign byte
+        bytes = (fls64((u64)(sign ? ~value : value)) + 7) >> 3;
         prefix |= sign ? 0x40 : 0;
-        prefix |= j + 1;
+        prefix |= bytes;
         *compressed++ = (unsigned char)prefix;
-
-        for(; j >= 0; j--)
-        {
-            *compressed++ = (unsigned char)(value & 0xff);
-            value >>= 8;
-        }
+        compressed = put_stack_chunk(compressed, value, bytes);
     }
     return (int)(compressed - stk->compressed);
 }
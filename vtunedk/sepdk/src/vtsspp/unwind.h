@@ -48,6 +48,8 @@
 #define IP_SEARCH_RANGE     0x08
 #define FUN_SEARCH_RANGE    0x1000
 
+#define STACK_WINDOW_SIZE   0x100   /// bytes of user stack fetched per read
+
 #define MIN_SYSTEM_MODULE   0x77800000
 #define MAX_SYSTEM_MODULE   0x7ffeffff
 
@@ -133,6 +135,11 @@ typedef struct _stack_control_t
 
     spinlock_t spin_lock;       /// spin lock protection
     user_vm_accessor_t* acc;    /// user vm accessor
+
+    /// read-ahead window over the user stack of the current sample
+    stkptr_t win_start;
+    stkptr_t win_end;
+    size_t window[STACK_WINDOW_SIZE / sizeof(size_t)];
     char dbgmsg[192];
 
     /// kernel compressed clean_stack
@@ -151,6 +158,7 @@ int vtss_init_stack(stack_control_t* stk);
 static int  realloc_stack(stack_control_t* stk);
 static void destroy_stack(stack_control_t* stk);
 static void clear_stack(stack_control_t* stk);
+static int  read_stack(stack_control_t* stk, char* addr, size_t* value, int stride);
 static int  unwind_stack_fwd(stack_control_t* stk);
 static int  unwind_stack_rev(stack_control_t* stk);
 static int  validate_stack(stack_control_t* stk);   /// callback for validating IPs
@@ -198,6 +198,16 @@ static inline int in_nmi(void)
 #endif /* in_nmi */
 #endif /* VTSS_AUTOCONF_KMAP_ATOMIC_ONE_ARG */
 
+#ifdef VTSS_AUTOCONF_KMAP_ATOMIC_ONE_ARG
+#define VTSS_KMAP_ATOMIC(page)    kmap_atomic(page)
+#define VTSS_KUNMAP_ATOMIC(addr)  kunmap_atomic(addr)
+#else
+#define VTSS_KMAP_ATOMIC(page)    kmap_atomic(page, in_nmi() ? KM_NMI : KM_IRQ0)
+#define VTSS_KUNMAP_ATOMIC(addr)  kunmap_atomic(addr, in_nmi() ? KM_NMI : KM_IRQ0)
+#endif
+
+#ifdef VTSS_VMA_CACHE
+
 static int vtss_user_vm_page_unpin(struct user_vm_accessor* this)
 {
     if (this->m_irq) {
@@ -270,9 +280,111 @@ static int vtss_user_vm_page_pin(struct user_vm_accessor* this, unsigned long ad
     return rc;
 }
 
+#else  /* VTSS_VMA_CACHE */
+
+static void vtss_user_vm_page_release(struct user_vm_accessor* this, user_vm_page_t* pg)
+{
+    if (pg->page != NULL) {
+        if (this->m_irq)
+            put_page(pg->page);
+        else
+            page_cache_release(pg->page); /* put_page(pg->page); */
+    }
+    pg->page    = NULL;
+    pg->vma     = NULL;
+    pg->page_id = (unsigned long)-1;
+}
+
+static void vtss_user_vm_page_release_all(struct user_vm_accessor* this)
+{
+    int i;
+
+    for (i = 0; i < VTSS_USER_VM_PAGES; i++)
+        vtss_user_vm_page_release(this, &this->m_pages[i]);
+}
+
+static user_vm_page_t* vtss_user_vm_page_find(struct user_vm_accessor* this, unsigned long page_id)
+{
+    int i;
+
+    for (i = 0; i < VTSS_USER_VM_PAGES; i++)
+        if (this->m_pages[i].page_id == page_id)
+            return &this->m_pages[i];
+    return NULL;
+}
+
+/*
+ * Return the cached pin of page_id, or pin it. On a miss in irq mode
+ * the pages that follow it (the rest of the stack) are pinned by the
+ * same fast-GUP call, into free slots; the least recently used page
+ * is evicted only if no slot is free.
+ */
+static user_vm_page_t* vtss_user_vm_page_get(struct user_vm_accessor* this, unsigned long page_id)
+{
+    int i, n = 0, rc;
+    int slots[VTSS_USER_VM_BATCH];
+    struct page* pages[VTSS_USER_VM_BATCH];
+    struct vm_area_struct* vma = NULL;
+    user_vm_page_t* pg = vtss_user_vm_page_find(this, page_id);
+#ifdef VTSS_DEBUG_PROFILE
+    cycles_t start_pgp_time;
+#endif
+
+    if (pg != NULL) {
+        pg->stamp = ++this->m_stamp;
+#ifdef VTSS_DEBUG_PROFILE
+        vtss_profile_cnt_pgh++;
+#endif
+        return pg;
+    }
+#ifdef VTSS_DEBUG_PROFILE
+    start_pgp_time = get_cycles();
+#endif
+    for (i = 0; i < VTSS_USER_VM_PAGES && n < (this->m_irq ? VTSS_USER_VM_BATCH : 1); i++)
+        if (this->m_pages[i].page == NULL)
+            slots[n++] = i;
+    if (n == 0) {
+        slots[0] = 0;
+        for (i = 1; i < VTSS_USER_VM_PAGES; i++)
+            if (this->m_pages[i].stamp < this->m_pages[slots[0]].stamp)
+                slots[0] = i;
+        vtss_user_vm_page_release(this, &this->m_pages[slots[0]]);
+        n = 1;
+    }
+    /* Stop the batch at the first page which is pinned already */
+    for (i = 1; i < n; i++)
+        if (vtss_user_vm_page_find(this, page_id + i) != NULL)
+            break;
+    n = i;
+
+    if (this->m_irq)
+        rc = vtss_get_user_pages_fast(page_id << PAGE_SHIFT, n, 0, pages);
+    else
+        rc = get_user_pages(this->m_task, this->m_mm, page_id << PAGE_SHIFT, 1, 0, 1, pages, &vma);
+    /* The requested page is the most recent one, prefetched ones are older */
+    for (i = rc - 1; i >= 0; i--) {
+        pg = &this->m_pages[slots[i]];
+        pg->page    = pages[i];
+        pg->vma     = vma;
+        pg->page_id = page_id + i;
+        pg->stamp   = ++this->m_stamp;
+    }
+#ifdef VTSS_DEBUG_PROFILE
+    vtss_profile_cnt_pgp++;
+    vtss_profile_clk_pgp += get_cycles() - start_pgp_time;
+#endif
+    return (rc > 0) ? &this->m_pages[slots[0]] : NULL;
+}
+
+#endif /* VTSS_VMA_CACHE */
+
 static int vtss_user_vm_unlock(struct user_vm_accessor* this)
 {
+#ifdef VTSS_VMA_CACHE
     vtss_user_vm_page_unpin(this);
+#else
+    vtss_user_vm_page_release_all(this);
+#endif
     if (this->m_mm != NULL) {
         if (!this->m_irq) {
             up_read(&this->m_mm->mmap_sem);
@@ -316,9 +428,10 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
 {
     size_t i, cpsize, bytes = 0;
     unsigned long offset, addr = (unsigned long)from;
-#ifdef VTSS_DEBUG_PROFILE
-    cycles_t start_vma_time = get_cycles();
+#ifndef VTSS_VMA_CACHE
+    user_vm_page_t* pg;
 #endif
+    cycles_t start_vma_time = get_cycles();
 #ifndef VTSS_VMA_CACHE
     mm_segment_t old_fs = get_fs();
 
@@ -347,6 +460,7 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
 #endif
         if (!access_ok(VERIFY_READ, addr, cpsize))
             break; /* Don't have a read access */
+#ifdef VTSS_VMA_CACHE
         if (page_id != this->m_page_id) {
 #ifdef VTSS_DEBUG_PROFILE
             cycles_t start_pgp_time = get_cycles();
@@ -367,16 +481,24 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
             vtss_profile_clk_pgp += get_cycles() - start_pgp_time;
 #endif
         }
-#ifdef VTSS_VMA_CACHE
         memcpy(to, this->m_buffer + offset, cpsize);
 #else
+        pg = vtss_user_vm_page_get(this, page_id);
+        if (pg == NULL) {
+            TRACE("page lock FAIL");
+            break; /* Cannot get a page for an access */
+        }
         if (this->m_irq) {
             long rc = 0;
-            VTSS_PROFILE(cpy, rc = __copy_from_user_inatomic(to, this->m_maddr + offset, cpsize));
+            void* maddr = VTSS_KMAP_ATOMIC(pg->page);
+            VTSS_PROFILE(cpy, rc = __copy_from_user_inatomic(to, maddr + offset, cpsize));
+            VTSS_KUNMAP_ATOMIC(maddr);
             if (rc)
                 break;
         } else {
-            VTSS_PROFILE(cpy, copy_from_user_page(this->m_vma, this->m_page, addr, to, this->m_maddr + offset, cpsize));
+            void* maddr = kmap(pg->page);
+            VTSS_PROFILE(cpy, copy_from_user_page(pg->vma, pg->page, addr, to, maddr + offset, cpsize));
+            kunmap(pg->page);
         }
 #endif
 #ifdef VTSS_DEBUG_VMA
@@ -397,10 +519,9 @@ static size_t vtss_user_vm_read(struct user_vm_accessor* this, void* from, void*
         set_fs(old_fs);
     }
 #endif
-#ifdef VTSS_DEBUG_PROFILE
-    vtss_profile_cnt_vma++;
-    vtss_profile_clk_vma += get_cycles() - start_vma_time;
-#endif
+    start_vma_time = get_cycles() - start_vma_time;
+    VTSS_PROFILE_SUM(vma, start_vma_time);
+    vtss_latency_add(vtss_latency_vma, start_vma_time);
     return bytes;
 }
 
@@ -438,6 +559,12 @@ user_vm_accessor_t* vtss_user_vm_accessor_init(int in_irq, cycles_t limit)
 #endif
     acc = (user_vm_accessor_t*)kmalloc(sizeof(user_vm_accessor_t), (in_irq ? GFP_ATOMIC : GFP_KERNEL) | __GFP_ZERO);
     if (acc != NULL) {
+#ifndef VTSS_VMA_CACHE
+        int i;
+
+        for (i = 0; i < VTSS_USER_VM_PAGES; i++)
+            acc->m_pages[i].page_id = (unsigned long)-1;
+#endif
         acc->m_page_id = (unsigned long)-1;
         acc->m_irq     = in_irq;
 #ifdef VTSS_VMA_TIME_LIMIT
@@ -33,6 +33,23 @@
 #include <linux/sched.h>        /* for struct task_struct */
 #include <linux/mm.h>           /* for struct vm_area_struct */
 
+#ifndef VTSS_VMA_CACHE
+#ifndef VTSS_USER_VM_PAGES
+#define VTSS_USER_VM_PAGES 8 /* pages kept pinned by one accessor */
+#endif
+#ifndef VTSS_USER_VM_BATCH
+#define VTSS_USER_VM_BATCH 4 /* pages pinned by one fast-GUP call */
+#endif
+
+typedef struct user_vm_page
+{
+    struct page*           page;
+    struct vm_area_struct* vma;
+    unsigned long          page_id;
+    unsigned long          stamp;   /* LRU */
+} user_vm_page_t;
+#endif
+
 typedef struct user_vm_accessor
 {
 /* public: */
@@ -55,6 +72,9 @@ typedef struct user_vm_accessor
 #endif
 #ifdef VTSS_VMA_CACHE
     char                   m_buffer[PAGE_SIZE];
+#else
+    user_vm_page_t         m_pages[VTSS_USER_VM_PAGES];
+    unsigned long          m_stamp;
 #endif
 } user_vm_accessor_t;
 
@@ -38,6 +38,8 @@
 #include <linux/smp.h>          /* for smp_processor_id() */
 #include <linux/cpumask.h>
 #include <linux/percpu.h>
+#include <linux/bitops.h>       /* for fls64() */
+#include <linux/timex.h>        /* for get_cycles() */
 
 #define VTSS_TO_STR_AUX(x) #x
 #define VTSS_TO_STR(x)     VTSS_TO_STR_AUX(x)
@@ -82,6 +84,7 @@ extern cycles_t vtss_profile_cnt_vma;
 extern cycles_t vtss_profile_clk_vma;
 extern cycles_t vtss_profile_cnt_pgp;
 extern cycles_t vtss_profile_clk_pgp;
+extern cycles_t vtss_profile_cnt_pgh;
 extern cycles_t vtss_profile_cnt_cpy;
 extern cycles_t vtss_profile_clk_cpy;
 extern cycles_t vtss_profile_cnt_vld;
@@ -89,11 +92,10 @@ extern cycles_t vtss_profile_clk_vld;
 extern cycles_t vtss_profile_cnt_unw;
 extern cycles_t vtss_profile_clk_unw;
 
-#define VTSS_PROFILE(name, expr) do {   \
-    cycles_t start_time = get_cycles(); \
-    (expr);                             \
-    vtss_profile_cnt_##name++;          \
-    vtss_profile_clk_##name += get_cycles() - start_time; \
+#define VTSS_PROFILE_ON(name) 1
+#define VTSS_PROFILE_SUM(name, clk) do { \
+    vtss_profile_cnt_##name++;           \
+    vtss_profile_clk_##name += (clk);    \
   } while (0)
 
 #define VTSS_PROFILE_PRINT(func, ...) do { \
@@ -137,13 +139,70 @@ extern cycles_t vtss_profile_clk_unw;
         vtss_profile_clk_pgp, vtss_profile_cnt_pgp, \
         (vtss_profile_clk_pgp*10000/(vtss_profile_clk_vma+1))/100, \
         (vtss_profile_clk_pgp*10000/(vtss_profile_clk_vma+1))%100); \
+    func(__VA_ARGS__ "...h=%15lld n=%9lld (%.2lld.%02lld%%)\n", \
+        vtss_profile_cnt_pgh, vtss_profile_cnt_pgh+vtss_profile_cnt_pgp, \
+        (vtss_profile_cnt_pgh*10000/(vtss_profile_cnt_pgh+vtss_profile_cnt_pgp+1))/100, \
+        (vtss_profile_cnt_pgh*10000/(vtss_profile_cnt_pgh+vtss_profile_cnt_pgp+1))%100); \
   } while(0)
 
 #else  /* VTSS_DEBUG_PROFILE */
-#define VTSS_PROFILE(name, expr) (expr)
+#define VTSS_PROFILE_ON(name) (vtss_latency_##name >= 0)
+#define VTSS_PROFILE_SUM(name, clk)
 #define VTSS_PROFILE_PRINT(func, ...)
 #endif /* VTSS_DEBUG_PROFILE */
 
+/*
+ * Per-CPU log2 latency histograms, always collected for hot paths.
+ * Bucket N counts calls which took [2^(N-1), 2^N) cycles, the last
+ * bucket also takes everything above. Paths mapped to -1 are timed
+ * only in VTSS_DEBUG_PROFILE builds.
+ */
+#define VTSS_LATENCY_BUCKETS 40
+
+enum {
+    vtss_latency_pmi = 0,
+    vtss_latency_ctx,
+    vtss_latency_stk,
+    vtss_latency_pmu,
+    vtss_latency_sys,
+    vtss_latency_bts,
+    vtss_latency_vma,
+    vtss_latency_count,
+    vtss_latency_unw = -1,
+    vtss_latency_vld = -1,
+    vtss_latency_cpy = -1,
+};
+
+typedef struct
+{
+    unsigned long hist[vtss_latency_count][VTSS_LATENCY_BUCKETS];
+} vtss_latency_t;
+
+DECLARE_PER_CPU(vtss_latency_t, vtss_latency);
+
+static inline void vtss_latency_add(int path, cycles_t clk)
+{
+    int bucket = fls64((u64)clk);
+
+    if (bucket >= VTSS_LATENCY_BUCKETS)
+        bucket = VTSS_LATENCY_BUCKETS - 1;
+    /* One irq-safe per-cpu add: callers may be preemptible or interrupted by the PMI */
+    this_cpu_inc(vtss_latency.hist[path][bucket]);
+}
+
+#define VTSS_PROFILE(name, expr) do {       \
+    if (VTSS_PROFILE_ON(name)) {            \
+        cycles_t start_time = get_cycles(); \
+        (expr);                             \
+        start_time = get_cycles() - start_time; \
+        VTSS_PROFILE_SUM(name, start_time); \
+        if (vtss_latency_##name >= 0)       \
+            vtss_latency_add(vtss_latency_##name, start_time); \
+    } else {                                \
+        (expr);                             \
+    }                                       \
+  } while (0)
+
 #if defined(CONFIG_PREEMPT_NOTIFIERS) && !defined(CONFIG_TRACEPOINTS)
 #define VTSS_USE_PREEMPT_NOTIFIERS 1 /* Use backup scheme */
 #endif
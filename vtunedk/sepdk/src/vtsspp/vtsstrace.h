@@ -248,6 +248,9 @@
 #define UECSYSTRACE_STACK_CTXINC64_V2 49    /// incremental stack without sp and fp values (both equal exectx.sp)
 
 #define UECSYSTRACE_STREAM_ZLIB 50          /// a record containing a stream compressed with ZLIB
+
+#define UECSYSTRACE_CLEAR_STACK_ID32 51     /// reference to a 32-bit call stack sequence emitted earlier on the same cpu
+#define UECSYSTRACE_CLEAR_STACK_ID64 52     /// reference to a 64-bit call stack sequence emitted earlier on the same cpu
 #define UECSYSTRACE_DEBUG       60          /// a record with debugging info in a human-readable format
 
 /// module types for for systrace(module map)
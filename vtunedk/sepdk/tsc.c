@@ -0,0 +1,543 @@
+/*COPYRIGHT**
+    Copyright (C) 2005-2013 Intel Corporation.  All Rights Reserved.
+
+    This file is part of SEP Development Kit
+
+    SEP Development Kit is free software; you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    version 2 as published by the Free Software Foundation.
+
+    SEP Development Kit is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SEP Development Kit; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    As a special exception, you may use this file as part of a free software
+    library without restriction.  Specifically, if other files instantiate
+    templates or use macros or inline functions from this file, or you compile
+    this file and link it with other files to produce an executable, this
+    file does not by itself cause the resulting executable to be covered by
+    the GNU General Public License.  This exception does not however
+    invalidate any other reasons why the executable file might be covered by
+    the GNU General Public License.
+**COPYRIGHT*/
+
+#include "lwpmudrv_defines.h"
+#include <linux/version.h>
+#include <linux/cache.h>
+#include <linux/irqflags.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include "lwpmudrv_types.h"
+#include "rise_errors.h"
+#include "lwpmudrv_ecb.h"
+#include "lwpmudrv.h"
+#include "control.h"
+#include "utility.h"
+#include "tsc.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 27)
+#define SMP_CALL_FUNCTION_SINGLE(cpu,func,ctx,retry,wait)    smp_call_function_single((cpu),(func),(ctx),(wait))
+#else
+#define SMP_CALL_FUNCTION_SINGLE(cpu,func,ctx,retry,wait)    smp_call_function_single((cpu),(func),(ctx),(retry),(wait))
+#endif
+
+#define TSC_ROUNDS           16              // ping-pong rounds per cpu, the shortest round trip wins
+#define TSC_SPIN_TIMEOUT     10000000ULL     // TSC ticks (a few ms) to wait for the other side with irqs off
+
+/*
+ * The skew of each cpu against cpu 0 and its error bound, both in TSC ticks.
+ * TSC_SKEW() reads tsc_skew.
+ */
+S64       *tsc_skew           = NULL;
+U64       *tsc_skew_err       = NULL;
+
+/*
+ * Rendezvous between the reference cpu and one peer cpu.  The reference
+ * sets seq to 2*round+1 (ping), the peer reads its TSC into peer_tsc and
+ * answers with 2*round+2 (pong).  Both live in one cache line so that a
+ * round costs a single line transfer each way.
+ */
+typedef struct TSC_SYNC_NODE_S  TSC_SYNC_NODE;
+typedef        TSC_SYNC_NODE   *TSC_SYNC;
+
+struct TSC_SYNC_NODE_S {
+    volatile U32  seq;
+    volatile U32  abort;
+    volatile U64  peer_tsc;
+    volatile U32  gen;          // measurement generation, stale peers bail out
+    U32           rounds;
+} ____cacheline_aligned;
+
+#define TSC_SYNC_seq(ts)             (ts)->seq
+#define TSC_SYNC_abort(ts)           (ts)->abort
+#define TSC_SYNC_peer_tsc(ts)        (ts)->peer_tsc
+#define TSC_SYNC_gen(ts)             (ts)->gen
+#define TSC_SYNC_rounds(ts)          (ts)->rounds
+
+static TSC_SYNC_NODE  tsc_sync;
+static S64           *tsc_offset    = NULL;   // scratch: offset against the reference cpu
+static U64           *tsc_error     = NULL;   // scratch: half of the best round trip
+static DEFINE_MUTEX(tsc_lock);
+
+/*
+ * Drift tracking.  While a collection runs the skews are remeasured every
+ * tsc_drift_ms into separate tables; tsc_skew itself stays the value
+ * measured at start so that the samples of one collection share one
+ * correction.  The collector reads the drift tables with TSC_Get_Drift.
+ */
+static S64           *tsc_drift_skew = NULL;
+static U64           *tsc_drift_err  = NULL;
+static U64            tsc_drift_tsc  = 0;     // cpu 0 time of the last drift measurement
+static U32            tsc_drift_gen  = 0;     // completed drift measurements this collection
+static U32            tsc_drift_ms   = 0;
+static DRV_BOOL       tsc_drift_active = FALSE;
+static struct delayed_work  tsc_drift_work;
+
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          U64 tsc_Read_Ordered (VOID)
+ *
+ * @brief       Read the TSC without letting it drift across the handshake
+ *
+ * @return      TSC value
+ *
+ * <I>Special Notes:</I>
+ *              rdtsc is not serializing, the fences keep it between the
+ *              surrounding loads and stores of the rendezvous.
+ */
+static inline U64
+tsc_Read_Ordered (
+    VOID
+)
+{
+    U64 tsc;
+
+    rmb();
+    UTILITY_Read_TSC(&tsc);
+    rmb();
+
+    return tsc;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID tsc_Peer (PVOID param)
+ *
+ * @brief       Peer side of the rendezvous, runs in IPI context
+ *
+ * @param       param - measurement generation this call belongs to
+ *
+ * @return      None
+ */
+static VOID
+tsc_Peer (
+    PVOID  param
+)
+{
+    U32  gen    = (U32)(size_t)param;
+    U32  rounds = TSC_SYNC_rounds(&tsc_sync);
+    U32  i;
+    U64  start;
+
+    for (i = 0; i < rounds; i++) {
+        start = tsc_Read_Ordered();
+        while (TSC_SYNC_seq(&tsc_sync) != 2*i+1) {
+            if (TSC_SYNC_gen(&tsc_sync) != gen) {
+                // a stale call, the measurement it belonged to is over
+                return;
+            }
+            if (TSC_SYNC_abort(&tsc_sync)) {
+                return;
+            }
+            if (tsc_Read_Ordered() - start > TSC_SPIN_TIMEOUT) {
+                TSC_SYNC_abort(&tsc_sync) = 1;
+                return;
+            }
+            cpu_relax();
+        }
+        if (TSC_SYNC_gen(&tsc_sync) != gen) {
+            return;
+        }
+        TSC_SYNC_peer_tsc(&tsc_sync) = tsc_Read_Ordered();
+        smp_wmb();
+        TSC_SYNC_seq(&tsc_sync) = 2*i+2;
+    }
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS tsc_Measure (S32 cpu, S64 *offset, U64 *error)
+ *
+ * @brief       Measure the TSC offset of a cpu against the current one
+ *
+ * @param       cpu    - the peer cpu
+ *              offset - peer TSC minus the TSC of the current cpu
+ *              error  - bound on |true offset - offset|
+ *
+ * @return      OS_SUCCESS or OS_FAULT if the peer did not respond
+ *
+ * <I>Special Notes:</I>
+ *              Must be called with preemption disabled.  Each round reads
+ *              t0 here, t1 on the peer and t2 back here.  The peer read
+ *              happened somewhere in [t0, t2], so the midpoint estimate is
+ *              off by at most half the round trip.  The round with the
+ *              shortest round trip wins, which filters out the rounds that
+ *              were stretched by cache misses or SMIs.
+ */
+static OS_STATUS
+tsc_Measure (
+    S32   cpu,
+    S64  *offset,
+    U64  *error
+)
+{
+    unsigned long  flags;
+    U32            rounds = TSC_SYNC_rounds(&tsc_sync);
+    U32            i;
+    U64            t0, t1, t2;
+    U64            rtt;
+    U64            best_rtt = ~0ULL;
+    S64            best_off = 0;
+
+    TSC_SYNC_gen(&tsc_sync)++;
+    TSC_SYNC_seq(&tsc_sync)   = 0;
+    TSC_SYNC_abort(&tsc_sync) = 0;
+    smp_mb();
+
+    if (SMP_CALL_FUNCTION_SINGLE(cpu, tsc_Peer, (PVOID)(size_t)TSC_SYNC_gen(&tsc_sync), 0, FALSE)) {
+        return OS_FAULT;
+    }
+
+    local_irq_save(flags);
+    for (i = 0; i < rounds; i++) {
+        t0 = tsc_Read_Ordered();
+        TSC_SYNC_seq(&tsc_sync) = 2*i+1;
+        while (TSC_SYNC_seq(&tsc_sync) != 2*i+2) {
+            if (TSC_SYNC_abort(&tsc_sync) || tsc_Read_Ordered() - t0 > TSC_SPIN_TIMEOUT) {
+                TSC_SYNC_abort(&tsc_sync) = 1;
+                local_irq_restore(flags);
+                SEP_PRINT_ERROR("tsc_Measure: cpu %d did not respond\n", cpu);
+                return OS_FAULT;
+            }
+            cpu_relax();
+        }
+        t2 = tsc_Read_Ordered();
+        smp_rmb();
+        t1 = TSC_SYNC_peer_tsc(&tsc_sync);
+
+        rtt = t2 - t0;
+        if (rtt < best_rtt) {
+            best_rtt = rtt;
+            best_off = (S64)(t1 - t0) - (S64)(rtt / 2);
+        }
+    }
+    local_irq_restore(flags);
+
+    *offset = best_off;
+    *error  = (best_rtt + 1) / 2;
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS tsc_Measure_All (S64 *skew, U64 *err, U64 *tsc)
+ *
+ * @brief       Measure the TSC skew of every cpu against cpu 0
+ *
+ * @param       skew - receives the skew of each cpu against cpu 0
+ *              err  - receives the error bound of each skew
+ *              tsc  - if not NULL, receives the cpu 0 time of the measurement
+ *
+ * @return      OS_SUCCESS, or OS_FAULT if a cpu did not respond
+ *
+ * <I>Special Notes:</I>
+ *              Every cpu is measured against the calling cpu and the
+ *              result is then rebased on cpu 0, so the error bound of a cpu
+ *              includes the one of cpu 0.  On failure skew and err are left
+ *              alone.  Must be called with tsc_lock held.
+ */
+static OS_STATUS
+tsc_Measure_All (
+    S64  *skew,
+    U64  *err,
+    U64  *tsc
+)
+{
+    S32        cpu;
+    S32        me;
+    S32        num_cpus  = GLOBAL_STATE_num_cpus(driver_state);
+    U64        now       = 0;
+    OS_STATUS  status    = OS_SUCCESS;
+
+    TSC_SYNC_rounds(&tsc_sync) = TSC_ROUNDS;
+
+    preempt_disable();
+    me = CONTROL_THIS_CPU();
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        tsc_offset[cpu] = 0;
+        tsc_error[cpu]  = 0;
+        if (cpu == me || !cpu_online(cpu)) {
+            continue;
+        }
+        status = tsc_Measure(cpu, &tsc_offset[cpu], &tsc_error[cpu]);
+        if (status != OS_SUCCESS) {
+            break;
+        }
+    }
+    now = tsc_Read_Ordered();
+    preempt_enable();
+
+    if (status == OS_SUCCESS) {
+        for (cpu = 0; cpu < num_cpus; cpu++) {
+            skew[cpu] = tsc_offset[cpu] - tsc_offset[0];
+            err[cpu]  = cpu ? tsc_error[cpu] + tsc_error[0] : 0;
+        }
+        if (tsc) {
+            // tsc_offset[me] is 0, so this is now in cpu 0 time
+            *tsc = now - tsc_offset[0];
+        }
+    }
+
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS TSC_Calibrate (VOID)
+ *
+ * @brief       Measure the TSC skew of every cpu against cpu 0
+ *
+ * @return      OS_SUCCESS, or OS_FAULT if a cpu did not respond
+ *
+ * <I>Special Notes:</I>
+ *              Sets the skews TSC_SKEW() applies.  On failure the previous
+ *              skews are kept.  Must be called from process context.
+ */
+extern OS_STATUS
+TSC_Calibrate (
+    VOID
+)
+{
+    S32        cpu;
+    OS_STATUS  status;
+
+    if (tsc_skew == NULL) {
+        return OS_INVALID;
+    }
+
+    mutex_lock(&tsc_lock);
+    status = tsc_Measure_All(tsc_skew, tsc_skew_err, NULL);
+    if (status == OS_SUCCESS) {
+        for (cpu = 0; cpu < GLOBAL_STATE_num_cpus(driver_state); cpu++) {
+            SEP_PRINT_DEBUG("TSC_Calibrate: cpu %d skew %lld +/- %llu\n",
+                            cpu, tsc_skew[cpu], tsc_skew_err[cpu]);
+        }
+    }
+    mutex_unlock(&tsc_lock);
+
+    return status;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID tsc_Drift_Work (struct work_struct *work)
+ *
+ * @brief       Remeasure the skews into the drift tables and rearm
+ *
+ * @param       work - tsc_drift_work
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              A failed measurement keeps the previous drift tables, the
+ *              next period tries again.
+ */
+static VOID
+tsc_Drift_Work (
+    struct work_struct *work
+)
+{
+    mutex_lock(&tsc_lock);
+    if (!tsc_drift_active) {
+        mutex_unlock(&tsc_lock);
+        return;
+    }
+    if (tsc_Measure_All(tsc_drift_skew, tsc_drift_err, &tsc_drift_tsc) == OS_SUCCESS) {
+        tsc_drift_gen++;
+    }
+    else {
+        SEP_PRINT_WARNING("tsc_Drift_Work: drift measurement failed, keeping the previous one\n");
+    }
+    schedule_delayed_work(&tsc_drift_work, msecs_to_jiffies(tsc_drift_ms));
+    mutex_unlock(&tsc_lock);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID TSC_Start_Drift_Tracking (U32 period_ms)
+ *
+ * @brief       Remeasure the skews every period_ms until tracking stops
+ *
+ * @param       period_ms - measurement period, 0 disables tracking
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              Resets the drift tables to the skews applied by TSC_SKEW(),
+ *              so a collector that reads them before the first period sees
+ *              no drift.
+ */
+extern VOID
+TSC_Start_Drift_Tracking (
+    U32  period_ms
+)
+{
+    size_t  size = GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64);
+
+    if (tsc_drift_skew == NULL) {
+        return;
+    }
+
+    mutex_lock(&tsc_lock);
+    memcpy(tsc_drift_skew, tsc_skew, size);
+    memcpy(tsc_drift_err, tsc_skew_err, size);
+    tsc_drift_tsc    = 0;
+    tsc_drift_gen    = 0;
+    tsc_drift_ms     = period_ms;
+    tsc_drift_active = period_ms != 0;
+    if (tsc_drift_active) {
+        schedule_delayed_work(&tsc_drift_work, msecs_to_jiffies(tsc_drift_ms));
+    }
+    mutex_unlock(&tsc_lock);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID TSC_Stop_Drift_Tracking (VOID)
+ *
+ * @brief       Stop remeasuring the skews
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              The drift tables keep the last measurement so that the
+ *              collector can still read them once the collection stopped.
+ */
+extern VOID
+TSC_Stop_Drift_Tracking (
+    VOID
+)
+{
+    mutex_lock(&tsc_lock);
+    tsc_drift_active = FALSE;
+    mutex_unlock(&tsc_lock);
+    cancel_delayed_work_sync(&tsc_drift_work);
+
+    return;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS TSC_Get_Drift (TSC_DRIFT_INFO info, U32 num_cpus)
+ *
+ * @brief       Copy the last drift measurement
+ *
+ * @param       info     - header followed by room for num_cpus skews and
+ *                         num_cpus error bounds
+ *              num_cpus - entries the caller made room for
+ *
+ * @return      OS_SUCCESS, OS_INVALID if the tables are gone or info is
+ *              too small
+ */
+extern OS_STATUS
+TSC_Get_Drift (
+    TSC_DRIFT_INFO  info,
+    U32             num_cpus
+)
+{
+    size_t  size = GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64);
+
+    if (tsc_drift_skew == NULL || num_cpus < GLOBAL_STATE_num_cpus(driver_state)) {
+        return OS_INVALID;
+    }
+
+    mutex_lock(&tsc_lock);
+    TSC_DRIFT_INFO_tsc(info)        = tsc_drift_tsc;
+    TSC_DRIFT_INFO_generation(info) = tsc_drift_gen;
+    TSC_DRIFT_INFO_num_cpus(info)   = GLOBAL_STATE_num_cpus(driver_state);
+    memcpy(TSC_DRIFT_INFO_skew(info), tsc_drift_skew, size);
+    memcpy(TSC_DRIFT_INFO_skew_err(info), tsc_drift_err, size);
+    mutex_unlock(&tsc_lock);
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS TSC_Initialize (VOID)
+ *
+ * @brief       Allocate the skew and drift tables and take the first measurement
+ *
+ * @return      OS_STATUS
+ */
+extern OS_STATUS
+TSC_Initialize (
+    VOID
+)
+{
+    size_t  size = GLOBAL_STATE_num_cpus(driver_state) * sizeof(U64);
+
+    tsc_skew       = CONTROL_Allocate_Memory(size);
+    tsc_skew_err   = CONTROL_Allocate_Memory(size);
+    tsc_offset     = CONTROL_Allocate_Memory(size);
+    tsc_error      = CONTROL_Allocate_Memory(size);
+    tsc_drift_skew = CONTROL_Allocate_Memory(size);
+    tsc_drift_err  = CONTROL_Allocate_Memory(size);
+    INIT_DELAYED_WORK(&tsc_drift_work, tsc_Drift_Work);
+    if (!tsc_skew || !tsc_skew_err || !tsc_offset || !tsc_error ||
+        !tsc_drift_skew || !tsc_drift_err) {
+        TSC_Destroy();
+        return OS_NO_MEM;
+    }
+
+    return TSC_Calibrate();
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID TSC_Destroy (VOID)
+ *
+ * @brief       Stop drift tracking and free the skew and drift tables
+ *
+ * @return      None
+ */
+extern VOID
+TSC_Destroy (
+    VOID
+)
+{
+    TSC_Stop_Drift_Tracking();
+
+    tsc_skew       = CONTROL_Free_Memory(tsc_skew);
+    tsc_skew_err   = CONTROL_Free_Memory(tsc_skew_err);
+    tsc_offset     = CONTROL_Free_Memory(tsc_offset);
+    tsc_error      = CONTROL_Free_Memory(tsc_error);
+    tsc_drift_skew = CONTROL_Free_Memory(tsc_drift_skew);
+    tsc_drift_err  = CONTROL_Free_Memory(tsc_drift_err);
+
+    return;
+}
@@ -0,0 +1,380 @@
+/*COPYRIGHT**
+    Copyright (C) 2005-2013 Intel Corporation.  All Rights Reserved.
+
+    This file is part of SEP Development Kit
+
+    SEP Development Kit is free software; you can redistribute it
+    and/or modify it under the terms of the GNU General Public License
+    version 2 as published by the Free Software Foundation.
+
+    SEP Development Kit is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with SEP Development Kit; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+    As a special exception, you may use this file as part of a free software
+    library without restriction.  Specifically, if other files instantiate
+    templates or use macros or inline functions from this file, or you compile
+    this file and link it with other files to produce an executable, this
+    file does not by itself cause the resulting executable to be covered by
+    the GNU General Public License.  This exception does not however
+    invalidate any other reasons why the executable file might be covered by
+    the GNU General Public License.
+**COPYRIGHT*/
+
+#include "lwpmudrv_defines.h"
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include "lwpmudrv_types.h"
+#include "rise_errors.h"
+#include "lwpmudrv_ecb.h"
+#include "lwpmudrv_struct.h"
+#include "lwpmudrv.h"
+#include "control.h"
+#include "utility.h"
+#include "unc_sampler.h"
+
+#define UNC_SAMPLER_SEQ          0           // slot word: sequence count, odd while a read is in progress
+#define UNC_SAMPLER_TSC          1           // slot word: TSC of the leader when the read started
+#define UNC_SAMPLER_DATA         2           // slot words: read_counts() output, group id first
+#define UNC_SAMPLER_LINE_U64S    8           // slots are whole cache lines
+#define UNC_SAMPLER_READ_RETRIES 4           // torn copies tolerated before the PMI reads the device itself
+
+/*
+ * Uncore counters are package wide, so rather than having every core PMI
+ * read them (MMIO for the IMC), one leader cpu per package reads them on
+ * its own timer into a per-package, per-device slot.  The PMI copies the
+ * latest slot of its package into the sample instead.
+ */
+static U32 unc_sample_us = 0;                       // DRV_CONFIG_unc_sample_us of the running collection
+
+extern DRV_CONFIG     pcfg;
+
+typedef struct UNC_SAMPLER_LEADER_NODE_S  UNC_SAMPLER_LEADER_NODE;
+typedef        UNC_SAMPLER_LEADER_NODE   *UNC_SAMPLER_LEADER;
+
+struct UNC_SAMPLER_LEADER_NODE_S {
+    struct hrtimer  timer;
+    U32             cpu;
+    U32             package;
+};
+
+#define UNC_SAMPLER_LEADER_timer(l)     (l)->timer
+#define UNC_SAMPLER_LEADER_cpu(l)       (l)->cpu
+#define UNC_SAMPLER_LEADER_package(l)   (l)->package
+
+static UNC_SAMPLER_LEADER  leaders            = NULL;
+static U32                 num_leaders        = 0;
+static U64                *snapshots          = NULL;   // num_slots packages of pkg_stride U64s
+static U32                 pkg_stride         = 0;
+static U32                *slot_offset        = NULL;   // per device, U64s into the package block
+static U32                *slot_len           = NULL;   // per device, U64s copied, 0 - not sampled
+static volatile DRV_BOOL   unc_sampler_active = FALSE;
+
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID unc_sampler_Take_Snapshot (UNC_SAMPLER_LEADER leader)
+ *
+ * @brief       Read the uncore counters of the leader's package into its slots
+ *
+ * @param       leader - the leader, must run on its cpu
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              The sequence count is odd while the slot is written so that
+ *              a reader can detect a torn copy.
+ */
+static VOID
+unc_sampler_Take_Snapshot (
+    UNC_SAMPLER_LEADER leader
+)
+{
+    U64       *block = &snapshots[UNC_SAMPLER_LEADER_package(leader) * pkg_stride];
+    U64       *slot;
+    DISPATCH   dispatch_unc;
+    U32        dev_idx;
+
+    for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
+        if (slot_len[dev_idx] == 0) {
+            continue;
+        }
+        slot         = &block[slot_offset[dev_idx]];
+        dispatch_unc = LWPMU_DEVICE_dispatch(&devices[dev_idx]);
+
+        slot[UNC_SAMPLER_SEQ]++;
+        smp_wmb();
+        UTILITY_Read_TSC(&slot[UNC_SAMPLER_TSC]);
+        dispatch_unc->read_counts(&slot[UNC_SAMPLER_DATA], dev_idx);
+        smp_wmb();
+        slot[UNC_SAMPLER_SEQ]++;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          enum hrtimer_restart unc_sampler_Timer_Callback (struct hrtimer *timer)
+ *
+ * @brief       Periodic uncore read on the package leader
+ *
+ * @param       timer - the leader's timer
+ *
+ * @return      HRTIMER_RESTART
+ */
+static enum hrtimer_restart
+unc_sampler_Timer_Callback (
+    struct hrtimer *timer
+)
+{
+    UNC_SAMPLER_LEADER leader = container_of(timer, UNC_SAMPLER_LEADER_NODE, timer);
+
+    unc_sampler_Take_Snapshot(leader);
+    hrtimer_forward_now(timer, ns_to_ktime((U64)unc_sample_us * 1000));
+
+    return HRTIMER_RESTART;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID unc_sampler_Start_Timer (PVOID param)
+ *
+ * @brief       Take the first snapshot and arm the timer, runs on the leader
+ *
+ * @param       param - the leader
+ *
+ * @return      None
+ */
+static VOID
+unc_sampler_Start_Timer (
+    PVOID param
+)
+{
+    UNC_SAMPLER_LEADER leader = (UNC_SAMPLER_LEADER)param;
+
+    unc_sampler_Take_Snapshot(leader);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,31)
+    hrtimer_start(&UNC_SAMPLER_LEADER_timer(leader),
+                  ns_to_ktime((U64)unc_sample_us * 1000),
+                  HRTIMER_MODE_REL_PINNED);
+#else
+    hrtimer_start(&UNC_SAMPLER_LEADER_timer(leader),
+                  ns_to_ktime((U64)unc_sample_us * 1000),
+                  HRTIMER_MODE_REL);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          OS_STATUS UNC_SAMPLER_Start (VOID)
+ *
+ * @brief       Start the package leader timers if DRV_CONFIG_unc_sample_us is set
+ *
+ * @param       None
+ *
+ * @return      OS_SUCCESS or OS_NO_MEM
+ *
+ * <I>Special Notes:</I>
+ *              The leaders are the socket masters reported by the topology
+ *              ioctl.  Without them, or without uncore event based counts,
+ *              nothing is started and the PMI keeps reading the devices.
+ */
+extern OS_STATUS
+UNC_SAMPLER_Start (
+    VOID
+)
+{
+    U32  num_cpus    = GLOBAL_STATE_num_cpus(driver_state);
+    U32  num_slots   = 0;
+    U32  num_masters = 0;
+    U32  cpu;
+    U32  dev_idx;
+    U32  i;
+    DRV_CONFIG  pcfg_unc;
+
+    UNC_SAMPLER_Destroy();
+    unc_sample_us = pcfg ? DRV_CONFIG_unc_sample_us(pcfg) : 0;
+    if (unc_sample_us == 0 || devices == NULL || core_to_package_map == NULL) {
+        return OS_SUCCESS;
+    }
+
+    for (cpu = 0; cpu < num_cpus; cpu++) {
+        num_masters += CPU_STATE_socket_master(&pcb[cpu]) ? 1 : 0;
+        if (core_to_package_map[cpu] >= num_slots) {
+            num_slots = core_to_package_map[cpu] + 1;
+        }
+    }
+    if (num_masters == 0) {
+        SEP_PRINT_WARNING("UNC_SAMPLER_Start: no package topology, uncore counters are read in the PMI\n");
+        return OS_SUCCESS;
+    }
+
+    slot_offset = CONTROL_Allocate_Memory(num_devices * sizeof(U32));
+    slot_len    = CONTROL_Allocate_Memory(num_devices * sizeof(U32));
+    if (slot_offset == NULL || slot_len == NULL) {
+        UNC_SAMPLER_Destroy();
+        return OS_NO_MEM;
+    }
+    for (dev_idx = 0; dev_idx < num_devices; dev_idx++) {
+        pcfg_unc = (DRV_CONFIG)LWPMU_DEVICE_pcfg(&devices[dev_idx]);
+        if (pcfg_unc == NULL                             ||
+            !DRV_CONFIG_event_based_counts(pcfg_unc)     ||
+            LWPMU_DEVICE_dispatch(&devices[dev_idx]) == NULL) {
+            continue;
+        }
+        slot_offset[dev_idx] = pkg_stride;
+        slot_len[dev_idx]    = (U32)LWPMU_DEVICE_num_events(&devices[dev_idx]) + 1;
+        pkg_stride          += ALIGN(UNC_SAMPLER_DATA + slot_len[dev_idx], UNC_SAMPLER_LINE_U64S);
+    }
+    if (pkg_stride == 0) {
+        UNC_SAMPLER_Destroy();
+        return OS_SUCCESS;
+    }
+
+    snapshots = CONTROL_Allocate_Memory(num_slots * pkg_stride * sizeof(U64));
+    leaders   = CONTROL_Allocate_Memory(num_masters * sizeof(UNC_SAMPLER_LEADER_NODE));
+    if (snapshots == NULL || leaders == NULL) {
+        UNC_SAMPLER_Destroy();
+        return OS_NO_MEM;
+    }
+
+    // num_leaders counts initialized timers only, UNC_SAMPLER_Stop() cancels those
+    for (cpu = 0; cpu < num_cpus && num_leaders < num_masters; cpu++) {
+        if (!CPU_STATE_socket_master(&pcb[cpu])) {
+            continue;
+        }
+        UNC_SAMPLER_LEADER_cpu(&leaders[num_leaders])     = cpu;
+        UNC_SAMPLER_LEADER_package(&leaders[num_leaders]) = core_to_package_map[cpu];
+        hrtimer_init(&UNC_SAMPLER_LEADER_timer(&leaders[num_leaders]), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        UNC_SAMPLER_LEADER_timer(&leaders[num_leaders]).function = unc_sampler_Timer_Callback;
+        num_leaders++;
+    }
+
+    unc_sampler_active = TRUE;
+    for (i = 0; i < num_leaders; i++) {
+        CONTROL_Invoke_Cpu(UNC_SAMPLER_LEADER_cpu(&leaders[i]), unc_sampler_Start_Timer, &leaders[i]);
+    }
+    SEP_PRINT_DEBUG("UNC_SAMPLER_Start: %d package leaders, every %d us\n", num_leaders, unc_sample_us);
+
+    return OS_SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID UNC_SAMPLER_Stop (VOID)
+ *
+ * @brief       Cancel the leader timers
+ *
+ * @param       None
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              The slots stay allocated, a PMI may still be copying one.
+ *              They are released by UNC_SAMPLER_Destroy().
+ */
+extern VOID
+UNC_SAMPLER_Stop (
+    VOID
+)
+{
+    U32 i;
+
+    unc_sampler_active = FALSE;
+    if (leaders == NULL) {
+        return;
+    }
+    for (i = 0; i < num_leaders; i++) {
+        hrtimer_cancel(&UNC_SAMPLER_LEADER_timer(&leaders[i]));
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          VOID UNC_SAMPLER_Destroy (VOID)
+ *
+ * @brief       Cancel the leader timers and free the slots
+ *
+ * @param       None
+ *
+ * @return      None
+ *
+ * <I>Special Notes:</I>
+ *              Call only once no PMI can be running.
+ */
+extern VOID
+UNC_SAMPLER_Destroy (
+    VOID
+)
+{
+    UNC_SAMPLER_Stop();
+    leaders     = CONTROL_Free_Memory(leaders);
+    snapshots   = CONTROL_Free_Memory(snapshots);
+    slot_offset = CONTROL_Free_Memory(slot_offset);
+    slot_len    = CONTROL_Free_Memory(slot_len);
+    num_leaders = 0;
+    pkg_stride  = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/*!
+ * @fn          DRV_BOOL UNC_SAMPLER_Read (U32 this_cpu, U32 dev_idx, U64 *data, U64 *tsc)
+ *
+ * @brief       Copy the latest uncore snapshot of the cpu's package
+ *
+ * @param       this_cpu - cpu taking the sample
+ * @param       dev_idx  - uncore device
+ * @param       data     - destination, laid out as read_counts() writes it
+ * @param       tsc      - receives the TSC at which the leader read the counts
+ *
+ * @return      TRUE if data was filled, FALSE if the caller has to read the device
+ *
+ * <I>Special Notes:</I>
+ *              Called from the PMI.  FALSE is returned when sampling by the
+ *              leaders is off, before the first snapshot, and when the copy
+ *              keeps tearing (a PMI that interrupted its own leader's read).
+ */
+extern DRV_BOOL
+UNC_SAMPLER_Read (
+    U32   this_cpu,
+    U32   dev_idx,
+    U64  *data,
+    U64  *tsc
+)
+{
+    U64  *slot;
+    U64   seq;
+    U32   retry;
+
+    if (!unc_sampler_active || slot_len[dev_idx] == 0) {
+        return FALSE;
+    }
+    slot = &snapshots[core_to_package_map[this_cpu] * pkg_stride + slot_offset[dev_idx]];
+
+    for (retry = 0; retry < UNC_SAMPLER_READ_RETRIES; retry++) {
+        seq = *(volatile U64 *)&slot[UNC_SAMPLER_SEQ];
+        if (seq == 0) {
+            return FALSE;
+        }
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+        smp_rmb();
+        memcpy(data, &slot[UNC_SAMPLER_DATA], slot_len[dev_idx] * sizeof(U64));
+        *tsc = slot[UNC_SAMPLER_TSC];
+        smp_rmb();
+        if (*(volatile U64 *)&slot[UNC_SAMPLER_SEQ] == seq) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}